@@ -19,6 +19,9 @@
  *
  * $Id: file.c,v 1.23 2005/01/11 10:20:36 madmac Exp $
  */
+#if defined(unix) || defined(__unix__)
+#define _POSIX_C_SOURCE 200112L
+#endif
 #define LIB3DS_EXPORT
 #include <lib3ds/file.h>
 #include <lib3ds/chunk.h>
@@ -32,6 +35,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#if defined(unix) || defined(__unix__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define LIB3DS_MMAP
+#endif
 #ifdef WITH_DMALLOC
 #include <dmalloc.h>
 #endif
@@ -160,6 +171,91 @@ lib3ds_file_load(const char *filename)
 }
 
 
+/*!
+ * Loads a .3DS file from disk into memory, like lib3ds_file_load, but
+ * maps the whole file in memory (or reads it in one go where mapping
+ * is not available) and decodes the chunks straight from there.
+ *
+ * \param filename  The filename of the .3DS file
+ *
+ * \return   A pointer to the Lib3dsFile structure containing the
+ *           data of the .3DS file. 
+ *           If the .3DS file can not be loaded NULL is returned.
+ *
+ * \note     To free the returned structure use lib3ds_free.
+ *
+ * \see lib3ds_file_load
+ *
+ * \ingroup file
+ */
+Lib3dsFile*
+lib3ds_file_load_mapped(const char *filename)
+{
+  Lib3dsFile *file;
+  Lib3dsIo *io;
+  void *data;
+  long size;
+#ifdef LIB3DS_MMAP
+  int fd;
+  struct stat st;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return(0);
+  }
+  if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+    close(fd);
+    return(0);
+  }
+  size = (long)st.st_size;
+  data = mmap(0, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return(lib3ds_file_load(filename));
+  }
+#else
+  FILE *f;
+
+  f = fopen(filename, "rb");
+  if (!f) {
+    return(0);
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size <= 0 || !(data = malloc(size))) {
+    fclose(f);
+    return(0);
+  }
+  if (fread(data, 1, size, f) != (size_t)size) {
+    free(data);
+    fclose(f);
+    return(0);
+  }
+  fclose(f);
+#endif
+
+  file = lib3ds_file_new();
+  if (file) {
+    io = lib3ds_io_new_mem(data, size);
+    if (!io || !lib3ds_file_read(file, io)) {
+      lib3ds_file_free(file);
+      file = 0;
+    }
+    if (io) {
+      lib3ds_io_free(io);
+    }
+  }
+
+#ifdef LIB3DS_MMAP
+  munmap(data, (size_t)size);
+#else
+  free(data);
+#endif
+  return(file);
+}
+
+
 /*!
  * Saves a .3DS file from memory to disk.
  *
@@ -39,6 +39,12 @@ struct _Lib3dsIo {
   Lib3dsIoTellFunc tell_func;
   Lib3dsIoReadFunc read_func;
   Lib3dsIoWriteFunc write_func;
+
+  /* memory input, see lib3ds_io_new_mem */
+  const Lib3dsByte *mem;
+  long mem_size;
+  long mem_pos;
+  Lib3dsBool mem_error;
 };
 
 
@@ -63,6 +69,33 @@ lib3ds_io_new(void *self, Lib3dsIoErrorFunc error_func, Lib3dsIoSeekFunc seek_fu
 }
 
 
+/*!
+ * \ingroup io
+ *
+ * Creates an input stream reading directly from a block of memory
+ * (e.g. a memory mapped file), which must stay valid until the stream
+ * is freed. Reads are bounds checked, reading past the end sets the
+ * error flag. Scalars and arrays are decoded straight from the memory,
+ * without going through the read callback.
+ */
+Lib3dsIo*
+lib3ds_io_new_mem(const void *data, long size)
+{
+  Lib3dsIo *io = calloc(sizeof(Lib3dsIo),1);
+  ASSERT(io);
+  if (!io) {
+    return 0;
+  }
+
+  io->mem = (const Lib3dsByte*)data;
+  io->mem_size = size;
+  io->mem_pos = 0;
+  io->mem_error = LIB3DS_FALSE;
+
+  return io;
+}
+
+
 void 
 lib3ds_io_free(Lib3dsIo *io)
 {
@@ -78,6 +111,9 @@ Lib3dsBool
 lib3ds_io_error(Lib3dsIo *io)
 {
   ASSERT(io);
+  if (io && io->mem) {
+    return io->mem_error;
+  }
   if (!io || !io->error_func) {
     return 0;
   }
@@ -89,6 +125,19 @@ long
 lib3ds_io_seek(Lib3dsIo *io, long offset, Lib3dsIoSeek origin)
 {
   ASSERT(io);
+  if (io && io->mem) {
+    long pos = offset;
+    if (origin == LIB3DS_SEEK_CUR) {
+      pos += io->mem_pos;
+    } else if (origin == LIB3DS_SEEK_END) {
+      pos += io->mem_size;
+    }
+    if (pos < 0 || pos > io->mem_size) {
+      return -1;
+    }
+    io->mem_pos = pos;
+    return 0;
+  }
   if (!io || !io->seek_func) {
     return 0;
   }
@@ -100,6 +149,9 @@ long
 lib3ds_io_tell(Lib3dsIo *io)
 {
   ASSERT(io);
+  if (io && io->mem) {
+    return io->mem_pos;
+  }
   if (!io || !io->tell_func) {
     return 0;
   }
@@ -111,6 +163,15 @@ int
 lib3ds_io_read(Lib3dsIo *io, Lib3dsByte *buffer, int size)
 {
   ASSERT(io);
+  if (io && io->mem) {
+    if (size > io->mem_size - io->mem_pos) {
+      size = io->mem_size - io->mem_pos;
+      io->mem_error = LIB3DS_TRUE;
+    }
+    memcpy(buffer, io->mem + io->mem_pos, size);
+    io->mem_pos += size;
+    return size;
+  }
   if (!io || !io->read_func) {
     return 0;
   }
@@ -118,6 +179,24 @@ lib3ds_io_read(Lib3dsIo *io, Lib3dsByte *buffer, int size)
 }
 
 
+/*
+ * Returns a pointer to the next size bytes of the stream. Memory streams
+ * return a pointer to their data, otherwise they are read into buf.
+ */
+static const Lib3dsByte*
+io_fetch(Lib3dsIo *io, Lib3dsByte *buf, int size)
+{
+  if (io->mem && size <= io->mem_size - io->mem_pos) {
+    const Lib3dsByte *ptr = io->mem + io->mem_pos;
+    io->mem_pos += size;
+    return ptr;
+  }
+  memset(buf, 0, size);
+  lib3ds_io_read(io, buf, size);
+  return buf;
+}
+
+
 int 
 lib3ds_io_write(Lib3dsIo *io, const Lib3dsByte *buffer, int size)
 {
@@ -151,11 +230,12 @@ lib3ds_io_read_byte(Lib3dsIo *io)
 Lib3dsWord
 lib3ds_io_read_word(Lib3dsIo *io)
 {
-  Lib3dsByte b[2];
+  Lib3dsByte buf[2];
+  const Lib3dsByte *b;
   Lib3dsWord w;
 
   ASSERT(io);
-  lib3ds_io_read(io, b, 2);
+  b=io_fetch(io, buf, 2);
   w=((Lib3dsWord)b[1] << 8) |
     ((Lib3dsWord)b[0]);
   return(w);
@@ -170,11 +250,12 @@ lib3ds_io_read_word(Lib3dsIo *io)
 Lib3dsDword
 lib3ds_io_read_dword(Lib3dsIo *io)
 {
-  Lib3dsByte b[4];
+  Lib3dsByte buf[4];
+  const Lib3dsByte *b;
   Lib3dsDword d;        
                          
   ASSERT(io);
-  lib3ds_io_read(io, b, 4);
+  b=io_fetch(io, buf, 4);
   d=((Lib3dsDword)b[3] << 24) |
     ((Lib3dsDword)b[2] << 16) |
     ((Lib3dsDword)b[1] << 8) |
@@ -207,11 +288,12 @@ lib3ds_io_read_intb(Lib3dsIo *io)
 Lib3dsIntw
 lib3ds_io_read_intw(Lib3dsIo *io)
 {
-  Lib3dsByte b[2];
+  Lib3dsByte buf[2];
+  const Lib3dsByte *b;
   Lib3dsWord w;
 
   ASSERT(io);
-  lib3ds_io_read(io, b, 2);
+  b=io_fetch(io, buf, 2);
   w=((Lib3dsWord)b[1] << 8) |
     ((Lib3dsWord)b[0]);
   return((Lib3dsIntw)w);
@@ -226,11 +308,12 @@ lib3ds_io_read_intw(Lib3dsIo *io)
 Lib3dsIntd
 lib3ds_io_read_intd(Lib3dsIo *io)
 {
-  Lib3dsByte b[4];
+  Lib3dsByte buf[4];
+  const Lib3dsByte *b;
   Lib3dsDword d;        
                          
   ASSERT(io);
-  lib3ds_io_read(io, b, 4);
+  b=io_fetch(io, buf, 4);
   d=((Lib3dsDword)b[3] << 24) |
     ((Lib3dsDword)b[2] << 16) |
     ((Lib3dsDword)b[1] << 8) |
@@ -247,11 +330,12 @@ lib3ds_io_read_intd(Lib3dsIo *io)
 Lib3dsFloat
 lib3ds_io_read_float(Lib3dsIo *io)
 {
-  Lib3dsByte b[4];
+  Lib3dsByte buf[4];
+  const Lib3dsByte *b;
   Lib3dsDword d;
 
   ASSERT(io);
-  lib3ds_io_read(io, b, 4);
+  b=io_fetch(io, buf, 4);
   d=((Lib3dsDword)b[3] << 24) |
     ((Lib3dsDword)b[2] << 16) |
     ((Lib3dsDword)b[1] << 8) |
@@ -260,6 +344,77 @@ lib3ds_io_read_float(Lib3dsIo *io)
 }
 
 
+/*!
+ * \ingroup io
+ *
+ * Read an array of words from a file stream in little endian format.
+ */
+Lib3dsBool
+lib3ds_io_read_words(Lib3dsIo *io, Lib3dsWord *w, int count)
+{
+  Lib3dsByte buf[2];
+  const Lib3dsByte *b;
+  int i;
+
+  ASSERT(io);
+  if (io->mem && count <= (io->mem_size - io->mem_pos) / 2) {
+    b = io->mem + io->mem_pos;
+    for (i=0; i<count; ++i, b+=2) {
+      w[i]=((Lib3dsWord)b[1] << 8) |
+        ((Lib3dsWord)b[0]);
+    }
+    io->mem_pos += 2 * count;
+    return(LIB3DS_TRUE);
+  }
+
+  for (i=0; i<count; ++i) {
+    b=io_fetch(io, buf, 2);
+    w[i]=((Lib3dsWord)b[1] << 8) |
+      ((Lib3dsWord)b[0]);
+  }
+  return(!lib3ds_io_error(io));
+}
+
+
+/*!
+ * \ingroup io
+ *
+ * Read an array of floats from a file stream in little endian format.
+ */
+Lib3dsBool
+lib3ds_io_read_floats(Lib3dsIo *io, Lib3dsFloat *f, int count)
+{
+  Lib3dsByte buf[4];
+  const Lib3dsByte *b;
+  Lib3dsDword d;
+  int i;
+
+  ASSERT(io);
+  if (io->mem && count <= (io->mem_size - io->mem_pos) / 4) {
+    b = io->mem + io->mem_pos;
+    for (i=0; i<count; ++i, b+=4) {
+      d=((Lib3dsDword)b[3] << 24) |
+        ((Lib3dsDword)b[2] << 16) |
+        ((Lib3dsDword)b[1] << 8) |
+        ((Lib3dsDword)b[0]);
+      f[i]=*((Lib3dsFloat*)&d);
+    }
+    io->mem_pos += 4 * count;
+    return(LIB3DS_TRUE);
+  }
+
+  for (i=0; i<count; ++i) {
+    b=io_fetch(io, buf, 4);
+    d=((Lib3dsDword)b[3] << 24) |
+      ((Lib3dsDword)b[2] << 16) |
+      ((Lib3dsDword)b[1] << 8) |
+      ((Lib3dsDword)b[0]);
+    f[i]=*((Lib3dsFloat*)&d);
+  }
+  return(!lib3ds_io_error(io));
+}
+
+
 /*!
  * \ingroup io
  * \ingroup vector
@@ -273,12 +428,7 @@ Lib3dsBool
 lib3ds_io_read_vector(Lib3dsIo *io, Lib3dsVector v)
 {
   ASSERT(io);
-  
-  v[0]=lib3ds_io_read_float(io);
-  v[1]=lib3ds_io_read_float(io);
-  v[2]=lib3ds_io_read_float(io);
-
-  return(!lib3ds_io_error(io));
+  return(lib3ds_io_read_floats(io, v, 3));
 }
 
 
@@ -289,12 +439,7 @@ Lib3dsBool
 lib3ds_io_read_rgb(Lib3dsIo *io, Lib3dsRgb rgb)
 {
   ASSERT(io);
-
-  rgb[0]=lib3ds_io_read_float(io);
-  rgb[1]=lib3ds_io_read_float(io);
-  rgb[2]=lib3ds_io_read_float(io);
-
-  return(!lib3ds_io_error(io));
+  return(lib3ds_io_read_floats(io, rgb, 3));
 }
 
 
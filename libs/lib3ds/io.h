@@ -46,6 +46,7 @@ typedef int (*Lib3dsIoWriteFunc)(void *self, const Lib3dsByte *buffer, int size)
 extern LIB3DSAPI Lib3dsIo* lib3ds_io_new(void *self, Lib3dsIoErrorFunc error_func,
   Lib3dsIoSeekFunc seek_func, Lib3dsIoTellFunc tell_func,
   Lib3dsIoReadFunc read_func, Lib3dsIoWriteFunc write_func);
+extern LIB3DSAPI Lib3dsIo* lib3ds_io_new_mem(const void *data, long size);
 extern LIB3DSAPI void lib3ds_io_free(Lib3dsIo *io);
 extern LIB3DSAPI Lib3dsBool lib3ds_io_error(Lib3dsIo *io);
 extern LIB3DSAPI long lib3ds_io_seek(Lib3dsIo *io, long offset, Lib3dsIoSeek origin);
@@ -60,6 +61,8 @@ extern LIB3DSAPI Lib3dsIntb lib3ds_io_read_intb(Lib3dsIo *io);
 extern LIB3DSAPI Lib3dsIntw lib3ds_io_read_intw(Lib3dsIo *io);
 extern LIB3DSAPI Lib3dsIntd lib3ds_io_read_intd(Lib3dsIo *io);
 extern LIB3DSAPI Lib3dsFloat lib3ds_io_read_float(Lib3dsIo *io);
+extern LIB3DSAPI Lib3dsBool lib3ds_io_read_words(Lib3dsIo *io, Lib3dsWord *w, int count);
+extern LIB3DSAPI Lib3dsBool lib3ds_io_read_floats(Lib3dsIo *io, Lib3dsFloat *f, int count);
 extern LIB3DSAPI Lib3dsBool lib3ds_io_read_vector(Lib3dsIo *io, Lib3dsVector v);
 extern LIB3DSAPI Lib3dsBool lib3ds_io_read_rgb(Lib3dsIo *io, Lib3dsRgb rgb);
 extern LIB3DSAPI Lib3dsBool lib3ds_io_read_string(Lib3dsIo *io, char *s, int buflen);
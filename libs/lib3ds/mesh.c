@@ -60,11 +60,13 @@ face_array_read(Lib3dsMesh *mesh, Lib3dsIo *io)
       return(LIB3DS_FALSE);
     }
     for (i=0; i<faces; ++i) {
+      Lib3dsWord w[4];
+      lib3ds_io_read_words(io, w, 4);
       strcpy(mesh->faceL[i].material, "");
-      mesh->faceL[i].points[0]=lib3ds_io_read_word(io);
-      mesh->faceL[i].points[1]=lib3ds_io_read_word(io);
-      mesh->faceL[i].points[2]=lib3ds_io_read_word(io);
-      mesh->faceL[i].flags=lib3ds_io_read_word(io);
+      mesh->faceL[i].points[0]=w[0];
+      mesh->faceL[i].points[1]=w[1];
+      mesh->faceL[i].points[2]=w[2];
+      mesh->faceL[i].flags=w[3];
     }
     lib3ds_chunk_read_tell(&c, io);
 
@@ -649,7 +651,7 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
         break;
       case LIB3DS_POINT_ARRAY:
         {
-          unsigned i,j;
+          unsigned i;
           unsigned points;
           
           lib3ds_mesh_free_point_list(mesh);
@@ -659,9 +661,11 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
               LIB3DS_ERROR_LOG;
               return(LIB3DS_FALSE);
             }
-            for (i=0; i<mesh->points; ++i) {
-              for (j=0; j<3; ++j) {
-                mesh->pointL[i].pos[j]=lib3ds_io_read_float(io);
+            if (sizeof(Lib3dsPoint) == 3 * sizeof(Lib3dsFloat)) {
+              lib3ds_io_read_floats(io, mesh->pointL[0].pos, 3 * mesh->points);
+            } else {
+              for (i=0; i<mesh->points; ++i) {
+                lib3ds_io_read_floats(io, mesh->pointL[i].pos, 3);
               }
             }
             ASSERT((!mesh->flags) || (mesh->points==mesh->flags));
@@ -671,7 +675,6 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
         break;
       case LIB3DS_POINT_FLAG_ARRAY:
         {
-          unsigned i;
           unsigned flags;
           
           lib3ds_mesh_free_flag_list(mesh);
@@ -681,9 +684,7 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
               LIB3DS_ERROR_LOG;
               return(LIB3DS_FALSE);
             }
-            for (i=0; i<mesh->flags; ++i) {
-              mesh->flagL[i]=lib3ds_io_read_word(io);
-            }
+            lib3ds_io_read_words(io, mesh->flagL, mesh->flags);
             ASSERT((!mesh->points) || (mesh->flags==mesh->points));
             ASSERT((!mesh->texels) || (mesh->flags==mesh->texels));
           }
@@ -723,7 +724,6 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
         break;
       case LIB3DS_TEX_VERTS:
         {
-          unsigned i;
           unsigned texels;
           
           lib3ds_mesh_free_texel_list(mesh);
@@ -733,10 +733,7 @@ lib3ds_mesh_read(Lib3dsMesh *mesh, Lib3dsIo *io)
               LIB3DS_ERROR_LOG;
               return(LIB3DS_FALSE);
             }
-            for (i=0; i<mesh->texels; ++i) {
-              mesh->texelL[i][0]=lib3ds_io_read_float(io);
-              mesh->texelL[i][1]=lib3ds_io_read_float(io);
-            }
+            lib3ds_io_read_floats(io, mesh->texelL[0], 2 * mesh->texels);
             ASSERT((!mesh->points) || (mesh->texels==mesh->points));
             ASSERT((!mesh->flags) || (mesh->texels==mesh->flags));
           }
@@ -585,6 +585,8 @@ void flip() {
 	glFlush();
 	glFinish();
 	fxwt::swap_buffers();
+
+	update_textures();
 }
 
 void load_xform_matrices() {
@@ -713,6 +715,15 @@ void draw(const VertexArray &varray, const IndexArray &iarray) {
 	}
 }
 
+void draw_positions(const Vector3 *pos, unsigned long count) {
+	load_xform_matrices();
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_SCALAR_TYPE, 0, pos);
+	glDrawArrays(primitive_type, 0, count);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
 
 /* draw_line(start_vertex, end_vertex, start_width, end_width)
  * Draws a line as a cylindrically billboarded elongated quad.
@@ -980,7 +991,10 @@ void set_texture_border_color(int tex_unit, const Color &color) {
 }
 
 void set_texture(int tex_unit, const Texture *tex) {
+	// select the unit first, reloading an evicted texture binds it
 	select_texture_unit(tex_unit);
+	touch_texture(tex);
+
 	glBindTexture(tex->get_type(), tex->tex_id);
 	ttype[tex_unit] = tex->get_type();
 }
@@ -21,6 +21,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "3dengfx_config.h"
 
 #include <limits.h>
+#include <float.h>
 #include <string>
 #include <algorithm>
 #include "3dscene.hpp"
@@ -62,6 +63,12 @@ Scene::Scene() {
 
 	first_render = true;
 	frame_count = 0;
+
+	xform_nodes_valid = false;
+	xform_nodes_rev = 0;
+
+	frustum_cull = true;
+	bvh_valid = bvh_current = false;
 }
 
 Scene::~Scene() {
@@ -113,11 +120,13 @@ unsigned long Scene::get_frame_poly_count() const {
 void Scene::add_camera(Camera *cam) {
 	cameras.push_back(cam);
 	if(!active_camera) active_camera = cam;
+	xform_nodes_valid = false;
 }
 
 void Scene::add_light(Light *light) {
 	if(lcount >= engfx_state::sys_caps.max_lights) return;
 	lights[lcount++] = light;
+	xform_nodes_valid = false;
 }
 
 void Scene::add_object(Object *obj) {
@@ -126,6 +135,8 @@ void Scene::add_object(Object *obj) {
 	} else {
 		objects.push_front(obj);
 	}
+	xform_nodes_valid = false;
+	bvh_valid = false;
 }
 
 void Scene::add_curve(Curve *curve) {
@@ -134,6 +145,7 @@ void Scene::add_curve(Curve *curve) {
 
 void Scene::add_particle_sys(ParticleSystem *p) {
 	psys.push_back(p);
+	xform_nodes_valid = false;
 }
 
 /* adds a cubemapped skycube, by creating a cube with the correct
@@ -176,6 +188,8 @@ bool Scene::remove_light(const Light *light) {
 		for(int i=idx; i<lcount-1; i++) {
 			lights[i] = lights[i + 1];
 		}
+		xform_nodes_valid = false;
+		svol_cache.remove(light);
 		return true;
 	}
 	
@@ -186,6 +200,9 @@ bool Scene::remove_object(const Object *obj) {
 	std::list<Object*>::iterator iter = find(objects.begin(), objects.end(), obj);
 	if(iter != objects.end()) {
 		objects.erase(iter);
+		xform_nodes_valid = false;
+		bvh_valid = false;
+		svol_cache.remove(obj);
 		return true;
 	}
 	return false;
@@ -195,6 +212,7 @@ bool Scene::remove_particle_sys(const ParticleSystem *p) {
 	std::list<ParticleSystem*>::iterator iter = find(psys.begin(), psys.end(), p);
 	if(iter != psys.end()) {
 		psys.erase(iter);
+		xform_nodes_valid = false;
 		return true;
 	}
 	return false;
@@ -253,7 +271,41 @@ XFormNode *Scene::get_node(const char *name) {
 	return 0;
 }
 
+/* returns the nearest non-hidden object whose bounding box is hit by the
+ * ray, and optionally the ray parameter of that hit in dist. The result is
+ * only as exact as the world-space bounding boxes of the objects.
+ */
+Object *Scene::pick_object(const Ray &ray, unsigned long msec, scalar_t *dist) const {
+	update_xforms(msec);
+	update_bvh(msec);
+
+	std::vector<int> hits;
+	bvh.get_ray_hits(ray, &hits);
+
+	Object *nearest = 0;
+	scalar_t nearest_dist = FLT_MAX;
+
+	for(size_t i=0; i<hits.size(); i++) {
+		Object *obj = bvh_objects[hits[i]];
+		if(obj->get_render_params().hidden) continue;
+
+		// the tree stores fattened boxes, test against the exact one
+		Vector3 min, max;
+		scalar_t t;
+		obj->get_world_bounds(&min, &max, msec);
+		if(aabox_ray_test(min, max, ray, &t) && t < nearest_dist) {
+			nearest_dist = t;
+			nearest = obj;
+		}
+	}
+
+	if(dist && nearest) *dist = nearest_dist;
+	return nearest;
+}
+
 std::list<Object*> *Scene::get_object_list() {
+	xform_nodes_valid = false;	// the caller may modify the list
+	bvh_valid = false;
 	return &objects;
 }
 
@@ -302,6 +354,10 @@ void Scene::set_background(const Color &bg) {
 	bg_color = bg;
 }
 
+void Scene::set_frustum_culling(bool enable) {
+	frustum_cull = enable;
+}
+
 void Scene::setup_lights(unsigned long msec) const {
 	int light_index = 0;
 	for(int i=0; i<lcount; i++) {
@@ -312,8 +368,100 @@ void Scene::setup_lights(unsigned long msec) const {
 	glDisable(GL_LIGHT0 + light_index);
 }
 
+/* flattens the transformation hierarchies of all the scene nodes into
+ * a single array, in depth-first order, so that update_xforms() always
+ * reaches a parent before any of its children.
+ */
+void Scene::build_xform_order() const {
+	std::vector<XFormNode*> roots;
+
+	std::list<Object*>::const_iterator oiter = objects.begin();
+	while(oiter != objects.end()) {
+		roots.push_back(*oiter++);
+	}
+	for(int i=0; i<lcount; i++) {
+		if(lights[i]) roots.push_back(lights[i]);
+	}
+	std::list<Camera*>::const_iterator citer = cameras.begin();
+	while(citer != cameras.end()) {
+		roots.push_back(*citer++);
+	}
+	std::list<ParticleSystem*>::const_iterator piter = psys.begin();
+	while(piter != psys.end()) {
+		roots.push_back(*piter++);
+	}
+
+	for(size_t i=0; i<roots.size(); i++) {
+		while(roots[i]->parent) roots[i] = roots[i]->parent;
+	}
+	std::sort(roots.begin(), roots.end());
+	roots.erase(std::unique(roots.begin(), roots.end()), roots.end());
+
+	xform_nodes.clear();
+
+	std::vector<XFormNode*> stack;
+	for(size_t i=0; i<roots.size(); i++) {
+		stack.push_back(roots[i]);
+
+		while(!stack.empty()) {
+			XFormNode *node = stack.back();
+			stack.pop_back();
+			xform_nodes.push_back(node);
+
+			for(int j=(int)node->children.size()-1; j>=0; j--) {
+				stack.push_back(node->children[j]);
+			}
+		}
+	}
+
+	xform_nodes_valid = true;
+	xform_nodes_rev = XFormNode::get_hierarchy_revision();
+}
+
+/* transformation update stage: brings the cached world transformations of
+ * every node in the scene up to date for the given time. Nodes are visited
+ * parent first, so each one is computed exactly once and never recurses up
+ * the hierarchy; static subtrees keep their caches between frames.
+ * Subsequent get_prs() / get_xform_matrix() calls with the same time during
+ * rendering, culling and shadow volume generation are simple cache lookups.
+ */
+void Scene::update_xforms(unsigned long msec) const {
+	if(!xform_nodes_valid || xform_nodes_rev != XFormNode::get_hierarchy_revision()) {
+		build_xform_order();
+	}
+
+	size_t count = xform_nodes.size();
+	for(size_t i=0; i<count; i++) {
+		xform_nodes[i]->get_xform_matrix(msec);
+	}
+}
+
+/* brings the world-space bounds of all objects in the BVH up to date,
+ * (re)creating it if the object list has changed since the last time.
+ * BVH item ids are the indices of the objects in the object list.
+ */
+void Scene::update_bvh(unsigned long msec) const {
+	if(!bvh_valid) {
+		bvh.clear();
+		bvh_objects.assign(objects.begin(), objects.end());
+	}
+
+	for(size_t i=0; i<bvh_objects.size(); i++) {
+		Vector3 min, max;
+		bvh_objects[i]->get_world_bounds(&min, &max, msec);
+
+		if(bvh_valid) {
+			bvh.update_item((int)i, min, max);
+		} else {
+			bvh.add_item(min, max);
+		}
+	}
+	bvh_valid = true;
+}
+
 void Scene::set_shadows(bool enable) {
 	shadows = enable;
+	if(!enable) svol_cache.clear();
 }
 
 void Scene::render(unsigned long msec) const {
@@ -324,6 +472,15 @@ void Scene::render(unsigned long msec) const {
 	if(!call_depth) {
 		// ---- this part is guaranteed to be executed once for each frame ----
 		poly_count = 0;		// reset the polygon counter
+
+		update_xforms(msec);
+		if(frustum_cull) {
+			update_bvh(msec);
+			bvh_current = true;
+		}
+		if(shadows) {
+			build_shadow_volumes(msec);
+		}
 		
 		::set_ambient_light(ambient_light);
 		
@@ -351,6 +508,7 @@ void Scene::render(unsigned long msec) const {
 	
 	// set camera
 	if(!active_camera) {
+		if(!call_depth) bvh_current = false;
 		call_depth--;
 		return;
 	}
@@ -380,7 +538,7 @@ void Scene::render(unsigned long msec) const {
 			set_front_face(ORDER_CW);
 			render_svol(i, msec);
 			
-			// render volume back faces
+			// render volume back faces, the volumes are still cached
 			set_stencil_op(SOP_KEEP, SOP_KEEP, SOP_DEC);
 			set_front_face(ORDER_CCW);
 			render_svol(i, msec);
@@ -411,10 +569,44 @@ void Scene::render(unsigned long msec) const {
 	
 	render_particles(msec);
 
+	if(!call_depth) bvh_current = false;
 	call_depth--;
 }
 
+/* When called from within render(), the BVH is up to date and the whole
+ * frustum culling takes place here, otherwise each object culls itself.
+ */
 void Scene::render_objects(unsigned long msec) const {
+	if(frustum_cull && bvh_current) {
+		FrustumPlane frustum_buf[6];
+		const FrustumPlane *frustum = frustum_buf;
+
+		if(engfx_state::view_mat_camera) {
+			frustum = engfx_state::view_mat_camera->get_frustum();
+		} else {
+			Matrix4x4 view_proj = engfx_state::proj_matrix * engfx_state::view_matrix;
+			for(int i=0; i<6; i++) {
+				frustum_buf[i] = FrustumPlane(view_proj, i);
+			}
+		}
+
+		bvh_visible.clear();
+		bvh.get_visible(frustum, &bvh_visible);
+
+		// keep the object list order (opaque objects first)
+		std::sort(bvh_visible.begin(), bvh_visible.end());
+
+		for(size_t i=0; i<bvh_visible.size(); i++) {
+			Object *obj = bvh_objects[bvh_visible[i]];
+			if(obj->get_render_params().hidden) continue;
+
+			if(obj->render(msec, false)) {
+				poly_count += obj->get_mesh_ptr()->get_triangle_array()->get_count();
+			}
+		}
+		return;
+	}
+
 	std::list<Object *>::const_iterator iter = objects.begin();
 	while(iter != objects.end()) {
 		Object *obj = *iter++;
@@ -422,7 +614,7 @@ void Scene::render_objects(unsigned long msec) const {
 		RenderParams rp = obj->get_render_params();
 
 		if(!rp.hidden) {
-			if(obj->render(msec)) {
+			if(obj->render(msec, frustum_cull)) {
 				poly_count += obj->get_mesh_ptr()->get_triangle_array()->get_count();
 			}
 		}
@@ -436,33 +628,77 @@ void Scene::render_particles(unsigned long msec) const {
 	}
 }
 
-// TODO: optimize this...
+/* get_svol_light - (JT)
+ * if obj casts shadows, returns its transformation and the position (or
+ * direction) of light lidx in its model space, for its shadow volume.
+ */
+bool Scene::get_svol_light(Object *obj, int lidx, unsigned long msec,
+		Matrix4x4 *xform, Vector3 *pov_or_dir, bool *dir) const {
+	RenderParams rp = obj->get_render_params();
+	if(rp.hidden || !rp.cast_shadows || obj->get_material_ptr()->alpha <= 0.995) {
+		return false;
+	}
+
+	*xform = obj->get_xform_matrix(msec);
+	Matrix4x4 inv_xform = xform->inverse();
+
+	if(dynamic_cast<DirLight*>(lights[lidx])) {
+		*pov_or_dir = ((DirLight*)lights[lidx])->get_direction();
+		pov_or_dir->transform(Matrix3x3(inv_xform));
+		*dir = true;
+	} else {
+		*pov_or_dir = lights[lidx]->get_position(msec);
+		pov_or_dir->transform(inv_xform);
+		*dir = false;
+	}
+	return true;
+}
+
+/* build_shadow_volumes - (JT)
+ * brings the shadow volumes of all objects for all the shadow casting
+ * lights up to date at once, building the ones that changed in parallel,
+ * so that render_svol only has to draw them. Called by render once the
+ * transformations of the frame are known.
+ */
+void Scene::build_shadow_volumes(unsigned long msec) const {
+	for(int i=0; i<lcount; i++) {
+		if(!lights[i]->casts_shadows()) continue;
+
+		std::list<Object *>::const_iterator iter = objects.begin();
+		while(iter != objects.end()) {
+			Object *obj = *iter++;
+
+			Matrix4x4 xform;
+			Vector3 lt;
+			bool is_dir;
+			if(get_svol_light(obj, i, msec, &xform, &lt, &is_dir)) {
+				svol_cache.request(obj, lights[i], obj->get_mesh_ptr(), lt, is_dir);
+			}
+		}
+	}
+	svol_cache.update();
+}
+
+/* The volumes are rebuilt only when the light moved relative to the object,
+ * or its mesh changed, see ShadowVolumeCache. Within render they have all
+ * been built already by build_shadow_volumes.
+ */
 void Scene::render_svol(int lidx, unsigned long msec) const {
 	std::list<Object *>::const_iterator iter = objects.begin();
 	while(iter != objects.end()) {
 		Object *obj = *iter++;
-		RenderParams rp = obj->get_render_params();
 
-		if(!rp.hidden && rp.cast_shadows && obj->get_material_ptr()->alpha > 0.995) {
-			Matrix4x4 xform = obj->get_prs(msec).get_xform_matrix();
-			Matrix4x4 inv_xform = xform.inverse();
+		Matrix4x4 xform;
+		Vector3 lt;
+		bool is_dir;
+		if(!get_svol_light(obj, lidx, msec, &xform, &lt, &is_dir)) continue;
 
-			Vector3 lt;
-			bool is_dir = false;
-			if(dynamic_cast<DirLight*>(lights[lidx])) {
-				lt = ((DirLight*)lights[lidx])->get_direction();
-				lt.transform(Matrix3x3(inv_xform));
-				is_dir = true;
-			} else {
-				lt = lights[lidx]->get_position(msec);
-				lt.transform(inv_xform);
-			}
-			
-			TriMesh *vol = obj->get_mesh_ptr()->get_shadow_volume(lt, is_dir);
-			set_matrix(XFORM_WORLD, xform);
-			draw(*vol->get_vertex_array(), *vol->get_index_array());
-			delete vol;
-		}
+		const std::vector<Vector3> *vol;
+		vol = svol_cache.get_volume(obj, lights[lidx], obj->get_mesh_ptr(), lt, is_dir);
+		if(vol->empty()) continue;
+
+		set_matrix(XFORM_WORLD, xform);
+		draw_positions(&(*vol)[0], vol->size());
 	}
 }
 
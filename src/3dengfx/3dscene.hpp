@@ -21,11 +21,14 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define _3DSCENE_HPP_
 
 #include <list>
+#include <vector>
 #include "camera.hpp"
 #include "light.hpp"
 #include "object.hpp"
 #include "psys.hpp"
+#include "shadows.hpp"
 #include "gfx/curves.hpp"
+#include "gfx/bvh.hpp"
 
 struct ShadowVolume {
 	TriMesh *shadow_mesh;
@@ -60,7 +63,25 @@ private:
 	mutable unsigned long poly_count;
 	unsigned long scene_poly_count;
 	bool frustum_cull;
+
+	// flattened transformation hierarchy, parents always precede their children
+	mutable std::vector<XFormNode*> xform_nodes;
+	mutable bool xform_nodes_valid;
+	mutable unsigned long xform_nodes_rev;
 	
+	// object bounding volume hierarchy, used for culling and picking
+	mutable BVHTree bvh;
+	mutable std::vector<Object*> bvh_objects;	// indexed by BVH item id
+	mutable std::vector<int> bvh_visible;
+	mutable bool bvh_valid, bvh_current;
+
+	// shadow volumes by object and light, reused until either moves
+	mutable ShadowVolumeCache svol_cache;
+
+	void build_xform_order() const;
+	void update_bvh(unsigned long msec) const;
+	bool get_svol_light(Object *obj, int lidx, unsigned long msec,
+			Matrix4x4 *xform, Vector3 *pov_or_dir, bool *dir) const;
 	void place_cube_camera(const Vector3 &pos);
 	bool render_all_cube_maps(unsigned long msec = XFORM_LOCAL_PRS) const;
 		
@@ -94,6 +115,8 @@ public:
 
 	XFormNode *get_node(const char *name);
 
+	Object *pick_object(const Ray &ray, unsigned long msec = XFORM_LOCAL_PRS, scalar_t *dist = 0) const;
+
 	std::list<Object*> *get_object_list();
 	std::list<Camera*> *get_camera_list();
 
@@ -110,12 +133,15 @@ public:
 	void set_background(const Color &bg);
 	void set_frustum_culling(bool enable);
 
+	void update_xforms(unsigned long msec = XFORM_LOCAL_PRS) const;
+
 	// render states
 	void setup_lights(unsigned long msec = XFORM_LOCAL_PRS) const;
 
 	void render(unsigned long msec = XFORM_LOCAL_PRS) const;
 	void render_objects(unsigned long msec = XFORM_LOCAL_PRS) const;
 	void render_particles(unsigned long msec = XFORM_LOCAL_PRS) const;
+	void build_shadow_volumes(unsigned long msec = XFORM_LOCAL_PRS) const;
 	void render_svol(int lidx, unsigned long msec = XFORM_LOCAL_PRS) const;
 	void render_cube_map(Object *obj, unsigned long msec = XFORM_LOCAL_PRS) const;
 
@@ -95,7 +95,7 @@ const TriMesh &Object::get_mesh() const {
 }
 
 unsigned long Object::get_vertex_count() const {
-	return mesh.get_vertex_array()->get_count();
+	return mesh.get_vertex_count();
 }
 
 const Vertex *Object::get_vertex_data() const {
@@ -234,11 +234,24 @@ void Object::set_shadow_casting(bool enable)
 }
 
 void Object::apply_xform(unsigned long time) {
-	world_mat = get_prs(time).get_xform_matrix();
+	world_mat = get_xform_matrix(time);
 	mesh.apply_xform(world_mat);
 	reset_xform(time);
 }
 
+/* returns the world-space axis-aligned bounding box of the object */
+void Object::get_world_bounds(Vector3 *min, Vector3 *max, unsigned long time) const {
+	VertexStatistics vstat = mesh.get_vertex_stats();
+	if(vstat.xmin > vstat.xmax) {	// no vertices
+		*min = *max = get_position(time);
+		return;
+	}
+
+	*min = Vector3(vstat.xmin, vstat.ymin, vstat.zmin);
+	*max = Vector3(vstat.xmax, vstat.ymax, vstat.zmax);
+	aabox_transform(min, max, get_xform_matrix(time));
+}
+
 void Object::calculate_normals() {
 	mesh.calculate_normals();
 }
@@ -247,29 +260,34 @@ void Object::normalize_normals() {
 	mesh.normalize_normals();
 }
 
-bool Object::render(unsigned long time) {
-	world_mat = get_prs(time).get_xform_matrix();
+/* renders the object, if cull is false, the bounding volume test against
+ * the view frustum is skipped (e.g. when the caller has already culled it).
+ */
+bool Object::render(unsigned long time, bool cull) {
+	world_mat = get_xform_matrix(time);
 
-	if(!bvol_valid) update_bounding_volume();
+	if(cull) {
+		if(!bvol_valid) update_bounding_volume();
 
-	// set the active world-space transformation for the bounding volume ...
-	bvol->set_transform(world_mat);
+		// set the active world-space transformation for the bounding volume ...
+		bvol->set_transform(world_mat);
 	
-	/* if we have the camera that generated the active view matrix available
-	 * chances are it already has the view frustum, so use it directly to test
-	 * the object, otherwise generate one.
-	 */
-	if(engfx_state::view_mat_camera) {
-		if(!bvol->visible(engfx_state::view_mat_camera->get_frustum())) return false;
-	} else {
-		Matrix4x4 view_proj = engfx_state::proj_matrix * engfx_state::view_matrix;
+		/* if we have the camera that generated the active view matrix available
+		 * chances are it already has the view frustum, so use it directly to test
+		 * the object, otherwise generate one.
+		 */
+		if(engfx_state::view_mat_camera) {
+			if(!bvol->visible(engfx_state::view_mat_camera->get_frustum())) return false;
+		} else {
+			Matrix4x4 view_proj = engfx_state::proj_matrix * engfx_state::view_matrix;
 		
-		FrustumPlane frustum[6];
-		for(int i=0; i<6; i++) {
-			frustum[i] = FrustumPlane(view_proj, i);
-		}
+			FrustumPlane frustum[6];
+			for(int i=0; i<6; i++) {
+				frustum[i] = FrustumPlane(view_proj, i);
+			}
 
-		if(!bvol->visible(frustum)) return false;
+			if(!bvol->visible(frustum)) return false;
+		}
 	}
 	
 	
@@ -476,7 +494,9 @@ void Object::draw_highlight()
 	Matrix4x4 view = get_matrix(XFORM_VIEW);
 	pov.transform(view.inverse());
 	pov.transform(model.inverse());
-	std::vector<Edge> *edges = mesh.get_contour_edges(pov, false);
+	ContourEdges contour;
+	mesh.get_contour_edges(&contour, pov, false);
+	const std::vector<Edge> *edges = &contour.edges;
 	
 	set_lighting(false);
 	::set_gfx_program(0);
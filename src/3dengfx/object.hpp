@@ -140,10 +140,12 @@ public:
 
 	void apply_xform(unsigned long time = XFORM_LOCAL_PRS);
 
+	void get_world_bounds(Vector3 *min, Vector3 *max, unsigned long time = XFORM_LOCAL_PRS) const;
+
 	void calculate_normals();
 	void normalize_normals();
 	
-	bool render(unsigned long time = XFORM_LOCAL_PRS);
+	bool render(unsigned long time = XFORM_LOCAL_PRS, bool cull = true);
 };
 
 
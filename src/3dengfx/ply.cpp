@@ -1,12 +1,17 @@
 #include <vector>
 #include <string>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <cctype>
 #include <cassert>
 #include "gfx/3dgeom.hpp"
+#include "sceneloader.hpp"
 #include "common/err_msg.h"
+#include "common/types.h"
 
-#define BUFFER_SIZE		256
+#define BUFFER_SIZE		1024
+#define CHUNK_SIZE		(1 << 20)	// must hold at least one line of ascii data
 
 using std::vector;
 using std::string;
@@ -18,14 +23,18 @@ enum PlyFormat {
 };
 
 enum PropType {
-	PROP_FLOAT,
 	PROP_INT8,
+	PROP_UINT8,
 	PROP_INT16,
+	PROP_UINT16,
 	PROP_INT32,
+	PROP_UINT32,
+	PROP_FLOAT,
+	PROP_DOUBLE,
 	PROP_LIST
 };
 
-const size_t prop_size[] = {32, 8, 16, 32, 0};
+const size_t prop_size[] = {1, 1, 2, 2, 4, 4, 4, 8, 0};
 
 struct PropTypeMatch {
 	const char *symb;
@@ -33,16 +42,20 @@ struct PropTypeMatch {
 } prop_match[] = {
 	{"float",	PROP_FLOAT},
 	{"float32",	PROP_FLOAT},
+	{"double",	PROP_DOUBLE},
+	{"float64",	PROP_DOUBLE},
 	{"int",		PROP_INT32},
 	{"int32",	PROP_INT32},
-	{"uint",	PROP_INT32},
-	{"uint32",	PROP_INT32},
+	{"uint",	PROP_UINT32},
+	{"uint32",	PROP_UINT32},
+	{"short",	PROP_INT16},
 	{"int16",	PROP_INT16},
-	{"uint16",	PROP_INT16},
+	{"ushort",	PROP_UINT16},
+	{"uint16",	PROP_UINT16},
 	{"char",	PROP_INT8},
-	{"uchar",	PROP_INT8},
 	{"int8",	PROP_INT8},
-	{"uint8",	PROP_INT8},
+	{"uchar",	PROP_UINT8},
+	{"uint8",	PROP_UINT8},
 	{"list",	PROP_LIST},
 	{0, (PropType)0}
 };
@@ -50,8 +63,13 @@ struct PropTypeMatch {
 struct Property {
 	string name;
 	PropType type;
-	PropType list_type;	// list elements type, if type == PROP_LIST
-	size_t size;
+	PropType count_type, list_type;	// list count and elements type, if type == PROP_LIST
+	size_t size;					// 0 for lists
+
+	long dest;			// offset of the vertex field this goes to, -1 to skip it
+	scalar_t scale;
+
+	Property() { type = count_type = list_type = PROP_UINT8; size = 0; dest = -1; scale = 1.0; }
 };
 
 enum ElementType {ELEM_UNKNOWN, ELEM_VERTEX, ELEM_FACE};
@@ -60,7 +78,7 @@ struct Element {
 	ElementType type;
 	unsigned long count;
 	vector<Property> prop;
-	long offset;
+	size_t size;		// record size for binary files, 0 if it contains lists
 };
 
 struct Ply {
@@ -72,18 +90,80 @@ struct Ply {
 	Ply() { fmt = PLY_ASCII; fp = 0; header_skip = 0; }
 };
 
+/* PlyStream - (JT)
+ * reads the body of the file in large chunks, the parsers work directly on
+ * the chunk buffer and ask for more data when they run out of it.
+ */
+class PlyStream {
+private:
+	FILE *fp;
+	char *buf;
+	size_t beg, end;
+	bool eof;
+
+public:
+	PlyStream(FILE *fp) {
+		this->fp = fp;
+		buf = new char[CHUNK_SIZE + 1];
+		beg = end = 0;
+		eof = false;
+	}
+	~PlyStream() { delete [] buf; }
+
+	// makes sure that at least size bytes are buffered (if there are that many)
+	bool fill(size_t size) {
+		if(end - beg >= size) return true;
+		if(eof || size > CHUNK_SIZE) return false;
+
+		memmove(buf, buf + beg, end - beg);
+		end -= beg;
+		beg = 0;
+
+		while(end < size && !eof) {
+			size_t rd = fread(buf + end, 1, CHUNK_SIZE - end, fp);
+			if(!rd) eof = true;
+			end += rd;
+		}
+		return end >= size;
+	}
+
+	// returns the next line (terminated by a 0 in place of the newline)
+	char *line() {
+		char *nl;
+		while(!(nl = (char*)memchr(buf + beg, '\n', end - beg))) {
+			if(!fill(end - beg + 1)) {
+				// last line without a newline
+				if(end == beg) return 0;
+				nl = buf + end;
+				break;
+			}
+		}
+		*nl = 0;
+		char *ln = buf + beg;
+		beg = nl - buf + (nl < buf + end ? 1 : 0);
+		return ln;
+	}
+
+	const unsigned char *get(size_t size) {
+		if(!fill(size)) return 0;
+		const unsigned char *ptr = (unsigned char*)buf + beg;
+		beg += size;
+		return ptr;
+	}
+};
+
 static Ply *read_header(FILE *fp);
-static Element *seek_elem(Ply *ply, ElementType elem_type);
+static bool read_elem(Ply *ply, PlyStream *ps, Element *elem, vector<Vertex> *verts, vector<Triangle> *tris);
 
 static const char *ply_filename = 0;	// for error reports
 
 bool file_is_ply(FILE *file) {
 	char sig[5] = {0};
-	
+
 	fseek(file, 0, SEEK_SET);
 	fgets(sig, 5, file);
 
-	return !strcmp(sig, "ply\n");
+	return !strcmp(sig, "ply\n") || !strcmp(sig, "ply\r");
 }
 
 #define FAIL(m) {\
@@ -93,11 +173,64 @@ bool file_is_ply(FILE *file) {
 	return 0;\
 }
 
-TriMesh *load_mesh_ply(const char *fname) {
-	const char *sep = " \t\n";
-	char buf[BUFFER_SIZE];
+/* setup_vertex_props - (JT)
+ * decides where each vertex property goes, based on its name and on which
+ * of the optional properties are requested.
+ */
+static bool setup_vertex_props(Element *elem, unsigned int props) {
+	static const struct {
+		const char *name;
+		unsigned int flag;
+		int field;
+	} vprop[] = {
+		{"x", 0, 0}, {"y", 0, 1}, {"z", 0, 2},
+		{"nx", PLY_LOAD_NORMALS, 3}, {"ny", PLY_LOAD_NORMALS, 4}, {"nz", PLY_LOAD_NORMALS, 5},
+		{"red", PLY_LOAD_COLORS, 6}, {"green", PLY_LOAD_COLORS, 7}, {"blue", PLY_LOAD_COLORS, 8},
+		{"alpha", PLY_LOAD_COLORS, 9},
+		{"diffuse_red", PLY_LOAD_COLORS, 6}, {"diffuse_green", PLY_LOAD_COLORS, 7},
+		{"diffuse_blue", PLY_LOAD_COLORS, 8},
+		{"u", PLY_LOAD_TEXCOORDS, 10}, {"v", PLY_LOAD_TEXCOORDS, 11},
+		{"s", PLY_LOAD_TEXCOORDS, 10}, {"t", PLY_LOAD_TEXCOORDS, 11},
+		{"texture_u", PLY_LOAD_TEXCOORDS, 10}, {"texture_v", PLY_LOAD_TEXCOORDS, 11},
+		{"texture_s", PLY_LOAD_TEXCOORDS, 10}, {"texture_t", PLY_LOAD_TEXCOORDS, 11},
+		{0, 0, 0}
+	};
+
+	Vertex v;
+	scalar_t *field_ptr[] = {
+		&v.pos.x, &v.pos.y, &v.pos.z,
+		&v.normal.x, &v.normal.y, &v.normal.z,
+		&v.color.r, &v.color.g, &v.color.b, &v.color.a,
+		&v.tex[0].u, &v.tex[0].v
+	};
+
+	int found = 0;
+	for(size_t i=0; i<elem->prop.size(); i++) {
+		Property *prop = &elem->prop[i];
+		prop->dest = -1;
+		prop->scale = 1.0;
+
+		for(int j=0; vprop[j].name; j++) {
+			if(prop->name == vprop[j].name && (!vprop[j].flag || (props & vprop[j].flag))) {
+				int field = vprop[j].field;
+
+				prop->dest = (char*)field_ptr[field] - (char*)&v;
+				if(field == 2 || field == 5) {
+					prop->scale = -1.0;		// flip z
+				} else if(field >= 6 && field <= 9 && prop->type == PROP_UINT8) {
+					prop->scale = 1.0 / 255.0;
+				}
+				found |= 1 << field;
+				break;
+			}
+		}
+	}
 
-	FILE *fp = fopen(fname, "r");
+	return (found & 7) == 7;
+}
+
+TriMesh *load_mesh_ply(const char *fname, unsigned int props) {
+	FILE *fp = fopen(fname, "rb");
 	if(!fp || !file_is_ply(fp)) {
 		if(fp) fclose(fp);
 		return 0;
@@ -115,95 +248,350 @@ TriMesh *load_mesh_ply(const char *fname) {
 	vector<Vertex> verts;
 	vector<Triangle> tris;
 
-	Element *elem;
+	Element *velem = 0, *felem = 0;
+	for(size_t i=0; i<ply->elem.size(); i++) {
+		if(ply->elem[i].type == ELEM_VERTEX) velem = &ply->elem[i];
+		if(ply->elem[i].type == ELEM_FACE) felem = &ply->elem[i];
+	}
 
-	// -- read the vertices
-	if(!(elem = seek_elem(ply, ELEM_VERTEX))) {
+	if(!velem) {
 		FAIL("failed to locate vertex data");
 	}
+	if(!felem) {
+		FAIL("failed to locate face data");
+	}
+	if(!setup_vertex_props(velem, props)) {
+		FAIL("weird vertex format, didn't find x, y and z");
+	}
+
+	// preallocate everything, faces will usually be triangles
+	verts.resize(velem->count);
+	tris.reserve(felem->count);
+
+	// the elements are read in a single pass, in the order they appear in the file
+	fseek(fp, ply->header_skip, SEEK_SET);
+	PlyStream ps(fp);
 
-	if(elem->prop[0].type != PROP_FLOAT || elem->prop[1].type != PROP_FLOAT || elem->prop[2].type != PROP_FLOAT) {
-		FAIL("weird vertex format, didn't find 3 floats");
+	for(size_t i=0; i<ply->elem.size(); i++) {
+		if(!read_elem(ply, &ps, &ply->elem[i], &verts, &tris)) {
+			fclose(fp);
+			delete ply;
+			return 0;
+		}
 	}
 
-	for(unsigned long i=0; i<elem->count; i++) {
-		Vertex v;
-		if(ply->fmt == PLY_ASCII) {
-			fgets(buf, BUFFER_SIZE, fp);
+	fclose(fp);
 
-			char *x_str = strtok(buf, sep);
-			char *y_str = strtok(0, sep);
-			char *z_str = strtok(0, sep);
+	Vertex vtmp;
+	bool has_normals = false, has_texcoords = false;
+	for(size_t i=0; i<velem->prop.size(); i++) {
+		long dest = velem->prop[i].dest;
+		if(dest == (char*)&vtmp.normal.x - (char*)&vtmp) has_normals = true;
+		if(dest == (char*)&vtmp.tex[0].u - (char*)&vtmp) has_texcoords = true;
+	}
+	delete ply;
 
-			if(!x_str || !y_str || !z_str) {
-				FAIL("vertex data loading failed, format inconsistent");
+	unsigned long vcount = verts.size();
+	for(size_t i=0; i<tris.size(); i++) {
+		for(int j=0; j<3; j++) {
+			if(tris[i].vertices[j] >= vcount) {
+				error("ply(%s): face %lu references vertex %lu, out of range", fname,
+						(unsigned long)i, (unsigned long)tris[i].vertices[j]);
+				return 0;
 			}
-			v.pos.x = atof(x_str);
-			v.pos.y = atof(y_str);
-			v.pos.z = -atof(z_str);
-			
+		}
+	}
+
+	if(has_texcoords) {
+		for(unsigned long i=0; i<vcount; i++) {
+			verts[i].tex[1] = verts[i].tex[0];
+		}
+	}
+
+	// ok now we have the vertex/triangle vectors, let's create the mesh and return it
+	TriMesh *mesh = new TriMesh(vcount ? &verts[0] : 0, vcount, tris.size() ? &tris[0] : 0, tris.size());
+
+	if(has_normals) {
+		// keep the normals of the file, but the triangle normals are still needed
+		Triangle *tptr = mesh->get_mod_triangle_array()->get_mod_data();
+		const Vertex *vptr = mesh->get_vertex_array()->get_data();
+		for(size_t i=0; i<tris.size(); i++) {
+			tptr[i].calculate_normal(vptr);
+		}
+	} else {
+		mesh->calculate_normals();
+	}
+	return mesh;
+}
+
+/* ---- ascii number parsing ----
+ * strtod and friends are locale dependent and quite slow, this is all that
+ * ply files need.
+ */
+static const double pow10_tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline double pow10_int(int exp) {
+	double res = 1.0;
+	while(exp > 22) {
+		res *= 1e22;
+		exp -= 22;
+	}
+	return res * pow10_tab[exp];
+}
+
+// returns a pointer past the number, or 0 if there isn't one
+static inline const char *parse_num(const char *ptr, double *res) {
+	while(*ptr == ' ' || *ptr == '\t' || *ptr == '\r') ptr++;
+
+	bool neg = false;
+	if(*ptr == '-') {
+		neg = true;
+		ptr++;
+	} else if(*ptr == '+') {
+		ptr++;
+	}
+
+	const char *start = ptr;
+	uint64_t mant = 0;
+	int exp = 0, digits = 0;
+
+	while(*ptr >= '0' && *ptr <= '9') {
+		if(digits < 19) {
+			mant = mant * 10 + (*ptr - '0');
+			if(mant) digits++;
 		} else {
-			FAIL("sorry binary ply loading not implemented yet");
+			exp++;
+		}
+		ptr++;
+	}
+	if(*ptr == '.') {
+		ptr++;
+		while(*ptr >= '0' && *ptr <= '9') {
+			if(digits < 19) {
+				mant = mant * 10 + (*ptr - '0');
+				if(mant) digits++;
+				exp--;
+			}
+			ptr++;
+		}
+	}
+	if(ptr == start || (ptr == start + 1 && *start == '.')) {
+		// "inf" and "nan" are not worth supporting
+		return 0;
+	}
+
+	if(*ptr == 'e' || *ptr == 'E') {
+		const char *eptr = ptr + 1;
+		bool eneg = false;
+		if(*eptr == '-') {
+			eneg = true;
+			eptr++;
+		} else if(*eptr == '+') {
+			eptr++;
 		}
+		if(*eptr >= '0' && *eptr <= '9') {
+			int e = 0;
+			while(*eptr >= '0' && *eptr <= '9') {
+				if(e < 10000) e = e * 10 + (*eptr - '0');
+				eptr++;
+			}
+			exp += eneg ? -e : e;
+			ptr = eptr;
+		}
+	}
 
-		verts.push_back(v);
+	double val = (double)mant;
+	if(exp > 0) {
+		val *= pow10_int(exp);
+	} else if(exp < 0) {
+		val /= pow10_int(-exp);
 	}
+	*res = neg ? -val : val;
+	return ptr;
+}
 
-	// -- read the face list
-	if(!(elem = seek_elem(ply, ELEM_FACE))) {
-		FAIL("failed to locate face data");
+/* ---- binary decoding ---- */
+static inline double get_bin(const unsigned char *ptr, PropType type, bool swap) {
+	unsigned char tmp[8];
+	size_t size = prop_size[type];
+
+	if(swap) {
+		for(size_t i=0; i<size; i++) {
+			tmp[i] = ptr[size - i - 1];
+		}
+		ptr = tmp;
 	}
 
-	if(elem->prop[0].type != PROP_LIST) {
-		FAIL("weird face format, didn't find an index list");
+	switch(type) {
+	case PROP_INT8:
+		return *(int8_t*)ptr;
+	case PROP_UINT8:
+		return *ptr;
+	case PROP_INT16:
+		{ int16_t v; memcpy(&v, ptr, 2); return v; }
+	case PROP_UINT16:
+		{ uint16_t v; memcpy(&v, ptr, 2); return v; }
+	case PROP_INT32:
+		{ int32_t v; memcpy(&v, ptr, 4); return v; }
+	case PROP_UINT32:
+		{ uint32_t v; memcpy(&v, ptr, 4); return v; }
+	case PROP_FLOAT:
+		{ float v; memcpy(&v, ptr, 4); return v; }
+	case PROP_DOUBLE:
+		{ double v; memcpy(&v, ptr, 8); return v; }
+	default:
+		break;
 	}
+	return 0.0;
+}
 
-	for(unsigned long i=0; i<elem->count; i++) {
-		int count;
-		unsigned long indices[4];
-		
-		if(ply->fmt == PLY_ASCII) {
-			fgets(buf, BUFFER_SIZE, fp);
-
-			count = atoi(strtok(buf, sep));
-			if(count < 3 || count > 4) {
-				FAIL("only triangles and quads are supported");
+#define ELEM_FAIL(m) {\
+	error("ply(%s): " m, ply_filename);\
+	return false;\
+}
+
+/* read_elem - (JT)
+ * reads all the records of an element, vertices go straight into their place
+ * in the preallocated vertex array, faces are split in triangle fans and
+ * appended to the triangle array and everything else is skipped.
+ */
+static bool read_elem(Ply *ply, PlyStream *ps, Element *elem, vector<Vertex> *verts, vector<Triangle> *tris) {
+	size_t prop_count = elem->prop.size();
+	Property *prop = prop_count ? &elem->prop[0] : 0;
+	Index findex[BUFFER_SIZE];
+
+	if(ply->fmt == PLY_ASCII) {
+		for(unsigned long i=0; i<elem->count; i++) {
+			const char *ptr = ps->line();
+			if(!ptr) ELEM_FAIL("unexpected end of file");
+
+			if(elem->type == ELEM_UNKNOWN) continue;
+
+			char *vptr = elem->type == ELEM_VERTEX ? (char*)&(*verts)[i] : 0;
+			int fcount = -1;
+
+			for(size_t j=0; j<prop_count; j++) {
+				double val;
+				if(!(ptr = parse_num(ptr, &val))) {
+					ELEM_FAIL("inconsistent element data");
+				}
+
+				if(prop[j].type == PROP_LIST) {
+					int count = (int)val;
+					if(count < 0) ELEM_FAIL("negative list size");
+
+					bool indices = elem->type == ELEM_FACE && fcount == -1 &&
+						(prop[j].name == "vertex_indices" || prop[j].name == "vertex_index");
+
+					for(int k=0; k<count; k++) {
+						if(!(ptr = parse_num(ptr, &val))) {
+							ELEM_FAIL("inconsistent face list data");
+						}
+						if(indices && k < BUFFER_SIZE) findex[k] = (Index)val;
+					}
+					if(indices) fcount = count < BUFFER_SIZE ? count : BUFFER_SIZE;
+
+				} else if(vptr && prop[j].dest >= 0) {
+					*(scalar_t*)(vptr + prop[j].dest) = (scalar_t)(val * prop[j].scale);
+				}
 			}
 
-			for(int j=0; j<count; j++) {
-				char *substr = strtok(0, sep);
-				if(!substr) {
-					FAIL("inconsistent face list data");
+			if(elem->type == ELEM_FACE) {
+				if(fcount < 3) ELEM_FAIL("face with less than 3 vertices (or no index list)");
+				for(int k=2; k<fcount; k++) {
+					tris->push_back(Triangle(findex[0], findex[k - 1], findex[k]));
 				}
-				indices[j] = atol(substr);
 			}
-			
-		} else {
-			FAIL("sorry binary ply loading not implemented yet");
 		}
+		return true;
+	}
 
-		Triangle tri(indices[0], indices[1], indices[2]);
-		tris.push_back(tri);
-
-		if(count == 4) {
-			Triangle tri2(indices[0], indices[2], indices[3]);
-			tris.push_back(tri2);
+	// binary
+	uint16_t one = 1;
+	bool big_endian_host = *(unsigned char*)&one == 0;
+	bool swap = (ply->fmt == PLY_BIG_ENDIAN) != big_endian_host;
+
+	// skip fixed size elements we don't care about in one go
+	if(elem->type == ELEM_UNKNOWN && elem->size) {
+		unsigned long left = elem->count;
+		while(left) {
+			unsigned long n = CHUNK_SIZE / elem->size;
+			if(n > left) n = left;
+			if(!ps->get(n * elem->size)) ELEM_FAIL("unexpected end of file");
+			left -= n;
 		}
+		return true;
 	}
 
-	fclose(fp);
-	delete ply;
+	for(unsigned long i=0; i<elem->count; i++) {
+		char *vptr = elem->type == ELEM_VERTEX ? (char*)&(*verts)[i] : 0;
+		int fcount = -1;
 
-	// ok now we have the vertex/triangle vectors, let's create the mesh and return it
-	TriMesh *mesh = new TriMesh(&verts[0], verts.size(), &tris[0], tris.size());
-	mesh->calculate_normals();
-	return mesh;
+		const unsigned char *rec = 0;
+		if(elem->size && !(rec = ps->get(elem->size))) {
+			ELEM_FAIL("unexpected end of file");
+		}
+
+		for(size_t j=0; j<prop_count; j++) {
+			if(prop[j].type == PROP_LIST) {
+				const unsigned char *ptr = ps->get(prop_size[prop[j].count_type]);
+				if(!ptr) ELEM_FAIL("unexpected end of file");
+
+				int count = (int)get_bin(ptr, prop[j].count_type, swap);
+				size_t esz = prop_size[prop[j].list_type];
+				if(count < 0 || !(ptr = ps->get(count * esz))) {
+					ELEM_FAIL("invalid list data");
+				}
+
+				if(elem->type == ELEM_FACE && fcount == -1 &&
+						(prop[j].name == "vertex_indices" || prop[j].name == "vertex_index")) {
+					fcount = count < BUFFER_SIZE ? count : BUFFER_SIZE;
+					for(int k=0; k<fcount; k++) {
+						findex[k] = (Index)get_bin(ptr + k * esz, prop[j].list_type, swap);
+					}
+				}
+
+			} else {
+				const unsigned char *ptr = rec;
+				if(rec) {
+					rec += prop[j].size;
+				} else if(!(ptr = ps->get(prop[j].size))) {
+					ELEM_FAIL("unexpected end of file");
+				}
+
+				if(vptr && prop[j].dest >= 0) {
+					*(scalar_t*)(vptr + prop[j].dest) = (scalar_t)(get_bin(ptr, prop[j].type, swap) * prop[j].scale);
+				}
+			}
+		}
+
+		if(elem->type == ELEM_FACE) {
+			if(fcount < 3) ELEM_FAIL("face with less than 3 vertices (or no index list)");
+			for(int k=2; k<fcount; k++) {
+				tris->push_back(Triangle(findex[0], findex[k - 1], findex[k]));
+			}
+		}
+	}
+	return true;
+}
+
+static bool get_prop_type(const char *symb, PropType *type) {
+	for(PropTypeMatch *mptr = prop_match; mptr->symb; mptr++) {
+		if(!strcmp(symb, mptr->symb)) {
+			*type = mptr->type;
+			return true;
+		}
+	}
+	return false;
 }
 
 static Ply *read_header(FILE *fp) {
-	const char *sep = " \t\n";
+	const char *sep = " \t\r\n";
 	char buf[BUFFER_SIZE];
-	
+
 	fseek(fp, 0, SEEK_SET);
 
 	Ply *ply = new Ply;
@@ -233,14 +621,14 @@ static Ply *read_header(FILE *fp) {
 				delete ply;
 				return 0;
 			}
-			
+
 		} else if(!strcmp(field, "element")) {
 			char *elem_name = strtok(0, sep);
 			if(!elem_name) {
 				warning("ply(%s): invalid element definition", ply_filename);
 				continue;
 			}
-			
+
 			char *count_str = strtok(0, sep);
 			if(!count_str || !isdigit(*count_str)) {
 				error("ply(%s): element not followed by a count", ply_filename);
@@ -253,92 +641,61 @@ static Ply *read_header(FILE *fp) {
 			Element elem;
 			elem.type = ELEM_UNKNOWN;
 			elem.count = count;
-						
-			if(!strcmp(elem_name, "vertex")) {
+			elem.size = 0;
+
+			// any repeated vertex or face elements are skipped
+			if(!strcmp(elem_name, "vertex") && !vertex_ok) {
 				elem.type = ELEM_VERTEX;
 				vertex_ok = true;
 			}
-			
-			if(!strcmp(elem_name, "face")) {
+
+			if(!strcmp(elem_name, "face") && !face_ok) {
 				elem.type = ELEM_FACE;
 				face_ok = true;
 			}
 
-			// determine element properties
-			while((buf[0] = fgetc(fp)) == 'p') {
-				if(!fgets(buf + 1, BUFFER_SIZE - 1, fp)) {
-					error("ply(%s): unexpected end of file while reading element properties", ply_filename);
-					delete ply;
-					return 0;
-				}
-				char *ptr = strtok(buf, sep);
-				if(!ptr || strcmp(ptr, "property")) {
-					error("ply(%s): looking for \"propery\", got \"%s\"", ply_filename, ptr ? ptr : "NULL");
-					delete ply;
-					return 0;
-				}
-
-				Property prop;
-				prop.size = 0;
-				
-				/*
-				char *name = strtok(0, sep);
-				if(!name) {
-					error("ply(%s): invalid property entry, no name specified", ply_filename);
-					delete ply;
-					return 0;
-				}
-				prop.name = name;
-				*/
+			ply->elem.push_back(elem);
 
-				char *type = strtok(0, sep);
-				if(!type) {
-					error("ply(%s): invalid property entry, no type specified", ply_filename);
-					delete ply;
-					return 0;
-				}
+		} else if(!strcmp(field, "property")) {
+			if(ply->elem.empty()) {
+				error("ply(%s): property outside of an element", ply_filename);
+				delete ply;
+				return 0;
+			}
+			Element *elem = &ply->elem.back();
 
-				PropTypeMatch *mptr = prop_match;
-				while(mptr->symb) {
-					if(!strcmp(type, mptr->symb)) {
-						prop.type = mptr->type;
-						prop.size = prop_size[prop.type];
-						break;
-					}
-					mptr++;
-				}
+			Property prop;
 
-				if(prop.type == PROP_LIST) {
-					type = strtok(0, sep);
-					if(!type) {
-						error("ply(%s): invalid property entry, no list subtype specified", ply_filename);
-						delete ply;
-						return 0;
-					}
-					
-					mptr = prop_match;
-					while(mptr->symb) {
-						if(!strcmp(type, mptr->symb)) {
-							prop.list_type = mptr->type;
-							prop.size = prop_size[prop.list_type];
-							break;
-						}
-						mptr++;
-					}
-				}
+			char *type = strtok(0, sep);
+			if(!type || !get_prop_type(type, &prop.type)) {
+				error("ply(%s): unknown property type \"%s\"", ply_filename, type ? type : "");
+				delete ply;
+				return 0;
+			}
 
-				if(!prop.size) {
-					error("ply(%s): unknown property type \"%s\"", ply_filename, type);
+			if(prop.type == PROP_LIST) {
+				char *count_type = strtok(0, sep);
+				char *list_type = strtok(0, sep);
+				if(!count_type || !list_type || !get_prop_type(count_type, &prop.count_type) ||
+						!get_prop_type(list_type, &prop.list_type) ||
+						prop.count_type == PROP_LIST || prop.list_type == PROP_LIST) {
+					error("ply(%s): invalid list property", ply_filename);
 					delete ply;
 					return 0;
 				}
-
-				elem.prop.push_back(prop);
+			} else {
+				prop.size = prop_size[prop.type];
 			}
 
-			ungetc(buf[0], fp);
+			char *name = strtok(0, sep);
+			if(!name) {
+				error("ply(%s): invalid property entry, no name specified", ply_filename);
+				delete ply;
+				return 0;
+			}
+			prop.name = name;
 
-			ply->elem.push_back(elem);
+			elem->prop.push_back(prop);
 
 		} else if(!strcmp(field, "end_header")) {
 			if(!vertex_ok || !face_ok) {
@@ -351,29 +708,48 @@ static Ply *read_header(FILE *fp) {
 		}
 	}
 
-	return ply;
-}
+	// binary records with no lists have a fixed size
+	for(size_t i=0; i<ply->elem.size(); i++) {
+		Element *elem = &ply->elem[i];
+		for(size_t j=0; j<elem->prop.size(); j++) {
+			if(elem->prop[j].type == PROP_LIST) {
+				elem->size = 0;
+				break;
+			}
+			elem->size += elem->prop[j].size;
+		}
+	}
 
-static Element *seek_elem(Ply *ply, ElementType elem_type) {
-	fseek(ply->fp, ply->header_skip, SEEK_SET);
-	
+	/* the element counts are used to preallocate the mesh, make sure they
+	 * aren't more than the rest of the file can hold: every property takes at
+	 * least its size in binary files (just the count for lists), and a
+	 * character and a separator in ascii files.
+	 */
+	fseek(fp, 0, SEEK_END);
+	unsigned long body_size = ftell(fp) - ply->header_skip;
 	if(ply->fmt == PLY_ASCII) {
-		char buf[BUFFER_SIZE];
-
-		for(size_t i=0; i<ply->elem.size(); i++) {
-			if(ply->elem[i].type == elem_type) {
-				return &ply->elem[i];
-			}
+		body_size++;	// the last line may not end in a newline
+	}
 
-			// it's not the one we want, skip it.
-			for(size_t j=0; j<ply->elem[i].count; j++) {
-				fgets(buf, BUFFER_SIZE, ply->fp);
+	for(size_t i=0; i<ply->elem.size(); i++) {
+		Element *elem = &ply->elem[i];
+		unsigned long min_size = 0;
+		for(size_t j=0; j<elem->prop.size(); j++) {
+			if(ply->fmt == PLY_ASCII) {
+				min_size += 2;
+			} else {
+				Property *prop = &elem->prop[j];
+				min_size += prop->type == PROP_LIST ? prop_size[prop->count_type] : prop->size;
 			}
 		}
-		return 0;
 
-	} else {
-		error("ply(%s): seek failed, binary ply loading not implemented yet", ply_filename);
-		return 0;
+		if(min_size && elem->count > body_size / min_size) {
+			error("ply(%s): %lu elements don't fit in the file", ply_filename, elem->count);
+			delete ply;
+			return 0;
+		}
+		body_size -= elem->count * min_size;
 	}
+
+	return ply;
 }
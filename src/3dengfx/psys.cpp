@@ -18,7 +18,9 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <string>
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include "3dengfx_config.h"
 #include "3denginefx.hpp"
@@ -26,6 +28,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "psys.hpp"
 #include "common/config_parser.h"
 #include "common/err_msg.h"
+#include "common/threadpool.h"
 
 #ifdef SINGLE_PRECISION_MATH
 #define GL_SCALAR_TYPE	GL_FLOAT
@@ -38,10 +41,59 @@ static scalar_t global_time;
 // just a trial and error constant to match point-sprite size with billboard size
 #define PSPRITE_BILLBOARD_RATIO		100
 
+// pooled particles are spawned and updated in chunks of this size, which
+// must not depend on the number of threads, to get the same results.
+#define PSYS_CHUNK_SIZE		4096
+
+// limit of the flattened emitter graph, in case of circular references
+#define PSYS_MAX_LEVELS		256
+
+// random stream of the values drawn once per update
+#define PSYS_SYSTEM_STREAM	0xffffffff
+
 // particle rendering state
 static bool use_psprites = true;
 static bool volatile_particles = false;
 
+// parameters passed to the particle system tasks
+struct PSysTaskData {
+	ParticleSystem *psys;
+	size_t first;			// first pool index to spawn
+	size_t count;			// particles to spawn
+	int updates_missed;
+};
+
+// random numbers a particle draws after its birth start here in its stream
+#define PSYS_LATE_STREAM_POS	0x80000000
+
+static unsigned int hash32(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+RandStream::RandStream(unsigned int seed, unsigned int stream) {
+	key = hash32(seed * 0x9e3779b9 + hash32(stream ^ 0x5bd1e995));
+	counter = 0;
+}
+
+unsigned int RandStream::next() {
+	return hash32(key ^ hash32(counter++ * 0x85ebca6b + 0xc2b2ae35));
+}
+
+void RandStream::seek(unsigned int pos) {
+	counter = pos;
+}
+
+scalar_t RandStream::frand(scalar_t range) {
+	// 24 bits, so that the result is exact in single precision
+	return range * (scalar_t)(next() >> 8) / (scalar_t)16777216.0;
+}
+
+
 Fuzzy::Fuzzy(scalar_t num, scalar_t range) {
 	this->num = num;
 	this->range = range;
@@ -51,6 +103,10 @@ scalar_t Fuzzy::operator()() const {
 	return range == 0.0 ? num : frand(range) + num - range / 2.0;
 }
 
+scalar_t Fuzzy::operator()(RandStream &rng) const {
+	return range == 0.0 ? num : rng.frand(range) + num - range / 2.0;
+}
+
 
 FuzzyVec3::FuzzyVec3(const Fuzzy &x, const Fuzzy &y, const Fuzzy &z) {
 	this->x = x;
@@ -62,6 +118,14 @@ Vector3 FuzzyVec3::operator()() const {
 	return Vector3(x(), y(), z());
 }
 
+Vector3 FuzzyVec3::operator()(RandStream &rng) const {
+	// the order of evaluation of function arguments is unspecified
+	scalar_t vx = x(rng);
+	scalar_t vy = y(rng);
+	scalar_t vz = z(rng);
+	return Vector3(vx, vy, vz);
+}
+
 
 Particle::Particle() {
 	friction = 1.0;
@@ -109,7 +173,7 @@ void BillboardParticle::update(const Vector3 &ext_force) {
  * if we use point sprites, and the particles are not rotating, then the
  * calling function has taken care to call glBegin() before calling this.
  */
-void BillboardParticle::draw() const {
+static void draw_billboard(const Vector3 &pos, scalar_t size, const Color &color, scalar_t angle) {
 	Matrix4x4 tex_rot;
 	if(volatile_particles) {
 		tex_rot.translate(Vector3(0.5, 0.5, 0.0));
@@ -118,8 +182,6 @@ void BillboardParticle::draw() const {
 		set_matrix(XFORM_TEXTURE, tex_rot);
 	}
 
-	Vector3 pos = get_position();
-	
 	if(use_psprites) {
 		if(volatile_particles) {
 			glPointSize(size);
@@ -138,6 +200,60 @@ void BillboardParticle::draw() const {
 	}
 }
 
+void BillboardParticle::draw() const {
+	draw_billboard(get_position(), size, color, angle);
+}
+
+
+ParticlePool::ParticlePool() {
+	count = 0;
+}
+
+size_t ParticlePool::add(size_t n) {
+	if(count + n > pos.size()) {
+		size_t sz = pos.empty() ? 64 : pos.size();
+		while(sz < count + n) sz *= 2;
+
+		pos.resize(sz);
+		velocity.resize(sz);
+		birth_time.resize(sz);
+		lifespan.resize(sz);
+		size_start.resize(sz);
+		size_end.resize(sz);
+		birth_angle.resize(sz);
+		emitter.resize(sz);
+		serial.resize(sz);
+		size.resize(sz);
+		angle.resize(sz);
+		color.resize(sz);
+	}
+
+	size_t first = count;
+	count += n;
+	return first;
+}
+
+void ParticlePool::remove(size_t idx) {
+	size_t last = --count;
+	if(idx == last) return;
+
+	pos[idx] = pos[last];
+	velocity[idx] = velocity[last];
+	birth_time[idx] = birth_time[last];
+	lifespan[idx] = lifespan[last];
+	size_start[idx] = size_start[last];
+	size_end[idx] = size_end[last];
+	birth_angle[idx] = birth_angle[last];
+	emitter[idx] = emitter[last];
+	serial[idx] = serial[last];
+	size[idx] = size[last];
+	angle[idx] = angle[last];
+	color[idx] = color[last];
+}
+
+void ParticlePool::clear() {
+	count = 0;
+}
 
 
 ParticleSysParams::ParticleSysParams() {
@@ -151,11 +267,62 @@ ParticleSysParams::ParticleSysParams() {
 	big_particles = false;
 	spawn_offset_curve = 0;
 	spawn_offset_curve_area = Fuzzy(0.5, 1.0);
+	emit_mode = EMIT_CONTINUOUS;
 
 	src_blend = BLEND_SRC_ALPHA;
 	dest_blend = BLEND_ONE;
 }
 
+ParticleSysParams::ParticleSysParams(const ParticleSysParams &params) {
+	*this = params;
+}
+
+ParticleSysParams::~ParticleSysParams() {
+	for(size_t i=0; i<sub_emitters.size(); i++) {
+		delete sub_emitters[i];
+	}
+}
+
+ParticleSysParams &ParticleSysParams::operator =(const ParticleSysParams &params) {
+	if(this == &params) return *this;
+
+	// copy everything before deleting our sub-emitters, params may be one of them
+	std::vector<ParticleSysParams*> subs(params.sub_emitters.size());
+	for(size_t i=0; i<subs.size(); i++) {
+		subs[i] = new ParticleSysParams(*params.sub_emitters[i]);
+	}
+
+	psize = params.psize;
+	psize_end = params.psize_end;
+	lifespan = params.lifespan;
+	birth_rate = params.birth_rate;
+	gravity = params.gravity;
+	shoot_dir = params.shoot_dir;
+	friction = params.friction;
+	spawn_offset = params.spawn_offset;
+	spawn_offset_curve = params.spawn_offset_curve;
+	spawn_offset_curve_area = params.spawn_offset_curve_area;
+	billboard_tex = params.billboard_tex;
+	start_color = params.start_color;
+	end_color = params.end_color;
+	rot = params.rot;
+	glob_rot = params.glob_rot;
+	src_blend = params.src_blend;
+	dest_blend = params.dest_blend;
+	halo = params.halo;
+	halo_color = params.halo_color;
+	halo_size = params.halo_size;
+	halo_rot = params.halo_rot;
+	big_particles = params.big_particles;
+	emit_mode = params.emit_mode;
+
+	for(size_t i=0; i<sub_emitters.size(); i++) {
+		delete sub_emitters[i];
+	}
+	sub_emitters = subs;
+	return *this;
+}
+
 
 
 ParticleSystem::ParticleSystem(const char *fname) {
@@ -171,6 +338,10 @@ ParticleSystem::ParticleSystem(const char *fname) {
 	prev_update = -1.0;
 	fraction = 0.0;
 	ptype = PTYPE_BILLBOARD;
+	pooled = false;
+	seed = 0;
+	spawn_serial = 0;
+	rng = RandStream(seed, PSYS_SYSTEM_STREAM);
 
 	ready = true;
 
@@ -193,6 +364,10 @@ void ParticleSystem::reset() {
 		delete *iter++;
 	}
 	particles.clear();
+	pool.clear();
+
+	spawn_serial = 0;
+	rng = RandStream(seed, PSYS_SYSTEM_STREAM);
 }
 
 void ParticleSystem::set_update_interval(scalar_t timeslice) {
@@ -201,6 +376,7 @@ void ParticleSystem::set_update_interval(scalar_t timeslice) {
 
 void ParticleSystem::set_params(const ParticleSysParams &psys_params) {
 	this->psys_params = psys_params;
+	build_levels();		// the old sub-emitters are gone
 }
 
 ParticleSysParams *ParticleSystem::get_params() {
@@ -211,6 +387,30 @@ void ParticleSystem::set_particle_type(ParticleType ptype) {
 	this->ptype = ptype;
 }
 
+void ParticleSystem::set_pooled(bool pooled) {
+	if(pooled != this->pooled) {
+		reset();
+		this->pooled = pooled;
+	}
+}
+
+bool ParticleSystem::is_pooled() const {
+	return pooled;
+}
+
+void ParticleSystem::set_seed(unsigned int seed) {
+	this->seed = seed;
+	reset();
+}
+
+unsigned int ParticleSystem::get_seed() const {
+	return seed;
+}
+
+int ParticleSystem::get_particle_count() const {
+	return pooled && ptype == PTYPE_BILLBOARD ? (int)pool.count : (int)particles.size();
+}
+
 void ParticleSystem::update(const Vector3 &ext_force) {
 	if(!ready) return;
 	
@@ -225,8 +425,11 @@ void ParticleSystem::update(const Vector3 &ext_force) {
 
 	curr_rot = fmod(psys_params.glob_rot * global_time, two_pi);
 
+	bool use_pool = pooled && ptype == PTYPE_BILLBOARD;
+
 	// spawn new particles
-	scalar_t spawn = psys_params.birth_rate() * (global_time - prev_update);
+	scalar_t rate = use_pool ? psys_params.birth_rate(rng) : psys_params.birth_rate();
+	scalar_t spawn = rate * (global_time - prev_update);
 	int spawn_count = (int)round(spawn);
 
 	// handle sub-timeslice spawning rates
@@ -251,162 +454,488 @@ void ParticleSystem::update(const Vector3 &ext_force) {
 	
 	scalar_t dt = (global_time - prev_update) / (scalar_t)spawn_count;
 	scalar_t t = prev_update;
-	
-	for(int i=0; i<spawn_count; i++) {
-		Particle *particle;
-		
-		switch(ptype) {
-		case PTYPE_BILLBOARD:
-			particle = new BillboardParticle;
-			{
-				curr_rot = fmod(psys_params.glob_rot * t, two_pi);
-				
-				BillboardParticle *bbp = (BillboardParticle*)particle;
-				bbp->texture = psys_params.billboard_tex;
-				bbp->start_color = psys_params.start_color;
-				bbp->end_color = psys_params.end_color;
-				bbp->rot = psys_params.rot;
-				bbp->birth_angle = curr_rot;
+
+	if(use_pool) {
+		build_levels();
+
+		if(spawn_count > 0) {
+			SpawnRequest req;
+			req.level = 0;
+			req.count = spawn_count;
+			req.pos = pos;
+			req.dp = dp;
+			req.t = t;
+			req.dt = dt;
+			req.rot = &prs.rotation;
+			spawn_queue.push_back(req);
+			spawn_pool();
+
+			curr_rot = fmod(psys_params.glob_rot * (t + dt * (spawn_count - 1)), two_pi);
+		}
+	} else {
+		for(int i=0; i<spawn_count; i++) {
+			curr_rot = fmod(psys_params.glob_rot * t, two_pi);
+
+			Vector3 offset = psys_params.spawn_offset();
+			if(psys_params.spawn_offset_curve) {
+				float t = psys_params.spawn_offset_curve_area();
+				offset += (*psys_params.spawn_offset_curve)(t);
+			}
+
+			// XXX: correct these rotations to span the whole interval
+			Vector3 ppos = pos + offset.transformed(prs.rotation);
+			scalar_t size_start = psys_params.psize();
+			scalar_t size_end = psys_params.psize_end < 0.0 ? size_start : psys_params.psize_end;
+			Vector3 velocity = psys_params.shoot_dir().transformed(prs.rotation);
+			scalar_t lifespan = psys_params.lifespan();
+
+			Particle *particle;
+
+			switch(ptype) {
+			case PTYPE_BILLBOARD:
+				particle = new BillboardParticle;
+				{
+					BillboardParticle *bbp = (BillboardParticle*)particle;
+					bbp->texture = psys_params.billboard_tex;
+					bbp->start_color = psys_params.start_color;
+					bbp->end_color = psys_params.end_color;
+					bbp->rot = psys_params.rot;
+					bbp->birth_angle = curr_rot;
+				}
+
+				break;
+
+			default:
+				error("Only billboarded particles implemented currently");
+				exit(-1);
+				break;
 			}
 
-			break;
+			//PRS sub_prs = get_prs((unsigned long)(t * 1000.0));
+
+			particle->set_position(ppos);
+			particle->set_rotation(prs.rotation);
+			particle->set_scaling(prs.scale);
+
+			particle->size_start = size_start;
+			particle->size_end = size_end;
+			particle->velocity = velocity;
+			particle->friction = psys_params.friction;
+			particle->birth_time = t;
+			particle->lifespan = lifespan;
+
+			particles.push_back(particle);
+
+			pos += dp;
+			t += dt;
+		}
+	}
+
+	// update particles
+	if(use_pool) {
+		update_pool(updates_missed);
+	} else {
+		std::list<Particle*>::iterator iter = particles.begin();
+		while(iter != particles.end()) {
+			Particle *p = *iter;
+			int i = 0;
+			while(p->alive() && i++ < updates_missed) {
+				p->update(psys_params.gravity);
+			}
 
-		default:
-			error("Only billboarded particles implemented currently");
-			exit(-1);
-			break;
+			if(p->alive()) {
+				iter++;
+			} else {
+				delete *iter;
+				iter = particles.erase(iter);
+			}
 		}
-		
-		//PRS sub_prs = get_prs((unsigned long)(t * 1000.0));
-		
-
-		Vector3 offset = psys_params.spawn_offset();
-		if(psys_params.spawn_offset_curve) {
-			float t = psys_params.spawn_offset_curve_area();
-			offset += (*psys_params.spawn_offset_curve)(t);
+	}
+
+	prev_update = global_time;
+	prev_pos = curr_pos;
+}
+
+/* flattens the tree of sub-emitters of the parameters, breadth first so that
+ * the children of each level are contiguous.
+ */
+void ParticleSystem::build_levels() {
+	levels.clear();
+
+	EmitterLevel root;
+	root.params = &psys_params;
+	root.first_child = root.child_count = 0;
+	levels.push_back(root);
+
+	for(size_t i=0; i<levels.size(); i++) {
+		ParticleSysParams *params = levels[i].params;
+		levels[i].first_child = levels.size();
+		levels[i].child_count = 0;
+
+		for(size_t j=0; j<params->sub_emitters.size(); j++) {
+			if(levels.size() >= PSYS_MAX_LEVELS) {
+				error("psys: too many sub-emitters (circular references?)");
+				return;
+			}
+
+			// childless until its turn comes, which it won't if we give up
+			EmitterLevel lev;
+			lev.params = params->sub_emitters[j];
+			lev.first_child = lev.child_count = 0;
+			levels.push_back(lev);
+			levels[i].child_count++;
 		}
-		// XXX: correct this rotation to span the whole interval
-		particle->set_position(pos + offset.transformed(prs.rotation));
-		particle->set_rotation(prs.rotation);
-		particle->set_scaling(prs.scale);
-
-		particle->size_start = psys_params.psize();
-		if(psys_params.psize_end < 0.0) {
-			particle->size_end = particle->size_start;
-		} else {
-			particle->size_end = psys_params.psize_end;
+	}
+}
+
+/* spawns the particles requested in the spawn queue, the k-th of them drawing
+ * its random values from the stream of serial number spawn_serial + k.
+ */
+void ParticleSystem::spawn_pool() {
+	size_t total = 0;
+	spawn_offsets.resize(spawn_queue.size());
+	for(size_t i=0; i<spawn_queue.size(); i++) {
+		spawn_offsets[i] = total;
+		total += spawn_queue[i].count;
+	}
+
+	if(total) {
+		// curves sample their arc length on first use, don't do it from the workers
+		for(size_t i=0; i<levels.size(); i++) {
+			if(levels[i].params->spawn_offset_curve) {
+				(*levels[i].params->spawn_offset_curve)(0.0);
+			}
 		}
-		particle->velocity = psys_params.shoot_dir().transformed(prs.rotation);	// XXX: correct this rotation to span the interval
-		particle->friction = psys_params.friction;
-		particle->birth_time = t;
-		particle->lifespan = psys_params.lifespan();
 
-		particles.push_back(particle);
+		PSysTaskData data;
+		data.psys = this;
+		data.first = pool.add(total);
+		data.count = total;
 
-		pos += dp;
-		t += dt;
+		tpool_parallel_for((total + PSYS_CHUNK_SIZE - 1) / PSYS_CHUNK_SIZE, spawn_task, &data);
+		spawn_serial += total;
 	}
-	
 
-	// update particles
-	
-	std::list<Particle*>::iterator iter = particles.begin();
-	while(iter != particles.end()) {
-		Particle *p = *iter;
-		int i = 0;
-		while(p->alive() && i++ < updates_missed) {
-			p->update(psys_params.gravity);
+	spawn_queue.clear();
+}
+
+void ParticleSystem::spawn_task(int chunk, void *cls) {
+	PSysTaskData *data = (PSysTaskData*)cls;
+	ParticleSystem *ps = data->psys;
+	ParticlePool *pool = &ps->pool;
+
+	size_t start = (size_t)chunk * PSYS_CHUNK_SIZE;
+	size_t end = std::min(start + PSYS_CHUNK_SIZE, data->count);
+
+	// find the request of the first particle of the chunk
+	size_t r = std::upper_bound(ps->spawn_offsets.begin(), ps->spawn_offsets.end(), start) -
+		ps->spawn_offsets.begin() - 1;
+
+	for(size_t k=start; k<end; k++) {
+		while(k >= ps->spawn_offsets[r] + ps->spawn_queue[r].count) r++;
+
+		const SpawnRequest &req = ps->spawn_queue[r];
+		const ParticleSysParams &params = *ps->levels[req.level].params;
+		size_t i = k - ps->spawn_offsets[r];
+
+		RandStream rng(ps->seed, ps->spawn_serial + k);
+		scalar_t t = req.t + req.dt * i;
+
+		Vector3 offset = params.spawn_offset(rng);
+		if(params.spawn_offset_curve) {
+			float ct = params.spawn_offset_curve_area(rng);
+			offset += (*params.spawn_offset_curve)(ct);
 		}
 
-		if(p->alive()) {
-			iter++;
-		} else {
-			delete *iter;
-			iter = particles.erase(iter);
+		size_t idx = data->first + k;
+		pool->size_start[idx] = params.psize(rng);
+		pool->size_end[idx] = params.psize_end < 0.0 ? pool->size_start[idx] : params.psize_end;
+		pool->velocity[idx] = params.shoot_dir(rng);
+		pool->lifespan[idx] = params.lifespan(rng);
+		pool->birth_time[idx] = t;
+		pool->birth_angle[idx] = fmod(params.glob_rot * t, two_pi);
+		pool->emitter[idx] = req.level;
+		pool->serial[idx] = ps->spawn_serial + k;
+
+		// XXX: correct these rotations to span the whole interval
+		if(req.rot) {
+			offset.transform(*req.rot);
+			pool->velocity[idx].transform(*req.rot);
 		}
+		pool->pos[idx] = req.pos + req.dp * i + offset;
+
+		// particles emitted by sub-emitters are born after the update pass
+		scalar_t time = global_time - t;
+		scalar_t lt = time / pool->lifespan[idx];
+		pool->color[idx] = blend_colors(params.start_color, params.end_color, lt);
+		pool->size[idx] = pool->size_start[idx] + (pool->size_end[idx] - pool->size_start[idx]) * lt;
+		pool->angle[idx] = params.rot * time + pool->birth_angle[idx];
 	}
+}
 
-	prev_update = global_time;
-	prev_pos = curr_pos;
+/* same as Particle::update and BillboardParticle::update applied
+ * updates_missed times to each particle of the pool. Chunks of particles
+ * are updated in parallel, and the dying ones are removed afterwards, from
+ * the last to the first, so that the order of the pool doesn't depend on
+ * the number of threads either. Then the particles emitted by the
+ * particles of the pool are appended, in the order of their parents.
+ */
+void ParticleSystem::update_pool(int updates_missed) {
+	int num_chunks = (pool.count + PSYS_CHUNK_SIZE - 1) / PSYS_CHUNK_SIZE;
+	if((int)dead_lists.size() < num_chunks) {
+		dead_lists.resize(num_chunks);
+		spawn_lists.resize(num_chunks);
+	}
+
+	PSysTaskData data;
+	data.psys = this;
+	data.updates_missed = updates_missed;
+
+	tpool_parallel_for(num_chunks, update_task, &data);
+
+	for(int i=0; i<num_chunks; i++) {
+		spawn_queue.insert(spawn_queue.end(), spawn_lists[i].begin(), spawn_lists[i].end());
+	}
+
+	// removing from the end, the particle moved in a dead one's place is alive
+	for(int i=num_chunks-1; i>=0; i--) {
+		std::vector<size_t> &dead = dead_lists[i];
+		for(int j=(int)dead.size()-1; j>=0; j--) {
+			pool.remove(dead[j]);
+		}
+	}
+
+	spawn_pool();
 }
 
-void ParticleSystem::draw() const {
-	if(!ready) return;
+void ParticleSystem::update_task(int chunk, void *cls) {
+	PSysTaskData *data = (PSysTaskData*)cls;
+	ParticleSystem *ps = data->psys;
+	ParticlePool *pool = &ps->pool;
+
+	std::vector<size_t> &dead = ps->dead_lists[chunk];
+	std::vector<SpawnRequest> &spawns = ps->spawn_lists[chunk];
+	dead.clear();
+	spawns.clear();
+
+	size_t start = (size_t)chunk * PSYS_CHUNK_SIZE;
+	size_t end = std::min(start + PSYS_CHUNK_SIZE, pool->count);
+
+	for(size_t i=start; i<end; i++) {
+		const EmitterLevel &lev = ps->levels[pool->emitter[i]];
+		const ParticleSysParams *params = lev.params;
+
+		scalar_t time = global_time - pool->birth_time[i];
+		if(time >= pool->lifespan[i]) {
+			dead.push_back(i);
+
+			// burst of the sub-emitters emitting on death
+			RandStream rng(ps->seed, pool->serial[i]);
+			rng.seek(PSYS_LATE_STREAM_POS);
+
+			for(int j=0; j<lev.child_count; j++) {
+				int child = lev.first_child + j;
+				const ParticleSysParams *cparams = ps->levels[child].params;
+				if(cparams->emit_mode != EMIT_ON_DEATH) continue;
+
+				int count = (int)round(cparams->birth_rate(rng));
+				if(count > 0) {
+					SpawnRequest req;
+					req.level = child;
+					req.count = count;
+					req.pos = pool->pos[i];
+					req.dp = Vector3(0, 0, 0);
+					req.t = pool->birth_time[i] + pool->lifespan[i];
+					req.dt = 0.0;
+					req.rot = 0;
+					spawns.push_back(req);
+				}
+			}
+			continue;
+		}
 
+		const Vector3 &grav = params->gravity;
+		scalar_t friction = params->friction;
+
+		Vector3 prev_pos = pool->pos[i];
+		Vector3 vel = pool->velocity[i];
+		Vector3 pos = prev_pos;
+		for(int j=0; j<data->updates_missed; j++) {
+			vel = (vel + grav) * friction;
+			pos += vel;
+		}
+		pool->velocity[i] = vel;
+		pool->pos[i] = pos;
+
+		scalar_t t = time / pool->lifespan[i];
+		pool->color[i] = blend_colors(params->start_color, params->end_color, t);
+		pool->size[i] = pool->size_start[i] + (pool->size_end[i] - pool->size_start[i]) * t;
+		pool->angle[i] = params->rot * time + pool->birth_angle[i];
+
+		// continuous sub-emitters: a particle of age a has emitted floor(rate * a)
+		scalar_t prev_time = std::max(ps->prev_update - pool->birth_time[i], (scalar_t)0.0);
+		for(int j=0; j<lev.child_count; j++) {
+			int child = lev.first_child + j;
+			const ParticleSysParams *cparams = ps->levels[child].params;
+			if(cparams->emit_mode != EMIT_CONTINUOUS) continue;
+
+			scalar_t rate = cparams->birth_rate.num;
+			int count = (int)(floor(rate * time) - floor(rate * prev_time));
+			if(count > 0) {
+				SpawnRequest req;
+				req.level = child;
+				req.count = count;
+				req.pos = prev_pos;
+				req.dp = (pos - prev_pos) / (scalar_t)count;
+				req.t = pool->birth_time[i] + prev_time;
+				req.dt = (time - prev_time) / (scalar_t)count;
+				req.rot = 0;
+				spawns.push_back(req);
+			}
+		}
+	}
+}
+
+/* sets up the render state for drawing billboards with the given parameters,
+ * rot is the texture rotation of non-volatile particles.
+ */
+static void begin_billboards(const ParticleSysParams &params, scalar_t rot) {
+	set_lighting(false);
+	set_zwrite(false);
+	set_alpha_blending(true);
+	set_blend_func(params.src_blend, params.dest_blend);
+
+	if(params.billboard_tex) {
+		enable_texture_unit(0);
+		disable_texture_unit(1);
+		set_texture(0, params.billboard_tex);
+		set_texture_addressing(0, TEXADDR_CLAMP, TEXADDR_CLAMP);
+
+		if(use_psprites) {
+			set_point_sprites(true);
+			set_point_sprite_coords(0, true);
+		}
+
+		if(!volatile_particles) {
+			Matrix4x4 prot;
+			prot.translate(Vector3(0.5, 0.5, 0.0));
+			prot.rotate(Vector3(0.0, 0.0, rot));
+			prot.translate(Vector3(-0.5, -0.5, 0.0));
+			set_matrix(XFORM_TEXTURE, prot);
+		}
+	}
+
+	set_texture_unit_color(0, TOP_MODULATE, TARG_TEXTURE, TARG_PREV);
+	set_texture_unit_alpha(0, TOP_MODULATE, TARG_TEXTURE, TARG_PREV);
+}
+
+static void end_billboards(const ParticleSysParams &params) {
+	if(use_psprites) {
+		glPointSize(1.0);
+	}
+
+	if(params.billboard_tex) {
+		if(use_psprites) {
+			set_point_sprites(true);
+			set_point_sprite_coords(0, true);
+		}
+		set_texture_addressing(0, TEXADDR_WRAP, TEXADDR_WRAP);
+		disable_texture_unit(0);
+
+		set_matrix(XFORM_TEXTURE, Matrix4x4::identity_matrix);
+	}
+
+	set_alpha_blending(false);
+	set_zwrite(true);
+	set_lighting(true);
+}
+
+static void set_billboard_state(const ParticleSysParams &params, bool psprites_unsupported) {
 	// use point sprites if the system supports them AND we don't need big particles
-	use_psprites = !psys_params.big_particles && !psprites_unsupported;
+	use_psprites = !params.big_particles && !psprites_unsupported;
 
 	// particles are volatile if they rotate OR they fluctuate in size
-	volatile_particles = psys_params.rot > small_number || psys_params.psize.range > small_number;
-	
-	set_matrix(XFORM_WORLD, Matrix4x4());
-	load_xform_matrices();
+	volatile_particles = params.rot > small_number || params.psize.range > small_number;
+}
 
-	std::list<Particle*>::const_iterator iter = particles.begin();
-	if(iter != particles.end()) {
-		
-		if(ptype == PTYPE_BILLBOARD) {
-			// ------ setup render state ------
-			set_lighting(false);
-			set_zwrite(false);
-			set_alpha_blending(true);
-			set_blend_func(psys_params.src_blend, psys_params.dest_blend);
-
-			if(psys_params.billboard_tex) {
-				enable_texture_unit(0);
-				disable_texture_unit(1);
-				set_texture(0, psys_params.billboard_tex);
-				set_texture_addressing(0, TEXADDR_CLAMP, TEXADDR_CLAMP);
-
-				if(use_psprites) {
-					set_point_sprites(true);
-					set_point_sprite_coords(0, true);
-				}
+// draws the pool, one emitter level at a time
+void ParticleSystem::draw_pool() const {
+	for(size_t lev=0; lev<levels.size(); lev++) {
+		const ParticleSysParams &params = *levels[lev].params;
+
+		// with a single level we can draw the whole pool, otherwise pick its particles
+		const unsigned int *idx = 0;
+		size_t count = pool.count;
+		if(levels.size() > 1) {
+			draw_idx.clear();
+			for(size_t i=0; i<pool.count; i++) {
+				if(pool.emitter[i] == lev) draw_idx.push_back(i);
+			}
+			count = draw_idx.size();
+			idx = count ? &draw_idx[0] : 0;
+		}
+		if(!count) continue;
 
-				if(!volatile_particles) {
-					Matrix4x4 prot;
-					prot.translate(Vector3(0.5, 0.5, 0.0));
-					prot.rotate(Vector3(0.0, 0.0, curr_rot));
-					prot.translate(Vector3(-0.5, -0.5, 0.0));
-					set_matrix(XFORM_TEXTURE, prot);
-				}
+		set_billboard_state(params, psprites_unsupported);
+		begin_billboards(params, lev ? fmod(params.glob_rot * global_time, two_pi) : curr_rot);
+
+		if(use_psprites && !volatile_particles) {
+			// the pool arrays can be passed to GL as they are
+			glPointSize(pool.size[idx ? idx[0] : 0]);
+
+			glEnableClientState(GL_VERTEX_ARRAY);
+			glEnableClientState(GL_COLOR_ARRAY);
+			glVertexPointer(3, GL_SCALAR_TYPE, 0, &pool.pos[0]);
+			glColorPointer(4, GL_SCALAR_TYPE, 0, &pool.color[0]);
+			if(idx) {
+				glDrawElements(GL_POINTS, count, GL_UNSIGNED_INT, idx);
+			} else {
+				glDrawArrays(GL_POINTS, 0, count);
 			}
+			glDisableClientState(GL_VERTEX_ARRAY);
+			glDisableClientState(GL_COLOR_ARRAY);
+		} else {
+			for(size_t i=0; i<count; i++) {
+				size_t j = idx ? idx[i] : i;
+				draw_billboard(pool.pos[j], pool.size[j], pool.color[j], pool.angle[j]);
+			}
+		}
 
-			set_texture_unit_color(0, TOP_MODULATE, TARG_TEXTURE, TARG_PREV);
-			set_texture_unit_alpha(0, TOP_MODULATE, TARG_TEXTURE, TARG_PREV);
+		end_billboards(params);
+	}
+}
+
+void ParticleSystem::draw() const {
+	if(!ready) return;
+
+	set_matrix(XFORM_WORLD, Matrix4x4());
+	load_xform_matrices();
+
+	if(pooled && ptype == PTYPE_BILLBOARD) {
+		draw_pool();
+	} else if(!particles.empty()) {
+		set_billboard_state(psys_params, psprites_unsupported);
+
+		if(ptype == PTYPE_BILLBOARD) {
+			begin_billboards(psys_params, curr_rot);
 
 			if(use_psprites && !volatile_particles) {
-				glPointSize((*iter)->size);
+				glPointSize(particles.front()->size);
 				glBegin(GL_POINTS);
 			}
 		}
 
 		// ------ render particles ------
+		std::list<Particle*>::const_iterator iter = particles.begin();
 		while(iter != particles.end()) {
 			(*iter++)->draw();
 		}
 	
 		if(ptype == PTYPE_BILLBOARD) {
-			// ------ restore render states -------
-			if(use_psprites) {
-				if(!volatile_particles) glEnd();
-				glPointSize(1.0);
-			}
-
-			if(psys_params.billboard_tex) {
-				if(use_psprites) {
-					set_point_sprites(true);
-					set_point_sprite_coords(0, true);
-				}
-				set_texture_addressing(0, TEXADDR_WRAP, TEXADDR_WRAP);
-				disable_texture_unit(0);
-
-				set_matrix(XFORM_TEXTURE, Matrix4x4::identity_matrix);
+			if(use_psprites && !volatile_particles) {
+				glEnd();
 			}
-
-			set_alpha_blending(false);
-			set_zwrite(true);
-			set_lighting(true);
+			end_billboards(psys_params);
 		}
 	}
 
@@ -512,9 +1041,15 @@ static Vector4 get_vector4(const char *str) {
 }
 
 
-bool psys::load_particle_sys_params(const char *fname, ParticleSysParams *psp) {
+/* loads the parameters of fname and, recursively, of its sub-emitters.
+ * loading lists the files being loaded further up, to catch circular
+ * references, and level_count counts the emitters loaded so far, to stop
+ * where build_levels() would give up anyway.
+ */
+static bool load_params(const char *fname, ParticleSysParams *psp, std::vector<std::string> *loading, int *level_count) {
 	Vector3 shoot, shoot_range;
 	Vector3 spawn_off, spawn_off_range;
+	std::vector<std::string> sub_files;
 	
 	set_parser_state(PS_AssignmentSymbol, ':');
 	set_parser_state(PS_CommentSymbol, '#');
@@ -642,11 +1177,52 @@ bool psys::load_particle_sys_params(const char *fname, ParticleSysParams *psp) {
 			if(!(psp->spawn_offset_curve = load_curve(opt->str_value))) {
 				error("psys: could not load spawn offset curve: %s", opt->str_value);
 			}
+
+		} else if(!strcmp(opt->option, "sub_emitter")) {
+			// the parser isn't reentrant, load them when we're done with this file
+			sub_files.push_back(opt->str_value);
+
+		} else if(!strcmp(opt->option, "emit_mode")) {
+			if(!strcmp(opt->str_value, "continuous")) {
+				psp->emit_mode = EMIT_CONTINUOUS;
+			} else if(!strcmp(opt->str_value, "death")) {
+				psp->emit_mode = EMIT_ON_DEATH;
+			} else {
+				error("psys: invalid emit mode: %s", opt->str_value);
+			}
 		}
 	}
 
 	psp->shoot_dir = FuzzyVec3(Fuzzy(shoot.x, shoot_range.x), Fuzzy(shoot.y, shoot_range.y), Fuzzy(shoot.z, shoot_range.z));
 	psp->spawn_offset = FuzzyVec3(Fuzzy(spawn_off.x, spawn_off_range.x), Fuzzy(spawn_off.y, spawn_off_range.y), Fuzzy(spawn_off.z, spawn_off_range.z));
 
+	loading->push_back(fname);
+	for(size_t i=0; i<sub_files.size(); i++) {
+		if(std::find(loading->begin(), loading->end(), sub_files[i]) != loading->end()) {
+			error("psys: circular sub-emitter reference to %s in %s", sub_files[i].c_str(), fname);
+			continue;
+		}
+		if(*level_count >= PSYS_MAX_LEVELS) {
+			error("psys: too many sub-emitters, ignoring %s", sub_files[i].c_str());
+			continue;
+		}
+		++*level_count;
+
+		ParticleSysParams *sub = new ParticleSysParams;
+		if(!load_params(sub_files[i].c_str(), sub, loading, level_count)) {
+			error("psys: could not load sub-emitter: %s", sub_files[i].c_str());
+			delete sub;
+			continue;
+		}
+		psp->sub_emitters.push_back(sub);
+	}
+	loading->pop_back();
+
 	return true;
 }
+
+bool psys::load_particle_sys_params(const char *fname, ParticleSysParams *psp) {
+	std::vector<std::string> loading;
+	int level_count = 1;
+	return load_params(fname, psp, &loading, &level_count);
+}
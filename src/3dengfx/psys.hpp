@@ -28,9 +28,28 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define _PSYS_HPP_
 
 #include <list>
+#include <vector>
 #include "gfx/3dgeom.hpp"
 #include "n3dmath2/n3dmath2.hpp"
 
+/* counter-based random numbers
+ * The n-th number of a stream is a hash of the seed, the stream id and n,
+ * so any number of streams can be generated in any order, or from several
+ * threads at once, always with the same results.
+ */
+class RandStream {
+private:
+	unsigned int key, counter;
+
+public:
+	RandStream(unsigned int seed = 0, unsigned int stream = 0);
+
+	unsigned int next();
+	scalar_t frand(scalar_t range);	// [0, range)
+
+	void seek(unsigned int pos);	// the next number will be the pos-th of the stream
+};
+
 /* fuzzy scalar values
  * random variables defined as a range of values around a central,
  * with equiprobable distrubution function
@@ -41,6 +60,7 @@ public:
 
 	Fuzzy(scalar_t num = 0.0, scalar_t range = 0.0);
 	scalar_t operator()() const;
+	scalar_t operator()(RandStream &rng) const;
 };
 
 /* TODO: make a fuzzy direction with polar coordinates, so the random 
@@ -55,6 +75,7 @@ private:
 public:
 	FuzzyVec3(const Fuzzy &x = Fuzzy(), const Fuzzy &y = Fuzzy(), const Fuzzy &z = Fuzzy());
 	Vector3 operator()() const;
+	Vector3 operator()(RandStream &rng) const;
 };
 
 
@@ -101,6 +122,12 @@ class MeshParticle : public Particle {
 };
 
 
+/* how a sub-emitter's particles are emitted by each particle of its parent:
+ * continuously at birth_rate particles per second (e.g. trails), or
+ * birth_rate particles at once when the parent dies (e.g. fireworks).
+ */
+enum ParticleEmitMode {EMIT_CONTINUOUS, EMIT_ON_DEATH};
+
 struct ParticleSysParams {
 	Fuzzy psize;			// particle size
 	scalar_t psize_end;		// end size (end of life)
@@ -127,16 +154,56 @@ struct ParticleSysParams {
 
 	bool big_particles;		// need support for big particles (i.e. don't use point sprites)
 
+	// nested emitters, only used with pooled particles (see set_pooled). They
+	// are owned by these parameters, copied along with them and deleted with them.
+	std::vector<ParticleSysParams*> sub_emitters;	// emitted by each particle of this system
+	ParticleEmitMode emit_mode;		// how this system is emitted when it's a sub-emitter
+
 	ParticleSysParams();
+	ParticleSysParams(const ParticleSysParams &params);
+	~ParticleSysParams();
+
+	ParticleSysParams &operator =(const ParticleSysParams &params);
 };
 
 enum ParticleType {PTYPE_PSYS, PTYPE_BILLBOARD, PTYPE_MESH};
 
+/* pooled billboard particles
+ * The particle attributes are kept in parallel arrays instead of Particle
+ * objects, and the live particles are always the first count elements;
+ * a dying particle is replaced by the last one. The arrays only grow, so
+ * once they are large enough no allocations take place.
+ */
+class ParticlePool {
+public:
+	std::vector<Vector3> pos, velocity;
+	std::vector<scalar_t> birth_time, lifespan;
+	std::vector<scalar_t> size_start, size_end, birth_angle;
+	std::vector<unsigned short> emitter;	// emitter graph level of each particle
+	std::vector<unsigned int> serial;		// selects the random stream of each particle
+
+	// current state, calculated by ParticleSystem::update()
+	std::vector<scalar_t> size, angle;
+	std::vector<Color> color;
+
+	size_t count;
+
+	ParticlePool();
+
+	size_t add(size_t n = 1);	// returns the index of the first new particle
+	void remove(size_t idx);
+	void clear();
+};
+
 /* Particle system
  * The design here gets a bit confusing but for good reason
  * the particle system is also a particle because it can be emmited by
  * another particle system. This way we get a tree structure of particle
  * emmiters with the leaves being just billboards or mesh-particles.
+ *
+ * With pooled particles, the tree of sub-emitters in the parameters is
+ * instead flattened to a list of emitter levels, and the particles of all
+ * levels live in the same pool and are updated in the same pass.
  */
 class ParticleSystem : public Particle {
 protected:
@@ -146,6 +213,39 @@ protected:
 	bool psprites_unsupported;
 	std::list<Particle*> particles;
 
+	bool pooled;
+	ParticlePool pool;
+
+	/* pooled particles take their random values from their own stream,
+	 * selected by their serial number, and are updated in chunks in
+	 * parallel, so the results only depend on the seed.
+	 */
+	unsigned int seed;
+	unsigned int spawn_serial;	// number of particles spawned since the reset
+	RandStream rng;				// for the values drawn once per update
+	std::vector<std::vector<size_t> > dead_lists;	// dying particles of each chunk
+
+	// a level of the flattened emitter graph, children are contiguous
+	struct EmitterLevel {
+		ParticleSysParams *params;
+		int first_child, child_count;
+	};
+	std::vector<EmitterLevel> levels;
+
+	// a batch of particles to spawn, the i-th at pos + dp * i, time t + dt * i
+	struct SpawnRequest {
+		int level;
+		size_t count;
+		Vector3 pos, dp;
+		scalar_t t, dt;
+		const Quaternion *rot;		// rotation of the spawn offset and velocity
+	};
+	std::vector<SpawnRequest> spawn_queue;
+	std::vector<std::vector<SpawnRequest> > spawn_lists;	// sub-emitter spawns of each chunk
+	std::vector<size_t> spawn_offsets;
+
+	mutable std::vector<unsigned int> draw_idx;
+
 	ParticleSysParams psys_params;
 	ParticleType ptype;
 
@@ -158,6 +258,14 @@ protected:
 	Vector3 curr_pos;
 	scalar_t curr_rot, curr_halo_rot;
 
+	void build_levels();
+	void spawn_pool();
+	void update_pool(int updates_missed);
+	void draw_pool() const;
+
+	static void spawn_task(int chunk, void *cls);
+	static void update_task(int chunk, void *cls);
+
 public:
 	ParticleSystem(const char *fname = 0);
 	virtual ~ParticleSystem();
@@ -169,6 +277,19 @@ public:
 	virtual ParticleSysParams *get_params();
 	virtual void set_particle_type(ParticleType ptype);
 
+	/* keep billboard particles in a ParticlePool instead of individual
+	 * Particle objects (off by default). Pooled particles are drawn in no
+	 * particular order, and aren't XFormNodes. Nested emitters need it.
+	 * Changing it resets the system.
+	 */
+	virtual void set_pooled(bool pooled);
+	virtual bool is_pooled() const;
+	virtual int get_particle_count() const;
+
+	// seed of the pooled particles' random streams, resets the system
+	virtual void set_seed(unsigned int seed);
+	virtual unsigned int get_seed() const;
+
 	virtual void update(const Vector3 &ext_force = Vector3());
 	virtual void draw() const;
 };
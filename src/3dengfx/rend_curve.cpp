@@ -78,7 +78,7 @@ Material RendCurve::get_material() const {
 bool RendCurve::render(unsigned long time) {
 	if(!curve) return false;
 	
-	set_matrix(XFORM_WORLD, get_prs(time).get_xform_matrix());
+	set_matrix(XFORM_WORLD, get_xform_matrix(time));
 	mat.set_glmaterial();
 
 	if(mat.tex[TEXTYPE_DIFFUSE]) {
@@ -114,7 +114,7 @@ bool RendCurve::render(unsigned long time) {
 bool RendCurve::render_segm(float start, float end, unsigned long time) {
 	if(!curve) return false;
 	
-	set_matrix(XFORM_WORLD, get_prs(time).get_xform_matrix());
+	set_matrix(XFORM_WORLD, get_xform_matrix(time));
 	mat.set_glmaterial();
 
 	if(mat.tex[TEXTYPE_DIFFUSE]) {
@@ -0,0 +1,830 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Binary scene cache (.3dxc)
+ *
+ * author: John Tsiombikas 2005
+ */
+
+#include "3dengfx_config.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "scenecache.hpp"
+#include "texman.hpp"
+#include "common/types.h"
+#include "common/err_msg.h"
+
+#if defined(unix) || defined(__unix__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
+
+/* File layout: a header identifying the engine build (byte order and sizes
+ * of the stored types) and the source file the cache was created from,
+ * followed by the mesh (for mesh caches), the scene records, or the pixels
+ * of an image and its mip levels (for image caches). Scalars are
+ * stored as 32bit words, arrays are aligned to CACHE_ALIGN bytes and stored
+ * in their in-memory layout, so that loading them is a plain copy.
+ */
+#define CACHE_MAGIC			"3DXC"
+#define CACHE_VERSION		3
+#define CACHE_BYTE_ORDER	0x01020304
+#define CACHE_ALIGN			16
+#define CACHE_EXT			".3dxc"
+
+enum {CACHE_SCENE, CACHE_MESH, CACHE_IMAGE};
+
+struct CacheKey {
+	uint32_t size_lo, size_hi;
+	uint32_t mtime_lo, mtime_hi;
+	uint32_t hash;
+};
+
+static bool use_cache = true;
+static std::string cache_path;
+
+MaterialTexRefs::MaterialTexRefs() {
+	cube_size = 0;
+	env_intensity = 1.0;
+}
+
+SceneContents::SceneContents() {
+	poly_count = 0;
+}
+
+void set_scene_cache(bool enable) {
+	use_cache = enable;
+}
+
+bool get_scene_cache() {
+	return use_cache;
+}
+
+void set_scene_cache_path(const char *path) {
+	cache_path = path ? path : "";
+	if(!cache_path.empty() && cache_path[cache_path.size() - 1] != '/') {
+		cache_path += '/';
+	}
+}
+
+static std::string get_cache_fname(const char *src_fname) {
+	if(cache_path.empty()) {
+		return std::string(src_fname) + CACHE_EXT;
+	}
+
+	const char *base = src_fname;
+	for(const char *ptr = src_fname; *ptr; ptr++) {
+		if(*ptr == '/' || *ptr == '\\') base = ptr + 1;
+	}
+	return cache_path + base + CACHE_EXT;
+}
+
+/* get_cache_key - (JT)
+ * the size and mtime of the source file catch nearly every change, the
+ * contents hash (FNV-1a over 32bit words) catches the rest.
+ */
+static bool get_cache_key(const char *fname, CacheKey *key) {
+	struct stat st;
+	FILE *fp;
+
+	if(stat(fname, &st) == -1 || !(fp = fopen(fname, "rb"))) {
+		return false;
+	}
+
+	uint64_t size = (uint64_t)st.st_size;
+	uint64_t mtime = (uint64_t)st.st_mtime;
+	key->size_lo = (uint32_t)size;
+	key->size_hi = (uint32_t)(size >> 32);
+	key->mtime_lo = (uint32_t)mtime;
+	key->mtime_hi = (uint32_t)(mtime >> 32);
+
+	std::vector<uint32_t> bufv(16384);
+	uint32_t *buf = &bufv[0];
+	uint32_t hash = 2166136261U;
+	size_t rd;
+	while((rd = fread(buf, 1, bufv.size() * 4, fp)) > 0) {
+		size_t words = rd / 4;
+		for(size_t i=0; i<words; i++) {
+			hash = (hash ^ buf[i]) * 16777619U;
+		}
+		for(size_t i=words * 4; i<rd; i++) {
+			hash = (hash ^ ((unsigned char*)buf)[i]) * 16777619U;
+		}
+	}
+	key->hash = hash;
+
+	fclose(fp);
+	return true;
+}
+
+
+////////////////// writing //////////////////
+
+class CacheWriter {
+private:
+	FILE *fp;
+	unsigned long pos;
+
+public:
+	bool fail;
+
+	CacheWriter(FILE *fp) { this->fp = fp; pos = 0; fail = false; }
+
+	void put(const void *data, unsigned long size) {
+		if(size && fwrite(data, 1, size, fp) != size) fail = true;
+		pos += size;
+	}
+
+	void align() {
+		static const char zeros[CACHE_ALIGN] = {0};
+		put(zeros, (CACHE_ALIGN - pos % CACHE_ALIGN) % CACHE_ALIGN);
+	}
+
+	void u32(uint32_t val) { put(&val, 4); }
+
+	void scalar(scalar_t val) {
+		float f = (float)val;
+		put(&f, 4);
+	}
+
+	void str(const std::string &s) {
+		u32(s.size());
+		put(s.c_str(), s.size());
+		put("\0\0\0", (4 - s.size() % 4) % 4);
+	}
+
+	void vec3(const Vector3 &v) { scalar(v.x); scalar(v.y); scalar(v.z); }
+	void quat(const Quaternion &q) { scalar(q.s); vec3(q.v); }
+	void color(const Color &c) { scalar(c.r); scalar(c.g); scalar(c.b); scalar(c.a); }
+
+	void array(const void *data, unsigned long size) {
+		align();
+		put(data, size);
+	}
+};
+
+static void write_header(CacheWriter *cw, int type, const CacheKey &key) {
+	cw->put(CACHE_MAGIC, 4);
+	cw->u32(CACHE_VERSION);
+	cw->u32(CACHE_BYTE_ORDER);
+	cw->u32(type);
+	cw->u32(sizeof(Vertex));
+	cw->u32(sizeof(Triangle));
+	cw->u32(sizeof(Edge));
+	cw->u32(sizeof(Index));
+	cw->put(&key, sizeof key);
+}
+
+static void write_prs(CacheWriter *cw, const PRS &prs) {
+	cw->vec3(prs.position);
+	cw->quat(prs.rotation);
+	cw->vec3(prs.scale);
+	cw->vec3(prs.pivot);
+}
+
+static void write_node(CacheWriter *cw, XFormNode *node) {
+	cw->str(node->name);
+	write_prs(cw, node->get_local_prs());
+
+	std::vector<Keyframe> *keys = node->get_keyframes();
+	cw->u32(keys->size());
+	for(size_t i=0; i<keys->size(); i++) {
+		cw->u32((*keys)[i].time);
+		write_prs(cw, (*keys)[i].prs);
+	}
+}
+
+static void write_mesh(CacheWriter *cw, const TriMesh *mesh) {
+	// normals are already calculated, make sure all the rest is as well
+	TriMesh *m = const_cast<TriMesh*>(mesh);
+	const IndexArray *igraph = m->get_index_graph();
+	const IndexArray *iarray = m->get_index_array();
+	const GeometryArray<Edge> *earray = m->get_edge_array();
+	const VertexArray *varray = m->get_vertex_array();
+	const TriangleArray *tarray = m->get_triangle_array();
+
+	unsigned long vcount = varray->get_count();
+	unsigned long tcount = tarray->get_count();
+	unsigned long ecount = earray->get_count();
+
+	cw->u32(vcount);
+	cw->u32(tcount);
+	cw->u32(ecount);
+	cw->array(varray->get_data(), vcount * sizeof(Vertex));
+	cw->array(tarray->get_data(), tcount * sizeof(Triangle));
+	cw->array(igraph->get_data(), vcount * sizeof(Index));
+	cw->array(iarray->get_data(), tcount * 3 * sizeof(Index));
+	cw->array(earray->get_data(), ecount * sizeof(Edge));
+	cw->align();
+}
+
+static void write_material(CacheWriter *cw, const Material &mat, const MaterialTexRefs &refs) {
+	cw->str(mat.name);
+	cw->color(mat.ambient_color);
+	cw->color(mat.diffuse_color);
+	cw->color(mat.specular_color);
+	cw->color(mat.emissive_color);
+	cw->scalar(mat.specular_power);
+	cw->scalar(mat.env_intensity);
+	cw->scalar(mat.bump_intensity);
+	cw->scalar(mat.alpha);
+	cw->u32(mat.wireframe);
+	cw->u32(mat.shading);
+	cw->u32(mat.auto_refl);
+	cw->u32(mat.auto_refl_upd);
+	cw->u32(mat.two_sided);
+
+	for(int i=0; i<MAX_TEXTURES; i++) {
+		cw->str(refs.fname[i]);
+	}
+	cw->u32(refs.cube_size);
+	cw->scalar(refs.env_intensity);
+}
+
+/* open_cache_file / close_cache_file - (JT)
+ * the cache is written in a temporary file which replaces the old one
+ * when complete, so that a failed or concurrent write never leaves a
+ * partial cache file behind.
+ */
+static FILE *open_cache_file(const std::string &fname) {
+	FILE *fp = fopen((fname + ".tmp").c_str(), "wb");
+	if(!fp) {
+		warning("can't write scene cache: %s", fname.c_str());
+	}
+	return fp;
+}
+
+static bool close_cache_file(FILE *fp, const std::string &fname, bool fail) {
+	std::string tmp = fname + ".tmp";
+
+	if(fclose(fp) != 0 || fail) {
+		remove(tmp.c_str());
+		return false;
+	}
+	remove(fname.c_str());
+	if(rename(tmp.c_str(), fname.c_str()) != 0) {
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool save_scene_cache(const char *src_fname, const SceneContents &sc) {
+	CacheKey key;
+	if(!get_cache_key(src_fname, &key)) {
+		return false;
+	}
+
+	std::string fname = get_cache_fname(src_fname);
+	FILE *fp = open_cache_file(fname);
+	if(!fp) return false;
+
+	CacheWriter cw(fp);
+	write_header(&cw, CACHE_SCENE, key);
+	cw.u32(sc.poly_count);
+
+	cw.u32(sc.objects.size());
+	for(size_t i=0; i<sc.objects.size(); i++) {
+		Object *obj = sc.objects[i];
+
+		write_node(&cw, obj);
+		cw.u32(obj->get_dynamic());
+		write_material(&cw, obj->mat, sc.tex_refs[i]);
+
+		cw.str(obj->parent ? obj->parent->name : "");
+		cw.u32(obj->children.size());
+		for(size_t j=0; j<obj->children.size(); j++) {
+			cw.str(obj->children[j]->name);
+		}
+
+		write_mesh(&cw, &obj->mesh);
+	}
+
+	cw.u32(sc.lights.size());
+	for(size_t i=0; i<sc.lights.size(); i++) {
+		Light *lt = sc.lights[i];
+
+		write_node(&cw, lt);
+		cw.color(lt->get_color(LIGHTCOL_AMBIENT));
+		cw.color(lt->get_color(LIGHTCOL_DIFFUSE));
+		cw.color(lt->get_color(LIGHTCOL_SPECULAR));
+		cw.scalar(lt->get_intensity());
+	}
+
+	cw.u32(sc.cameras.size());
+	for(size_t i=0; i<sc.cameras.size(); i++) {
+		TargetCamera *cam = sc.cameras[i];
+
+		write_node(&cw, cam);
+		cw.vec3(cam->get_target());
+		cw.scalar(cam->get_fov());
+	}
+
+	cw.u32(sc.curves.size());
+	for(size_t i=0; i<sc.curves.size(); i++) {
+		Curve *curve = sc.curves[i];
+		int count = curve->get_point_count();
+
+		cw.str(curve->name);
+		cw.u32(count);
+		for(int j=0; j<count; j++) {
+			cw.vec3(*curve->get_control_point(j));
+		}
+	}
+
+	return close_cache_file(fp, fname, cw.fail);
+}
+
+bool save_mesh_cache(const char *src_fname, const TriMesh *mesh) {
+	CacheKey key;
+	if(!get_cache_key(src_fname, &key)) {
+		return false;
+	}
+
+	std::string fname = get_cache_fname(src_fname);
+	FILE *fp = open_cache_file(fname);
+	if(!fp) return false;
+
+	CacheWriter cw(fp);
+	write_header(&cw, CACHE_MESH, key);
+	write_mesh(&cw, mesh);
+
+	return close_cache_file(fp, fname, cw.fail);
+}
+
+bool save_image_cache(const char *src_fname, unsigned int mip_flags, const TexImage *img) {
+	CacheKey key;
+	if(!get_cache_key(src_fname, &key)) {
+		return false;
+	}
+
+	std::string fname = get_cache_fname(src_fname);
+	FILE *fp = open_cache_file(fname);
+	if(!fp) return false;
+
+	CacheWriter cw(fp);
+	write_header(&cw, CACHE_IMAGE, key);
+	cw.u32(mip_flags);
+	cw.u32(img->xsz);
+	cw.u32(img->ysz);
+	cw.u32(img->mips.count);
+	cw.array(img->pixels, img->xsz * img->ysz * sizeof(Pixel));
+	for(int i=0; i<img->mips.count; i++) {
+		const PixelBuffer &lvl = img->mips.level[i];
+		cw.array(lvl.buffer, lvl.width * lvl.height * sizeof(Pixel));
+	}
+
+	return close_cache_file(fp, fname, cw.fail);
+}
+
+
+////////////////// reading //////////////////
+
+/* CacheReader - (JT)
+ * reads the cache file straight from memory (mapped if possible), every read
+ * is bounds checked and running out of data or finding an inconsistency sets
+ * the fail flag, after which all reads return zeros.
+ */
+class CacheReader {
+private:
+	const unsigned char *data;
+	unsigned long size, pos;
+	void *mem;		// the mapping or buffer to release
+
+public:
+	bool fail;
+
+	CacheReader() { data = 0; size = pos = 0; mem = 0; fail = true; }
+	~CacheReader() { close(); }
+
+	bool open(const char *fname);
+	void close();
+
+	const void *get(unsigned long sz) {
+		if(fail || sz > size - pos) {
+			fail = true;
+			return 0;
+		}
+		const void *ptr = data + pos;
+		pos += sz;
+		return ptr;
+	}
+
+	void align() {
+		get((CACHE_ALIGN - pos % CACHE_ALIGN) % CACHE_ALIGN);
+	}
+
+	uint32_t u32() {
+		const void *ptr = get(4);
+		uint32_t val = 0;
+		if(ptr) memcpy(&val, ptr, 4);
+		return val;
+	}
+
+	scalar_t scalar() {
+		const void *ptr = get(4);
+		float val = 0;
+		if(ptr) memcpy(&val, ptr, 4);
+		return val;
+	}
+
+	std::string str() {
+		uint32_t len = u32();
+		const char *ptr = (const char*)get(len);
+		align4();
+		return ptr ? std::string(ptr, len) : std::string();
+	}
+
+	void align4() {
+		get((4 - pos % 4) % 4);
+	}
+
+	Vector3 vec3() {
+		scalar_t x = scalar();
+		scalar_t y = scalar();
+		scalar_t z = scalar();
+		return Vector3(x, y, z);
+	}
+
+	Quaternion quat() {
+		scalar_t s = scalar();
+		return Quaternion(s, vec3());
+	}
+
+	Color color() {
+		scalar_t r = scalar();
+		scalar_t g = scalar();
+		scalar_t b = scalar();
+		scalar_t a = scalar();
+		return Color(r, g, b, a);
+	}
+
+	// count elements of elem_size bytes, returns 0 for empty arrays
+	const void *array(unsigned long count, unsigned long elem_size) {
+		align();
+		if(count > (size - pos) / elem_size) {
+			fail = true;
+			return 0;
+		}
+		return count ? get(count * elem_size) : 0;
+	}
+};
+
+bool CacheReader::open(const char *fname) {
+	close();
+
+#ifdef USE_MMAP
+	int fd = ::open(fname, O_RDONLY);
+	if(fd == -1) return false;
+
+	struct stat st;
+	if(fstat(fd, &st) == -1 || st.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+	size = st.st_size;
+
+	mem = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if(mem == MAP_FAILED) {
+		mem = 0;
+		return false;
+	}
+#else
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) return false;
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+
+	if(!size || !(mem = malloc(size)) || fread(mem, 1, size, fp) != size) {
+		free(mem);
+		mem = 0;
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+#endif
+
+	data = (const unsigned char*)mem;
+	pos = 0;
+	fail = false;
+	return true;
+}
+
+void CacheReader::close() {
+	if(mem) {
+#ifdef USE_MMAP
+		munmap(mem, size);
+#else
+		free(mem);
+#endif
+	}
+	data = 0;
+	mem = 0;
+	size = pos = 0;
+	fail = true;
+}
+
+static bool read_header(CacheReader *cr, int type, const CacheKey &key) {
+	const void *magic = cr->get(4);
+	if(!magic || memcmp(magic, CACHE_MAGIC, 4) != 0) return false;
+
+	if(cr->u32() != CACHE_VERSION || cr->u32() != CACHE_BYTE_ORDER || cr->u32() != (uint32_t)type) {
+		return false;
+	}
+	if(cr->u32() != sizeof(Vertex) || cr->u32() != sizeof(Triangle) ||
+			cr->u32() != sizeof(Edge) || cr->u32() != sizeof(Index)) {
+		return false;
+	}
+
+	const void *fkey = cr->get(sizeof key);
+	return fkey && memcmp(fkey, &key, sizeof key) == 0;
+}
+
+static PRS read_prs(CacheReader *cr) {
+	PRS prs;
+	prs.position = cr->vec3();
+	prs.rotation = cr->quat();
+	prs.scale = cr->vec3();
+	prs.pivot = cr->vec3();
+	return prs;
+}
+
+static void read_node(CacheReader *cr, XFormNode *node) {
+	node->name = cr->str();
+
+	PRS prs = read_prs(cr);
+	node->set_position(prs.position);
+	node->set_rotation(prs.rotation);
+	node->set_scaling(prs.scale);
+	node->set_pivot(prs.pivot);
+
+	uint32_t key_count = cr->u32();
+	for(uint32_t i=0; i<key_count && !cr->fail; i++) {
+		unsigned long time = cr->u32();
+		node->add_keyframe(Keyframe(read_prs(cr), time));
+	}
+}
+
+static bool read_mesh(CacheReader *cr, TriMesh *mesh) {
+	uint32_t vcount = cr->u32();
+	uint32_t tcount = cr->u32();
+	uint32_t ecount = cr->u32();
+
+	const Vertex *varr = (const Vertex*)cr->array(vcount, sizeof(Vertex));
+	const Triangle *tarr = (const Triangle*)cr->array(tcount, sizeof(Triangle));
+	const Index *igraph = (const Index*)cr->array(vcount, sizeof(Index));
+	const Index *iarr = (const Index*)cr->array(tcount, 3 * sizeof(Index));
+	const Edge *earr = (const Edge*)cr->array(ecount, sizeof(Edge));
+	cr->align();
+	if(cr->fail) return false;
+
+	// indices out of range would crash the renderer later on
+	for(uint32_t i=0; i<tcount; i++) {
+		const Index *tv = tarr[i].vertices;
+		if(tv[0] >= vcount || tv[1] >= vcount || tv[2] >= vcount) return false;
+	}
+	for(uint32_t i=0; i<tcount * 3; i++) {
+		if(iarr[i] >= vcount) return false;
+	}
+	for(uint32_t i=0; i<vcount; i++) {
+		if(igraph[i] >= vcount) return false;
+	}
+	for(uint32_t i=0; i<ecount; i++) {
+		const Edge &e = earr[i];
+		if(e.vertices[0] >= vcount || e.vertices[1] >= vcount) return false;
+		// every edge has a first face, the second one is optional
+		if(e.adjfaces[0] >= tcount) return false;
+		if(e.adjfaces[1] >= tcount && e.adjfaces[1] != NO_ADJFACE) return false;
+	}
+
+	mesh->set_data(varr, vcount, tarr, tcount, igraph, iarr, earr, ecount);
+	return true;
+}
+
+static void read_material(CacheReader *cr, Material *mat, MaterialTexRefs *refs) {
+	mat->name = cr->str();
+	mat->ambient_color = cr->color();
+	mat->diffuse_color = cr->color();
+	mat->specular_color = cr->color();
+	mat->emissive_color = cr->color();
+	mat->specular_power = cr->scalar();
+	mat->env_intensity = cr->scalar();
+	mat->bump_intensity = cr->scalar();
+	mat->alpha = cr->scalar();
+	mat->wireframe = cr->u32() != 0;
+	mat->shading = (ShadeMode)cr->u32();
+	mat->auto_refl = cr->u32() != 0;
+	mat->auto_refl_upd = (int32_t)cr->u32();
+	mat->two_sided = cr->u32() != 0;
+
+	for(int i=0; i<MAX_TEXTURES; i++) {
+		refs->fname[i] = cr->str();
+	}
+	refs->cube_size = cr->u32();
+	refs->env_intensity = cr->scalar();
+}
+
+Scene *load_scene_cache(const char *src_fname, bool load_textures) {
+	CacheKey key;
+	CacheReader cr;
+
+	if(!get_cache_key(src_fname, &key) || !cr.open(get_cache_fname(src_fname).c_str())) {
+		return 0;
+	}
+	if(!read_header(&cr, CACHE_SCENE, key)) {
+		return 0;
+	}
+
+	Scene *scene = new Scene;
+	scene->set_poly_count(cr.u32());
+
+	// the hierarchy is linked up by name after all the nodes are created
+	std::vector<Object*> objects;
+	std::vector<MaterialTexRefs> tex_refs;
+	std::vector<std::string> parents;
+	std::vector<std::vector<std::string> > children;
+
+	uint32_t obj_count = cr.u32();
+	for(uint32_t i=0; i<obj_count && !cr.fail; i++) {
+		Object *obj = new Object;
+
+		read_node(&cr, obj);
+		bool dynamic = cr.u32() != 0;
+		MaterialTexRefs refs;
+		read_material(&cr, obj->get_material_ptr(), &refs);
+
+		parents.push_back(cr.str());
+		children.push_back(std::vector<std::string>());
+		uint32_t child_count = cr.u32();
+		for(uint32_t j=0; j<child_count && !cr.fail; j++) {
+			children.back().push_back(cr.str());
+		}
+
+		obj->set_dynamic(dynamic);
+		if(!read_mesh(&cr, obj->get_mesh_ptr())) {
+			cr.fail = true;
+			delete obj;
+			break;
+		}
+
+		scene->add_object(obj);
+		objects.push_back(obj);
+		tex_refs.push_back(refs);
+	}
+
+	uint32_t light_count = cr.u32();
+	for(uint32_t i=0; i<light_count && !cr.fail; i++) {
+		PointLight *lt = new PointLight;
+
+		read_node(&cr, lt);
+		Color amb = cr.color();
+		Color diff = cr.color();
+		Color spec = cr.color();
+		lt->set_color(amb, diff, spec);
+		lt->set_intensity(cr.scalar());
+
+		scene->add_light(lt);
+	}
+
+	uint32_t cam_count = cr.u32();
+	for(uint32_t i=0; i<cam_count && !cr.fail; i++) {
+		TargetCamera *cam = new TargetCamera;
+
+		read_node(&cr, cam);
+		cam->set_target(cr.vec3());
+		cam->set_fov(cr.scalar());
+
+		scene->add_camera(cam);
+	}
+
+	uint32_t curve_count = cr.u32();
+	for(uint32_t i=0; i<curve_count && !cr.fail; i++) {
+		Curve *curve = new CatmullRomSplineCurve;
+
+		curve->name = cr.str();
+		uint32_t count = cr.u32();
+		for(uint32_t j=0; j<count && !cr.fail; j++) {
+			curve->add_control_point(cr.vec3());
+		}
+
+		scene->add_curve(curve);
+	}
+
+	if(cr.fail) {
+		warning("scene cache for %s is corrupt, ignoring it", src_fname);
+		delete scene;
+		return 0;
+	}
+
+	for(size_t i=0; i<objects.size(); i++) {
+		if(!parents[i].empty()) {
+			objects[i]->parent = scene->get_node(parents[i].c_str());
+		}
+		for(size_t j=0; j<children[i].size(); j++) {
+			XFormNode *child = scene->get_node(children[i][j].c_str());
+			if(child) {
+				objects[i]->add_child(child);
+			}
+		}
+	}
+
+	if(load_textures) {
+		load_scene_textures(objects, tex_refs, 0.5, 1.0);
+	}
+	return scene;
+}
+
+TriMesh *load_mesh_cache(const char *src_fname) {
+	CacheKey key;
+	CacheReader cr;
+
+	if(!get_cache_key(src_fname, &key) || !cr.open(get_cache_fname(src_fname).c_str())) {
+		return 0;
+	}
+	if(!read_header(&cr, CACHE_MESH, key)) {
+		return 0;
+	}
+
+	TriMesh *mesh = new TriMesh;
+	if(!read_mesh(&cr, mesh)) {
+		warning("mesh cache for %s is corrupt, ignoring it", src_fname);
+		delete mesh;
+		return 0;
+	}
+	return mesh;
+}
+
+bool load_image_cache(const char *src_fname, unsigned int mip_flags, TexImage *img) {
+	CacheKey key;
+	CacheReader cr;
+
+	if(!get_cache_key(src_fname, &key) || !cr.open(get_cache_fname(src_fname).c_str())) {
+		return false;
+	}
+	if(!read_header(&cr, CACHE_IMAGE, key) || cr.u32() != mip_flags) {
+		return false;
+	}
+
+	unsigned long xsz = cr.u32();
+	unsigned long ysz = cr.u32();
+	int mip_count = (int)cr.u32();
+	const void *pixels = cr.array(xsz * ysz, sizeof(Pixel));
+
+	if(cr.fail || !pixels || mip_count != get_mip_level_count(xsz, ysz) - 1) {
+		warning("image cache for %s is corrupt, ignoring it", src_fname);
+		return false;
+	}
+
+	// the levels are checked before allocating anything
+	const void *levels[MAX_MIP_LEVELS];
+	unsigned long lxsz = xsz, lysz = ysz;
+	for(int i=0; i<mip_count; i++) {
+		lxsz = lxsz > 1 ? lxsz / 2 : 1;
+		lysz = lysz > 1 ? lysz / 2 : 1;
+		levels[i] = cr.array(lxsz * lysz, sizeof(Pixel));
+	}
+	if(cr.fail) {
+		warning("image cache for %s is corrupt, ignoring it", src_fname);
+		return false;
+	}
+
+	if(!(img->pixels = malloc(xsz * ysz * sizeof(Pixel)))) {
+		return false;
+	}
+	memcpy(img->pixels, pixels, xsz * ysz * sizeof(Pixel));
+	img->xsz = xsz;
+	img->ysz = ysz;
+
+	img->mips.set_level_count(mip_count, xsz, ysz);
+	for(int i=0; i<mip_count; i++) {
+		PixelBuffer *lvl = img->mips.level + i;
+		memcpy(lvl->buffer, levels[i], lvl->width * lvl->height * sizeof(Pixel));
+	}
+	return true;
+}
@@ -0,0 +1,91 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Binary scene cache (.3dxc)
+ *
+ * Keeps the scenes and meshes created by the scene loader, after all the
+ * processing (coordinate conversion, normals, edges), in a binary file
+ * next to the source file (or in the cache directory). The cache is keyed
+ * by the size, modification time and contents hash of the source file, and
+ * is rewritten whenever that changes.
+ *
+ * Image caches hold the decoded pixels of a texture image and its mip
+ * levels, as built by the texture manager when mipmapping is enabled.
+ *
+ * author: John Tsiombikas 2005
+ */
+
+#ifndef _SCENECACHE_HPP_
+#define _SCENECACHE_HPP_
+
+#include <string>
+#include <vector>
+#include "3dscene.hpp"
+
+// textures referenced by a material, as named in the scene file
+struct MaterialTexRefs {
+	std::string fname[MAX_TEXTURES];	// indexed by TextureType
+	int cube_size;						// auto reflection cube map size, 0 if none
+	scalar_t env_intensity;				// given to the material if the env map loads
+
+	MaterialTexRefs();
+};
+
+// everything the scene loader created for a scene, in creation order
+struct SceneContents {
+	std::vector<Object*> objects;
+	std::vector<MaterialTexRefs> tex_refs;	// one per object
+	std::vector<Light*> lights;
+	std::vector<TargetCamera*> cameras;
+	std::vector<Curve*> curves;
+	unsigned long poly_count;
+
+	SceneContents();
+};
+
+struct TexImage;
+
+// the cache is enabled by default
+void set_scene_cache(bool enable);
+bool get_scene_cache();
+
+// directory to keep the cache files in, by default they go next to the
+// source files (as <source file name>.3dxc)
+void set_scene_cache_path(const char *path);
+
+// return 0/false if there is no valid cache for src_fname. The textures of
+// the scene are only loaded if load_textures is true.
+Scene *load_scene_cache(const char *src_fname, bool load_textures = true);
+TriMesh *load_mesh_cache(const char *src_fname);
+
+bool save_scene_cache(const char *src_fname, const SceneContents &sc);
+bool save_mesh_cache(const char *src_fname, const TriMesh *mesh);
+
+// mip_flags identify the filter the mip levels were built with, the cache
+// is only valid for the same flags. The image is allocated by malloc.
+bool load_image_cache(const char *src_fname, unsigned int mip_flags, TexImage *img);
+bool save_image_cache(const char *src_fname, unsigned int mip_flags, const TexImage *img);
+
+// defined in sceneloader.cpp
+void load_material_textures(const MaterialTexRefs &refs, Material *mat);
+void load_scene_textures(const std::vector<Object*> &objects, const std::vector<MaterialTexRefs> &refs,
+		float prog_start, float prog_end);
+
+#endif	// _SCENECACHE_HPP_
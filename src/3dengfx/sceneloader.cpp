@@ -26,6 +26,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "3dengfx_config.h"
 
 #include <algorithm>
+#include <set>
 
 #include <cstdio>
 #include <cassert>
@@ -38,12 +39,16 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <lib3ds/vector.h>
 #include <lib3ds/light.h>
 #include "3dscene.hpp"
+#include "sceneloader.hpp"
+#include "scenecache.hpp"
 #include "object.hpp"
 #include "light.hpp"
 #include "camera.hpp"
 #include "texman.hpp"
 #include "gfx/curves.hpp"
+#include "gfx/image.h"
 #include "common/err_msg.h"
+#include "common/threadpool.h"
 
 #define CONV_VEC3(v)		Vector3((v)[0], (v)[2], (v)[1])
 #define CONV_QUAT(q)		Quaternion((q)[3], Vector3((q)[0], (q)[2], (q)[1]))
@@ -52,16 +57,16 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define CONV_RGBA(c)		Color((c)[0], (c)[1], (c)[2], (c)[3])
 #define CONV_RGB(c)			Color((c)[0], (c)[1], (c)[2])
 
-static bool load_objects(Lib3dsFile *file, Scene *scene);
-static bool load_lights(Lib3dsFile *file, Scene *scene);
-static bool load_cameras(Lib3dsFile *file, Scene *scene);
-static bool load_material(Lib3dsFile *file, const char *name, Material *mat);
+static bool load_objects(Lib3dsFile *file, Scene *scene, SceneContents *sc);
+static bool load_lights(Lib3dsFile *file, Scene *scene, SceneContents *sc);
+static bool load_cameras(Lib3dsFile *file, Scene *scene, SceneContents *sc);
+static bool load_material(Lib3dsFile *file, const char *name, Material *mat, MaterialTexRefs *refs);
 static bool load_keyframes(Lib3dsFile *file, const char *name, Lib3dsNodeTypes type, XFormNode *node);
 static void construct_hierarchy(Lib3dsFile *file, Scene *scene);
+static void report_progress(float progress);
+static void run_tasks(int count, void (*func)(int, void*), void *cls, float prog_start, float prog_end);
 //static void fix_hierarchy(XFormNode *node);
 
-TriMesh *load_mesh_ply(const char *fname);	// defined in ply.cpp
-
 static const char *tex_path(const char *path);
 static std::vector<int> *get_frames(Lib3dsObjectData *o);
 static std::vector<int> *get_frames(Lib3dsLightData *lt);
@@ -77,6 +82,9 @@ static std::vector<int> *get_frames(Lib3dsCameraData *cam);
 
 static char data_path[TPATH_SIZE];
 
+static void (*progress_func)(float, void*);
+static void *progress_cls;
+
 void set_scene_data_path(const char *path) {
 	if(!path || !*path) {
 		data_path[0] = 0;
@@ -93,23 +101,52 @@ void set_scene_data_path(const char *path) {
 }
 
 
+void set_scene_load_callback(void (*func)(float, void*), void *cls) {
+	progress_func = func;
+	progress_cls = cls;
+}
+
+/* load_scene - (JT)
+ * Loading goes through a few stages: the file is parsed and the scene nodes,
+ * materials and keyframes are set up on the calling thread, then the meshes
+ * are built (and their normals calculated) in parallel, one task per mesh,
+ * and finally the textures are decoded in parallel, and created on the
+ * calling thread, which is the one with the GL context.
+ */
 Scene *load_scene(const char *fname) {
+	Scene *scene;
+
+	report_progress(0.0);
+
+	if(get_scene_cache() && (scene = load_scene_cache(fname))) {
+		report_progress(1.0);
+		return scene;
+	}
 
 	Lib3dsFile *file;
-	if(!(file = lib3ds_file_load(fname))) {
+	if(!(file = lib3ds_file_load_mapped(fname))) {
 		error("%s: could not load %s", __func__, fname);
 		return 0;
 	}
 	lib3ds_file_eval(file, 0);
+	report_progress(0.1);
 
-	Scene *scene = new Scene;
+	scene = new Scene;
+	SceneContents sc;
 
-	load_objects(file, scene);
-	load_lights(file, scene);
-	load_cameras(file, scene);
+	load_objects(file, scene, &sc);
+	load_lights(file, scene, &sc);
+	load_cameras(file, scene, &sc);
 
 	construct_hierarchy(file, scene);
 
+	// the cache keeps the materials as they are before the textures are loaded
+	if(get_scene_cache()) {
+		save_scene_cache(fname, sc);
+	}
+
+	load_scene_textures(sc.objects, sc.tex_refs, 0.6, 1.0);
+
 	/*
 	std::list<Object*> *obj_list = scene->get_objects_list();
 	std::list<Object*>::iterator iter = obj_list->begin();
@@ -119,33 +156,135 @@ Scene *load_scene(const char *fname) {
 	*/
 	
 	lib3ds_file_free(file);
-
+	report_progress(1.0);
 	return scene;
 }
 
 TriMesh *load_mesh(const char *fname, const char *name) {
 	TriMesh *mesh = 0;
-	
-	Lib3dsFile *file = lib3ds_file_load(fname);
-	if(file && name) {
-		Scene *scene = new Scene;
-		load_objects(file, scene);
-
-		Object *obj = scene->get_object(name);
-		if(obj) {
-			mesh = new TriMesh;
-			*mesh = obj->get_mesh();
+
+	if(name) {
+		// only the mesh is needed, like load_objects, leave the textures alone
+		Scene *scene = get_scene_cache() ? load_scene_cache(fname, false) : 0;
+		if(!scene) {
+			Lib3dsFile *file = lib3ds_file_load_mapped(fname);
+			if(file) {
+				SceneContents sc;
+				scene = new Scene;
+				load_objects(file, scene, &sc);
+				lib3ds_file_free(file);
+			}
 		}
-		lib3ds_file_free(file);
+
+		if(scene) {
+			Object *obj = scene->get_object(name);
+			if(obj) {
+				mesh = new TriMesh;
+				*mesh = obj->get_mesh();
+			}
+			delete scene;
+			return mesh;
+		}
+	}
+
+	if(get_scene_cache() && (mesh = load_mesh_cache(fname))) {
 		return mesh;
 	}
 
 	mesh = load_mesh_ply(fname);
+	if(mesh && get_scene_cache()) {
+		save_mesh_cache(fname, mesh);
+	}
 	return mesh;
 }
-	
 
-static bool load_objects(Lib3dsFile *file, Scene *scene) {
+static void report_progress(float progress) {
+	if(progress_func) {
+		progress_func(progress, progress_cls);
+	}
+}
+
+struct TaskBatch {
+	void (*func)(int, void*);
+	void *cls;
+	int offset;
+};
+
+static void run_batch_task(int idx, void *cls) {
+	TaskBatch *batch = (TaskBatch*)cls;
+	batch->func(batch->offset + idx, batch->cls);
+}
+
+/* run_tasks - (JT)
+ * runs count tasks through the thread pool. When there is a progress callback
+ * they are run in batches, a few per thread, so that the progress (going from
+ * prog_start to prog_end) can be reported from the calling thread in between.
+ */
+static void run_tasks(int count, void (*func)(int, void*), void *cls, float prog_start, float prog_end) {
+	int batch_size = progress_func ? tpool_get_thread_count() * 4 : count;
+	if(batch_size < 1) batch_size = 1;
+
+	TaskBatch batch;
+	batch.func = func;
+	batch.cls = cls;
+
+	for(batch.offset = 0; batch.offset < count; batch.offset += batch_size) {
+		int size = std::min(batch_size, count - batch.offset);
+		tpool_parallel_for(size, run_batch_task, &batch);
+
+		report_progress(prog_start + (prog_end - prog_start) * (batch.offset + size) / count);
+	}
+}
+
+
+// a mesh to be built by build_mesh, in parallel with the rest
+struct MeshTask {
+	Lib3dsMesh *m;
+	Object *obj;
+	Vector3 node_pos;
+	Quaternion node_rot;
+};
+
+static void build_mesh(int idx, void *cls) {
+	MeshTask *task = (MeshTask*)cls + idx;
+	Lib3dsMesh *m = task->m;
+
+	// load the vertices
+	Vertex *varray = new Vertex[m->points];
+	Vertex *vptr = varray;
+	for(int i=0; i<(int)m->points; i++) {
+		vptr->pos = CONV_VEC3(m->pointL[i].pos) - task->node_pos;
+		vptr->pos.transform(task->node_rot);
+		
+		if(m->texels) {
+			vptr->tex[0] = vptr->tex[1] = CONV_TEXCOORD(m->texelL[i]);
+		}
+		
+		vptr++;
+	}
+
+	// load the polygons
+	Triangle *tarray = new Triangle[m->faces];
+	Triangle *tptr = tarray;
+	for(int i=0; i<(int)m->faces; i++) {
+		*tptr = CONV_TRIANGLE(m->faceL[i]);
+		tptr->normal = CONV_VEC3(m->faceL[i].normal);
+		tptr->smoothing_group = m->faceL[i].smoothing;
+
+		tptr++;
+	}
+
+	// set the geometry data to the object
+	task->obj->get_mesh_ptr()->set_data(varray, m->points, tarray, m->faces);
+	task->obj->get_mesh_ptr()->calculate_normals();
+
+	delete [] varray;
+	delete [] tarray;
+}
+
+static bool load_objects(Lib3dsFile *file, Scene *scene, SceneContents *sc) {
+	std::vector<MeshTask> tasks;
+
 	// load meshes
 	unsigned long poly_count = 0;
 	Lib3dsMesh *m = file->meshes;
@@ -160,25 +299,13 @@ static bool load_objects(Lib3dsFile *file, Scene *scene) {
 		Vector3 node_scl = node ? CONV_VEC3(node->data.object.scl) : Vector3(1,1,1);
 		Vector3 pivot = node ? CONV_VEC3(node->data.object.pivot) : Vector3();
 
-		// load the vertices
-		Vertex *varray = new Vertex[m->points];
-		Vertex *vptr = varray;
-		for(int i=0; i<(int)m->points; i++) {
-			vptr->pos = CONV_VEC3(m->pointL[i].pos) - node_pos;
-			vptr->pos.transform(node_rot);
-			
-			if(m->texels) {
-				vptr->tex[0] = vptr->tex[1] = CONV_TEXCOORD(m->texelL[i]);
-			}
-			
-			vptr++;
-		}
-		
 		if(m->faces) {
 			poly_count += m->faces;
 			// -------- object ---------
 			Object *obj = new Object;
-			obj->set_dynamic(false);
+
+			// the mesh is built by a worker thread, keep it away from GL until then
+			obj->set_dynamic(true);
 
 			obj->name = m->name;
 
@@ -187,26 +314,17 @@ static bool load_objects(Lib3dsFile *file, Scene *scene) {
 			obj->set_scaling(node_scl);
 
 			obj->set_pivot(pivot);
-		
-			// load the polygons
-			Triangle *tarray = new Triangle[m->faces];
-			Triangle *tptr = tarray;
-			for(int i=0; i<(int)m->faces; i++) {
-				*tptr = CONV_TRIANGLE(m->faceL[i]);
-				tptr->normal = CONV_VEC3(m->faceL[i].normal);
-				tptr->smoothing_group = m->faceL[i].smoothing;
-
-				tptr++;
-			}
 
-			// set the geometry data to the object
-			obj->get_mesh_ptr()->set_data(varray, m->points, tarray, m->faces);
-			obj->get_mesh_ptr()->calculate_normals();
-		
-			delete [] tarray;
+			MeshTask task;
+			task.m = m;
+			task.obj = obj;
+			task.node_pos = node_pos;
+			task.node_rot = node_rot;
+			tasks.push_back(task);
 
 			// load the material
-			load_material(file, m->faceL[0].material, obj->get_material_ptr());
+			MaterialTexRefs refs;
+			load_material(file, m->faceL[0].material, obj->get_material_ptr(), &refs);
 
 			// load the keyframes (if any)
 			if(load_keyframes(file, m->name, LIB3DS_OBJECT_NODE, obj)) {
@@ -216,6 +334,8 @@ static bool load_objects(Lib3dsFile *file, Scene *scene) {
 			}
 
 			scene->add_object(obj);
+			sc->objects.push_back(obj);
+			sc->tex_refs.push_back(refs);
 			
 		} else {
 			// --------- curve ------------
@@ -225,19 +345,29 @@ static bool load_objects(Lib3dsFile *file, Scene *scene) {
 			Vector3 offs = node_pos - pivot;
 			
 			for(int i=0; i<(int)m->points; i++) {
-				curve->add_control_point(varray[i].pos + offs);
+				Vector3 pt = CONV_VEC3(m->pointL[i].pos) - node_pos;
+				pt.transform(node_rot);
+				curve->add_control_point(pt + offs);
 			}
 
 			scene->add_curve(curve);
+			sc->curves.push_back(curve);
 		}
 
-		delete [] varray;
+		m = m->next;
+	}
+	report_progress(0.2);
 
+	if(!tasks.empty()) {
+		run_tasks((int)tasks.size(), build_mesh, &tasks[0], 0.2, 0.6);
+	}
 
-		m = m->next;
+	for(size_t i=0; i<tasks.size(); i++) {
+		tasks[i].obj->set_dynamic(false);
 	}
 	
 	scene->set_poly_count(poly_count);
+	sc->poly_count = poly_count;
 	return true;
 }
 
@@ -250,7 +380,7 @@ static bool is_pow_two(unsigned long val) {
 	return (count_ones == 1 && !(val & 1)) ? true : false;
 }
 
-static bool load_material(Lib3dsFile *file, const char *name, Material *mat) {
+static bool load_material(Lib3dsFile *file, const char *name, Material *mat, MaterialTexRefs *refs) {
 	Lib3dsMaterial *m;
 	if(!name || !*name || !(m = lib3ds_file_material_by_name(file, name))) {
 		return false;
@@ -278,58 +408,135 @@ static bool load_material(Lib3dsFile *file, const char *name, Material *mat) {
 		mat->shading = SHADING_FLAT;
 	}
 
+	if(m->autorefl_map.flags & LIB3DS_USE_REFL_MAP) {
+		mat->env_intensity = m->reflection_map.percent;
+
+		int cube_sz = m->autorefl_map.size;
+		if(!is_pow_two(cube_sz)) {
+			warning("Material \"%s\" specifies a non power of 2 cube map and won't render correctly!", m->name);
+		}
+		refs->cube_size = cube_sz;
+
+		mat->auto_refl_upd = m->autorefl_map.frame_step;
+		if(m->autorefl_map.flags & LIB3DS_READ_FIRST_FRAME_ONLY ||
+			m->autorefl_map.flags & 0x8 || m->autorefl_map.frame_step == 1000) {
+			mat->auto_refl = true;
+			mat->auto_refl_upd = 0;
+		}
+	}
+
 	// load the textures
+	refs->fname[TEXTYPE_DIFFUSE] = m->texture1_map.name;
+	refs->fname[TEXTYPE_DETAIL] = m->texture2_map.name;
+	refs->fname[TEXTYPE_ENVMAP] = m->reflection_map.name;
+	refs->fname[TEXTYPE_LIGHTMAP] = m->self_illum_map.name;
+	refs->fname[TEXTYPE_BUMPMAP] = m->bump_map.name;
+
+	// the textures themselves are loaded afterwards, by load_scene_textures
+	refs->env_intensity = m->reflection_map.percent;
+
+	return true;
+}
+
+struct TexLoadTask {
+	std::string fname;
+	TexImage img;
+	bool loaded;
+};
+
+static void decode_texture(int idx, void *cls) {
+	TexLoadTask *task = (TexLoadTask*)cls + idx;
+	task->loaded = load_texture_image(task->fname.c_str(), &task->img);
+}
+
+/* load_scene_textures - (JT)
+ * loads the textures of all the objects. The images of the textures that
+ * aren't loaded already are decoded in parallel first (along with their mip
+ * levels), so that the get_texture calls in load_material_textures find them
+ * in the texture manager. Cubemap files are left to get_texture.
+ */
+void load_scene_textures(const std::vector<Object*> &objects, const std::vector<MaterialTexRefs> &refs,
+		float prog_start, float prog_end) {
+	std::vector<std::string> fnames;
+	std::set<std::string> names;
+
+	for(size_t i=0; i<refs.size(); i++) {
+		for(int j=0; j<MAX_TEXTURES; j++) {
+			const char *tpath = tex_path(refs[i].fname[j].c_str());
+			if(!tpath || find_texture(tpath) || !names.insert(tpath).second) {
+				continue;
+			}
+			if(!is_cubemap(tpath)) {
+				fnames.push_back(tpath);
+			}
+		}
+	}
+
+	float prog_decoded = prog_start + (prog_end - prog_start) * 0.9;
+	if(!fnames.empty()) {
+		// TexImage can't be copied, so no vector here
+		TexLoadTask *tasks = new TexLoadTask[fnames.size()];
+		for(size_t i=0; i<fnames.size(); i++) {
+			tasks[i].fname = fnames[i];
+			tasks[i].loaded = false;
+		}
+
+		run_tasks((int)fnames.size(), decode_texture, tasks, prog_start, prog_decoded);
+
+		for(size_t i=0; i<fnames.size(); i++) {
+			if(tasks[i].loaded) {
+				add_texture_image(&tasks[i].img, tasks[i].fname.c_str());
+			}
+		}
+		delete [] tasks;
+	}
+
+	for(size_t i=0; i<objects.size(); i++) {
+		load_material_textures(refs[i], objects[i]->get_material_ptr());
+	}
+	report_progress(prog_end);
+}
+
+/* load_material_textures - (JT)
+ * loads the textures of a material, this is kept apart from load_material
+ * since the scene cache stores the texture references, not the textures.
+ */
+void load_material_textures(const MaterialTexRefs &refs, Material *mat) {
 	Texture *tex = 0, *detail = 0, *env = 0, *light = 0, *bump = 0;
 	const char *tpath;
 	
-	tpath = tex_path(m->texture1_map.name);
+	tpath = tex_path(refs.fname[TEXTYPE_DIFFUSE].c_str());
 	if(tpath && (tex = get_texture(tpath))) {
 		mat->set_texture(tex, TEXTYPE_DIFFUSE);
 	}
 
-	tpath = tex_path(m->texture2_map.name);
+	tpath = tex_path(refs.fname[TEXTYPE_DETAIL].c_str());
 	if(tpath && (detail = get_texture(tpath))) {
 		mat->set_texture(detail, TEXTYPE_DETAIL);
 	}
 
-	tpath = tex_path(m->reflection_map.name);
+	tpath = tex_path(refs.fname[TEXTYPE_ENVMAP].c_str());
 	if(tpath && (env = get_texture(tpath))) {
 		mat->set_texture(env, TEXTYPE_ENVMAP);
-		mat->env_intensity = m->reflection_map.percent;
+		mat->env_intensity = refs.env_intensity;
 	}
 	
-	tpath = tex_path(m->bump_map.name);
+	tpath = tex_path(refs.fname[TEXTYPE_BUMPMAP].c_str());
 	if(tpath && (bump = get_texture(tpath))) {
 		//FIXME: make dot3 work first mat->set_texture(bump, TEXTYPE_BUMPMAP);
 	}
 
-	tpath = tex_path(m->self_illum_map.name);
+	tpath = tex_path(refs.fname[TEXTYPE_LIGHTMAP].c_str());
 	if(tpath && (light = get_texture(tpath))) {
 		mat->set_texture(light, TEXTYPE_LIGHTMAP);
 	}
 
-	if(m->autorefl_map.flags & LIB3DS_USE_REFL_MAP) {
-		mat->env_intensity = m->reflection_map.percent;
-		
-		int cube_sz = m->autorefl_map.size;
-		if(!is_pow_two(cube_sz)) {
-			warning("Material \"%s\" specifies a non power of 2 cube map and won't render correctly!", m->name);
-		}
-		
-		Texture *cube_tex = new Texture(cube_sz, cube_sz, TEX_CUBE);
+	if(refs.cube_size) {
+		Texture *cube_tex = new Texture(refs.cube_size, refs.cube_size, TEX_CUBE);
 		add_texture(cube_tex);
 
 		mat->set_texture(cube_tex, TEXTYPE_ENVMAP);
-		mat->auto_refl_upd = m->autorefl_map.frame_step;
-		if(m->autorefl_map.flags & LIB3DS_READ_FIRST_FRAME_ONLY ||
-			m->autorefl_map.flags & 0x8 || m->autorefl_map.frame_step == 1000) {
-			mat->auto_refl = true;
-			mat->auto_refl_upd = 0;
-		}
 	}
-		
-
-	return true;
 }
 
 static const char *tex_path(const char *path) {
@@ -352,7 +559,7 @@ static const char *tex_path(const char *path) {
 }
 
 
-bool load_lights(Lib3dsFile *file, Scene *scene) {
+bool load_lights(Lib3dsFile *file, Scene *scene, SceneContents *sc) {
 	Lib3dsLight *lt = file->lights;
 	while(lt) {
 		Light *light;
@@ -373,6 +580,7 @@ bool load_lights(Lib3dsFile *file, Scene *scene) {
 				light->set_position(Vector3());
 			}
 			scene->add_light(light);
+			sc->lights.push_back(light);
 		}
 
 		lt = lt->next;
@@ -381,7 +589,7 @@ bool load_lights(Lib3dsFile *file, Scene *scene) {
 	return true;
 }
 
-bool load_cameras(Lib3dsFile *file, Scene *scene) {
+bool load_cameras(Lib3dsFile *file, Scene *scene, SceneContents *sc) {
 	Lib3dsCamera *c = file->cameras;
 	while(c) {
 		TargetCamera *cam = new TargetCamera;
@@ -400,6 +608,7 @@ bool load_cameras(Lib3dsFile *file, Scene *scene) {
 		//TODO: load_keyframes(file, ... hmmm where is the target node?
 		
 		scene->add_camera(cam);
+		sc->cameras.push_back(cam);
 		c = c->next;
 	}
 	return true;
@@ -517,7 +726,7 @@ static void construct_hierarchy(Lib3dsFile *file, Scene *scene) {
 		while(child) {
 			XFormNode *child_node = scene->get_node(child->name);
 			if(child_node) {
-				(*iter)->children.push_back(child_node);
+				(*iter)->add_child(child_node);
 			}
 			child = child->next;
 		}
@@ -552,6 +761,7 @@ static void fix_hierarchy(XFormNode *node) {
 
 static std::vector<int> *get_frames(Lib3dsObjectData *o) {
 	static std::vector<int> frames;
+	frames.clear();
 	
 	Lib3dsLin3Key *pos_key = o->pos_track.keyL;
 	while(pos_key) {
@@ -586,6 +796,7 @@ static std::vector<int> *get_frames(Lib3dsObjectData *o) {
 
 static std::vector<int> *get_frames(Lib3dsLightData *lt) {
 	static std::vector<int> frames;
+	frames.clear();
 	
 	Lib3dsLin3Key *pos_key = lt->pos_track.keyL;
 	while(pos_key) {
@@ -600,6 +811,7 @@ static std::vector<int> *get_frames(Lib3dsLightData *lt) {
 
 static std::vector<int> *get_frames(Lib3dsCameraData *cam) {
 	static std::vector<int> frames;
+	frames.clear();
 	
 	Lib3dsLin3Key *pos_key = cam->pos_track.keyL;
 	while(pos_key) {
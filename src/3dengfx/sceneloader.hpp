@@ -32,7 +32,23 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 void set_scene_data_path(const char *path);
 
+// progress callback for load_scene, called from the thread that calls
+// load_scene, with the fraction of the loading done so far (0 to 1)
+void set_scene_load_callback(void (*func)(float progress, void *cls), void *cls = 0);
+
 Scene *load_scene(const char *fname);
 TriMesh *load_mesh(const char *fname, const char *name = 0);
 
+// vertex properties load_mesh_ply can load besides the positions,
+// faces are always loaded.
+enum {
+	PLY_LOAD_NORMALS	= 1,
+	PLY_LOAD_TEXCOORDS	= 2,
+	PLY_LOAD_COLORS		= 4,
+	PLY_LOAD_ALL		= 0xffff
+};
+
+// loads ascii and binary (little and big endian) ply files
+TriMesh *load_mesh_ply(const char *fname, unsigned int props = PLY_LOAD_ALL);
+
 #endif	// _SCENELOADER_H_
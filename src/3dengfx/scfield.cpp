@@ -24,13 +24,46 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
 #define SCFIELD_SOURCE
+#include <algorithm>
+#include <math.h>
 #include "mcube_tables.h"
 #include "scfield.hpp"
 #include "3dengfx/3denginefx.hpp"
+#include "n3dmath2/n3dmath2_batch.hpp"
+#include "common/threadpool.h"
+#include "common/simd.h"
+
+// the SSE2 metaball summation works on scalar_t, only for single precision
+#ifndef SINGLE_PRECISION_MATH
+#undef X86_SIMD
+#endif
 
 // don't change this
 #define EDGE_NOT_ASSOCIATED		0xFFFFFFFF
 
+// references to vertices of the previous slab, resolved after triangulation
+#define EDGE_EXTERNAL_X			0x80000000
+#define EDGE_EXTERNAL_Y			0x40000000
+#define EDGE_INDEX_MASK			0x3FFFFFFF
+
+// axis (0: x, 1: y, 2: z) and offset from the cell origin of each cell edge
+static const int edge_desc[12][4] = {
+	{0, 0, 0, 1}, {2, 1, 0, 0}, {0, 0, 0, 0}, {2, 0, 0, 0},
+	{0, 0, 1, 1}, {2, 1, 1, 0}, {0, 0, 1, 0}, {2, 0, 1, 0},
+	{1, 0, 0, 1}, {1, 1, 0, 1}, {1, 1, 0, 0}, {1, 0, 0, 0}
+};
+
+// parameters passed to the triangulation tasks
+struct MCTaskData
+{
+	ScalarField *field;
+	scalar_t isolevel, t;
+	bool calc_normals;
+	Vertex *varray;
+	Triangle *tarray;
+	unsigned int *tri_offset;
+};
+
 /* -----------------
  * private functions
  * -----------------
@@ -40,10 +73,10 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  * AddVertex
  * adds a vertex and returns its index
  */
-unsigned int ScalarField::add_vertex(const Vertex &vert)
+unsigned int ScalarField::add_vertex(MCSlab *slab, const Vertex &vert)
 {
-	verts.push_back(vert);
-	return verts.size() - 1;
+	slab->verts.push_back(vert);
+	return slab->verts.size() - 1;
 }
 
 /*
@@ -52,8 +85,13 @@ unsigned int ScalarField::add_vertex(const Vertex &vert)
  */
 void ScalarField::clear()
 {
-	verts.erase(verts.begin(), verts.end());
-	tris.erase(tris.begin(), tris.end());
+	slabs.clear();
+
+	// sparse edge tables are reset when the active blocks are allocated
+	if (sparse)
+	{
+		return;
+	}
 	
 	unsigned int num_bytes = dimensions * dimensions * dimensions * sizeof(unsigned int);
 
@@ -62,25 +100,406 @@ void ScalarField::clear()
 	memset(edges_z, 0xFF, num_bytes);
 }
 
+/*
+ * ClearEdges
+ * resets the part of the edges table written by the cell layers
+ * [z_start, z_end): the z-aligned edges starting on these layers,
+ * and the x/y-aligned edges above them (and below the first layer).
+ */
+void ScalarField::clear_edges(unsigned int z_start, unsigned int z_end)
+{
+	unsigned int d2 = dimensions * dimensions;
+	unsigned int xy_start = z_start > 0 ? z_start + 1 : 0;
+
+	memset(edges_z + z_start * d2, 0xFF, (z_end - z_start) * d2 * sizeof(unsigned int));
+	memset(edges_x + xy_start * d2, 0xFF, (z_end + 1 - xy_start) * d2 * sizeof(unsigned int));
+	memset(edges_y + xy_start * d2, 0xFF, (z_end + 1 - xy_start) * d2 * sizeof(unsigned int));
+}
+
+/*
+ * ResetEdges
+ * frees the edge tables and allocates new ones for the current mode.
+ * In sparse mode the tables are allocated on triangulation, when
+ * we know how many blocks are active.
+ */
+void ScalarField::reset_edges()
+{
+	if (edges_x)
+		delete [] edges_x;
+	if (edges_y)
+		delete [] edges_y;
+	if (edges_z)
+		delete [] edges_z;
+	edges_x = edges_y = edges_z = 0;
+	edges_capacity = 0;
+
+	block_min.clear();
+	block_max.clear();
+	block_edges.clear();
+	blocks_per_dim = 0;
+
+	if (dimensions < 2)
+	{
+		return;
+	}
+
+	if (sparse)
+	{
+		blocks_per_dim = (dimensions - 2) / block_size + 1;
+		unsigned int num_blocks = blocks_per_dim * blocks_per_dim * blocks_per_dim;
+		block_min.resize(num_blocks);
+		block_max.resize(num_blocks);
+		block_edges.resize(num_blocks, EDGE_NOT_ASSOCIATED);
+	}
+	else
+	{
+		edges_capacity = dimensions * dimensions * dimensions;
+		edges_x = new unsigned int[edges_capacity];
+		edges_y = new unsigned int[edges_capacity];
+		edges_z = new unsigned int[edges_capacity];
+	}
+
+	clear();
+}
+
+/*
+ * GetEdgeSlot
+ * returns the edge table and the index in it for a cell edge, or
+ * EDGE_NOT_ASSOCIATED if the edge belongs to an inactive block.
+ * In sparse mode an edge belongs to the block of its first vertex, and the
+ * tables of a block have room for the edges on its far faces, since the
+ * vertices on the far faces of the last blocks don't start another block.
+ */
+unsigned int ScalarField::get_edge_slot(int cx, int cy, int cz, int edge, unsigned int **table)
+{
+	const int *desc = edge_desc[edge];
+	unsigned int x = cx + desc[1];
+	unsigned int y = cy + desc[2];
+	unsigned int z = cz + desc[3];
+
+	*table = desc[0] == 0 ? edges_x : (desc[0] == 1 ? edges_y : edges_z);
+
+	if (!sparse)
+	{
+		return x + y * dimensions + z * dimensions * dimensions;
+	}
+
+	unsigned int bx = x / block_size;
+	unsigned int by = y / block_size;
+	unsigned int bz = z / block_size;
+	if (bx >= blocks_per_dim) bx = blocks_per_dim - 1;
+	if (by >= blocks_per_dim) by = blocks_per_dim - 1;
+	if (bz >= blocks_per_dim) bz = blocks_per_dim - 1;
+
+	unsigned int base = block_edges[bx + (by + bz * blocks_per_dim) * blocks_per_dim];
+	if (base == EDGE_NOT_ASSOCIATED)
+	{
+		return EDGE_NOT_ASSOCIATED;
+	}
+
+	unsigned int bs1 = block_size + 1;
+	x -= bx * block_size;
+	y -= by * block_size;
+	z -= bz * block_size;
+	return base + x + (y + z * bs1) * bs1;
+}
+
+/*
+ * ActivateBlocks
+ * marks the blocks whose range of values the isolevel crosses as active,
+ * and allocates and resets their edge tables. Returns the number of
+ * active blocks.
+ */
+unsigned int ScalarField::activate_blocks(scalar_t isolevel)
+{
+	unsigned int bs1 = block_size + 1;
+	unsigned int block_edge_count = bs1 * bs1 * bs1;
+	unsigned int num_blocks = block_edges.size();
+	unsigned int active = 0;
+
+	for (unsigned int i=0; i<num_blocks; i++)
+	{
+		// same test as process_cell: a cell is crossed if some corners
+		// are below the isolevel and some are not.
+		if (block_min[i] < isolevel && block_max[i] >= isolevel)
+		{
+			block_edges[i] = active++ * block_edge_count;
+		}
+		else
+		{
+			block_edges[i] = EDGE_NOT_ASSOCIATED;
+		}
+	}
+
+	unsigned int edge_count = active * block_edge_count;
+	if (edge_count > edges_capacity)
+	{
+		if (edges_x)
+			delete [] edges_x;
+		if (edges_y)
+			delete [] edges_y;
+		if (edges_z)
+			delete [] edges_z;
+
+		// leave some room for the surface to grow in the next frames
+		edges_capacity = edge_count + edge_count / 4;
+		edges_x = new unsigned int[edges_capacity];
+		edges_y = new unsigned int[edges_capacity];
+		edges_z = new unsigned int[edges_capacity];
+	}
+
+	memset(edges_x, 0xFF, edge_count * sizeof(unsigned int));
+	memset(edges_y, 0xFF, edge_count * sizeof(unsigned int));
+	memset(edges_z, 0xFF, edge_count * sizeof(unsigned int));
+
+	return active;
+}
+
 /*
  * EvaluateAll
  * Evaluates all values with the external Evaluate function (if specified)
  */
 void ScalarField::evaluate_all(scalar_t t)
 {
-	if (!evaluate)
+	if (!evaluate && !batch_evaluate)
 	{
 		return;
 	}
 
-	for (unsigned int z=0; z<dimensions; z++)
+	MCTaskData data;
+	data.field = this;
+	data.t = t;
+
+	tpool_parallel_for(dimensions, evaluate_task, &data);
+}
+
+/*
+ * EvaluateTask
+ * evaluates a single z slice of the field
+ */
+void ScalarField::evaluate_task(int z, void *cls)
+{
+	MCTaskData *data = (MCTaskData*)cls;
+	ScalarField *sf = data->field;
+
+	if (sf->batch_evaluate)
+	{
+		unsigned int d = sf->dimensions;
+		sf->batch_evaluate(sf->values + z * d * d, d, d, d, sf->get_position(0, 0, z),
+				sf->cell_size, data->t, sf->batch_cls);
+		return;
+	}
+
+	for (unsigned int y=0; y<sf->dimensions; y++)
+	{
+		for (unsigned int x=0; x<sf->dimensions; x++)
+		{
+			sf->set_value(x, y, z, sf->evaluate(sf->get_position(x, y, z), data->t));
+		}
+	}
+}
+
+/*
+ * EvaluatePoint
+ * evaluates the field at an arbitrary point with whichever evaluator is set
+ */
+scalar_t ScalarField::evaluate_point(const Vector3 &vec, scalar_t t)
+{
+	if (metaballs)
+	{
+		return metaballs->evaluate(vec);
+	}
+	if (batch_evaluate)
+	{
+		scalar_t val;
+		batch_evaluate(&val, 1, 1, 1, vec, cell_size, t, batch_cls);
+		return val;
+	}
+	return evaluate ? evaluate(vec, t) : 0;
+}
+
+/*
+ * BlockRangeTask
+ * finds the range of values of every block in a layer of blocks, including
+ * the vertices on their far faces, which they share with their neighbours.
+ */
+void ScalarField::block_range_task(int bz, void *cls)
+{
+	MCTaskData *data = (MCTaskData*)cls;
+	ScalarField *sf = data->field;
+
+	unsigned int bs = sf->block_size;
+	unsigned int bpd = sf->blocks_per_dim;
+	unsigned int last = sf->dimensions - 1;
+	unsigned int d = sf->dimensions;
+	unsigned int d2 = sf->dimensions * sf->dimensions;
+
+	unsigned int z0 = bz * bs;
+	unsigned int z1 = std::min(z0 + bs, last);
+
+	for (unsigned int by=0; by<bpd; by++)
+	{
+		unsigned int y0 = by * bs;
+		unsigned int y1 = std::min(y0 + bs, last);
+
+		for (unsigned int bx=0; bx<bpd; bx++)
+		{
+			unsigned int x0 = bx * bs;
+			unsigned int x1 = std::min(x0 + bs, last);
+
+			scalar_t min_val = sf->values[x0 + y0 * d + z0 * d2];
+			scalar_t max_val = min_val;
+
+			for (unsigned int z=z0; z<=z1; z++)
+			{
+				for (unsigned int y=y0; y<=y1; y++)
+				{
+					const scalar_t *row = sf->values + y * d + z * d2;
+					for (unsigned int x=x0; x<=x1; x++)
+					{
+						min_val = std::min(min_val, row[x]);
+						max_val = std::max(max_val, row[x]);
+					}
+				}
+			}
+
+			unsigned int idx = bx + (by + bz * bpd) * bpd;
+			sf->block_min[idx] = min_val;
+			sf->block_max[idx] = max_val;
+		}
+	}
+}
+
+/*
+ * PolygonizeTask
+ * runs marching cubes on all the cells of a slab. Vertices on the bottom
+ * face of the slab belong to the previous one, so instead of creating them
+ * we store references to their edges in the triangles.
+ */
+void ScalarField::polygonize_task(int slab_idx, void *cls)
+{
+	MCTaskData *data = (MCTaskData*)cls;
+	ScalarField *sf = data->field;
+	MCSlab *slab = &sf->slabs[slab_idx];
+
+	slab->verts.clear();
+	slab->tris.clear();
+
+	if (sf->sparse)
+	{
+		// slabs are made of whole layers of blocks, visit the active ones
+		unsigned int bs = sf->block_size;
+		unsigned int bpd = sf->blocks_per_dim;
+		unsigned int last = sf->dimensions - 1;
+
+		for (unsigned int bz=slab->z_start / bs; bz * bs < slab->z_end; bz++)
+		{
+			for (unsigned int by=0; by<bpd; by++)
+			{
+				for (unsigned int bx=0; bx<bpd; bx++)
+				{
+					if (sf->block_edges[bx + (by + bz * bpd) * bpd] == EDGE_NOT_ASSOCIATED)
+					{
+						continue;
+					}
+
+					unsigned int x1 = std::min(bx * bs + bs, last);
+					unsigned int y1 = std::min(by * bs + bs, last);
+					unsigned int z1 = std::min(bz * bs + bs, last);
+
+					for (unsigned int z=bz * bs; z<z1; z++)
+					{
+						for (unsigned int y=by * bs; y<y1; y++)
+						{
+							for (unsigned int x=bx * bs; x<x1; x++)
+							{
+								sf->process_cell(x, y, z, data->isolevel, slab);
+							}
+						}
+					}
+				}
+			}
+		}
+		return;
+	}
+
+	sf->clear_edges(slab->z_start, slab->z_end);
+
+	for (unsigned int z=slab->z_start; z<slab->z_end; z++)
+	{
+		for (unsigned int y=0; y<sf->dimensions-1; y++)
+		{
+			for (unsigned int x=0; x<sf->dimensions-1; x++)
+			{
+				sf->process_cell(x, y, z, data->isolevel, slab);
+			}
+		}
+	}
+}
+
+/*
+ * OutputTask
+ * calculates the normals of a slab's vertices (if requested), and copies
+ * the slab to its place in the final vertex and triangle arrays, turning
+ * slab-relative indices to mesh indices.
+ */
+void ScalarField::output_task(int slab_idx, void *cls)
+{
+	MCTaskData *data = (MCTaskData*)cls;
+	ScalarField *sf = data->field;
+	const MCSlab *slab = &sf->slabs[slab_idx];
+
+	unsigned int vcount = slab->verts.size();
+	Vertex *vptr = data->varray + slab->vert_offset;
+
+	for (unsigned int i=0; i<vcount; i++)
+	{
+		vptr[i] = slab->verts[i];
+	}
+
+	if (data->calc_normals)
+	{
+		if (sf->get_normal)
+		{
+			for (unsigned int i=0; i<vcount; i++)
+			{
+				vptr[i].normal = sf->get_normal(vptr[i].pos, data->t);
+			}
+		}
+		else
+		{
+			for (unsigned int i=0; i<vcount; i++)
+			{
+				vptr[i].normal = sf->def_eval_normals(vptr[i].pos, data->t);
+			}
+		}
+	}
+
+	unsigned int prev_offset = slab_idx > 0 ? sf->slabs[slab_idx - 1].vert_offset : 0;
+	unsigned int tcount = slab->tris.size();
+	Triangle *tptr = data->tarray + data->tri_offset[slab_idx];
+
+	for (unsigned int i=0; i<tcount; i++)
 	{
-		for (unsigned int y=0; y<dimensions; y++)
+		tptr[i] = slab->tris[i];
+
+		for (int j=0; j<3; j++)
 		{
-			for (unsigned int x=0; x<dimensions; x++)
+			Index idx = tptr[i].vertices[j];
+
+			if (idx & EDGE_EXTERNAL_X)
+			{
+				idx = sf->edges_x[idx & EDGE_INDEX_MASK] + prev_offset;
+			}
+			else if (idx & EDGE_EXTERNAL_Y)
 			{
-				set_value(x, y, z, evaluate(get_position(x, y, z), t));
+				idx = sf->edges_y[idx & EDGE_INDEX_MASK] + prev_offset;
 			}
+			else
+			{
+				idx += slab->vert_offset;
+			}
+			tptr[i].vertices[j] = idx;
 		}
 	}
 }
@@ -89,8 +508,11 @@ void ScalarField::evaluate_all(scalar_t t)
 /*
  * ProcesssCell
  */
-void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
+void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel, MCSlab *slab)
 {
+	// the bottom face edges of a slab's first layer belong to the previous slab
+	bool bottom = z == (int)slab->z_start && z > 0;
+
 	unsigned char cube_index = 0;
 	if(get_value(x, y, z, 0) < isolevel) cube_index |= 1;
 	if(get_value(x, y, z, 1) < isolevel) cube_index |= 2;
@@ -115,7 +537,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 0);
 		vec2 = get_position(x, y, z, 1);
 
-		set_edge(x, y, z, 0, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 0, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	if ( (edge_index & 2) && (get_edge(x, y, z, 1) == EDGE_NOT_ASSOCIATED) )
@@ -127,10 +549,10 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 1);
 		vec2 = get_position(x, y, z, 2);
 
-		set_edge(x, y, z, 1, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 1, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
-	if ( (edge_index & 4) && (get_edge(x, y, z, 2) == EDGE_NOT_ASSOCIATED) )
+	if ( (edge_index & 4) && !bottom && (get_edge(x, y, z, 2) == EDGE_NOT_ASSOCIATED) )
 	{
 		val1 = get_value(x, y, z, 2);
 		val2 = get_value(x, y, z, 3);
@@ -139,7 +561,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 2);
 		vec2 = get_position(x, y, z, 3);
 
-		set_edge(x, y, z, 2, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 2, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	if ( (edge_index & 8) && (get_edge(x, y, z, 3) == EDGE_NOT_ASSOCIATED) )
@@ -151,7 +573,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 0);
 		vec2 = get_position(x, y, z, 1);
 
-		set_edge(x, y, z, 3, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 3, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	if ( (edge_index & 16) && (get_edge(x, y, z, 4) == EDGE_NOT_ASSOCIATED) )
@@ -163,7 +585,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 4);
 		vec2 = get_position(x, y, z, 5);
 
-		set_edge(x, y, z, 4, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 4, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	if ( (edge_index & 32) && (get_edge(x, y, z, 5) == EDGE_NOT_ASSOCIATED) )
@@ -175,10 +597,10 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 5);
 		vec2 = get_position(x, y, z, 6);
 
-		set_edge(x, y, z, 5, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 5, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
-	if ( (edge_index & 64) && (get_edge(x, y, z, 6) == EDGE_NOT_ASSOCIATED) )
+	if ( (edge_index & 64) && !bottom && (get_edge(x, y, z, 6) == EDGE_NOT_ASSOCIATED) )
 	{
 		val1 = get_value(x, y, z, 6);
 		val2 = get_value(x, y, z, 7);
@@ -187,7 +609,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 6);
 		vec2 = get_position(x, y, z, 7);
 
-		set_edge(x, y, z, 6, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 6, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	if ( (edge_index & 128) && (get_edge(x, y, z, 7) == EDGE_NOT_ASSOCIATED) )
@@ -199,7 +621,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 7);
 		vec2 = get_position(x, y, z, 4);
 
-		set_edge(x, y, z, 7, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 7, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	if ( (edge_index & 256) && (get_edge(x, y, z, 8) == EDGE_NOT_ASSOCIATED) )
@@ -211,7 +633,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 0);
 		vec2 = get_position(x, y, z, 4);
 
-		set_edge(x, y, z, 8, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 8, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	if ( (edge_index & 512) && (get_edge(x, y, z, 9) == EDGE_NOT_ASSOCIATED) )
@@ -223,10 +645,10 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 1);
 		vec2 = get_position(x, y, z, 5);
 
-		set_edge(x, y, z, 9, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 9, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
-	if ( (edge_index & 1024) && (get_edge(x, y, z, 10) == EDGE_NOT_ASSOCIATED) )
+	if ( (edge_index & 1024) && !bottom && (get_edge(x, y, z, 10) == EDGE_NOT_ASSOCIATED) )
 	{
 		val1 = get_value(x, y, z, 2);
 		val2 = get_value(x, y, z, 6);
@@ -235,10 +657,10 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 2);
 		vec2 = get_position(x, y, z, 6);
 
-		set_edge(x, y, z, 10, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 10, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
-	if ( (edge_index & 2048) && (get_edge(x, y, z, 11) == EDGE_NOT_ASSOCIATED) )
+	if ( (edge_index & 2048) && !bottom && (get_edge(x, y, z, 11) == EDGE_NOT_ASSOCIATED) )
 	{
 		val1 = get_value(x, y, z, 3);
 		val2 = get_value(x, y, z, 7);
@@ -247,7 +669,7 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 		vec1 = get_position(x, y, z, 3);
 		vec2 = get_position(x, y, z, 7);
 
-		set_edge(x, y, z, 11, add_vertex( Vertex( vec1 + p * (vec2 - vec1) ) ) );
+		set_edge(x, y, z, 11, add_vertex(slab, Vertex( vec1 + p * (vec2 - vec1) ) ) );
 	}
 
 	// Add triangles
@@ -255,43 +677,62 @@ void ScalarField::process_cell(int x, int y, int z, scalar_t isolevel)
 
 	if (tri_table[cube_index][0] != -1)
 	{
-		p1 = get_edge(x, y, z, tri_table[cube_index][0]);
-		p2 = get_edge(x, y, z, tri_table[cube_index][1]);
-		p3 = get_edge(x, y, z, tri_table[cube_index][2]);
-		tris.push_back(Triangle(p2, p1, p3));
+		p1 = get_tri_edge(slab, x, y, z, tri_table[cube_index][0]);
+		p2 = get_tri_edge(slab, x, y, z, tri_table[cube_index][1]);
+		p3 = get_tri_edge(slab, x, y, z, tri_table[cube_index][2]);
+		slab->tris.push_back(Triangle(p2, p1, p3));
 	}
 
 	if (tri_table[cube_index][3] != -1)
 	{
-		p1 = get_edge(x, y, z, tri_table[cube_index][3]);
-		p2 = get_edge(x, y, z, tri_table[cube_index][4]);
-		p3 = get_edge(x, y, z, tri_table[cube_index][5]);
-		tris.push_back(Triangle(p2, p1, p3));
+		p1 = get_tri_edge(slab, x, y, z, tri_table[cube_index][3]);
+		p2 = get_tri_edge(slab, x, y, z, tri_table[cube_index][4]);
+		p3 = get_tri_edge(slab, x, y, z, tri_table[cube_index][5]);
+		slab->tris.push_back(Triangle(p2, p1, p3));
 	}
 
 	if (tri_table[cube_index][6] != -1)
 	{
-		p1 = get_edge(x, y, z, tri_table[cube_index][6]);
-		p2 = get_edge(x, y, z, tri_table[cube_index][7]);
-		p3 = get_edge(x, y, z, tri_table[cube_index][8]);
-		tris.push_back(Triangle(p2, p1, p3));
+		p1 = get_tri_edge(slab, x, y, z, tri_table[cube_index][6]);
+		p2 = get_tri_edge(slab, x, y, z, tri_table[cube_index][7]);
+		p3 = get_tri_edge(slab, x, y, z, tri_table[cube_index][8]);
+		slab->tris.push_back(Triangle(p2, p1, p3));
 	}
 
 	if (tri_table[cube_index][9] != -1)
 	{
-		p1 = get_edge(x, y, z, tri_table[cube_index][9]);
-		p2 = get_edge(x, y, z, tri_table[cube_index][10]);
-		p3 = get_edge(x, y, z, tri_table[cube_index][11]);
-		tris.push_back(Triangle(p2, p1, p3));
+		p1 = get_tri_edge(slab, x, y, z, tri_table[cube_index][9]);
+		p2 = get_tri_edge(slab, x, y, z, tri_table[cube_index][10]);
+		p3 = get_tri_edge(slab, x, y, z, tri_table[cube_index][11]);
+		slab->tris.push_back(Triangle(p2, p1, p3));
 	}
 
 	if (tri_table[cube_index][12] != -1)
 	{
-		p1 = get_edge(x, y, z, tri_table[cube_index][12]);
-		p2 = get_edge(x, y, z, tri_table[cube_index][13]);
-		p3 = get_edge(x, y, z, tri_table[cube_index][14]);
-		tris.push_back(Triangle(p2, p1, p3));
+		p1 = get_tri_edge(slab, x, y, z, tri_table[cube_index][12]);
+		p2 = get_tri_edge(slab, x, y, z, tri_table[cube_index][13]);
+		p3 = get_tri_edge(slab, x, y, z, tri_table[cube_index][14]);
+		slab->tris.push_back(Triangle(p2, p1, p3));
+	}
+}
+
+/*
+ * GetTriEdge
+ * returns the vertex index of an edge to be used in a triangle of a slab
+ */
+unsigned int ScalarField::get_tri_edge(const MCSlab *slab, int cx, int cy, int cz, int edge)
+{
+	if (cz == (int)slab->z_start && cz > 0)
+	{
+		unsigned int *table;
+
+		if (edge == 2 || edge == 6)
+			return EDGE_EXTERNAL_X | get_edge_slot(cx, cy, cz, edge, &table);
+		if (edge == 10 || edge == 11)
+			return EDGE_EXTERNAL_Y | get_edge_slot(cx, cy, cz, edge, &table);
 	}
+
+	return get_edge(cx, cy, cz, edge);
 }
 
 /*
@@ -305,14 +746,14 @@ unsigned int ScalarField::get_value_index(int x, int y, int z)
 
 
 Vector3 ScalarField::def_eval_normals(const Vector3 &vec, scalar_t t) {
-	if(!evaluate) return Vector3(0, 0, 0);
+	if(!evaluate && !batch_evaluate) return Vector3(0, 0, 0);
 	
 	Vector3 diff = cell_size * 0.25;
 
 	Vector3 grad;
-	grad.x = evaluate(vec + Vector3(diff.x, 0, 0), t) - evaluate(vec + Vector3(-diff.x, 0, 0), t);
-	grad.y = evaluate(vec + Vector3(0, diff.y, 0), t) - evaluate(vec + Vector3(0, -diff.y, 0), t);
-	grad.z = evaluate(vec + Vector3(0, 0, diff.z), t) - evaluate(vec + Vector3(0, 0, -diff.z), t);
+	grad.x = evaluate_point(vec + Vector3(diff.x, 0, 0), t) - evaluate_point(vec + Vector3(-diff.x, 0, 0), t);
+	grad.y = evaluate_point(vec + Vector3(0, diff.y, 0), t) - evaluate_point(vec + Vector3(0, -diff.y, 0), t);
+	grad.z = evaluate_point(vec + Vector3(0, 0, diff.z), t) - evaluate_point(vec + Vector3(0, 0, -diff.z), t);
 
 	return grad.normalized();
 }
@@ -327,10 +768,17 @@ ScalarField::ScalarField()
 {
 	values = 0;
 	edges_x = edges_y = edges_z = 0;
+	edges_capacity = 0;
 	dimensions = 0;
+	sparse = false;
+	block_size = 8;
+	blocks_per_dim = 0;
 	from = to = cell_size =  Vector3(0, 0, 0);
 	evaluate = 0;
 	get_normal = 0;
+	batch_evaluate = 0;
+	batch_cls = 0;
+	metaballs = 0;
 }
 
 ScalarField::ScalarField(unsigned int dimensions, const Vector3 &from, const Vector3 &to)
@@ -342,9 +790,16 @@ ScalarField::ScalarField(unsigned int dimensions, const Vector3 &from, const Vec
 
 	values = 0;
 	edges_x = edges_y = edges_z = 0;
+	edges_capacity = 0;
+	sparse = false;
+	block_size = 8;
+	blocks_per_dim = 0;
 
 	evaluate = 0;
 	get_normal = 0;
+	batch_evaluate = 0;
+	batch_cls = 0;
+	metaballs = 0;
 
 	set_dimensions(dimensions);
 }
@@ -366,21 +821,33 @@ void ScalarField::set_dimensions(unsigned int dimensions)
 	this->dimensions = dimensions;
 	if (values)
 		delete [] values;
-	if (edges_x)
-		delete [] edges_x;
-	if (edges_y)
-		delete [] edges_y;
-	if (edges_z)
-		delete [] edges_z;
 
 	values = new scalar_t [dimensions * dimensions * dimensions];
-	
-	unsigned int edges_per_dim = dimensions * dimensions * dimensions;
-	edges_x = new unsigned int[edges_per_dim];
-	edges_y = new unsigned int[edges_per_dim];
-	edges_z = new unsigned int[edges_per_dim];
 
-	clear();
+	reset_edges();
+}
+
+void ScalarField::set_sparse(bool enable, unsigned int block_size)
+{
+	if (block_size < 1)
+	{
+		block_size = 1;
+	}
+
+	if (enable == sparse && (!enable || block_size == this->block_size))
+	{
+		return;
+	}
+
+	sparse = enable;
+	this->block_size = block_size;
+
+	reset_edges();
+}
+
+bool ScalarField::get_sparse() const
+{
+	return sparse;
 }
 
 // Get / Set
@@ -427,54 +894,21 @@ scalar_t ScalarField::get_value(int cx, int cy, int cz, int vert_index)
 // and the cell's edge number
 void ScalarField::set_edge(int cx, int cy, int cz, int edge, unsigned int index)
 {
-	unsigned int d = dimensions;
-	unsigned int d2 = dimensions * dimensions;
-	
-	if (edge == 0) 
-		edges_x[cx + 0 + (cy + 0) * d + (cz + 1) * d2] =  index;
-	else if (edge == 1) 
-		edges_z[cx + 1 + (cy + 0) * d + (cz + 0) * d2] =  index;
-	else if (edge == 2) 
-		edges_x[cx + 0 + (cy + 0) * d + (cz + 0) * d2] =  index;
-	else if (edge == 3) 
-		edges_z[cx + 0 + (cy + 0) * d + (cz + 0) * d2] =  index;
-	else if (edge == 4) 
-		edges_x[cx + 0 + (cy + 1) * d + (cz + 1) * d2] =  index;
-	else if (edge == 5) 
-		edges_z[cx + 1 + (cy + 1) * d + (cz + 0) * d2] =  index;
-	else if (edge == 6) 
-		edges_x[cx + 0 + (cy + 1) * d + (cz + 0) * d2] =  index;
-	else if (edge == 7) 
-		edges_z[cx + 0 + (cy + 1) * d + (cz + 0) * d2] =  index;
-	else if (edge == 8) 
-		edges_y[cx + 0 + (cy + 0) * d + (cz + 1) * d2] =  index;
-	else if (edge == 9) 
-		edges_y[cx + 1 + (cy + 0) * d + (cz + 1) * d2] =  index;
-	else if (edge == 10) 
-		edges_y[cx + 1 + (cy + 0) * d + (cz + 0) * d2] =  index;
-	else if (edge == 11) 
-		edges_y[cx + 0 + (cy + 0) * d + (cz + 0) * d2] =  index;
+	unsigned int *table;
+	unsigned int slot = get_edge_slot(cx, cy, cz, edge, &table);
+
+	if (slot != EDGE_NOT_ASSOCIATED)
+	{
+		table[slot] = index;
+	}
 }
 
 unsigned int ScalarField::get_edge(int cx, int cy, int cz, int edge)
 {
-	unsigned int d = dimensions;
-	unsigned int d2 = dimensions * dimensions;
+	unsigned int *table;
+	unsigned int slot = get_edge_slot(cx, cy, cz, edge, &table);
 
-	if (edge == 0)  return edges_x[cx + 0 + (cy + 0) * d + (cz + 1) * d2];
-	if (edge == 1)  return edges_z[cx + 1 + (cy + 0) * d + (cz + 0) * d2];
-	if (edge == 2)  return edges_x[cx + 0 + (cy + 0) * d + (cz + 0) * d2];
-	if (edge == 3)  return edges_z[cx + 0 + (cy + 0) * d + (cz + 0) * d2];
-	if (edge == 4)  return edges_x[cx + 0 + (cy + 1) * d + (cz + 1) * d2];
-	if (edge == 5)  return edges_z[cx + 1 + (cy + 1) * d + (cz + 0) * d2];
-	if (edge == 6)  return edges_x[cx + 0 + (cy + 1) * d + (cz + 0) * d2];
-	if (edge == 7)  return edges_z[cx + 0 + (cy + 1) * d + (cz + 0) * d2];
-	if (edge == 8)  return edges_y[cx + 0 + (cy + 0) * d + (cz + 1) * d2];
-	if (edge == 9)  return edges_y[cx + 1 + (cy + 0) * d + (cz + 1) * d2];
-	if (edge == 10) return edges_y[cx + 1 + (cy + 0) * d + (cz + 0) * d2];
-	if (edge == 11) return edges_y[cx + 0 + (cy + 0) * d + (cz + 0) * d2];
-
-	return 0;
+	return slot == EDGE_NOT_ASSOCIATED ? EDGE_NOT_ASSOCIATED : table[slot];
 }
 
 // Position in space
@@ -584,6 +1018,23 @@ Vector3 ScalarField::get_to()
 void ScalarField::set_evaluator(scalar_t (*evaluate) (const Vector3 &vec, scalar_t t))
 {
 	this->evaluate = evaluate;
+	batch_evaluate = 0;
+	batch_cls = 0;
+	metaballs = 0;
+}
+
+void ScalarField::set_batch_evaluator(ScalarBatchEvaluator evaluate, void *cls)
+{
+	batch_evaluate = evaluate;
+	batch_cls = cls;
+	this->evaluate = 0;
+	metaballs = 0;
+}
+
+void ScalarField::set_metaballs(MetaballSet *mballs)
+{
+	set_batch_evaluator(MetaballSet::evaluate_slice, mballs);
+	metaballs = mballs;
 }
 	
 void ScalarField::set_normal_evaluator(Vector3 (*get_normal) (const Vector3 &vec, scalar_t t))
@@ -594,66 +1045,264 @@ void ScalarField::set_normal_evaluator(Vector3 (*get_normal) (const Vector3 &vec
 // last but not least
 void ScalarField::triangulate(TriMesh *mesh, scalar_t isolevel, scalar_t t, bool calc_normals)
 {
-	// Reset mesh and edges table
-	clear();
+	if (dimensions < 2)
+	{
+		return;
+	}
 
 	// Evaluate
 	evaluate_all(t);
 
-	// triangulate
-	for (unsigned int z=0; z<dimensions-1; z++)
+	MCTaskData data;
+	data.field = this;
+	data.isolevel = isolevel;
+	data.t = t;
+
+	// in sparse mode, find the blocks the isosurface passes through
+	unsigned int layers = dimensions - 1;
+	unsigned int layer_size = 1;
+	if (sparse)
 	{
-		for (unsigned int y=0; y<dimensions-1; y++)
-		{
-			for (unsigned int x=0; x<dimensions-1; x++)
-			{
-				process_cell(x, y, z, isolevel);
-			}
-		}
+		tpool_parallel_for(blocks_per_dim, block_range_task, &data);
+		activate_blocks(isolevel);
+
+		layers = blocks_per_dim;
+		layer_size = block_size;
 	}
 
-	// Generate TriMesh
-	Vertex *varray = new Vertex[verts.size()];
-	Triangle *tarray = new Triangle[tris.size()];
+	// split the cell layers in slabs, a few per thread for load balancing.
+	// in sparse mode the slabs are made of whole layers of blocks.
+	unsigned int num_slabs = 1;
+	int num_threads = tpool_get_thread_count();
+	if (num_threads > 1)
+	{
+		num_slabs = num_threads * 4;
+		if (num_slabs > layers) num_slabs = layers;
+	}
 
-	for (unsigned int i=0; i<verts.size(); i++)
+	slabs.resize(num_slabs);
+	for (unsigned int i=0; i<num_slabs; i++)
 	{
-		varray[i] = verts[i];
+		slabs[i].z_start = i * layers / num_slabs * layer_size;
+		slabs[i].z_end = std::min((i + 1) * layers / num_slabs * layer_size, dimensions - 1);
 	}
 
-	for (unsigned int i=0; i<tris.size(); i++)
+	// triangulate
+	tpool_parallel_for(num_slabs, polygonize_task, &data);
+
+	// Generate TriMesh
+	std::vector<unsigned int> tri_offset(num_slabs);
+	unsigned int vcount = 0, tcount = 0;
+	for (unsigned int i=0; i<num_slabs; i++)
 	{
-		tarray[i] = tris[i];
+		slabs[i].vert_offset = vcount;
+		tri_offset[i] = tcount;
+		vcount += slabs[i].verts.size();
+		tcount += slabs[i].tris.size();
 	}
 
-	bool need_normals = calc_normals;
-	
+	Vertex *varray = new Vertex[vcount];
+	Triangle *tarray = new Triangle[tcount];
+
 	// calculate normals if needed
-	if(need_normals) {
-		unsigned int vsz = verts.size();
-		if(get_normal) {
-			for(unsigned int i=0; i<vsz; i++) {
-				varray[i].normal = get_normal(varray[i].pos, t);
-			}
-			need_normals = false;
-		} else if(evaluate) {
-			for(unsigned int i=0; i<vsz; i++) {
-				varray[i].normal = def_eval_normals(varray[i].pos, t);
-			}
-			need_normals = false;
-		}
-	}
+	// as a final resort, if we could not calculate normals any other way
+	// use the regular mesh normal calculation function.
+	data.calc_normals = calc_normals && (get_normal || evaluate || batch_evaluate);
+	data.varray = varray;
+	data.tarray = tarray;
+	data.tri_offset = &tri_offset[0];
+
+	tpool_parallel_for(num_slabs, output_task, &data);
 	
-	mesh->set_data(varray, verts.size(), tarray, tris.size());
+	mesh->set_data(varray, vcount, tarray, tcount);
 
 	delete [] varray;
 	delete [] tarray;
 
-	// as a final resort, if we could not calculate normals any other way
-	// use the regular mesh normal calculation function.
-	if(need_normals) {
+	if(calc_normals && !data.calc_normals) {
 		mesh->calculate_normals_by_index();
 	}
 }
 
+/* ---------
+ * metaballs
+ * ---------
+ */
+
+Metaball::Metaball(const Vector3 &pos, scalar_t radius, scalar_t strength)
+{
+	this->pos = pos;
+	this->radius = radius;
+	this->strength = strength;
+}
+
+/*
+ * AddBallSpan
+ * adds the contribution of a ball to the values [i0, i1) of a row, where
+ * value i is at x = px + dx * i, and dyz2 is the squared distance of the
+ * row from the center of the ball.
+ */
+static void add_ball_span_c(scalar_t *row, int i0, int i1, scalar_t px, scalar_t dx,
+		const Metaball *ball, scalar_t dyz2)
+{
+	scalar_t inv_r2 = 1.0 / (ball->radius * ball->radius);
+
+	for (int i=i0; i<i1; i++)
+	{
+		scalar_t x = px + dx * i - ball->pos.x;
+		scalar_t k = std::max((scalar_t)(1.0 - (x * x + dyz2) * inv_r2), (scalar_t)0.0);
+		row[i] += ball->strength * k * k * k;
+	}
+}
+
+#ifdef X86_SIMD
+TARGET_SSE2
+static void add_ball_span_sse2(scalar_t *row, int i0, int i1, scalar_t px, scalar_t dx,
+		const Metaball *ball, scalar_t dyz2)
+{
+	scalar_t inv_r2 = 1.0 / (ball->radius * ball->radius);
+
+	__m128 vpx = _mm_set1_ps(px - ball->pos.x);
+	__m128 vdx = _mm_set1_ps(dx);
+	__m128 vdyz2 = _mm_set1_ps(dyz2);
+	__m128 vinv_r2 = _mm_set1_ps(inv_r2);
+	__m128 vstrength = _mm_set1_ps(ball->strength);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 four = _mm_set1_ps(4.0f);
+	__m128 idx = _mm_setr_ps(i0, i0 + 1, i0 + 2, i0 + 3);
+
+	int i = i0;
+	for (; i + 4 <= i1; i += 4)
+	{
+		__m128 x = _mm_add_ps(vpx, _mm_mul_ps(vdx, idx));
+		__m128 r2 = _mm_add_ps(_mm_mul_ps(x, x), vdyz2);
+		__m128 k = _mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(r2, vinv_r2)), zero);
+		__m128 val = _mm_mul_ps(vstrength, _mm_mul_ps(k, _mm_mul_ps(k, k)));
+
+		_mm_storeu_ps(row + i, _mm_add_ps(_mm_loadu_ps(row + i), val));
+		idx = _mm_add_ps(idx, four);
+	}
+
+	add_ball_span_c(row, i, i1, px, dx, ball, dyz2);
+}
+#endif	// X86_SIMD
+
+MetaballSet::MetaballSet()
+{
+	// choose the SIMD path now, not from the worker threads
+	get_simd_level();
+}
+
+void MetaballSet::add_ball(const Metaball &ball)
+{
+	balls.push_back(ball);
+}
+
+void MetaballSet::remove_ball(int idx)
+{
+	balls.erase(balls.begin() + idx);
+}
+
+void MetaballSet::clear()
+{
+	balls.clear();
+}
+
+int MetaballSet::get_ball_count() const
+{
+	return (int)balls.size();
+}
+
+Metaball *MetaballSet::get_ball(int idx)
+{
+	return &balls[idx];
+}
+
+/*
+ * Evaluate
+ * the field at a single point, with the same arithmetic as evaluate_slice,
+ * so that the two agree.
+ */
+scalar_t MetaballSet::evaluate(const Vector3 &pos) const
+{
+	scalar_t sum = 0;
+	for (size_t i=0; i<balls.size(); i++)
+	{
+		const Metaball *ball = &balls[i];
+		scalar_t dy = pos.y - ball->pos.y;
+		scalar_t dz = pos.z - ball->pos.z;
+		scalar_t dyz2 = dy * dy + dz * dz;
+		if (dyz2 < ball->radius * ball->radius)
+		{
+			add_ball_span_c(&sum, 0, 1, pos.x, 0, ball, dyz2);
+		}
+	}
+	return sum;
+}
+
+void MetaballSet::evaluate_slice(scalar_t *values, int xcount, int ycount, int pitch,
+		const Vector3 &pos, const Vector3 &step, scalar_t t, void *cls)
+{
+	const MetaballSet *mset = (const MetaballSet*)cls;
 
+	void (*add_ball_span)(scalar_t*, int, int, scalar_t, scalar_t, const Metaball*, scalar_t);
+	add_ball_span = add_ball_span_c;
+#ifdef X86_SIMD
+	if (get_simd_level() >= SIMD_SSE2)
+	{
+		add_ball_span = add_ball_span_sse2;
+	}
+#endif
+
+	// keep the balls that reach this slice
+	std::vector <const Metaball*> near_balls;
+	std::vector <scalar_t> near_dz2;
+	for (size_t i=0; i<mset->balls.size(); i++)
+	{
+		const Metaball *ball = &mset->balls[i];
+		scalar_t dz = pos.z - ball->pos.z;
+		if (dz * dz < ball->radius * ball->radius)
+		{
+			near_balls.push_back(ball);
+			near_dz2.push_back(dz * dz);
+		}
+	}
+
+	for (int y=0; y<ycount; y++)
+	{
+		scalar_t *row = values + y * pitch;
+		scalar_t py = pos.y + step.y * y;
+
+		memset(row, 0, xcount * sizeof *row);
+
+		for (size_t i=0; i<near_balls.size(); i++)
+		{
+			const Metaball *ball = near_balls[i];
+			scalar_t r2 = ball->radius * ball->radius;
+			scalar_t dy = py - ball->pos.y;
+			scalar_t dyz2 = dy * dy + near_dz2[i];
+			if (dyz2 >= r2)
+			{
+				continue;
+			}
+
+			// the span of the row inside the ball
+			int i0 = 0, i1 = xcount;
+			if (step.x > 0)
+			{
+				// clamp before converting, the ball may be far outside the grid
+				scalar_t half = sqrt(r2 - dyz2);
+				scalar_t f0 = ceil((ball->pos.x - half - pos.x) / step.x);
+				scalar_t f1 = floor((ball->pos.x + half - pos.x) / step.x) + 1;
+				i0 = (int)std::min(std::max(f0, (scalar_t)0), (scalar_t)xcount);
+				i1 = (int)std::min(std::max(f1, (scalar_t)0), (scalar_t)xcount);
+			}
+
+			if (i0 < i1)
+			{
+				add_ball_span(row, i0, i1, pos.x, step.x, ball, dyz2);
+			}
+		}
+	}
+}
@@ -31,6 +31,56 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #ifndef _SCALAR_FIELD_HEADER_
 #define _SCALAR_FIELD_HEADER_
 
+// batch evaluator: fills a z slice of the grid, xcount x ycount points
+// starting at pos and spaced by step.x and step.y. The rows of the
+// slice are pitch values apart in the values array.
+typedef void (*ScalarBatchEvaluator)(scalar_t *values, int xcount, int ycount, int pitch,
+		const Vector3 &pos, const Vector3 &step, scalar_t t, void *cls);
+
+// a metaball with the field function of soft objects:
+// strength * (1 - r^2 / radius^2)^3 inside the radius, zero outside
+struct Metaball
+{
+	Vector3 pos;
+	scalar_t radius, strength;
+
+	Metaball(const Vector3 &pos = Vector3(0, 0, 0), scalar_t radius = 1, scalar_t strength = 1);
+};
+
+// sum of metaballs, evaluated in batches by a ScalarField (see
+// ScalarField::set_metaballs). Since every ball has a finite radius,
+// only the balls that reach a slice, and then a row of it, are summed,
+// and only over the span of the row they cover.
+class MetaballSet
+{
+protected:
+	std::vector <Metaball> balls;
+
+public:
+	MetaballSet();
+
+	void add_ball(const Metaball &ball);
+	void remove_ball(int idx);
+	void clear();
+	int get_ball_count() const;
+	Metaball *get_ball(int idx);
+
+	scalar_t evaluate(const Vector3 &pos) const;
+
+	// ScalarBatchEvaluator, cls must point to the MetaballSet
+	static void evaluate_slice(scalar_t *values, int xcount, int ycount, int pitch,
+			const Vector3 &pos, const Vector3 &step, scalar_t t, void *cls);
+};
+
+// mesh data generated by triangulate for a range of cell layers
+struct MCSlab
+{
+	unsigned int z_start, z_end;
+	std::vector <Vertex> verts;
+	std::vector <Triangle> tris;
+	unsigned int vert_offset;		// index of the first vertex in the final mesh
+};
+
 class ScalarField
 {
 protected:
@@ -43,19 +93,42 @@ protected:
 	unsigned int dimensions;			// dimensions of the field
 	Vector3 from, to, cell_size;		// limits in space of the field
 
-	// Mesh storage
-	std::vector <Vertex> verts;
-	std::vector <Triangle> tris;
+	// block-sparse mode: the cells are grouped in blocks of block_size^3,
+	// edge tables exist only for the blocks the isosurface passes through,
+	// and edges_x/y/z hold the tables of those blocks back to back.
+	bool sparse;
+	unsigned int block_size, blocks_per_dim;
+	std::vector <scalar_t> block_min, block_max;	// range of values in each block
+	std::vector <unsigned int> block_edges;		// start of a block's edge tables
+	unsigned int edges_capacity;				// size of each of the edge arrays
+
+	// Mesh storage, one slab per triangulation task
+	std::vector <MCSlab> slabs;
 
 	// Evaluators
 	scalar_t (*evaluate)(const Vector3 &vec, scalar_t t);
 	Vector3 (*get_normal)(const Vector3 &vec, scalar_t t);
+	ScalarBatchEvaluator batch_evaluate;
+	void *batch_cls;
+	const MetaballSet *metaballs;		// evaluated directly at single points
 
 	// private methods
-	unsigned int add_vertex(const Vertex &vert);	// adds a vertex and returns its index
-	void clear();				// clears the std::vectors that hold mesh data
+	unsigned int add_vertex(MCSlab *slab, const Vertex &vert);	// adds a vertex and returns its index
+	void clear();				// clears the mesh data and the edges table
+	void clear_edges(unsigned int z_start, unsigned int z_end);
+	void reset_edges();			// (re)allocates the edge tables for the current mode
+	unsigned int get_edge_slot(int cx, int cy, int cz, int edge, unsigned int **table);
+	unsigned int activate_blocks(scalar_t isolevel);
 	void evaluate_all(scalar_t t);
-	void process_cell(int x, int y, int z, scalar_t isolevel);
+	scalar_t evaluate_point(const Vector3 &vec, scalar_t t);
+	void process_cell(int x, int y, int z, scalar_t isolevel, MCSlab *slab);
+	unsigned int get_tri_edge(const MCSlab *slab, int cx, int cy, int cz, int edge);
+
+	// triangulation tasks, run through the thread pool
+	static void evaluate_task(int z, void *cls);
+	static void block_range_task(int bz, void *cls);
+	static void polygonize_task(int slab, void *cls);
+	static void output_task(int slab, void *cls);
 
 	unsigned int get_value_index(int x, int y, int z);
 	Vector3 def_eval_normals(const Vector3 &vec, scalar_t t);
@@ -68,6 +141,13 @@ public:
 	~ScalarField();
 
 	void set_dimensions(unsigned int dimensions);
+
+	// block-sparse mode keeps the min/max value of every block of cells and
+	// skips the blocks the isolevel can't cross, so that edge memory and
+	// polygonization time depend on the area of the isosurface instead of
+	// the volume of the field. The values are still stored densely.
+	void set_sparse(bool enable, unsigned int block_size = 8);
+	bool get_sparse() const;
 	
 	// draw the 3d grid.
 	// if full, draws everything. If not, draws the bounding volume
@@ -93,10 +173,17 @@ public:
 	Vector3 get_to();
 
 	// Evaluators
+	// NOTE: these are called concurrently from multiple threads during
+	// triangulation, so they must not modify any shared state.
+	// Setting a point evaluator removes the batch evaluator and vice versa.
 	void set_evaluator(scalar_t (*evaluate)(const Vector3 &vec, scalar_t t));
+	void set_batch_evaluator(ScalarBatchEvaluator evaluate, void *cls = 0);
+	void set_metaballs(MetaballSet *mballs);
 	void set_normal_evaluator(Vector3 (*get_normal)(const Vector3 &vec, scalar_t t));
 	
 	// last but not least 
+	// the volume is split in slabs of cell layers which are processed in
+	// parallel, the result is identical to processing it serially.
 	void triangulate(TriMesh *mesh, scalar_t isolevel, scalar_t t, bool calc_normals);
 };
 
@@ -19,35 +19,14 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
 #include <vector>
+#include <algorithm>
 #include "shadows.hpp"
+#include "common/threadpool.h"
 
 std::vector<Edge> *create_silhouette(const TriMesh *mesh, const Vector3 &pt) {
-	const GeometryArray<Edge> *mesh_edges = mesh->get_edge_array();
-	unsigned long ecount = mesh_edges->get_count();
-	const Edge *eptr = mesh_edges->get_data();
-
-	const Vertex *varray = mesh->get_vertex_array()->get_data();
-	const Triangle *tarray = mesh->get_triangle_array()->get_data();
-
-	std::vector<Edge> *edges = new std::vector<Edge>;
-
-	for(unsigned long i=0; i<ecount; i++) {
-		const Triangle *t1 = tarray + eptr->adjfaces[0];
-		const Triangle *t2 = tarray + eptr->adjfaces[1];
-		// XXX: assumption that the light direction for one of a triangle's vertices
-		// can be used as the light direction for the whole triangle.
-		Vector3 ldir1 = (pt - varray[t1->vertices[0]].pos).normalized();
-		Vector3 ldir2 = (pt - varray[t2->vertices[0]].pos).normalized();
-		scalar_t t1dot = dot_product(t1->normal, ldir1);
-		scalar_t t2dot = dot_product(t2->normal, ldir2);
-		
-		if((t1dot > 0 && t2dot < 0) || (t1dot < 0 && t2dot > 0)) {
-			edges->push_back(*eptr);
-		}
-		eptr++;
-	}
-
-	return edges;
+	ContourEdges contour;
+	mesh->get_contour_edges(&contour, pt, false);
+	return new std::vector<Edge>(contour.edges);
 }
 
 void destroy_silhouette(std::vector<Edge> *edges) {
@@ -58,3 +37,127 @@ TriMesh *create_shadow_volume(const TriMesh *mesh, const Vector3 &pt) {
 	
 }
 */
+
+ShadowVolumeCache::ShadowVolumeCache() {
+	rebuilds = 0;
+}
+
+ShadowVolumeCache::Volume *ShadowVolumeCache::find(const void *caster, const void *light) {
+	std::map<Key, Volume>::iterator iter = volumes.find(Key(caster, light));
+	if(iter == volumes.end()) {
+		iter = volumes.insert(std::make_pair(Key(caster, light), Volume())).first;
+		iter->second.mesh = 0;
+		iter->second.dirty = false;
+	}
+	return &iter->second;
+}
+
+/* returns true if the volume has to be rebuilt for the given mesh and light */
+bool ShadowVolumeCache::set_source(Volume *vol, const TriMesh *mesh, const Vector3 &pov_or_dir, bool dir) {
+	// tolerate the noise of transforming the light to model space, which
+	// may leave a few bits different when both move together.
+	scalar_t tolerance = 1e-10 * std::max((scalar_t)1.0, pov_or_dir.length_sq());
+
+	if(vol->mesh == mesh && vol->mesh_rev == mesh->get_revision() && vol->dir == dir &&
+			(pov_or_dir - vol->pov_or_dir).length_sq() <= tolerance) {
+		return false;
+	}
+
+	vol->mesh = mesh;
+	vol->mesh_rev = mesh->get_revision();
+	vol->pov_or_dir = pov_or_dir;
+	vol->dir = dir;
+	return true;
+}
+
+/* Doesn't modify anything but the volume, so that many volumes can be
+ * built at once, as long as their meshes were prepared beforehand.
+ */
+void ShadowVolumeCache::build(Volume *vol) {
+	ContourEdges *contour = &vol->contour;
+	vol->mesh->get_contour_edges(contour, vol->pov_or_dir, vol->dir);
+
+	const Vertex *verts = vol->mesh->get_vertex_array()->get_data();
+	const Vector3 &pov_or_dir = vol->pov_or_dir;
+
+	// a quad from each contour edge to its extrusion, as get_shadow_volume
+	vol->verts.resize(contour->edges.size() * 6);
+	Vector3 *vptr = vol->verts.empty() ? 0 : &vol->verts[0];
+
+	for(size_t i=0; i<contour->edges.size(); i++) {
+		Vector3 p1 = verts[contour->edges[i].vertices[0]].pos;
+		Vector3 p2 = verts[contour->edges[i].vertices[1]].pos;
+		Vector3 ep1 = extrude(p1, shadow_extrusion, pov_or_dir, vol->dir);
+		Vector3 ep2 = extrude(p2, shadow_extrusion, pov_or_dir, vol->dir);
+
+		*vptr++ = p1;
+		*vptr++ = ep1;
+		*vptr++ = ep2;
+		*vptr++ = p1;
+		*vptr++ = ep2;
+		*vptr++ = p2;
+	}
+	vol->dirty = false;
+}
+
+void ShadowVolumeCache::build_task(int idx, void *cls) {
+	ShadowVolumeCache *cache = (ShadowVolumeCache*)cls;
+	build(cache->pending[idx]);
+}
+
+const std::vector<Vector3> *ShadowVolumeCache::get_volume(const void *caster, const void *light,
+		const TriMesh *mesh, const Vector3 &pov_or_dir, bool dir) {
+	Volume *vol = find(caster, light);
+
+	if(set_source(vol, mesh, pov_or_dir, dir) || vol->dirty) {
+		mesh->prepare_contour_edges();
+		build(vol);
+		rebuilds++;
+	}
+	return &vol->verts;
+}
+
+void ShadowVolumeCache::request(const void *caster, const void *light,
+		const TriMesh *mesh, const Vector3 &pov_or_dir, bool dir) {
+	Volume *vol = find(caster, light);
+
+	if(set_source(vol, mesh, pov_or_dir, dir) && !vol->dirty) {
+		// whatever the mesh calculates lazily has to be there before
+		// building in parallel, including the vertex array of SoA meshes.
+		mesh->prepare_contour_edges();
+		mesh->get_vertex_array();
+
+		vol->dirty = true;
+		pending.push_back(vol);
+	}
+}
+
+void ShadowVolumeCache::update() {
+	if(pending.empty()) return;
+
+	tpool_parallel_for((int)pending.size(), build_task, this);
+	rebuilds += pending.size();
+	pending.clear();
+}
+
+void ShadowVolumeCache::remove(const void *caster_or_light) {
+	update();	// don't leave pointers to removed volumes in the queue
+
+	std::map<Key, Volume>::iterator iter = volumes.begin();
+	while(iter != volumes.end()) {
+		if(iter->first.first == caster_or_light || iter->first.second == caster_or_light) {
+			volumes.erase(iter++);
+		} else {
+			iter++;
+		}
+	}
+}
+
+void ShadowVolumeCache::clear() {
+	pending.clear();
+	volumes.clear();
+}
+
+unsigned long ShadowVolumeCache::get_rebuild_count() const {
+	return rebuilds;
+}
@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define SHADOWS_HPP_
 
 #include <vector>
+#include <map>
 #include "gfx/3dgeom.hpp"
 #include "n3dmath2/n3dmath2.hpp"
 
@@ -29,4 +30,56 @@ std::vector<Edge> *create_silhouette(const TriMesh *mesh, const Vector3 &pt);
 void destroy_silhouette(std::vector<Edge> *edges);
 //TriMesh *create_shadow_volume(const TriMesh *mesh, const Vector3 &pt);
 
+/* Shadow volumes of each caster for each light, kept until the light moves
+ * relative to the caster or the mesh changes, so that both stencil passes,
+ * and any frames in which nothing moved, draw the same volume. The volumes
+ * are just positions, as triangle lists in the model space of the caster,
+ * and each one keeps its buffers from one rebuild to the next.
+ *
+ * Volumes are built on demand by get_volume, or all together by requesting
+ * each of them and then calling update, which builds the ones that changed
+ * in parallel on the thread pool.
+ */
+class ShadowVolumeCache {
+private:
+	struct Volume {
+		const TriMesh *mesh;
+		unsigned long mesh_rev;
+		Vector3 pov_or_dir;
+		bool dir;
+		bool dirty;			// requested, but not built yet
+		ContourEdges contour;
+		std::vector<Vector3> verts;
+	};
+
+	typedef std::pair<const void*, const void*> Key;
+	std::map<Key, Volume> volumes;
+	std::vector<Volume*> pending;
+	unsigned long rebuilds;
+
+	Volume *find(const void *caster, const void *light);
+	bool set_source(Volume *vol, const TriMesh *mesh, const Vector3 &pov_or_dir, bool dir);
+	static void build(Volume *vol);
+	static void build_task(int idx, void *cls);
+
+public:
+	ShadowVolumeCache();
+
+	// returns the volume of mesh for the light at (or pointing towards)
+	// pov_or_dir in model space, building it if needed. caster and light are
+	// only used to tell the volumes apart.
+	const std::vector<Vector3> *get_volume(const void *caster, const void *light,
+			const TriMesh *mesh, const Vector3 &pov_or_dir, bool dir);
+
+	// same arguments as get_volume, but leaves the building to update
+	void request(const void *caster, const void *light,
+			const TriMesh *mesh, const Vector3 &pov_or_dir, bool dir);
+	void update();
+
+	void remove(const void *caster_or_light);
+	void clear();
+
+	unsigned long get_rebuild_count() const;
+};
+
 #endif	// SHADOWS_HPP_
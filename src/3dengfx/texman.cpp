@@ -26,12 +26,16 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <string>
 #include <cstring>
 #include "texman.hpp"
+#include "scenecache.hpp"
 #include "common/hashtable.hpp"
 #include "gfx/image.h"
 #include "gfx/color.hpp"
 #include "n3dmath2/n3dmath2.hpp"
+#include "n3dmath2/n3dmath2_batch.hpp"
 #include "common/string_hash.hpp"
 #include "common/err_msg.h"
+#include "common/threadpool.h"
+#include "common/timer.h"
 
 using std::string;
 
@@ -40,6 +44,135 @@ static void create_normal_cube_map();
 static HashTable<string, Texture*> *textures;
 static Texture *normal_cubemap;
 
+// texture streaming
+#define PLACEHOLDER_SIZE	8
+
+struct StreamJob {
+	TexManEntry *entry;		// its tex is 0 if the texture was deleted meanwhile
+	string fname;
+	TexImage img;
+	bool loaded;
+};
+
+static struct tpool_queue *stream_queue;
+static unsigned long upload_budget = 4 * 1024 * 1024;
+static TexStreamStats stream_stats;
+static unsigned long frame_stall_usec, total_stall_usec;
+
+// mipmapping
+static bool mipmapping;
+static MipFilter mip_filter = MIP_FILTER_BOX;
+static bool mip_gamma = true;
+
+/* Residency bookkeeping: every texture in the database has an entry, and the
+ * entries are kept in a list ordered by the last frame each texture was used
+ * (looked up or bound with set_texture), most recent first. When the textures
+ * take more video memory than the budget, the least recently used ones which
+ * were loaded from image files are released, and reloaded from the same file
+ * the next time they are used. Textures used in the current frame, pinned
+ * textures, and streamed textures still waiting for their image are kept.
+ */
+struct TexManEntry {
+	Texture *tex;
+	string fname;			// image to reload from, empty if it can't be evicted
+	unsigned long bytes;	// video memory, as counted in resident_bytes
+	unsigned long last_use;	// frame number
+	int pin_count;
+	bool resident, streaming;
+	TexManEntry *prev, *next;
+};
+
+static TexManEntry *lru_head, *lru_tail;
+static unsigned long frame_number;
+static unsigned long mem_budget;		// 0 for no limit
+static unsigned long resident_bytes;
+static int frame_hits, frame_misses, frame_evictions, frame_reloads;
+static TexCacheStats cache_stats;
+
+static void lru_unlink(TexManEntry *e) {
+	if(e->prev) e->prev->next = e->next; else lru_head = e->next;
+	if(e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+}
+
+static void lru_push_front(TexManEntry *e) {
+	e->prev = 0;
+	e->next = lru_head;
+	if(lru_head) lru_head->prev = e; else lru_tail = e;
+	lru_head = e;
+}
+
+// textures may change size after they are added (lock/unlock, set_pixel_data)
+static void update_size(TexManEntry *e) {
+	unsigned long bytes = e->tex->get_memory_usage();
+	resident_bytes = resident_bytes - e->bytes + bytes;
+	e->bytes = bytes;
+}
+
+static void upload_image(Texture *tex, TexImage *img) {
+	tex->set_pixel_data((Pixel*)img->pixels, img->xsz, img->ysz);
+	if(img->mips.count) {
+		tex->set_mip_levels(&img->mips);
+	}
+
+	free_image(img->pixels);
+	img->pixels = 0;
+	img->mips.clear();
+}
+
+static void reload_texture(TexManEntry *e) {
+	unsigned long start = timer_usec();
+
+	TexImage img;
+	if(load_texture_image(e->fname.c_str(), &img)) {
+		upload_image(e->tex, &img);
+	} else {
+		error("failed to reload evicted texture: %s", e->fname.c_str());
+		e->fname.clear();	// don't try again, leave it empty
+	}
+	e->resident = true;
+	update_size(e);
+	frame_reloads++;
+
+	frame_stall_usec += timer_usec() - start;
+}
+
+/* use_texture - (JT)
+ * marks the texture as used in the current frame, reloading it if it has
+ * been evicted.
+ */
+static void use_texture(TexManEntry *e) {
+	if(e->last_use != frame_number) {
+		lru_unlink(e);
+		lru_push_front(e);
+		e->last_use = frame_number;
+	}
+
+	if(e->resident) {
+		update_size(e);
+		frame_hits++;
+	} else {
+		frame_misses++;
+		reload_texture(e);
+	}
+}
+
+static void evict_textures() {
+	TexManEntry *e = lru_tail;
+	while(mem_budget && e && resident_bytes > mem_budget) {
+		// everything from here on has been used in this frame
+		if(e->last_use == frame_number) break;
+
+		if(e->resident && !e->pin_count && !e->streaming && !e->fname.empty()) {
+			e->tex->release();
+			resident_bytes -= e->bytes;
+			e->bytes = 0;
+			e->resident = false;
+			frame_evictions++;
+		}
+		e = e->prev;
+	}
+}
+
 static void delete_texture(Texture *tex) {
 	glDeleteTextures(1, &tex->tex_id);
 	glGetError();
@@ -67,10 +200,43 @@ void add_texture(Texture *texture, const char *fname) {
 	} else {
 		textures->insert(fname, texture);
 	}
+
+	TexManEntry *e = new TexManEntry;
+	e->tex = texture;
+	e->bytes = 0;
+	e->last_use = frame_number;
+	e->pin_count = 0;
+	e->resident = true;
+	e->streaming = false;
+	lru_push_front(e);
+	texture->man_entry = e;
+	update_size(e);
 }
 
-// TODO: implement this one, after making HashTable remove by value
+/* remove_texture - (JT)
+ * takes the texture out of the database and drops its bookkeeping, the
+ * texture itself isn't deleted. Called by the Texture destructor. The entry
+ * of a streamed texture which is still being decoded is left to
+ * upload_streamed_textures, which throws away the image.
+ */
 void remove_texture(Texture *texture) {
+	TexManEntry *e = texture->man_entry;
+	if(!e) return;
+
+	Pair<string, Texture*> *res = textures ? textures->find_first_val(texture) : 0;
+	if(res) {
+		textures->remove(res->key);
+	}
+
+	lru_unlink(e);
+	resident_bytes -= e->bytes;
+	texture->man_entry = 0;
+
+	if(e->streaming) {
+		e->tex = 0;
+	} else {
+		delete e;
+	}
 }
 
 Texture *find_texture(const char *fname) {
@@ -92,31 +258,269 @@ Texture *get_texture(const char *fname) {
 	if(!fname) return 0;
 	
 	Texture *tex;
-	if((tex = find_texture(fname))) return tex;
+	if((tex = find_texture(fname))) {
+		use_texture(tex->man_entry);
+		return tex;
+	}
+	frame_misses++;
+
+	unsigned long start = timer_usec();
 
 	// first check to see if it's a custom file (cubemap).
 	if(is_cubemap(fname)) {
 		tex = load_cubemap(fname);
 		add_texture(tex, fname);
+	} else {
+		TexImage img;
+		tex = load_texture_image(fname, &img) ? add_texture_image(&img, fname) : 0;
+	}
+
+	frame_stall_usec += timer_usec() - start;
+	return tex;
+}
+
+TexImage::TexImage() {
+	pixels = 0;
+	xsz = ysz = 0;
+}
+
+TexImage::~TexImage() {
+	if(pixels) free_image(pixels);
+}
+
+void set_texture_mipmapping(bool enable, MipFilter filter, bool gamma_correct) {
+	mipmapping = enable;
+	mip_filter = filter;
+	mip_gamma = gamma_correct;
+
+	// pick the SIMD path now, not from the loading threads
+	get_simd_level();
+}
+
+bool get_texture_mipmapping() {
+	return mipmapping;
+}
+
+/* load_texture_image - (JT)
+ * the part of get_texture that doesn't need the GL context. With mipmapping
+ * enabled, the image and its mip levels come from the image cache if it's
+ * there and was built with the same filter, otherwise they are built and
+ * the cache is written for the next time.
+ */
+bool load_texture_image(const char *fname, TexImage *img) {
+	free_image(img->pixels);
+	img->pixels = 0;
+	img->mips.clear();
+
+	unsigned int mip_flags = (unsigned int)mip_filter | (mip_gamma ? 0x100 : 0);
+	bool use_cache = mipmapping && get_scene_cache();
+
+	if(use_cache && load_image_cache(fname, mip_flags, img)) {
+		return true;
+	}
+
+	if(!(img->pixels = load_image(fname, &img->xsz, &img->ysz))) {
+		return false;
+	}
+
+	if(mipmapping) {
+		build_mipmaps(&img->mips, (Pixel*)img->pixels, img->xsz, img->ysz, mip_filter, mip_gamma);
+		if(use_cache) {
+			save_image_cache(fname, mip_flags, img);
+		}
+	}
+	return true;
+}
+
+/* add_texture_image - (JT)
+ * creates a texture out of an image returned by load_texture_image, and
+ * adds it to the texture database. This is the part of get_texture that
+ * needs the GL context, the image itself may have been loaded by any thread.
+ */
+Texture *add_texture_image(TexImage *img, const char *fname) {
+	Texture *tex = new Texture;
+	upload_image(tex, img);
+
+	add_texture(tex, fname);
+	tex->man_entry->fname = fname;	// can be reloaded from the same file
+	return tex;
+}
+
+
+static void decode_job(void *cls) {
+	StreamJob *job = (StreamJob*)cls;
+	job->loaded = load_texture_image(job->fname.c_str(), &job->img);
+}
+
+/* get_texture_async - (JT)
+ * like get_texture, but instead of loading the image right away, it returns
+ * a texture holding a small placeholder image, and queues the image to be
+ * decoded by a background thread. The placeholder is replaced by the actual
+ * image in a later upload_streamed_textures call, and the texture pointer
+ * stays the same. Cubemaps are still loaded synchronously.
+ */
+Texture *get_texture_async(const char *fname) {
+	if(!fname) return 0;
+
+	Texture *tex;
+	if((tex = find_texture(fname))) {
+		use_texture(tex->man_entry);
 		return tex;
 	}
-	
-	PixelBuffer pbuf;
-	
-	void *img_buf = load_image(fname, &pbuf.width, &pbuf.height);
-	if(!img_buf) return 0;
 
-	pbuf.buffer = new Pixel[pbuf.width * pbuf.height];
-	memcpy(pbuf.buffer, img_buf, pbuf.width * pbuf.height * sizeof(Pixel));
+	if(is_cubemap(fname)) {
+		return get_texture(fname);
+	}
 
-	free_image(img_buf);
-	
-	tex = new Texture;
-	tex->set_pixel_data(pbuf);
+	if(!stream_queue && !(stream_queue = tpool_queue_create())) {
+		return get_texture(fname);
+	}
+
+	StreamJob *job = new StreamJob;
+	job->fname = fname;
+	job->loaded = false;
+	if(tpool_queue_submit(stream_queue, decode_job, job) == -1) {
+		delete job;
+		return get_texture(fname);
+	}
+
+	// the job is only collected by upload_streamed_textures, on this thread
+	tex = new Texture(PLACEHOLDER_SIZE, PLACEHOLDER_SIZE);
 	add_texture(tex, fname);
+	tex->man_entry->fname = fname;
+	tex->man_entry->streaming = true;
+	job->entry = tex->man_entry;
+	frame_misses++;
+
 	return tex;
 }
 
+void set_texture_upload_budget(unsigned long bytes) {
+	upload_budget = bytes;
+}
+
+/* upload_streamed_textures - (JT)
+ * replaces the placeholders of decoded streamed textures with the actual
+ * images, until the upload budget is exhausted (at least one texture is
+ * uploaded each time though, however large). The decoded buffers are
+ * uploaded as they are, without any intermediate copies.
+ * This is called by update_textures once per frame.
+ */
+void upload_streamed_textures() {
+	unsigned long start = timer_usec();
+	unsigned long bytes = 0;
+	int count = 0;
+
+	StreamJob *job;
+	while(stream_queue && bytes < upload_budget && (job = (StreamJob*)tpool_queue_done(stream_queue))) {
+		TexManEntry *e = job->entry;
+
+		if(!e->tex) {
+			// the texture was deleted before the image arrived
+			delete e;
+			delete job;
+			continue;
+		}
+
+		if(job->loaded) {
+			bytes += job->img.xsz * job->img.ysz * sizeof(Pixel) + job->img.mips.get_size();
+			upload_image(e->tex, &job->img);
+			count++;
+		} else {
+			error("failed to load texture: %s, keeping the placeholder", job->fname.c_str());
+		}
+
+		// it may have been evicted before the image arrived
+		e->streaming = false;
+		e->resident = true;
+		update_size(e);
+
+		delete job;
+	}
+
+	frame_stall_usec += timer_usec() - start;
+
+	int pending = stream_queue ? tpool_queue_pending(stream_queue) : 0;
+	int finished = stream_queue ? tpool_queue_finished(stream_queue) : 0;
+
+	stream_stats.decode_queue = pending - finished;
+	stream_stats.upload_queue = finished;
+	stream_stats.uploaded_textures = count;
+	stream_stats.uploaded_bytes = bytes;
+}
+
+TexStreamStats get_texture_stream_stats() {
+	return stream_stats;
+}
+
+
+void set_texture_memory_budget(unsigned long bytes) {
+	mem_budget = bytes;
+}
+
+unsigned long get_texture_memory_budget() {
+	return mem_budget;
+}
+
+void pin_texture(Texture *tex) {
+	if(tex->man_entry) {
+		tex->man_entry->pin_count++;
+	}
+}
+
+void unpin_texture(Texture *tex) {
+	if(tex->man_entry && tex->man_entry->pin_count > 0) {
+		tex->man_entry->pin_count--;
+	}
+}
+
+void touch_texture(const Texture *tex) {
+	if(tex->man_entry) {
+		use_texture(tex->man_entry);
+	}
+}
+
+/* update_textures - (JT)
+ * called by flip() at the end of every frame: uploads the streamed textures
+ * that are ready, evicts textures to get within the memory budget, and
+ * closes the frame for the purposes of the statistics.
+ */
+void update_textures() {
+	upload_streamed_textures();
+	evict_textures();
+
+	total_stall_usec += frame_stall_usec;
+	stream_stats.stall_msec = frame_stall_usec / 1000.0f;
+	stream_stats.total_stall_msec = total_stall_usec / 1000.0f;
+	frame_stall_usec = 0;
+
+	cache_stats.hits = frame_hits;
+	cache_stats.misses = frame_misses;
+	cache_stats.evictions = frame_evictions;
+	cache_stats.reloads = frame_reloads;
+	cache_stats.resident_textures = cache_stats.evicted_textures = 0;
+	cache_stats.resident_bytes = resident_bytes;
+	cache_stats.cpu_bytes = 0;
+
+	for(TexManEntry *e = lru_head; e; e = e->next) {
+		if(e->resident) {
+			cache_stats.resident_textures++;
+		} else {
+			cache_stats.evicted_textures++;
+		}
+		if(e->tex->buffer) {
+			cache_stats.cpu_bytes += e->tex->width * e->tex->height * sizeof(Pixel);
+		}
+	}
+
+	frame_hits = frame_misses = frame_evictions = frame_reloads = 0;
+	frame_number++;
+}
+
+TexCacheStats get_texture_cache_stats() {
+	return cache_stats;
+}
+
 
 void destroy_textures() {
 	static bool called_again = false;
@@ -129,8 +533,33 @@ void destroy_textures() {
 	}
 
 	info("Shutting down texture manager, destroying all textures...");
+
+	// the decoders still refer to their textures, finish them off first
+	if(stream_queue) {
+		tpool_queue_wait(stream_queue);
+
+		StreamJob *job;
+		while((job = (StreamJob*)tpool_queue_done(stream_queue))) {
+			if(!job->entry->tex) {
+				delete job->entry;
+			}
+			delete job;
+		}
+		tpool_queue_destroy(stream_queue);
+		stream_queue = 0;
+	}
+
 	delete textures;
 	textures = 0;
+
+	while(lru_head) {
+		TexManEntry *e = lru_head;
+		lru_head = e->next;
+		e->tex->man_entry = 0;
+		delete e;
+	}
+	lru_tail = 0;
+	resident_bytes = 0;
 }
 
 
@@ -295,7 +724,7 @@ Texture *load_cubemap(const char *fname) {
 	char line[512];
 	unsigned int cube_size = 0;
 	unsigned long xsz = 0, ysz = 0;
-	void *img[6] = {0};
+	string img[6];
 
 	fgets(line, 512, fp);	// skip file id & text description
 	
@@ -303,7 +732,9 @@ Texture *load_cubemap(const char *fname) {
 		cube_size = atoi(line);
 	}
 	
-	for(int i=0; i<6; i++) {
+	// only the sizes are checked at first, the faces are decoded afterwards
+	int count;
+	for(count=0; count<6; count++) {
 		if(!fgets(line, 512, fp)) {
 			error("%s is not a complete cubemap file, EOF encountered", fname);
 			break;
@@ -314,12 +745,12 @@ Texture *load_cubemap(const char *fname) {
 		}
 		
 		unsigned long x, y;
-		if(!(img[i] = load_image(line, &x, &y))) {
+		if(probe_image(line, &x, &y) == -1) {
 			error("cubemap %s requires %s, which cannot be opened", fname, line);
 			break;
 		}
 
-		if(i > 0 && (x != xsz || y != ysz)) {
+		if(count > 0 && (x != xsz || y != ysz)) {
 			error("inconsistent cubemap %s, image sizes differ", fname);
 			break;
 		}
@@ -330,14 +761,12 @@ Texture *load_cubemap(const char *fname) {
 			error("cubemap %s contains non-square textures", fname);
 			break;
 		}
+		img[count] = line;
 	}
 
 	fclose(fp);
 	
-	if(!img[5]) {
-		for(int i=0; i<6; i++) {
-			if(img[i]) free_image(img[i]);
-		}
+	if(count < 6) {
 		return 0;
 	}
 	
@@ -345,7 +774,7 @@ Texture *load_cubemap(const char *fname) {
 		warning("cubemap %s loaded correctly, but wrong size in the header", fname);
 	}
 
-	Texture *cube = new Texture(cube_size, cube_size, TEX_CUBE);
+	Texture *cube = new Texture(xsz, ysz, TEX_CUBE);
 
 	CubeMapFace faces[] = {
 		CUBE_MAP_PX, CUBE_MAP_NX,
@@ -353,12 +782,16 @@ Texture *load_cubemap(const char *fname) {
 		CUBE_MAP_PZ, CUBE_MAP_NZ
 	};
 
-	for(int i=0; i<6; i++) {
-		cube->lock(faces[i]);
-		memcpy(cube->buffer, img[i], cube_size * cube_size * sizeof(Pixel));
-		cube->unlock(faces[i]);
+	// every face is decoded into the same buffer and uploaded from there,
+	// bottom-up, as they have always been uploaded.
+	PixelBuffer face(xsz, ysz);
+	Pixel *last_row = face.buffer + (ysz - 1) * xsz;
 
-		free_image(img[i]);
+	for(int i=0; i<6; i++) {
+		if(load_image_into(img[i].c_str(), last_row, xsz, ysz, -(long)(xsz * sizeof(Pixel))) == -1) {
+			error("failed to load cubemap face %s", img[i].c_str());
+		}
+		cube->set_pixel_data(face.buffer, xsz, ysz, faces[i]);
 	}
 
 	return cube;
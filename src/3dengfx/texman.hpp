@@ -26,6 +26,76 @@ void remove_texture(Texture *texture);
 Texture *find_texture(const char *fname);
 
 Texture *get_texture(const char *fname);
+
+// an image loaded for a texture, along with its mip levels
+struct TexImage {
+	void *pixels;		// as returned by load_image
+	unsigned long xsz, ysz;
+	MipLevels mips;		// empty if mipmapping is disabled
+
+	TexImage();
+	~TexImage();
+};
+
+// mip levels are built on the CPU when textures are loaded, and kept in an
+// image cache next to the image file, if the scene cache is enabled (see
+// scenecache.hpp). Disabled by default.
+void set_texture_mipmapping(bool enable, MipFilter filter = MIP_FILTER_BOX, bool gamma_correct = true);
+bool get_texture_mipmapping();
+
+// can be called by any thread, decodes the image (or reads it from the
+// image cache) and builds the mip levels
+bool load_texture_image(const char *fname, TexImage *img);
+// uploads the image to a new texture, and adds it to the texture database.
+// the image is freed in the process.
+Texture *add_texture_image(TexImage *img, const char *fname);
+
+// texture streaming
+Texture *get_texture_async(const char *fname);
+
+// bytes of image data to upload per frame (default 4mb)
+void set_texture_upload_budget(unsigned long bytes);
+void upload_streamed_textures();
+
+// once per frame (called by flip), uploads streamed textures and evicts
+// textures to stay within the memory budget.
+void update_textures();
+
+struct TexStreamStats {
+	int decode_queue;			// textures waiting to be decoded
+	int upload_queue;			// decoded textures waiting to be uploaded
+	int uploaded_textures;		// uploaded during the last frame
+	unsigned long uploaded_bytes;
+	float stall_msec;			// time spent loading textures on the rendering thread
+	float total_stall_msec;		// during the last frame, and in total
+};
+
+// statistics as of the last update_textures call
+TexStreamStats get_texture_stream_stats();
+
+// memory budget for the textures (estimated video memory), 0 for no limit,
+// which is the default. Evicted textures are reloaded when next used.
+void set_texture_memory_budget(unsigned long bytes);
+unsigned long get_texture_memory_budget();
+
+// pinned textures are never evicted, pins are counted
+void pin_texture(Texture *tex);
+void unpin_texture(Texture *tex);
+
+// marks a texture as used in this frame, reloading it if it's evicted,
+// set_texture does that for every texture it binds.
+void touch_texture(const Texture *tex);
+
+struct TexCacheStats {
+	int hits, misses;			// texture lookups and binds during the last frame
+	int evictions, reloads;		// during the last frame
+	int resident_textures, evicted_textures;
+	unsigned long resident_bytes;	// estimated video memory used by the textures
+	unsigned long cpu_bytes;		// system memory used by locked textures
+};
+
+// statistics as of the last update_textures call
+TexCacheStats get_texture_cache_stats();
 void destroy_textures();
 
 
@@ -24,6 +24,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <string.h>
 #include "opengl.h"
 #include "textures.hpp"
+#include "texman.hpp"
 
 static void invert_image(Pixel *img, int x, int y) {
 	Pixel *s2 = img + (y - 1) * x;
@@ -65,6 +66,8 @@ Texture::Texture(int x, int y, TextureDim type) {
 	width = x;
 	height = type == TEX_1D ? 1 : y;
 	this->type = type;
+	man_entry = 0;
+	mip_levels = 0;
 
 	if(x != -1 && y != -1) {
 		gen_undef_image(width, height);
@@ -76,6 +79,8 @@ Texture::Texture(int x, TextureDim type) {
 	width = x;
 	height = type == TEX_1D ? 1 : x;
 	this->type = type;
+	man_entry = 0;
+	mip_levels = 0;
 
 	gen_undef_image(width, height);
 	add_frame(undef_pbuf);
@@ -83,6 +88,7 @@ Texture::Texture(int x, TextureDim type) {
 		
 Texture::~Texture() {
 	// TODO: check if it's destroyed between a lock/unlock and free image data
+	remove_texture(this);
 }
 
 void Texture::add_frame() {
@@ -91,6 +97,8 @@ void Texture::add_frame() {
 	
 	glTexParameteri(type, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	// only level 0 exists until set_mip_levels is called
+	glTexParameteri(type, GL_TEXTURE_MAX_LEVEL, 0);
 
 	if(type == TEX_CUBE) {
 		glTexParameteri(type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -129,6 +137,33 @@ unsigned int Texture::get_active_frame() const {
 	return active_frame;
 }
 
+unsigned int Texture::get_frame_count() const {
+	return (unsigned int)frame_tex_id.size();
+}
+
+void Texture::release() {
+	if(!frame_tex_id.empty()) {
+		glDeleteTextures((GLsizei)frame_tex_id.size(), &frame_tex_id[0]);
+		frame_tex_id.clear();
+	}
+	tex_id = 0;
+	active_frame = 0;
+	mip_levels = 0;
+}
+
+unsigned long Texture::get_memory_usage() const {
+	unsigned long faces = type == TEX_CUBE ? 6 : 1;
+	unsigned long size = width * height;
+
+	unsigned long xsz = width, ysz = height;
+	for(int i=0; i<mip_levels; i++) {
+		xsz = xsz > 1 ? xsz / 2 : 1;
+		ysz = ysz > 1 ? ysz / 2 : 1;
+		size += xsz * ysz;
+	}
+	return size * sizeof(Pixel) * faces * frame_tex_id.size();
+}
+
 void Texture::lock(CubeMapFace cube_map_face) {
 	buffer = new Pixel[width * height];
 	
@@ -170,40 +205,68 @@ void Texture::unlock(CubeMapFace cube_map_face) {
 }
 
 void Texture::set_pixel_data(const PixelBuffer &pbuf, CubeMapFace cube_map_face) {
+	Pixel *pixels = new Pixel[pbuf.width * pbuf.height];
+	memcpy(pixels, pbuf.buffer, pbuf.width * pbuf.height * sizeof(Pixel));
+
+	set_pixel_data(pixels, pbuf.width, pbuf.height, cube_map_face);
+
+	delete [] pixels;
+}
+
+void Texture::set_pixel_data(Pixel *pixels, unsigned long xsz, unsigned long ysz, CubeMapFace cube_map_face) {
 	
 	if(!frame_tex_id.size()) {
 		add_frame();
 	}
 		
-	width = pbuf.width;
-	height = pbuf.height;
+	width = xsz;
+	height = ysz;
 	
 	glBindTexture(type, tex_id);
 
-	buffer = new Pixel[width * height];
-	memcpy(buffer, pbuf.buffer, width * height * sizeof(Pixel));
-	invert_image(buffer, width, height);
+	// any mip levels we had don't match the new image
+	if(mip_levels) {
+		glTexParameteri(type, GL_TEXTURE_MAX_LEVEL, 0);
+		mip_levels = 0;
+	}
 
 	switch(type) {
 	case TEX_1D:
-		glTexImage1D(type, 0, 4, width, 0, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+		invert_image(pixels, width, height);
+		glTexImage1D(type, 0, 4, width, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 		break;
 
 	case TEX_2D:
-		glTexImage2D(type, 0, 4, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, buffer);
+		invert_image(pixels, width, height);
+		glTexImage2D(type, 0, 4, width, height, 0, GL_BGRA, GL_UNSIGNED_BYTE, pixels);
 		break;
 
 	case TEX_CUBE:
-		invert_image(buffer, width, height);
-		glTexImage2D(cube_map_face, 0, 4, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+		glTexImage2D(cube_map_face, 0, 4, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 		break;
 
 	default:
 		break;
 	}
+}
 
-	delete [] buffer;
-	buffer = 0;
+void Texture::set_mip_levels(MipLevels *mips) {
+	if(type != TEX_2D || !frame_tex_id.size()) return;
+
+	glBindTexture(type, tex_id);
+
+	for(int i=0; i<mips->count; i++) {
+		PixelBuffer *lvl = mips->level + i;
+		invert_image(lvl->buffer, lvl->width, lvl->height);
+		glTexImage2D(type, i + 1, 4, lvl->width, lvl->height, 0, GL_BGRA, GL_UNSIGNED_BYTE, lvl->buffer);
+	}
+
+	glTexParameteri(type, GL_TEXTURE_MAX_LEVEL, mips->count);
+	mip_levels = mips->count;
+}
+
+int Texture::get_mip_level_count() const {
+	return mip_levels;
 }
 
 TextureDim Texture::get_type() const {
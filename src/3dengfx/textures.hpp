@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include <vector>
 #include "gfx/pbuffer.hpp"
+#include "gfx/mipmap.hpp"
 #include "3denginefx_types.hpp"
 
 /* ---- Texture class ----
@@ -33,6 +34,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 ** actual data from OpenGL, we can use the function set_pixel_data() with a
 ** new PixelBuffer as argument (this is copied, not referenced)
 */
+struct TexManEntry;
+
 class Texture : public PixelBuffer {
 private:
 	// for animated textures this will hold all the tex_ids of the frames
@@ -40,11 +43,13 @@ private:
 	unsigned int active_frame;
 
 	TextureDim type;
+	int mip_levels;		// uploaded mip levels, besides level 0
 
 public:
 	unsigned int tex_id;	/* OpenGL texture id 
 							 * (for animated textures this is the active tex_id)
 							 */
+	TexManEntry *man_entry;	// texture manager bookkeeping, see texman.cpp
 
 	Texture(int x = -1, int y = -1, TextureDim type = TEX_2D);
 	Texture(int x, TextureDim type = TEX_1D);
@@ -55,11 +60,26 @@ public:
 	
 	void set_active_frame(unsigned int frame);
 	unsigned int get_active_frame() const;
+	unsigned int get_frame_count() const;
+
+	// deletes the OpenGL textures of all the frames, after this the texture
+	// is empty until it gets new pixel data.
+	void release();
+
+	// estimated size of the texture in video memory
+	unsigned long get_memory_usage() const;
 	
 	void lock(CubeMapFace cube_map_face = CUBE_MAP_PX);		// get a valid pixel pointer
 	void unlock(CubeMapFace cube_map_face = CUBE_MAP_PX);	// update system data & invalidate pointer
 	
 	void set_pixel_data(const PixelBuffer &pbuf, CubeMapFace cube_map_face = CUBE_MAP_PX);
+	// uploads the pixels without copying them first, they are modified in the process
+	void set_pixel_data(Pixel *pixels, unsigned long xsz, unsigned long ysz, CubeMapFace cube_map_face = CUBE_MAP_PX);
+
+	// uploads mip levels 1 and up (2D textures only), after the pixel data
+	// of level 0 is set. The levels are modified in the process.
+	void set_mip_levels(MipLevels *mips);
+	int get_mip_level_count() const;	// besides level 0
 
 	TextureDim get_type() const;
 };
@@ -0,0 +1,43 @@
+/*
+Copyright (C) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include "aligned_mem.h"
+
+/* we over-allocate by align + sizeof(void*) bytes, and store the pointer
+ * returned by malloc right before the aligned block we hand out.
+ */
+void *malloc_aligned(size_t size, size_t align) {
+	char *mem, *ptr;
+
+	if(!(mem = malloc(size + align + sizeof(void*)))) {
+		return 0;
+	}
+
+	ptr = mem + sizeof(void*);
+	ptr += (align - ((size_t)ptr & (align - 1))) & (align - 1);
+
+	((void**)ptr)[-1] = mem;
+	return ptr;
+}
+
+void free_aligned(void *ptr) {
+	if(ptr) {
+		free(((void**)ptr)[-1]);
+	}
+}
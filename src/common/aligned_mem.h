@@ -0,0 +1,47 @@
+/*
+Copyright (C) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* aligned memory allocation
+ * author: John Tsiombikas 2007
+ */
+
+#ifndef _ALIGNED_MEM_H_
+#define _ALIGNED_MEM_H_
+
+#include <stddef.h>
+
+/* default alignment for data streams that are going to be
+ * processed with SIMD instructions.
+ */
+#define SIMD_ALIGN	32
+
+#ifdef __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+/* align must be a power of two. returns 0 on failure.
+ * memory allocated with malloc_aligned must be freed with free_aligned.
+ */
+void *malloc_aligned(size_t size, size_t align);
+void free_aligned(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* _ALIGNED_MEM_H_ */
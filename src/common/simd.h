@@ -0,0 +1,54 @@
+/*
+Copyright (C) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* x86 SIMD code paths
+ * author: John Tsiombikas 2007
+ *
+ * X86_SIMD is defined when the SSE2/SSSE3/AVX2 paths can be compiled, which
+ * takes gcc function target attributes (gcc >= 4.9), so that the library
+ * doesn't have to be built with -msse2 / -mavx2. The functions using them
+ * are marked with the TARGET_* attributes, and are only called after
+ * checking what the cpu supports (see get_simd_level in n3dmath2_batch.hpp).
+ *
+ * Files whose SIMD and plain paths must produce the exact same results define
+ * SIMD_EXACT_MATH before including this. The library is normally built with
+ * -ffast-math, which lets the compiler reassociate the scalar and vector code
+ * differently and turn divisions into multiplications by the reciprocal, so
+ * it's turned off for the rest of those files.
+ */
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#if defined(__GNUC__) && \
+	(defined(__i386__) || defined(__x86_64__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define X86_SIMD
+#include <immintrin.h>
+
+#define TARGET_SSE2		__attribute__((target("sse2")))
+#define TARGET_SSSE3	__attribute__((target("ssse3")))
+#define TARGET_AVX2		__attribute__((target("avx2")))
+#endif
+
+#if defined(SIMD_EXACT_MATH) && defined(__GNUC__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 4))
+#pragma GCC optimize("no-fast-math")
+#endif
+
+#endif	/* _SIMD_H_ */
@@ -0,0 +1,409 @@
+/*
+Copyright (C) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/* worker thread pool for data-parallel loops
+ * author: John Tsiombikas 2007
+ */
+
+#if defined(unix) || defined(__unix__)
+#define _XOPEN_SOURCE	500
+#define USE_PTHREADS
+#endif	/* unix */
+
+#include <stdlib.h>
+#include "threadpool.h"
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif	/* USE_PTHREADS */
+
+#define MAX_THREADS		64
+
+static int num_threads = -1;
+
+static void init(void) {
+	const char *env;
+
+	if(num_threads > 0) return;
+
+	num_threads = 1;
+#ifdef USE_PTHREADS
+	num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif	/* USE_PTHREADS */
+	if((env = getenv("ENGFX_THREADS"))) {
+		num_threads = atoi(env);
+	}
+
+	if(num_threads < 1) num_threads = 1;
+	if(num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+}
+
+int tpool_get_thread_count(void) {
+	init();
+	return num_threads;
+}
+
+static void run_serial(int task_count, void (*func)(int, void*), void *cls) {
+	int i;
+	for(i=0; i<task_count; i++) {
+		func(i, cls);
+	}
+}
+
+#ifdef USE_PTHREADS
+
+/* The workers sleep on work_cond until job_id changes, then everybody
+ * (workers and caller) grabs task indices until none are left. The last
+ * one to finish a task wakes up the caller through done_cond.
+ */
+static pthread_t workers[MAX_THREADS];
+static int num_workers;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static int busy;
+static unsigned long job_id;
+static void (*job_func)(int, void*);
+static void *job_cls;
+static int job_next, job_count, job_pending;
+
+/* runs tasks of the current job until there are none left,
+ * must be called with pool_lock held.
+ */
+static void work(void) {
+	while(job_next < job_count) {
+		int task = job_next++;
+
+		pthread_mutex_unlock(&pool_lock);
+		job_func(task, job_cls);
+		pthread_mutex_lock(&pool_lock);
+
+		if(--job_pending == 0) {
+			pthread_cond_signal(&done_cond);
+		}
+	}
+}
+
+static void *worker_func(void *arg) {
+	int idx = (int)(size_t)arg;
+	unsigned long last_job = 0;
+
+	pthread_mutex_lock(&pool_lock);
+	for(;;) {
+		while(job_id == last_job) {
+			pthread_cond_wait(&work_cond, &pool_lock);
+		}
+		last_job = job_id;
+
+		/* sit this one out if the thread count was lowered since */
+		if(idx < num_threads - 1) {
+			work();
+		}
+	}
+	return 0;
+}
+
+static void start_workers(int count) {
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while(num_workers < count) {
+		if(pthread_create(workers + num_workers, &attr, worker_func, (void*)(size_t)num_workers) != 0) {
+			break;
+		}
+		num_workers++;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+void tpool_set_thread_count(int count) {
+	if(count < 1) count = 1;
+	if(count > MAX_THREADS) count = MAX_THREADS;
+
+	pthread_mutex_lock(&pool_lock);
+	num_threads = count;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void tpool_parallel_for(int task_count, void (*func)(int, void*), void *cls) {
+	init();
+
+	if(task_count <= 1 || num_threads <= 1) {
+		run_serial(task_count, func, cls);
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+
+	/* nested or concurrent calls just run on the calling thread */
+	if(busy) {
+		pthread_mutex_unlock(&pool_lock);
+		run_serial(task_count, func, cls);
+		return;
+	}
+	busy = 1;
+
+	/* workers are never destroyed, so the pool only grows */
+	if(num_workers < num_threads - 1) {
+		start_workers(num_threads - 1);
+	}
+
+	job_func = func;
+	job_cls = cls;
+	job_next = 0;
+	job_count = task_count;
+	job_pending = task_count;
+	job_id++;
+	pthread_cond_broadcast(&work_cond);
+
+	work();
+	while(job_pending) {
+		pthread_cond_wait(&done_cond, &pool_lock);
+	}
+
+	busy = 0;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+#else	/* !USE_PTHREADS */
+
+void tpool_set_thread_count(int count) {
+	num_threads = 1;
+}
+
+void tpool_parallel_for(int task_count, void (*func)(int, void*), void *cls) {
+	run_serial(task_count, func, cls);
+}
+
+#endif	/* USE_PTHREADS */
+
+
+/* ---- background job queues ---- */
+
+struct job {
+	void (*func)(void*);
+	void *cls;
+	struct tpool_queue *queue;
+	struct job *next;
+};
+
+struct tpool_queue {
+	struct job *done_head, *done_tail;
+	int pending, finished;
+};
+
+static void push_done(struct job *job) {
+	struct tpool_queue *q = job->queue;
+
+	job->next = 0;
+	if(q->done_tail) {
+		q->done_tail->next = job;
+	} else {
+		q->done_head = job;
+	}
+	q->done_tail = job;
+	q->finished++;
+}
+
+#ifdef USE_PTHREADS
+
+/* all queues share the background threads and the list of jobs waiting
+ * to run, each queue keeps its own list of finished jobs.
+ */
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_done_cond = PTHREAD_COND_INITIALIZER;
+static struct job *wait_head, *wait_tail;
+static int num_bg_workers;
+
+static void *bg_worker_func(void *arg) {
+	struct job *job;
+
+	pthread_mutex_lock(&async_lock);
+	for(;;) {
+		while(!wait_head) {
+			pthread_cond_wait(&async_cond, &async_lock);
+		}
+		job = wait_head;
+		if(!(wait_head = job->next)) {
+			wait_tail = 0;
+		}
+
+		pthread_mutex_unlock(&async_lock);
+		job->func(job->cls);
+		pthread_mutex_lock(&async_lock);
+
+		push_done(job);
+		pthread_cond_broadcast(&async_done_cond);
+	}
+	return 0;
+}
+
+/* one background thread less than the processors, leaving one for
+ * the thread that's submitting the jobs, but at least one.
+ */
+static void start_bg_workers(void) {
+	pthread_attr_t attr;
+	pthread_t thread;
+	int count = tpool_get_thread_count() - 1;
+	if(count < 1) count = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while(num_bg_workers < count) {
+		if(pthread_create(&thread, &attr, bg_worker_func, 0) != 0) {
+			break;
+		}
+		num_bg_workers++;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+#define LOCK_QUEUES		pthread_mutex_lock(&async_lock)
+#define UNLOCK_QUEUES	pthread_mutex_unlock(&async_lock)
+#else
+#define LOCK_QUEUES
+#define UNLOCK_QUEUES
+#endif	/* USE_PTHREADS */
+
+struct tpool_queue *tpool_queue_create(void) {
+	struct tpool_queue *q;
+
+	if(!(q = malloc(sizeof *q))) {
+		return 0;
+	}
+	q->done_head = q->done_tail = 0;
+	q->pending = q->finished = 0;
+	return q;
+}
+
+int tpool_queue_submit(struct tpool_queue *q, void (*func)(void*), void *cls) {
+	struct job *job;
+
+	if(!(job = malloc(sizeof *job))) {
+		return -1;
+	}
+	job->func = func;
+	job->cls = cls;
+	job->queue = q;
+	job->next = 0;
+
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&async_lock);
+	q->pending++;
+
+	if(!num_bg_workers) {
+		start_bg_workers();
+	}
+
+	if(num_bg_workers) {
+		if(wait_tail) {
+			wait_tail->next = job;
+		} else {
+			wait_head = job;
+		}
+		wait_tail = job;
+		pthread_cond_signal(&async_cond);
+		pthread_mutex_unlock(&async_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&async_lock);
+#else
+	q->pending++;
+#endif	/* USE_PTHREADS */
+
+	/* no background threads, run it right away */
+	func(cls);
+
+	LOCK_QUEUES;
+	push_done(job);
+	UNLOCK_QUEUES;
+	return 0;
+}
+
+void *tpool_queue_done(struct tpool_queue *q) {
+	struct job *job;
+	void *cls;
+
+	LOCK_QUEUES;
+	if(!(job = q->done_head)) {
+		UNLOCK_QUEUES;
+		return 0;
+	}
+	if(!(q->done_head = job->next)) {
+		q->done_tail = 0;
+	}
+	q->pending--;
+	q->finished--;
+	UNLOCK_QUEUES;
+
+	cls = job->cls;
+	free(job);
+	return cls;
+}
+
+int tpool_queue_pending(struct tpool_queue *q) {
+	int res;
+
+	LOCK_QUEUES;
+	res = q->pending;
+	UNLOCK_QUEUES;
+	return res;
+}
+
+int tpool_queue_finished(struct tpool_queue *q) {
+	int res;
+
+	LOCK_QUEUES;
+	res = q->finished;
+	UNLOCK_QUEUES;
+	return res;
+}
+
+void tpool_queue_wait(struct tpool_queue *q) {
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&async_lock);
+	while(q->finished < q->pending) {
+		pthread_cond_wait(&async_done_cond, &async_lock);
+	}
+	pthread_mutex_unlock(&async_lock);
+#endif	/* USE_PTHREADS */
+}
+
+void tpool_queue_destroy(struct tpool_queue *q) {
+	struct job *job;
+
+	if(!q) return;
+
+	/* the background threads must be done with it first */
+	tpool_queue_wait(q);
+
+	while(q->done_head) {
+		job = q->done_head;
+		q->done_head = job->next;
+		free(job);
+	}
+	free(q);
+}
@@ -0,0 +1,85 @@
+/*
+Copyright (C) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+/* worker thread pool for data-parallel loops
+ * author: John Tsiombikas 2007
+ *
+ * tpool_parallel_for() splits a loop into tasks which run on a set of
+ * persistent worker threads (and the calling thread), and returns when all
+ * of them are done. On systems without pthreads, when the thread count is
+ * set to 1, or when called from within another parallel loop, the tasks
+ * simply run serially on the calling thread, in order.
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif	/* __cplusplus */
+
+/* returns the number of threads used by tpool_parallel_for, which defaults
+ * to the number of processors, or the value of the ENGFX_THREADS env. var.
+ */
+int tpool_get_thread_count(void);
+
+/* sets the number of threads, 1 disables multithreading */
+void tpool_set_thread_count(int count);
+
+/* calls func(i, cls) for every i in [0, task_count) and waits for them to
+ * complete. Tasks may run concurrently in any order.
+ */
+void tpool_parallel_for(int task_count, void (*func)(int, void*), void *cls);
+
+/* background job queues: jobs submitted to a queue run on a set of
+ * background threads (separate from the parallel_for workers) while the
+ * caller goes on, and are then collected with tpool_queue_done. Without
+ * pthreads the jobs run on the spot, inside tpool_queue_submit.
+ */
+struct tpool_queue;
+
+struct tpool_queue *tpool_queue_create(void);
+
+/* returns -1 if the job can't be queued (out of memory), in which case it
+ * doesn't run at all.
+ */
+int tpool_queue_submit(struct tpool_queue *q, void (*func)(void*), void *cls);
+
+/* returns the cls of a finished job of q, or 0 if none is finished yet
+ * (so the cls of a job must not be 0).
+ */
+void *tpool_queue_done(struct tpool_queue *q);
+
+/* number of jobs of q that are submitted but not collected yet, and how
+ * many of them are finished.
+ */
+int tpool_queue_pending(struct tpool_queue *q);
+int tpool_queue_finished(struct tpool_queue *q);
+
+/* blocks until all the jobs submitted to q so far are finished */
+void tpool_queue_wait(struct tpool_queue *q);
+
+/* waits for the jobs of q to finish, and frees it. The cls of the jobs
+ * which aren't collected yet are not freed, collect them first if needed.
+ */
+void tpool_queue_destroy(struct tpool_queue *q);
+
+#ifdef __cplusplus
+}
+#endif	/* __cplusplus */
+
+#endif	/* _THREADPOOL_H_ */
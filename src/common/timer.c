@@ -102,3 +102,20 @@ unsigned long timer_getmsec(ntimer *timer) {
 unsigned long timer_getsec(ntimer *timer) {
 	return timer_getmsec(timer) / 1000;
 }
+
+unsigned long timer_usec(void) {
+#if defined(__unix__) || defined(unix)
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if(!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&count);
+	return (unsigned long)(count.QuadPart * 1000000 / freq.QuadPart);
+#endif	/* __unix__ */
+}
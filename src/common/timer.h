@@ -43,6 +43,11 @@ void timer_back(ntimer *timer, unsigned long msec);
 unsigned long timer_getmsec(ntimer *timer);
 unsigned long timer_getsec(ntimer *timer); 
 
+/* free running microsecond counter for timing short intervals, the
+ * difference of two readings is correct even if it wraps around.
+ */
+unsigned long timer_usec(void);
+
 #ifdef __cplusplus
 }
 #endif	/* __cplusplus */
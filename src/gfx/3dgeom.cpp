@@ -32,7 +32,10 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <cfloat>
 #include <algorithm>
 #include "3dgeom.hpp"
+#include "n3dmath2/n3dmath2_batch.hpp"
 #include "common/psort.hpp"
+#include "common/aligned_mem.h"
+#include "common/threadpool.h"
 
 #ifdef USING_3DENGFX
 #include "3dengfx/3denginefx.hpp"
@@ -91,23 +94,33 @@ Triangle::Triangle(Index v1, Index v2, Index v3) {
 }
 
 void Triangle::calculate_normal(const Vertex *vbuffer, bool normalize) {
-	Vector3 v1 = vbuffer[vertices[1]].pos - vbuffer[vertices[0]].pos;
-	Vector3 v2 = vbuffer[vertices[2]].pos - vbuffer[vertices[0]].pos;
+	calculate_normal(StridedPtr<Vector3>((Vector3*)&vbuffer->pos, sizeof(Vertex)), normalize);
+}
+
+void Triangle::calculate_normal(const StridedPtr<Vector3> &pos, bool normalize) {
+	Vector3 v1 = pos[vertices[1]] - pos[vertices[0]];
+	Vector3 v2 = pos[vertices[2]] - pos[vertices[0]];
 	normal = cross_product(v1, v2);
 	if(normalize) normal.normalize();
 }
 
-void Triangle::calculate_tangent(const Vertex *vbuffer, bool normalize){
+void Triangle::calculate_tangent(const Vertex *vbuffer, bool normalize) {
+	StridedPtr<Vector3> pos((Vector3*)&vbuffer->pos, sizeof(Vertex));
+	StridedPtr<TexCoord> tex((TexCoord*)vbuffer->tex, sizeof(Vertex));
+	calculate_tangent(pos, tex, normalize);
+}
+
+void Triangle::calculate_tangent(const StridedPtr<Vector3> &pos, const StridedPtr<TexCoord> &tex, bool normalize) {
 	Vector3 a, b, c, d;
 	scalar_t au, bu, cu, du;
 	
-	a = vbuffer[vertices[0]].pos;
-	b = vbuffer[vertices[1]].pos;
-	c = vbuffer[vertices[2]].pos;
+	a = pos[vertices[0]];
+	b = pos[vertices[1]];
+	c = pos[vertices[2]];
 
-	au = vbuffer[vertices[0]].tex[0].u;
-	bu = vbuffer[vertices[1]].tex[0].u;
-	cu = vbuffer[vertices[2]].tex[0].u;
+	au = tex[vertices[0]].u;
+	bu = tex[vertices[1]].u;
+	cu = tex[vertices[2]].u;
 
 	int i=0;
 
@@ -160,6 +173,159 @@ void Quad::calculate_normal(const Vertex *vbuffer, bool normalize) {
 	if(normalize) normal.normalize();
 }
 
+///////////////////////////////////////////
+//     VertexStreams implementation      //
+///////////////////////////////////////////
+
+VertexStreams::VertexStreams() {
+	pos = normal = tangent = 0;
+	color = 0;
+	tex[0] = tex[1] = 0;
+	count = 0;
+}
+
+VertexStreams::VertexStreams(const Vertex *vdata, unsigned long count) {
+	pos = normal = tangent = 0;
+	color = 0;
+	tex[0] = tex[1] = 0;
+	this->count = 0;
+
+	set_data(vdata, count);
+}
+
+VertexStreams::VertexStreams(const VertexStreams &vs) {
+	pos = normal = tangent = 0;
+	color = 0;
+	tex[0] = tex[1] = 0;
+	count = 0;
+
+	*this = vs;
+}
+
+VertexStreams::~VertexStreams() {
+	destroy();
+}
+
+VertexStreams &VertexStreams::operator =(const VertexStreams &vs) {
+	if(&vs == this) return *this;
+
+	alloc(vs.count);
+	if(count) {
+		memcpy(pos, vs.pos, count * sizeof *pos);
+		memcpy(normal, vs.normal, count * sizeof *normal);
+		memcpy(tangent, vs.tangent, count * sizeof *tangent);
+		memcpy(color, vs.color, count * sizeof *color);
+		memcpy(tex[0], vs.tex[0], count * sizeof *tex[0]);
+		memcpy(tex[1], vs.tex[1], count * sizeof *tex[1]);
+	}
+	return *this;
+}
+
+void VertexStreams::alloc(unsigned long count) {
+	if(count == this->count) return;
+
+	destroy();
+	if(!count) return;
+
+	pos = (Vector3*)malloc_aligned(count * sizeof *pos, SIMD_ALIGN);
+	normal = (Vector3*)malloc_aligned(count * sizeof *normal, SIMD_ALIGN);
+	tangent = (Vector3*)malloc_aligned(count * sizeof *tangent, SIMD_ALIGN);
+	color = (Color*)malloc_aligned(count * sizeof *color, SIMD_ALIGN);
+	tex[0] = (TexCoord*)malloc_aligned(count * sizeof *tex[0], SIMD_ALIGN);
+	tex[1] = (TexCoord*)malloc_aligned(count * sizeof *tex[1], SIMD_ALIGN);
+
+	if(!pos || !normal || !tangent || !color || !tex[0] || !tex[1]) {
+		std::cerr << "VertexStreams: failed to allocate " << count << " vertices\n";
+		destroy();
+		return;
+	}
+	this->count = count;
+}
+
+void VertexStreams::destroy() {
+	free_aligned(pos);
+	free_aligned(normal);
+	free_aligned(tangent);
+	free_aligned(color);
+	free_aligned(tex[0]);
+	free_aligned(tex[1]);
+
+	pos = normal = tangent = 0;
+	color = 0;
+	tex[0] = tex[1] = 0;
+	count = 0;
+}
+
+void VertexStreams::set_count(unsigned long count) {
+	unsigned long prev_count = this->count;
+	if(count == prev_count) return;
+
+	VertexStreams tmp;
+	if(prev_count && count) {
+		tmp = *this;
+	}
+
+	alloc(count);
+
+	// keep whatever fits from the old data and default-initialize the rest
+	unsigned long keep = tmp.count < this->count ? tmp.count : this->count;
+	for(unsigned long i=0; i<keep; i++) {
+		set_vertex(i, tmp.get_vertex(i));
+	}
+
+	Vertex def;
+	for(unsigned long i=keep; i<this->count; i++) {
+		set_vertex(i, def);
+	}
+}
+
+void VertexStreams::set_data(const Vertex *vdata, unsigned long count) {
+	if(!vdata) return;
+
+	alloc(count);
+	for(unsigned long i=0; i<this->count; i++) {
+		pos[i] = vdata->pos;
+		normal[i] = vdata->normal;
+		tangent[i] = vdata->tangent;
+		color[i] = vdata->color;
+		tex[0][i] = vdata->tex[0];
+		tex[1][i] = vdata->tex[1];
+		vdata++;
+	}
+}
+
+void VertexStreams::get_data(Vertex *vdata) const {
+	for(unsigned long i=0; i<count; i++) {
+		vdata->pos = pos[i];
+		vdata->normal = normal[i];
+		vdata->tangent = tangent[i];
+		vdata->color = color[i];
+		vdata->tex[0] = tex[0][i];
+		vdata->tex[1] = tex[1][i];
+		vdata++;
+	}
+}
+
+Vertex VertexStreams::get_vertex(unsigned long idx) const {
+	Vertex v;
+	v.pos = pos[idx];
+	v.normal = normal[idx];
+	v.tangent = tangent[idx];
+	v.color = color[idx];
+	v.tex[0] = tex[0][idx];
+	v.tex[1] = tex[1][idx];
+	return v;
+}
+
+void VertexStreams::set_vertex(unsigned long idx, const Vertex &v) {
+	pos[idx] = v.pos;
+	normal[idx] = v.normal;
+	tangent[idx] = v.tangent;
+	color[idx] = v.color;
+	tex[0][idx] = v.tex[0];
+	tex[1][idx] = v.tex[1];
+}
+
 ///////////////////////////////////////////
 // Index specialization of GeometryArray //
 ///////////////////////////////////////////
@@ -284,103 +450,304 @@ void GeometryArray<Index>::set_data(const Index *data, unsigned long count) {
 
 ///////////// Triangle Mesh Implementation /////////////
 TriMesh::TriMesh() {
+	vlayout = VLAYOUT_AOS;
+	varray_valid = vstreams_valid = true;
 	indices_valid = false;
 	vertex_stats_valid = false;
 	edges_valid = false;
 	index_graph_valid = false;
 	triangle_normals_valid = false;
 	triangle_normals_normalized = false;
+	face_planes_valid = false;
+	revision = 0;
 }
 
 TriMesh::TriMesh(const Vertex *vdata, unsigned long vcount, const Triangle *tdata, unsigned long tcount) {
+	vlayout = VLAYOUT_AOS;
+	varray_valid = vstreams_valid = true;
 	indices_valid = false;
 	vertex_stats_valid = false;
 	edges_valid = false;
 	index_graph_valid = false;
 	triangle_normals_valid = false;
 	triangle_normals_normalized = false;
+	face_planes_valid = false;
+	revision = 0;
 	set_data(vdata, vcount, tdata, tcount);
 }
 
+/* edge building - (JT)
+ * Every side of every triangle becomes a record keyed by its (lower, higher)
+ * vertex pair, taken through the index graph so that seams are welded. The
+ * records are distributed into buckets by the lower vertex, counting and
+ * scattering ranges of triangles in parallel, and then each bucket is sorted
+ * by key and by the order the sides appear in the triangle array. Each run
+ * of equal keys is an edge: it keeps the winding of the first triangle using
+ * it (for get_contour_edges), and the second face is the last triangle
+ * sharing it. The edges come out ordered by their vertex pairs.
+ */
+#define EDGE_TRIS_PER_TASK		16384
+#define EDGE_RECS_PER_BUCKET	4096
+#define EDGE_MAX_BUCKETS		1024
+
+struct EdgeRec {
+	Index lo, hi;
+	Index side;		// triangle * 3 + side, the order of appearance
+};
+
+struct EdgeJob {
+	const Triangle *tris;
+	const Index *igraph;
+	unsigned long tcount;
+	int tri_tasks;
+
+	int buckets;
+	int shift;			// bucket of a record: lo >> shift
+	unsigned long *offs;	// tri_tasks x buckets: counts, then scatter positions
+	unsigned long *bucket_start;	// buckets + 1
+	unsigned long *edge_start;		// buckets + 1: counts, then output positions
+
+	EdgeRec *recs;
+	Edge *edges;
+};
+
+static void count_edges_task(int idx, void *cls) {
+	EdgeJob *job = (EdgeJob*)cls;
+	unsigned long *count = job->offs + idx * job->buckets;
+
+	unsigned long t0 = job->tcount * idx / job->tri_tasks;
+	unsigned long t1 = job->tcount * (idx + 1) / job->tri_tasks;
+
+	for(unsigned long i=t0; i<t1; i++) {
+		const Index *v = job->tris[i].vertices;
+		Index a = job->igraph[v[0]];
+		Index b = job->igraph[v[1]];
+		Index c = job->igraph[v[2]];
+
+		count[std::min(a, b) >> job->shift]++;
+		count[std::min(b, c) >> job->shift]++;
+		count[std::min(c, a) >> job->shift]++;
+	}
+}
+
+static void scatter_edges_task(int idx, void *cls) {
+	EdgeJob *job = (EdgeJob*)cls;
+	unsigned long *pos = job->offs + idx * job->buckets;
+
+	unsigned long t0 = job->tcount * idx / job->tri_tasks;
+	unsigned long t1 = job->tcount * (idx + 1) / job->tri_tasks;
+
+	for(unsigned long i=t0; i<t1; i++) {
+		for(int j=0; j<3; j++) {
+			Index a = job->igraph[job->tris[i].vertices[j]];
+			Index b = job->igraph[job->tris[i].vertices[(j + 1) % 3]];
+
+			EdgeRec rec;
+			rec.lo = std::min(a, b);
+			rec.hi = std::max(a, b);
+			rec.side = (Index)(i * 3 + j);
+			job->recs[pos[rec.lo >> job->shift]++] = rec;
+		}
+	}
+}
+
+static bool edge_rec_hi_less(const EdgeRec &a, const EdgeRec &b) {
+	return a.hi < b.hi;
+}
+
+static void sort_edges_task(int idx, void *cls) {
+	EdgeJob *job = (EdgeJob*)cls;
+	EdgeRec *rec = job->recs + job->bucket_start[idx];
+	unsigned long count = job->bucket_start[idx + 1] - job->bucket_start[idx];
+	if(!count) {
+		job->edge_start[idx] = 0;
+		return;
+	}
+
+	// the scatter leaves the records of a bucket in order of appearance, so
+	// a counting sort by the lower vertex and then a stable sort of the
+	// records of each vertex by the higher one are enough.
+	Index first = (Index)idx << job->shift;
+	unsigned long range = 1UL << job->shift;
+
+	vector<unsigned long> offs(range + 1, 0);
+	vector<EdgeRec> tmp(rec, rec + count);
+	for(unsigned long i=0; i<count; i++) {
+		offs[tmp[i].lo - first + 1]++;
+	}
+	for(unsigned long i=0; i<range; i++) {
+		offs[i + 1] += offs[i];
+	}
+	for(unsigned long i=0; i<count; i++) {
+		rec[offs[tmp[i].lo - first]++] = tmp[i];
+	}
+
+	unsigned long edges = 0, start = 0;
+	for(unsigned long i=0; i<range; i++) {
+		unsigned long end = offs[i];	// now the end of vertex i's records
+
+		if(end - start > 16) {
+			std::stable_sort(rec + start, rec + end, edge_rec_hi_less);
+		} else for(unsigned long j=start + 1; j<end; j++) {
+			EdgeRec r = rec[j];
+			unsigned long k = j;
+			while(k > start && rec[k - 1].hi > r.hi) {
+				rec[k] = rec[k - 1];
+				k--;
+			}
+			rec[k] = r;
+		}
+
+		for(unsigned long j=start; j<end; j++) {
+			if(j == start || rec[j].hi != rec[j - 1].hi) edges++;
+		}
+		start = end;
+	}
+	job->edge_start[idx] = edges;
+}
+
+static void emit_edges_task(int idx, void *cls) {
+	EdgeJob *job = (EdgeJob*)cls;
+	const EdgeRec *rec = job->recs + job->bucket_start[idx];
+	const EdgeRec *end = job->recs + job->bucket_start[idx + 1];
+	Edge *edge = job->edges + job->edge_start[idx];
+
+	while(rec < end) {
+		const EdgeRec *last = rec;
+		while(last + 1 < end && last[1].lo == rec->lo && last[1].hi == rec->hi) {
+			last++;
+		}
+
+		Index face = rec->side / 3;
+		int j = rec->side % 3;
+		edge->vertices[0] = job->igraph[job->tris[face].vertices[j]];
+		edge->vertices[1] = job->igraph[job->tris[face].vertices[(j + 1) % 3]];
+		edge->adjfaces[0] = face;
+		edge->adjfaces[1] = last == rec ? NO_ADJFACE : last->side / 3;
+		edge++;
+
+		rec = last + 1;
+	}
+}
+
 void TriMesh::calculate_edges() {
 
 	if (!index_graph_valid)
 		calculate_index_graph();
 
-	unsigned int vcount = varray.get_count();
-	vector<Edge> *edge_table = new vector<Edge>[vcount];
-	const Triangle *tris = tarray.get_data();
-	const Index *igraph = index_graph.get_data();
-	unsigned int tcount = tarray.get_count();
-	unsigned int num_edges = 0;
+	unsigned long vcount = get_vertex_count();
+	unsigned long tcount = tarray.get_count();
 
-	// Triangle loop
-	for (unsigned int i=0; i<tcount; i++)
-	{
-		unsigned int a, b, temp;
-		for (unsigned int j=0; j<3; j++)
-		{
-			a = igraph[tris[i].vertices[j]];
-			b = igraph[tris[i].vertices[(j + 1) % 3]];
+	EdgeJob job;
+	job.tris = tarray.get_data();
+	job.igraph = index_graph.get_data();
+	job.tcount = tcount;
+	job.tri_tasks = (int)((tcount + EDGE_TRIS_PER_TASK - 1) / EDGE_TRIS_PER_TASK);
 
-			if (a > b)
-			{
-				temp = b;
-				b = a;
-				a = temp;
-			}
+	// enough buckets to keep each one's records in cache when sorting,
+	// the bucket of a vertex being the high bits of its index
+	unsigned long max_index = vcount ? vcount - 1 : 0;
+	int vbits = 0;
+	while (max_index >> vbits) vbits++;
 
-			int edge_found = -1;
-			for (unsigned int edge = 0; edge < edge_table[a].size(); edge++)
-			{
-				if (edge_table[a][edge].vertices[1] == b)
-				{
-					edge_found = edge;
-					break;
-				}
-			}
+	job.buckets = 1;
+	while (job.buckets < EDGE_MAX_BUCKETS && (unsigned long)job.buckets * EDGE_RECS_PER_BUCKET < tcount * 3)
+	{
+		job.buckets <<= 1;
+	}
+	job.shift = 0;
+	while (vbits - job.shift > 0 && (1UL << (vbits - job.shift)) > (unsigned long)job.buckets)
+	{
+		job.shift++;
+	}
+	job.buckets = 1 << (vbits - job.shift);
 
-			if (edge_found != -1)
-			{
-				// edge was already in the list
-				// add the second face to this edge
-				edge_table[a][edge_found].adjfaces[1] = i;
-			}
-			else
-			{
-				// add a new edge to the list
-				Edge new_edge(a, b, i);
-				edge_table[a].push_back(new_edge);
-				num_edges++;
-			}
-		}
-	} // End triangle loop
+	vector<unsigned long> offs(job.tri_tasks * job.buckets, 0);
+	vector<unsigned long> bucket_start(job.buckets + 1);
+	vector<unsigned long> edge_start(job.buckets + 1);
+	job.offs = job.tri_tasks ? &offs[0] : 0;	// no tasks for an empty mesh
+	job.bucket_start = &bucket_start[0];
+	job.edge_start = &edge_start[0];
 
-	// collect edges
-	Edge *edges = new Edge[num_edges];
-	int k = 0;
-	for (unsigned int i=0; i<vcount; i++)
+	tpool_parallel_for(job.tri_tasks, count_edges_task, &job);
+
+	// turn the per task counts into scatter positions, in task order
+	unsigned long pos = 0;
+	for (int i=0; i<job.buckets; i++)
 	{
-		for (unsigned int j=0; j<edge_table[i].size(); j++)
+		bucket_start[i] = pos;
+		for (int j=0; j<job.tri_tasks; j++)
 		{
-			edges[k] = edge_table[i][j];
-			k++;
+			unsigned long count = offs[j * job.buckets + i];
+			offs[j * job.buckets + i] = pos;
+			pos += count;
 		}
 	}
+	bucket_start[job.buckets] = pos;
+
+	job.recs = new EdgeRec[tcount * 3];
+	tpool_parallel_for(job.tri_tasks, scatter_edges_task, &job);
+	tpool_parallel_for(job.buckets, sort_edges_task, &job);
+
+	unsigned long num_edges = 0;
+	for (int i=0; i<job.buckets; i++)
+	{
+		unsigned long count = edge_start[i];
+		edge_start[i] = num_edges;
+		num_edges += count;
+	}
+	edge_start[job.buckets] = num_edges;
 
-	earray.set_data(edges, num_edges);
+	job.edges = new Edge[num_edges];
+	tpool_parallel_for(job.buckets, emit_edges_task, &job);
+
+	earray.set_data(job.edges, num_edges);
 	edges_valid = true;
 
 	// cleanup
-	delete [] edge_table;
-	delete [] edges;
+	delete [] job.recs;
+	delete [] job.edges;
+}
+
+/* calculate_face_planes - (JT)
+ * the planes of the triangles, for classifying them against a point of view
+ * or direction in one batch, stored as 4 arrays: the normal components
+ * and the dot product of the normal with the first vertex.
+ */
+void TriMesh::calculate_face_planes() {
+	if(!triangle_normals_valid) {
+		calculate_triangle_normals(false);
+	}
+
+	StridedPtr<Vector3> pos = get_stream_ptrs().pos;
+	const Triangle *tptr = tarray.get_data();
+	unsigned long tcount = tarray.get_count();
+
+	face_planes.resize(tcount * 4);
+	scalar_t *nx = tcount ? &face_planes[0] : 0;
+	scalar_t *ny = nx + tcount;
+	scalar_t *nz = ny + tcount;
+	scalar_t *d = nz + tcount;
+
+	for(unsigned long i=0; i<tcount; i++) {
+		const Vector3 &n = tptr[i].normal;
+		nx[i] = n.x;
+		ny[i] = n.y;
+		nz[i] = n.z;
+		d[i] = dot_product(n, pos[tptr[i].vertices[0]]);
+	}
+	face_planes_valid = true;
 }
 
 void TriMesh::calculate_triangle_normals(bool normalize)
 {
+	StridedPtr<Vector3> pos = get_stream_ptrs().pos;
+	Triangle *tptr = tarray.get_mod_data();
+	unsigned long tcount = tarray.get_count();
+
 	// calculate the triangle normals
-	for(unsigned int i=0; i<tarray.get_count(); i++) {
-		tarray.get_mod_data()[i].calculate_normal(varray.get_data(), normalize);
+	for(unsigned long i=0; i<tcount; i++) {
+		(tptr++)->calculate_normal(pos, normalize);
 	}
 
 	triangle_normals_valid = true;
@@ -402,15 +769,130 @@ const GeometryArray<Edge> *TriMesh::get_edge_array() const {
 	return &earray;
 }
 
+const IndexArray *TriMesh::get_index_graph() const {
+	if(!index_graph_valid) {
+		const_cast<TriMesh*>(this)->calculate_index_graph();
+	}
+	return &index_graph;
+}
+
+/* sync_vertex_array / sync_vertex_streams - (JT)
+ * with VLAYOUT_SOA the mesh keeps both an interleaved VertexArray (needed for
+ * drawing and for the Vertex-based API) and the VertexStreams which are used
+ * by the geometry processing functions. Whichever was modified last is the
+ * authoritative copy, and these bring the other one up to date.
+ */
+void TriMesh::sync_vertex_array() const {
+	TriMesh *self = const_cast<TriMesh*>(this);
+
+	if(vlayout == VLAYOUT_SOA && vstreams_valid) {
+		unsigned long count = vstreams.get_count();
+		if(count == varray.get_count()) {
+			vstreams.get_data(self->varray.get_mod_data());
+		} else {
+			Vertex *tmp = new Vertex[count];
+			vstreams.get_data(tmp);
+			self->varray.set_data(tmp, count);
+			delete [] tmp;
+		}
+	}
+	varray_valid = true;
+}
+
+void TriMesh::sync_vertex_streams() const {
+	if(vlayout == VLAYOUT_SOA && varray_valid) {
+		const_cast<TriMesh*>(this)->vstreams.set_data(varray.get_data(), varray.get_count());
+	}
+	vstreams_valid = true;
+}
+
+/* get_stream_ptrs / get_mod_stream_ptrs - (JT)
+ * return strided pointers to the vertex attributes in whatever layout is
+ * currently in use. All the geometry processing functions below access the
+ * vertices through these. The mod version marks the streams as modified.
+ */
+VertexStreamPtrs TriMesh::get_stream_ptrs() const {
+	VertexStreamPtrs ptrs;
+
+	if(vlayout == VLAYOUT_SOA) {
+		if(!vstreams_valid) sync_vertex_streams();
+
+		VertexStreams *vs = const_cast<VertexStreams*>(&vstreams);
+		ptrs.pos = StridedPtr<Vector3>(vs->get_mod_positions());
+		ptrs.normal = StridedPtr<Vector3>(vs->get_mod_normals());
+		ptrs.tangent = StridedPtr<Vector3>(vs->get_mod_tangents());
+		ptrs.color = StridedPtr<Color>(vs->get_mod_colors());
+		ptrs.tex[0] = StridedPtr<TexCoord>(vs->get_mod_texcoords(0));
+		ptrs.tex[1] = StridedPtr<TexCoord>(vs->get_mod_texcoords(1));
+	} else {
+		Vertex *vptr = const_cast<Vertex*>(varray.get_data());
+		if(vptr) {
+			ptrs.pos = StridedPtr<Vector3>(&vptr->pos, sizeof(Vertex));
+			ptrs.normal = StridedPtr<Vector3>(&vptr->normal, sizeof(Vertex));
+			ptrs.tangent = StridedPtr<Vector3>(&vptr->tangent, sizeof(Vertex));
+			ptrs.color = StridedPtr<Color>(&vptr->color, sizeof(Vertex));
+			ptrs.tex[0] = StridedPtr<TexCoord>(vptr->tex, sizeof(Vertex));
+			ptrs.tex[1] = StridedPtr<TexCoord>(vptr->tex + 1, sizeof(Vertex));
+		}
+	}
+	return ptrs;
+}
+
+VertexStreamPtrs TriMesh::get_mod_stream_ptrs() {
+	revision++;
+	if(vlayout == VLAYOUT_SOA) {
+		if(!vstreams_valid) sync_vertex_streams();
+		varray_valid = false;
+	} else {
+		varray.get_mod_data();	// marks the VBO as out of sync
+	}
+	return get_stream_ptrs();
+}
+
+void TriMesh::set_vertex_layout(VertexLayout layout) {
+	if(layout == vlayout) return;
+
+	if(layout == VLAYOUT_SOA) {
+		vstreams.set_data(varray.get_data(), varray.get_count());
+	} else {
+		if(!varray_valid) sync_vertex_array();
+		vstreams.set_count(0);
+	}
+	varray_valid = vstreams_valid = true;
+	vlayout = layout;
+}
+
 void TriMesh::set_data(const Vertex *vdata, unsigned long vcount, const Triangle *tdata, unsigned long tcount) {
+	varray_valid = true;	// the vertex array is about to be overwritten anyway
 	get_mod_vertex_array()->set_data(vdata, vcount);	// also invalidates vertex stats
 	get_mod_triangle_array()->set_data(tdata, tcount);	// also invalidates indices and edges
 }
 
+void TriMesh::set_data(const Vertex *vdata, unsigned long vcount, const Triangle *tdata, unsigned long tcount,
+		const Index *igraph, const Index *idata, const Edge *edata, unsigned long ecount) {
+	set_data(vdata, vcount, tdata, tcount);
+
+	// any of the derived arrays that's missing is calculated when needed
+	if(igraph) {
+		index_graph.set_data(igraph, vcount);
+		index_graph_valid = true;
+	}
+	if(idata) {
+		iarray.set_data(idata, tcount * 3);
+		indices_valid = true;
+	}
+	if(edata) {
+		earray.set_data(edata, ecount);
+		edges_valid = true;
+	}
+	triangle_normals_valid = true;
+	triangle_normals_normalized = false;
+}
+
 void TriMesh::calculate_normals_by_index() {
 	// precalculate which triangles index each vertex
 	std::vector<unsigned int> *tri_indices;
-	tri_indices = new std::vector<unsigned int>[varray.get_count()];
+	tri_indices = new std::vector<unsigned int>[get_vertex_count()];
 
 	for(unsigned int i=0; i<tarray.get_count(); i++) {
 		for(int j=0; j<3; j++) {	
@@ -422,8 +904,10 @@ void TriMesh::calculate_normals_by_index() {
 	if (!triangle_normals_valid)
 		calculate_triangle_normals(false);
 	
+	StridedPtr<Vector3> vnormal = get_mod_stream_ptrs().normal;
+
 	// now calculate the vertex normals
-	for(unsigned int i=0; i<varray.get_count(); i++) {
+	for(unsigned int i=0; i<get_vertex_count(); i++) {
 		Vector3 normal;
 		for(unsigned int j=0; j<(unsigned int)tri_indices[i].size(); j++) {
 			normal += tarray.get_data()[tri_indices[i][j]].normal;
@@ -433,7 +917,7 @@ void TriMesh::calculate_normals_by_index() {
 		if(tri_indices[i].size()) {
 			normal.normalize();
 		}
-		varray.get_mod_data()[i].normal = normal;
+		vnormal[i] = normal;
 	}
 	
 	delete [] tri_indices;
@@ -452,7 +936,7 @@ void TriMesh::calculate_normals()
 
 	// precalculate which triangles index each vertex
 	std::vector<unsigned int> *tri_indices;
-	tri_indices = new std::vector<unsigned int>[varray.get_count()];
+	tri_indices = new std::vector<unsigned int>[get_vertex_count()];
 
 	for(unsigned int i=0; i<tarray.get_count(); i++) {
 		for(int j=0; j<3; j++) {	
@@ -461,13 +945,15 @@ void TriMesh::calculate_normals()
 		}
 	}
 	
+	StridedPtr<Vector3> vnormal = get_mod_stream_ptrs().normal;
+
 	// now calculate the vertex normals
-	for(unsigned int i=0; i<varray.get_count(); i++) {
+	for(unsigned int i=0; i<get_vertex_count(); i++) {
 		
 		if (index_graph.get_data()[i] != i)
 		{
 			// normal already calculated. Just copy
-			varray.get_mod_data()[i].normal = varray.get_mod_data()[index_graph.get_data()[i]].normal;
+			vnormal[i] = vnormal[index_graph.get_data()[i]];
 			continue;
 		}
 			
@@ -479,17 +965,16 @@ void TriMesh::calculate_normals()
 		// avoid division with zero
 		if (tri_indices[i].size())
 			normal.normalize();
-		varray.get_mod_data()[i].normal = normal;
+		vnormal[i] = normal;
 	}
 	
 	delete [] tri_indices;
 }
 
 void TriMesh::normalize_normals() {
-	Vertex *vptr = varray.get_mod_data();
-	for(unsigned int i=0; i<varray.get_count(); i++) {
-		vptr[i].normal.normalize();
-	}
+	StridedPtr<Vector3> normal = get_mod_stream_ptrs().normal;
+	Vector3 *nptr = normal.get_ptr();
+	normalize_vectors(nptr, nptr, get_vertex_count(), normal.get_stride(), normal.get_stride());
 }
 
 /* TriMesh::invert_winding() - (JT)
@@ -507,12 +992,11 @@ void TriMesh::invert_winding() {
 		tptr++;
 	}
 
-	Vertex *vptr = varray.get_mod_data();
-	int vcount = varray.get_count();
+	StridedPtr<Vector3> normal = get_mod_stream_ptrs().normal;
+	int vcount = get_vertex_count();
 
 	for(int i=0; i<vcount; i++) {
-		vptr->normal = -vptr->normal;
-		vptr++;
+		normal[i] = -normal[i];
 	}
 }
 
@@ -520,7 +1004,7 @@ void TriMesh::invert_winding() {
 void TriMesh::calculate_tangents() {
 	// precalculate which triangles index each vertex
 	std::vector<unsigned int> *tri_indices;
-	tri_indices = new std::vector<unsigned int>[varray.get_count()];
+	tri_indices = new std::vector<unsigned int>[get_vertex_count()];
 
 	for(unsigned int i=0; i<tarray.get_count(); i++) {
 		for(int j=0; j<3; j++) {	
@@ -528,13 +1012,15 @@ void TriMesh::calculate_tangents() {
 		}
 	}
 
+	VertexStreamPtrs vs = get_mod_stream_ptrs();
+
 	// calculate the triangle tangents
 	for(unsigned int i=0; i<tarray.get_count(); i++) {
-		tarray.get_mod_data()[i].calculate_tangent(varray.get_data(), false);
+		tarray.get_mod_data()[i].calculate_tangent(vs.pos, vs.tex[0], false);
 	}
 	
 	// now calculate the vertex tangents
-	for(unsigned int i=0; i<varray.get_count(); i++) {
+	for(unsigned int i=0; i<get_vertex_count(); i++) {
 		Vector3 tangent;
 		for(unsigned int j=0; j<(unsigned int)tri_indices[i].size(); j++) {
 			tangent += tarray.get_data()[tri_indices[i][j]].tangent;
@@ -544,20 +1030,20 @@ void TriMesh::calculate_tangents() {
 		if(tri_indices[i].size()) {
 			tangent.normalize();
 		}
-		varray.get_mod_data()[i].tangent = tangent;
+		vs.tangent[i] = tangent;
 	}
 	
 	delete [] tri_indices;
 }
 
 void TriMesh::apply_xform(const Matrix4x4 &xform) {
-	Vertex *vptr = varray.get_mod_data();
-	unsigned long count = varray.get_count();
+	VertexStreamPtrs vs = get_mod_stream_ptrs();
+	unsigned long count = get_vertex_count();
 
-	for(unsigned long i=0; i<count; i++) {
-		vptr->pos.transform(xform);
-		(vptr++)->normal.transform((Matrix3x3)xform);
-	}
+	Vector3 *pos = vs.pos.get_ptr();
+	Vector3 *normal = vs.normal.get_ptr();
+	transform_points(pos, pos, count, xform, vs.pos.get_stride(), vs.pos.get_stride());
+	transform_vectors(normal, normal, count, Matrix3x3(xform), vs.normal.get_stride(), vs.normal.get_stride());
 }
 
 void TriMesh::operator +=(const TriMesh *m2) {
@@ -570,8 +1056,8 @@ void TriMesh::operator +=(const TriMesh *m2) {
  */
 void TriMesh::sort_triangles(Vector3 point, bool hilo)
 {
-	const Vertex *verts = get_vertex_array()->get_data();
-	unsigned int vcount = get_vertex_array()->get_count();
+	StridedPtr<Vector3> pos = get_stream_ptrs().pos;
+	unsigned int vcount = get_vertex_count();
 	Triangle *tris = get_mod_triangle_array()->get_mod_data();
 	unsigned int tcount = get_triangle_array()->get_count();
 
@@ -580,7 +1066,7 @@ void TriMesh::sort_triangles(Vector3 point, bool hilo)
 
 	for (unsigned int i=0; i<vcount; i++)
 	{
-		sq_distances[i] = (verts[i].pos - point).length_sq();
+		sq_distances[i] = (pos[i] - point).length_sq();
 	}
 
 	// store sum of sq distances for each triangle
@@ -608,13 +1094,12 @@ VertexStatistics TriMesh::get_vertex_stats() const {
 		vstats.xmin = vstats.ymin = vstats.zmin = FLT_MAX;
 		vstats.xmax = vstats.ymax = vstats.zmax = -FLT_MAX;
 		
-		const Vertex *varray = get_vertex_array()->get_data();
-		int count = get_vertex_array()->get_count();
+		StridedPtr<Vector3> vpos = get_stream_ptrs().pos;
+		int count = get_vertex_count();
 
-		const Vertex *vptr = varray;
 		vstats.centroid = Vector3(0, 0, 0);
 		for(int i=0; i<count; i++) {
-			Vector3 pos = (vptr++)->pos;
+			Vector3 pos = vpos[i];
 			vstats.centroid += pos;
 
 			if(pos.x < vstats.xmin) vstats.xmin = pos.x;
@@ -630,9 +1115,8 @@ VertexStatistics TriMesh::get_vertex_stats() const {
 		scalar_t max_len_sq = 0.0;
 		scalar_t avg_len_sq = 0.0;
 		
-		vptr = varray;
 		for(int i=0; i<count; i++) {
-			scalar_t len_sq = ((vptr++)->pos - vstats.centroid).length_sq();
+			scalar_t len_sq = (vpos[i] - vstats.centroid).length_sq();
 			if(len_sq < min_len_sq) min_len_sq = len_sq;
 			if(len_sq > max_len_sq) max_len_sq = len_sq;
 			avg_len_sq += len_sq;
@@ -646,95 +1130,85 @@ VertexStatistics TriMesh::get_vertex_stats() const {
 	return vstats;
 }
 
+/* prepare_contour_edges - (JT)
+ * calculates everything get_contour_edges needs, which it would otherwise
+ * do the first time it's called. Call it before running queries from more
+ * than one thread.
+ */
+void TriMesh::prepare_contour_edges() const {
+	get_edge_array();
+	if(!face_planes_valid) {
+		const_cast<TriMesh*>(this)->calculate_face_planes();
+	}
+}
+
 /* get_contour_edges - (MG, JT)
- * returns the contour edges relative to the given point of view or direction
+ * finds the contour edges relative to the given point of view or direction.
  * The edges are in clockwise order, so they can be used to create a shadow volume
  * mesh by extruding them...
+ * All triangles are classified in one pass over their planes, after which
+ * the contour edges are the ones with different bits for their two faces, in
+ * the edge array. Edges with a single face are taken to be next to a triangle
+ * facing the pov, so that open meshes get closed shadow volumes.
  * NOTE: pov_or_dir should be given in model space
  */
-std::vector<Edge> *TriMesh::get_contour_edges(const Vector3 &pov_or_dir, bool dir)
+void TriMesh::get_contour_edges(ContourEdges *contour, const Vector3 &pov_or_dir, bool dir) const
 {
-	static std::vector<Edge> cont_edges;
-	
-	// calculate triangle normals
-	if(!triangle_normals_valid) {
-		calculate_triangle_normals(false);
-	}
-	
-	const Vertex *va = get_vertex_array()->get_data();
-	unsigned long vc = get_vertex_array()->get_count();
-	const Triangle *ta = get_triangle_array()->get_data();
-	unsigned long tc = get_triangle_array()->get_count();
-	
-	vector<Edge> *vert_edge = new vector<Edge>[vc];
-	
-	Vector3 direction = pov_or_dir;
-	for(unsigned long i=0; i<tc; i++) {
-		if(!dir) {
-			direction = va[ta[i].vertices[0]].pos - pov_or_dir;
-		}
-		
-		if(dot_product(ta[i].normal, direction) > 0) {
-			for(int j=0; j<3; j++) {
-				int v0idx = j;
-				int v1idx = (j + 1) % 3;
-
-				Index v0 = ta[i].vertices[v0idx];
-				Index v1 = ta[i].vertices[v1idx];
-				
-				Edge edge(v1, v0);
-				std::vector<Edge>::iterator iter = vert_edge[v0].begin();
-				
-				bool found = false;
-				for(unsigned int k=0; k<vert_edge[v0].size(); k++, iter++) {
-					if(vert_edge[v0][k].vertices[1] == v1) {
-						vert_edge[v0].erase(iter);
-						found = true;
-						break;
-					}
-				}
+	prepare_contour_edges();
 
-				if(!found) {
-					iter = vert_edge[v1].begin();
-					for(unsigned int k=0; k<vert_edge[v1].size(); k++, iter++) {
-						if(vert_edge[v1][k].vertices[0] == v0) {
-							vert_edge[v1].erase(iter);
-							found = true;
-							break;
-						}
-					}
-				}
+	unsigned long tc = tarray.get_count();
+	unsigned long ec = earray.get_count();
+	const Edge *eptr = earray.get_data();
 
-				if(!found) vert_edge[v0].push_back(edge);
-				
-			}
-			
-		}
-	}
+	contour->edges.clear();
+	if(!tc) return;
 
-	cont_edges.clear();
-	for(unsigned int i=0; i<vc; i++) {
-		for(unsigned int j=0; j<vert_edge[i].size(); j++) {
-			cont_edges.push_back(vert_edge[i][j]);
-		}
+	// dot(n, p0 - pov) for points, dot(n, dir) for directions
+	Vector4 v = dir ? Vector4(pov_or_dir.x, pov_or_dir.y, pov_or_dir.z, 0) :
+		Vector4(-pov_or_dir.x, -pov_or_dir.y, -pov_or_dir.z, 1);
+
+	contour->facing.resize((tc + 31) / 32);
+	uint32_t *facing = &contour->facing[0];
+	const scalar_t *planes = &face_planes[0];
+	plane_side_mask(facing, planes, planes + tc, planes + 2 * tc, planes + 3 * tc, tc, v);
+
+	if(contour->edges.capacity() < ec) {
+		contour->edges.reserve(ec);
 	}
 
-	delete [] vert_edge;
+	for(unsigned long i=0; i<ec; i++) {
+		const Edge &e = eptr[i];
+		Index f0 = e.adjfaces[0], f1 = e.adjfaces[1];
+
+		bool away0 = (facing[f0 / 32] >> (f0 % 32)) & 1;
+		bool away1 = f1 != NO_ADJFACE && ((facing[f1 / 32] >> (f1 % 32)) & 1);
 
-	return &cont_edges;
+		if(away0 != away1) {
+			// the edge follows the winding of its first face, reverse the
+			// winding of the one facing away.
+			if(away0) {
+				contour->edges.push_back(Edge(e.vertices[1], e.vertices[0], f0, f1));
+			} else {
+				contour->edges.push_back(Edge(e.vertices[0], e.vertices[1], f0, f1));
+			}
+		}
+	}
 }
 
+const scalar_t shadow_extrusion = 100000;
+
 /* get_uncapped_shadow_volume() - (MG)
  * specify pov_or_dir in model space
  * delete the returned mesh after using it
  */
-const scalar_t infinity = 100000;
 TriMesh *TriMesh::get_shadow_volume(const Vector3 &pov_or_dir, bool dir)
 {
 	TriMesh *ret = new TriMesh;
 	
-	const Vertex *va = get_vertex_array()->get_data();
-	std::vector<Edge> *contour_edges = get_contour_edges(pov_or_dir, dir);
+	StridedPtr<Vector3> pos = get_stream_ptrs().pos;
+	ContourEdges contour;
+	get_contour_edges(&contour, pov_or_dir, dir);
+	const std::vector<Edge> *contour_edges = &contour.edges;
 
 	// calculate number of vertices and indices for the mesh
 	unsigned long num_quads = contour_edges->size();
@@ -750,14 +1224,14 @@ TriMesh *TriMesh::get_shadow_volume(const Vector3 &pov_or_dir, bool dir)
 	{
 		for (unsigned long j=0; j<2; j++)
 		{
-			verts[2 * i + j].pos = va[(*contour_edges)[i].vertices[j]].pos;
+			verts[2 * i + j].pos = pos[(*contour_edges)[i].vertices[j]];
 		}
 	}
 
 	// add extruded vertices
 	for (unsigned long i=0; i<num_verts/2; i++)
 	{
-		verts[i + num_verts/2].pos = extrude(verts[i].pos, infinity, pov_or_dir, dir);
+		verts[i + num_verts/2].pos = extrude(verts[i].pos, shadow_extrusion, pov_or_dir, dir);
 	}
 
 	// make triangles
@@ -795,73 +1269,384 @@ TriMesh *TriMesh::get_shadow_volume(const Vector3 &pov_or_dir, bool dir)
 	return capped;
 }*/
 
-/* class VertexOrder - (MG)
- * used by this module only
+/* vertex welding - (JT)
+ * Vertices closer than xsmall_number to each other on every axis are the
+ * same point, and the index graph maps each of them to the lowest index among
+ * them. The positions are quantized to a grid of cells a small multiple of
+ * the welding distance, and are counting sorted by a hash of their cell into
+ * a table, in parallel: first into buckets of table slots by ranges of
+ * vertices, and then each bucket by slot. Each vertex then only has to look
+ * into its own cell, and the neighbouring ones when it's near a cell
+ * boundary. The slots list their vertices in index order, so that the search
+ * stops at the first match, along with their positions, so that the vertices
+ * of a bucket can be welded in slot order without touching the vertex array.
  */
-class VertexOrder
-{
-public:
-	Index	order;
-	Vertex	vertex;
+#define WELD_VERTS_PER_TASK		16384
+#define WELD_VERTS_PER_BUCKET	4096
+#define WELD_MAX_BUCKETS		1024
 
-	// Constructor
-	VertexOrder()
-	{
-		order = 0;
-		vertex = Vertex();
+struct WeldEntry {
+	scalar_t x, y, z;
+	Index vertex;
+};
+
+struct WeldJob {
+	StridedPtr<Vector3> pos;
+	unsigned long vcount;
+	int tasks;
+
+	double inv_cell_size;
+	int slot_bits;
+	int buckets;
+	int shift;				// bucket of a slot: slot >> shift
+	unsigned long *offs;	// tasks x buckets: counts, then scatter positions
+	unsigned long *bucket_start;	// buckets + 1
+
+	Vector3 *bounds;		// min and max of each task
+
+	Index *slot;			// of each vertex
+	Index *slot_start;		// slots + 1
+	WeldEntry *tmp;			// the vertices by bucket, then by slot
+	WeldEntry *entries;
+	Index *igraph;
+};
+
+static inline int64_t weld_cell(double x, double inv_cell_size) {
+	double q = x * inv_cell_size;
+	if(!(q > -9.0e18 && q < 9.0e18)) {
+		// points too far away for a cell of their own share the outermost
+		// ones, which keeps the order of the cells, and NaNs go to cell 0.
+		if(q > 0.0) return (int64_t)9.0e18;
+		if(q < 0.0) return -(int64_t)9.0e18;
+		return 0;
 	}
 
-	VertexOrder(Index order, const Vertex& vertex)
-	{
-		this->order = order;
-		this->vertex = vertex;
+	int64_t cell = (int64_t)q;
+	return cell > q ? cell - 1 : cell;
+}
+
+static inline uint32_t weld_fold(int64_t x) {
+	return (uint32_t)x ^ (uint32_t)((uint64_t)x >> 32) * 0x9e3779b1;
+}
+
+static inline Index weld_slot(int64_t x, int64_t y, int64_t z, int slot_bits) {
+	uint32_t h = weld_fold(x) * 0x8da6b343 ^ weld_fold(y) * 0xd8163841 ^ weld_fold(z) * 0xcb1ab31f;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	return h >> (32 - slot_bits);
+}
+
+static void vertex_bounds_task(int idx, void *cls) {
+	WeldJob *job = (WeldJob*)cls;
+	Vector3 vmin(FLT_MAX, FLT_MAX, FLT_MAX), vmax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	unsigned long v0 = job->vcount * idx / job->tasks;
+	unsigned long v1 = job->vcount * (idx + 1) / job->tasks;
+
+	for(unsigned long i=v0; i<v1; i++) {
+		Vector3 p = job->pos[i];
+		for(int j=0; j<3; j++) {
+			if(fabs(p[j]) > FLT_MAX || p[j] != p[j]) continue;
+			if(p[j] < vmin[j]) vmin[j] = p[j];
+			if(p[j] > vmax[j]) vmax[j] = p[j];
+		}
 	}
-};
+	job->bounds[idx * 2] = vmin;
+	job->bounds[idx * 2 + 1] = vmax;
+}
+
+static void hash_vertices_task(int idx, void *cls) {
+	WeldJob *job = (WeldJob*)cls;
+	unsigned long *count = job->offs + idx * job->buckets;
+	double inv = job->inv_cell_size;
+
+	unsigned long v0 = job->vcount * idx / job->tasks;
+	unsigned long v1 = job->vcount * (idx + 1) / job->tasks;
+
+	for(unsigned long i=v0; i<v1; i++) {
+		Vector3 p = job->pos[i];
+		Index slot = weld_slot(weld_cell(p.x, inv), weld_cell(p.y, inv), weld_cell(p.z, inv), job->slot_bits);
+		job->slot[i] = slot;
+		count[slot >> job->shift]++;
+	}
+}
+
+static void scatter_vertices_task(int idx, void *cls) {
+	WeldJob *job = (WeldJob*)cls;
+	unsigned long *pos = job->offs + idx * job->buckets;
+
+	unsigned long v0 = job->vcount * idx / job->tasks;
+	unsigned long v1 = job->vcount * (idx + 1) / job->tasks;
+
+	for(unsigned long i=v0; i<v1; i++) {
+		Vector3 p = job->pos[i];
+		WeldEntry *ent = job->tmp + pos[job->slot[i] >> job->shift]++;
+		ent->x = p.x;
+		ent->y = p.y;
+		ent->z = p.z;
+		ent->vertex = (Index)i;
+	}
+}
+
+static void sort_vertices_task(int idx, void *cls) {
+	WeldJob *job = (WeldJob*)cls;
+	unsigned long start = job->bucket_start[idx];
+	unsigned long end = job->bucket_start[idx + 1];
+
+	Index first = (Index)idx << job->shift;
+	unsigned long range = 1UL << job->shift;
+	Index *slot_start = job->slot_start + first;
+
+	memset(slot_start, 0, range * sizeof *slot_start);
+	for(unsigned long i=start; i<end; i++) {
+		slot_start[job->slot[job->tmp[i].vertex] - first]++;
+	}
+
+	Index pos = (Index)start;
+	for(unsigned long i=0; i<range; i++) {
+		Index count = slot_start[i];
+		slot_start[i] = pos;
+		pos += count;
+	}
+
+	// stable, each slot keeps its vertices in index order
+	vector<Index> next(slot_start, slot_start + range);
+	for(unsigned long i=start; i<end; i++) {
+		const WeldEntry &ent = job->tmp[i];
+		job->entries[next[job->slot[ent.vertex] - first]++] = ent;
+	}
+}
 
-// fwd declaration
-static std::vector<unsigned int> process_vo_array(VertexOrder *array, unsigned int size, unsigned int crit);
+static void weld_vertices_task(int idx, void *cls) {
+	WeldJob *job = (WeldJob*)cls;
+	double eps = xsmall_number;
+	double inv = job->inv_cell_size;
+
+	unsigned long start = job->bucket_start[idx];
+	unsigned long end = job->bucket_start[idx + 1];
+
+	for(unsigned long i=start; i<end; i++) {
+		const WeldEntry &p = job->entries[i];
+		Index weld = p.vertex;
+
+		// the cells a point within eps might be in, one or two per axis
+		int64_t x0 = weld_cell(p.x - eps, inv), x1 = weld_cell(p.x + eps, inv);
+		int64_t y0 = weld_cell(p.y - eps, inv), y1 = weld_cell(p.y + eps, inv);
+		int64_t z0 = weld_cell(p.z - eps, inv), z1 = weld_cell(p.z + eps, inv);
+
+		for(int64_t z=z0; z<=z1; z++) {
+			for(int64_t y=y0; y<=y1; y++) {
+				for(int64_t x=x0; x<=x1; x++) {
+					Index slot = weld_slot(x, y, z, job->slot_bits);
+					for(Index j=job->slot_start[slot]; j<job->slot_start[slot + 1]; j++) {
+						const WeldEntry &ent = job->entries[j];
+						if(ent.vertex >= weld) break;
+
+						if(fabs(ent.x - p.x) < eps && fabs(ent.y - p.y) < eps && fabs(ent.z - p.z) < eps) {
+							weld = ent.vertex;
+							break;
+						}
+					}
+				}
+			}
+		}
+		job->igraph[p.vertex] = weld;
+	}
+}
 
 void TriMesh::calculate_index_graph()
 {
-	Index *igraph = new Index[varray.get_count()];
-	for (unsigned int i=0; i<varray.get_count(); i++)
+	unsigned long vcount = get_vertex_count();
+	Index *igraph = new Index[vcount];
+
+	WeldJob job;
+	job.pos = get_stream_ptrs().pos;
+	job.vcount = vcount;
+	job.tasks = (int)((vcount + WELD_VERTS_PER_TASK - 1) / WELD_VERTS_PER_TASK);
+
+	// cells about the size of the spacing of vertices on a surface, so that
+	// most points are away from cell boundaries, but never more than 1024
+	// times the welding distance, so that a few far away vertices can't
+	// crowd all the others into the same cells.
+	vector<Vector3> bounds(job.tasks * 2);
+	job.bounds = job.tasks ? &bounds[0] : 0;
+	tpool_parallel_for(job.tasks, vertex_bounds_task, &job);
+
+	Vector3 vmin(FLT_MAX, FLT_MAX, FLT_MAX), vmax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int i=0; i<job.tasks; i++)
 	{
-		igraph[i] = i;
+		for (int j=0; j<3; j++)
+		{
+			vmin[j] = std::min(vmin[j], bounds[i * 2][j]);
+			vmax[j] = std::max(vmax[j], bounds[i * 2 + 1][j]);
+		}
 	}
-		
-	VertexOrder *vo = new VertexOrder[varray.get_count()];
-	for (unsigned int i=0; i<varray.get_count(); i++)
+
+	double cell_size = 16.0 * xsmall_number;
+	for (int j=0; j<3; j++)
 	{
-		vo[i] = VertexOrder(i, varray.get_data()[i]);
+		if (vmin[j] > vmax[j]) continue;
+		double extent = (double)vmax[j] - vmin[j];
+		cell_size = std::max(cell_size, std::min(extent / sqrt((double)vcount), 1024.0 * xsmall_number));
 	}
+	job.inv_cell_size = 1.0 / cell_size;
 
-	// sort by x, then by y , then by z, and return constant-z parts
-	std::vector<unsigned int> parts;
-	parts = process_vo_array(vo, varray.get_count(), 0);
-	
-	for (unsigned int i=0; i<parts.size(); i += 2)
+	// a table slot per vertex or so, in buckets of a few thousand slots
+	job.slot_bits = 1;
+	while (job.slot_bits < 31 && (1UL << job.slot_bits) < vcount) job.slot_bits++;
+
+	job.buckets = 1;
+	while (job.buckets < WELD_MAX_BUCKETS && (unsigned long)job.buckets * WELD_VERTS_PER_BUCKET < vcount)
+	{
+		job.buckets <<= 1;
+	}
+	job.shift = 0;
+	while ((1UL << (job.slot_bits - job.shift)) > (unsigned long)job.buckets) job.shift++;
+	job.buckets = 1 << (job.slot_bits - job.shift);
+
+	vector<unsigned long> offs(job.tasks * job.buckets, 0);
+	vector<unsigned long> bucket_start(job.buckets + 1);
+	job.offs = job.tasks ? &offs[0] : 0;
+	job.bucket_start = &bucket_start[0];
+
+	job.slot = new Index[vcount];
+	job.slot_start = new Index[(1UL << job.slot_bits) + 1];
+	job.tmp = new WeldEntry[vcount];
+	job.entries = new WeldEntry[vcount];
+	job.igraph = igraph;
+
+	tpool_parallel_for(job.tasks, hash_vertices_task, &job);
+
+	// turn the per task counts into scatter positions, in task order
+	unsigned long pos = 0;
+	for (int i=0; i<job.buckets; i++)
 	{
-		// find min index of this part
-		Index min_index = vo[parts[i]].order;
-		for (unsigned int j=0; j<parts[i + 1]; j++)
+		bucket_start[i] = pos;
+		for (int j=0; j<job.tasks; j++)
 		{
-			if(min_index > vo[parts[i] + j].order) {
-				min_index = vo[parts[i] + j].order;
-			}
+			unsigned long count = offs[j * job.buckets + i];
+			offs[j * job.buckets + i] = pos;
+			pos += count;
 		}
-		
-		// replace index
-		for (unsigned int j=0; j<parts[i + 1]; j++)
-			igraph[vo[parts[i] + j].order] = min_index;
 	}
+	bucket_start[job.buckets] = pos;
+	job.slot_start[1UL << job.slot_bits] = (Index)vcount;
+
+	tpool_parallel_for(job.tasks, scatter_vertices_task, &job);
+	tpool_parallel_for(job.buckets, sort_vertices_task, &job);
+	tpool_parallel_for(job.buckets, weld_vertices_task, &job);
 
-	index_graph.set_data(igraph, varray.get_count());
+	// a vertex may be welded to one which is itself welded to an earlier
+	// one, if they are spread further than the welding distance. Lower
+	// indices come first, so a single pass maps all of them to the first.
+	for (unsigned long i=0; i<vcount; i++)
+	{
+		igraph[i] = igraph[igraph[i]];
+	}
+
+	index_graph.set_data(igraph, vcount);
 	index_graph_valid = true;
 	
-	delete [] vo;
+	delete [] job.slot;
+	delete [] job.slot_start;
+	delete [] job.tmp;
+	delete [] job.entries;
 	delete [] igraph;
 }
 
+static bool same_attributes(const Vertex &a, const Vertex &b)
+{
+	return !memcmp(&a.normal, &b.normal, sizeof a.normal) &&
+		!memcmp(&a.tangent, &b.tangent, sizeof a.tangent) &&
+		!memcmp(&a.color, &b.color, sizeof a.color) &&
+		!memcmp(a.tex, b.tex, sizeof a.tex);
+}
+
+/* weld_vertices - (JT)
+ * each vertex is replaced by the first one it's welded to in the index
+ * graph or, when keeping attributes, by the first one of those which
+ * also has the same attributes. The vertices that remain are moved to the
+ * position of the first of their group, so that seams still meet exactly.
+ */
+void TriMesh::weld_vertices(bool keep_attributes)
+{
+	const Index *igraph = get_index_graph()->get_data();
+	const Vertex *verts = get_vertex_array()->get_data();
+	unsigned long vcount = get_vertex_count();
+	const Triangle *tris = tarray.get_data();
+	unsigned long tcount = tarray.get_count();
+
+	Index *remap = new Index[vcount];
+	Index *next_kept = new Index[vcount];	// circular list of the vertices kept in each group
+	Index *kept_verts = new Index[vcount];
+	unsigned long new_vcount = 0;
+
+	for (unsigned long i=0; i<vcount; i++)
+	{
+		Index first = igraph[i];
+		if (first != i)
+		{
+			// look for a vertex to merge with among the ones kept so far
+			Index kept = first;
+			bool found = !keep_attributes || same_attributes(verts[kept], verts[i]);
+			while (!found && next_kept[kept] != first)
+			{
+				kept = next_kept[kept];
+				found = same_attributes(verts[kept], verts[i]);
+			}
+
+			if (found)
+			{
+				remap[i] = remap[kept];
+				continue;
+			}
+
+			// or keep this one too, at the end of the list
+			next_kept[kept] = i;
+			next_kept[i] = first;
+		}
+		else
+		{
+			next_kept[i] = i;
+		}
+
+		remap[i] = new_vcount;
+		kept_verts[new_vcount++] = i;
+	}
+
+	Vertex *new_verts = new Vertex[new_vcount];
+	for (unsigned long i=0; i<new_vcount; i++)
+	{
+		new_verts[i] = verts[kept_verts[i]];
+		new_verts[i].pos = verts[igraph[kept_verts[i]]].pos;
+	}
+
+	Triangle *new_tris = new Triangle[tcount];
+	unsigned long new_tcount = 0;
+	for (unsigned long i=0; i<tcount; i++)
+	{
+		Triangle tri = tris[i];
+		for (int j=0; j<3; j++)
+		{
+			tri.vertices[j] = remap[tri.vertices[j]];
+		}
+
+		if (tri.vertices[0] != tri.vertices[1] && tri.vertices[1] != tri.vertices[2] &&
+				tri.vertices[2] != tri.vertices[0])
+		{
+			new_tris[new_tcount++] = tri;
+		}
+	}
+
+	set_data(new_verts, new_vcount, new_tris, new_tcount);
+
+	delete [] remap;
+	delete [] next_kept;
+	delete [] kept_verts;
+	delete [] new_verts;
+	delete [] new_tris;
+}
+
 /* join_tri_mesh - (MG)
  * Gets 2 trimeshes and returns a new one
  * that contains both meshes
@@ -936,111 +1721,3 @@ Vector3 extrude(const Vector3 &vec, scalar_t distance, const Vector3 &pov_or_dir
 
 	return vec + direction;
 }
-
-/* utilities for finding duplicate vertices - (MG)
- */
-extern const scalar_t xsmall_number;
-
-// Sort criteria for VertexOrder objects
-static bool vo_sort_crit_x(const VertexOrder& a, const VertexOrder& b)
-{
-	return (a.vertex.pos.x < b.vertex.pos.x);
-}
-
-static bool vo_sort_crit_y(const VertexOrder& a, const VertexOrder& b)
-{
-	return (a.vertex.pos.y < b.vertex.pos.y);
-}
-
-static bool vo_sort_crit_z(const VertexOrder& a, const VertexOrder& b)
-{
-	return (a.vertex.pos.z < b.vertex.pos.z);
-}
-
-// equality criteria for VertexOrder objects
-static bool vo_eq_crit_x(const VertexOrder& a, const VertexOrder& b)
-{
-	return (b.vertex.pos.x - a.vertex.pos.x < xsmall_number);
-}
-
-static bool vo_eq_crit_y(const VertexOrder& a, const VertexOrder& b)
-{
-	return (b.vertex.pos.y - a.vertex.pos.y < xsmall_number);
-}
-
-static bool vo_eq_crit_z(const VertexOrder& a, const VertexOrder& b)
-{
-	return (b.vertex.pos.z - a.vertex.pos.z < xsmall_number);
-}
-
-static bool (* vo_sort_crit[])(const VertexOrder& a, const VertexOrder& b) = {vo_sort_crit_x, vo_sort_crit_y, vo_sort_crit_z};
-
-static bool (* vo_eq_crit[])(const VertexOrder& a, const VertexOrder& b) = {vo_eq_crit_x, vo_eq_crit_y, vo_eq_crit_z};
-
-static std::vector<unsigned int> vo_find_constant_parts(VertexOrder *array, unsigned int size, unsigned int crit)
-{
-	std::vector<unsigned int> parts;
-	if (crit > 2) return parts;
-
-	bool (* eq_crit)(const VertexOrder& a, const VertexOrder& b);
-	eq_crit = vo_eq_crit[crit];
-
-	unsigned int start=0;
-	for (unsigned int i=0; i<size; i++)
-	{
-		if (!eq_crit(array[start], array[i]))
-		{
-			if (i - start > 1)
-			{
-				parts.push_back(start);
-				parts.push_back(i - start);
-			}
-
-			start = i;
-		}
-	}
-
-	if (size - start > 1)
-	{
-		parts.push_back(start);
-		parts.push_back(size - start);
-	}
-
-	return parts;
-}
-
-static std::vector<unsigned int> process_vo_array(VertexOrder *array, unsigned int size, unsigned int crit)
-{
-	std::vector<unsigned int> r_parts;
-	if (crit > 2) return r_parts;
-		
-	bool (* sort_crit)(const VertexOrder& a, const VertexOrder& b);
-	sort_crit = vo_sort_crit[crit];
-
-	// sort array
-	std::sort(array, array + size, sort_crit);
-
-	// find constant parts
-	std::vector<unsigned int> parts;
-	parts = vo_find_constant_parts(array, size, crit);
-	
-	if (crit < 2)
-	{
-		for (unsigned int i=0; i<parts.size(); i += 2)
-		{
-			std::vector<unsigned int> new_parts;
-			new_parts = process_vo_array(array + parts[i], parts[i + 1], crit + 1);
-			for (unsigned int j=0; j<new_parts.size(); j+=2)
-			{
-				r_parts.push_back(new_parts[j] + parts[i]);
-				r_parts.push_back(new_parts[j+1]);
-			}
-		}
-		return r_parts;
-	}
-	else
-	{
-		// found constant z parts. just return them
-		return parts;
-	}
-}
@@ -48,6 +48,26 @@ struct TexCoord {
 
 class Triangle;	// fwd declaration
 
+/* StridedPtr - (JT)
+ * pointer to an array of elements spaced stride bytes apart, so that the
+ * same code can walk a vertex attribute in a VertexArray (stride is
+ * sizeof(Vertex)), or in a tightly packed VertexStreams array.
+ */
+template <class T>
+class StridedPtr {
+private:
+	char *ptr;
+	size_t stride;
+
+public:
+	inline StridedPtr(T *ptr = 0, size_t stride = sizeof(T));
+
+	inline T &operator [](unsigned long idx) const;
+	inline T *get_ptr() const;
+	inline size_t get_stride() const;
+};
+
+
 class Vertex {
 public:
 	Vector3 pos;
@@ -73,6 +93,16 @@ public:
 
 std::ostream &operator <<(std::ostream &o, const Edge &e);
 
+/* results of TriMesh::get_contour_edges, along with the scratch space it
+ * needs. Keep one around and reuse it, so that it only allocates when it
+ * has to grow. Threads running queries at the same time need one each.
+ */
+class ContourEdges {
+public:
+	std::vector<uint32_t> facing;	// a bit per triangle, set if it faces away from the pov
+	std::vector<Edge> edges;
+};
+
 
 class Triangle {
 public:
@@ -84,7 +114,9 @@ public:
 	Triangle(Index v1 = 0, Index v2 = 0, Index v3 = 0);
 
 	void calculate_normal(const Vertex *vbuffer, bool normalize=false);
+	void calculate_normal(const StridedPtr<Vector3> &pos, bool normalize=false);
 	void calculate_tangent(const Vertex *vbuffer, bool normalize=false);
+	void calculate_tangent(const StridedPtr<Vector3> &pos, const StridedPtr<TexCoord> &tex, bool normalize=false);
 };
 
 std::ostream &operator <<(std::ostream &o, const Triangle &t);
@@ -175,6 +207,65 @@ typedef GeometryArray<Vertex> VertexArray;
 typedef GeometryArray<Triangle> TriangleArray;
 typedef GeometryArray<Index> IndexArray;
 
+//////////////// Vertex Streams ///////////////
+
+/* VertexStreams - structure of arrays vertex storage. (JT)
+ * Each vertex attribute lives in its own aligned array, so that processing
+ * that only needs positions (or normals) doesn't drag whole Vertex records
+ * through the cache. Vertex records can be scattered into or gathered from
+ * the streams, so it can always be converted to/from a VertexArray.
+ */
+class VertexStreams {
+private:
+	Vector3 *pos, *normal, *tangent;
+	Color *color;
+	TexCoord *tex[2];
+	unsigned long count;
+
+	void alloc(unsigned long count);
+	void destroy();
+
+public:
+	VertexStreams();
+	VertexStreams(const Vertex *vdata, unsigned long count);
+	VertexStreams(const VertexStreams &vs);
+	~VertexStreams();
+
+	VertexStreams &operator =(const VertexStreams &vs);
+
+	void set_count(unsigned long count);
+	void set_data(const Vertex *vdata, unsigned long count);	// scatter
+	void get_data(Vertex *vdata) const;							// gather
+
+	Vertex get_vertex(unsigned long idx) const;
+	void set_vertex(unsigned long idx, const Vertex &v);
+
+	inline unsigned long get_count() const;
+
+	inline const Vector3 *get_positions() const;
+	inline Vector3 *get_mod_positions();
+	inline const Vector3 *get_normals() const;
+	inline Vector3 *get_mod_normals();
+	inline const Vector3 *get_tangents() const;
+	inline Vector3 *get_mod_tangents();
+	inline const Color *get_colors() const;
+	inline Color *get_mod_colors();
+	inline const TexCoord *get_texcoords(int set) const;
+	inline TexCoord *get_mod_texcoords(int set);
+};
+
+/* pointers to each vertex attribute of a mesh, regardless of layout */
+struct VertexStreamPtrs {
+	StridedPtr<Vector3> pos, normal, tangent;
+	StridedPtr<Color> color;
+	StridedPtr<TexCoord> tex[2];
+};
+
+enum VertexLayout {
+	VLAYOUT_AOS,	// interleaved Vertex records (default)
+	VLAYOUT_SOA		// one stream per vertex attribute
+};
+
 ////////////// triangle mesh class ////////////
 struct VertexStatistics {
 	Vector3 centroid;
@@ -186,25 +277,38 @@ struct VertexStatistics {
 
 class TriMesh {
 private:
+	VertexLayout vlayout;
 	VertexArray varray;
+	VertexStreams vstreams;
 	TriangleArray tarray;
 	IndexArray iarray;
 	IndexArray index_graph;
 	
 	GeometryArray<Edge> earray;
+	std::vector<scalar_t> face_planes;	// triangle planes (nx, ny, nz, d arrays) for contours
 
 	mutable VertexStatistics vstats;
 	
 	mutable bool vertex_stats_valid;
+	mutable bool varray_valid;		// only used with VLAYOUT_SOA
+	mutable bool vstreams_valid;	// only used with VLAYOUT_SOA
 	bool indices_valid;
 	bool edges_valid;
 	bool index_graph_valid;
 	bool triangle_normals_valid;
 	bool triangle_normals_normalized;
+	bool face_planes_valid;
+	unsigned long revision;
 	
 	void calculate_edges();
+	void calculate_face_planes();
 	void calculate_index_graph();
 	void calculate_triangle_normals(bool normalize);
+
+	void sync_vertex_array() const;
+	void sync_vertex_streams() const;
+	VertexStreamPtrs get_stream_ptrs() const;
+	VertexStreamPtrs get_mod_stream_ptrs();
 	
 public:
 	TriMesh();
@@ -212,20 +316,48 @@ public:
 	
 	inline const VertexArray *get_vertex_array() const;
 	inline VertexArray *get_mod_vertex_array();
+
+	// of whichever layout is in use, without syncing the other one
+	inline unsigned long get_vertex_count() const;
+
+	void set_vertex_layout(VertexLayout layout);
+	inline VertexLayout get_vertex_layout() const;
+
+	// only valid with VLAYOUT_SOA, return 0 otherwise
+	inline const VertexStreams *get_vertex_streams() const;
+	inline VertexStreams *get_mod_vertex_streams();
 	
 	inline const TriangleArray *get_triangle_array() const;
 	inline TriangleArray *get_mod_triangle_array();
 	
 	const IndexArray *get_index_array();
 	const GeometryArray<Edge> *get_edge_array() const;
+	const IndexArray *get_index_graph() const;
+
+	// changes whenever the mesh data may have been modified
+	inline unsigned long get_revision() const;
 	
 	void set_data(const Vertex *vdata, unsigned long vcount, const Triangle *tdata, unsigned long tcount);	
 
+	// restores a mesh along with the data derived from it, as previously
+	// returned by get_index_graph, get_index_array and get_edge_array of a mesh
+	// on which calculate_normals was called (e.g. from a mesh cache), so that
+	// none of it has to be recalculated. Any of the derived arrays may be
+	// null, to be calculated when needed instead.
+	void set_data(const Vertex *vdata, unsigned long vcount, const Triangle *tdata, unsigned long tcount,
+			const Index *igraph, const Index *idata, const Edge *edata, unsigned long ecount);
+
 	void calculate_normals_by_index();
 	void calculate_normals();
 	void normalize_normals();
 	void invert_winding();
 
+	// merges the vertices mapped to the same one by the index graph and
+	// drops the triangles which collapse, leaving no duplicate vertices to
+	// upload. Unless keep_attributes is false, only vertices with identical
+	// normals, colors and texture coordinates are merged.
+	void weld_vertices(bool keep_attributes = true);
+
 	void calculate_tangents();
 
 	void apply_xform(const Matrix4x4 &xform);
@@ -237,7 +369,13 @@ public:
 	VertexStatistics get_vertex_stats() const;
 
 	// shadow volumes
-	std::vector<Edge> *get_contour_edges(const Vector3 &pov_or_dir, bool dir = false);
+	// the edges between triangles facing towards and away from pov_or_dir (in
+	// model space), with the vertices in clockwise order, so that they can be
+	// extruded into a shadow volume. Doesn't modify the mesh, and can be called
+	// from many threads at once (with a ContourEdges each) after
+	// prepare_contour_edges.
+	void get_contour_edges(ContourEdges *contour, const Vector3 &pov_or_dir, bool dir = false) const;
+	void prepare_contour_edges() const;
 	//TriMesh *get_uncapped_shadow_volume(const Vector3 &pov_or_dir, bool dir = false);
 	TriMesh *get_shadow_volume(const Vector3 &pov_or_dir, bool dir = false);
 };
@@ -249,6 +387,9 @@ void join_tri_mesh(TriMesh *ret, const TriMesh *m1, const TriMesh *m2);
 TriMesh *join_tri_mesh(const TriMesh *m1, const TriMesh *m2);
 Vector3 extrude(const Vector3 &vec, scalar_t distance, const Vector3 &pov_or_dir, bool dir);
 
+// how far shadow volumes are extruded from their contour
+extern const scalar_t shadow_extrusion;
+
 #include "3dgeom.inl"
 
 #endif	// _3DGEOM_HPP_
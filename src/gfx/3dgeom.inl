@@ -219,19 +219,131 @@ inline unsigned int GeometryArray<Index>::get_buffer_object() const {
 }
 
 
+///////// VertexStreams (inline functions) //////////
+inline unsigned long VertexStreams::get_count() const {
+	return count;
+}
+
+inline const Vector3 *VertexStreams::get_positions() const {
+	return pos;
+}
+
+inline Vector3 *VertexStreams::get_mod_positions() {
+	return pos;
+}
+
+inline const Vector3 *VertexStreams::get_normals() const {
+	return normal;
+}
+
+inline Vector3 *VertexStreams::get_mod_normals() {
+	return normal;
+}
+
+inline const Vector3 *VertexStreams::get_tangents() const {
+	return tangent;
+}
+
+inline Vector3 *VertexStreams::get_mod_tangents() {
+	return tangent;
+}
+
+inline const Color *VertexStreams::get_colors() const {
+	return color;
+}
+
+inline Color *VertexStreams::get_mod_colors() {
+	return color;
+}
+
+inline const TexCoord *VertexStreams::get_texcoords(int set) const {
+	return tex[set];
+}
+
+inline TexCoord *VertexStreams::get_mod_texcoords(int set) {
+	return tex[set];
+}
+
+///////// StridedPtr //////////
+template <class T>
+inline StridedPtr<T>::StridedPtr(T *ptr, size_t stride) {
+	this->ptr = (char*)ptr;
+	this->stride = stride;
+}
+
+template <class T>
+inline T &StridedPtr<T>::operator [](unsigned long idx) const {
+	return *(T*)(ptr + idx * stride);
+}
+
+template <class T>
+inline T *StridedPtr<T>::get_ptr() const {
+	return (T*)ptr;
+}
+
+template <class T>
+inline size_t StridedPtr<T>::get_stride() const {
+	return stride;
+}
+
 ///////// Triangle Mesh Implementation (inline functions) //////////
 inline const VertexArray *TriMesh::get_vertex_array() const {
+	if(vlayout == VLAYOUT_SOA && !varray_valid) {
+		sync_vertex_array();
+	}
 	return &varray;
 }
 
 inline VertexArray *TriMesh::get_mod_vertex_array() {
+	if(vlayout == VLAYOUT_SOA) {
+		if(!varray_valid) sync_vertex_array();
+		vstreams_valid = false;
+	}
 	vertex_stats_valid = false;
 	edges_valid = false;
 	index_graph_valid = false;
 	triangle_normals_valid = triangle_normals_normalized = false;
+	face_planes_valid = false;
+	revision++;
 	return &varray;
 }
 
+inline unsigned long TriMesh::get_vertex_count() const {
+	if(vlayout == VLAYOUT_SOA && !varray_valid) {
+		return vstreams.get_count();
+	}
+	return varray.get_count();
+}
+
+inline unsigned long TriMesh::get_revision() const {
+	return revision;
+}
+
+inline VertexLayout TriMesh::get_vertex_layout() const {
+	return vlayout;
+}
+
+inline const VertexStreams *TriMesh::get_vertex_streams() const {
+	if(vlayout != VLAYOUT_SOA) return 0;
+
+	if(!vstreams_valid) sync_vertex_streams();
+	return &vstreams;
+}
+
+inline VertexStreams *TriMesh::get_mod_vertex_streams() {
+	if(vlayout != VLAYOUT_SOA) return 0;
+
+	if(!vstreams_valid) sync_vertex_streams();
+	varray_valid = false;
+	vertex_stats_valid = false;
+	edges_valid = false;
+	index_graph_valid = false;
+	triangle_normals_valid = triangle_normals_normalized = false;
+	face_planes_valid = false;
+	revision++;
+	return &vstreams;
+}
+
 inline const TriangleArray *TriMesh::get_triangle_array() const {
 	return &tarray;
 }
@@ -241,5 +353,7 @@ inline TriangleArray *TriMesh::get_mod_triangle_array() {
 	edges_valid = false;
 	index_graph_valid = false;
 	triangle_normals_valid = triangle_normals_normalized = false;
+	face_planes_valid = false;
+	revision++;
 	return &tarray;
 }
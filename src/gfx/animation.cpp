@@ -116,12 +116,55 @@ XFormNode::XFormNode() {
 	use_ctrl = 0;
 	key_time_mode = TIME_CLAMP;
 	parent = 0;
-	cache.valid = false;
+	cache.valid = cache.xform_valid = false;
+	cache.time_invariant = false;
 }
 
 XFormNode::~XFormNode() {
 }
 
+unsigned long XFormNode::hierarchy_rev;
+
+/* Invalidates the cached PRS of this node and its whole subtree.
+ * A node can only have a valid cache if its parent had one when it was
+ * computed, so if this node is already invalid, so is everything below it.
+ */
+void XFormNode::invalidate_cache() {
+	if(!cache.valid) return;
+	cache.valid = cache.xform_valid = false;
+
+	for(size_t i=0; i<children.size(); i++) {
+		children[i]->invalidate_cache();
+	}
+}
+
+void XFormNode::add_child(XFormNode *child) {
+	if(find(children.begin(), children.end(), child) == children.end()) {
+		children.push_back(child);
+	}
+	child->parent = this;
+	child->invalidate_cache();
+	hierarchy_rev++;
+}
+
+bool XFormNode::remove_child(XFormNode *child) {
+	vector<XFormNode*>::iterator iter = find(children.begin(), children.end(), child);
+	if(iter == children.end()) return false;
+
+	children.erase(iter);
+	child->parent = 0;
+	child->invalidate_cache();
+	hierarchy_rev++;
+	return true;
+}
+
+/* changes whenever add_child/remove_child modify any hierarchy,
+ * so that users of flattened hierarchies (Scene) know when to rebuild them.
+ */
+unsigned long XFormNode::get_hierarchy_revision() {
+	return hierarchy_rev;
+}
+
 Keyframe *XFormNode::get_nearest_key(int start, int end, unsigned long time) {
 	if(start == end) return &keys[start];
 	if(end - start == 1) {
@@ -164,7 +207,7 @@ void XFormNode::add_controller(MotionController ctrl, ControllerType ctrl_type)
 		break;
 	}
 	use_ctrl = true;
-	cache.valid = false;
+	invalidate_cache();
 }
 
 vector<MotionController> *XFormNode::get_controllers(ControllerType ctrl_type) {
@@ -182,7 +225,7 @@ vector<MotionController> *XFormNode::get_controllers(ControllerType ctrl_type) {
 		return &scale_ctrl;
 		break;
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::add_keyframe(const Keyframe &key) {
@@ -200,11 +243,11 @@ void XFormNode::add_keyframe(const Keyframe &key) {
 		keys.push_back(key);
 		key_count++;
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 Keyframe *XFormNode::get_keyframe(unsigned long time) {
-	cache.valid = false;
+	invalidate_cache();
 	Keyframe *keyframe = get_nearest_key(time);
 	return (keyframe->time == time) ? keyframe : 0;
 }
@@ -214,17 +257,17 @@ void XFormNode::delete_keyframe(unsigned long time) {
 	if(iter != keys.end()) {
 		keys.erase(iter);
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 std::vector<Keyframe> *XFormNode::get_keyframes() {
-	cache.valid = false;
+	invalidate_cache();
 	return &keys;
 }
 
 void XFormNode::set_timeline_mode(TimelineMode time_mode) {
 	key_time_mode = time_mode;
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::set_position(const Vector3 &pos, unsigned long time) {
@@ -236,7 +279,7 @@ void XFormNode::set_position(const Vector3 &pos, unsigned long time) {
 			keyframe->prs.position = pos;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::set_rotation(const Quaternion &rot, unsigned long time) {
@@ -248,7 +291,7 @@ void XFormNode::set_rotation(const Quaternion &rot, unsigned long time) {
 			keyframe->prs.rotation = rot;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::set_rotation(const Vector3 &euler, unsigned long time) {
@@ -266,7 +309,7 @@ void XFormNode::set_rotation(const Vector3 &euler, unsigned long time) {
 			keyframe->prs.rotation = xrot * yrot * zrot;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::set_scaling(const Vector3 &scale, unsigned long time) {
@@ -278,12 +321,12 @@ void XFormNode::set_scaling(const Vector3 &scale, unsigned long time) {
 			keyframe->prs.scale = scale;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::set_pivot(const Vector3 &pivot) {
 	local_prs.pivot = pivot;
-	cache.valid = false;
+	invalidate_cache();
 }
 
 
@@ -303,6 +346,10 @@ Vector3 XFormNode::get_pivot() const {
 	return local_prs.pivot;
 }
 
+PRS XFormNode::get_local_prs() const {
+	return local_prs;
+}
+
 
 void XFormNode::translate(const Vector3 &trans, unsigned long time) {
 	if(time == XFORM_LOCAL_PRS) {
@@ -313,7 +360,7 @@ void XFormNode::translate(const Vector3 &trans, unsigned long time) {
 			keyframe->prs.position += trans;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::rotate(const Quaternion &rot, unsigned long time) {
@@ -325,7 +372,7 @@ void XFormNode::rotate(const Quaternion &rot, unsigned long time) {
 			keyframe->prs.rotation = rot * keyframe->prs.rotation;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::rotate(const Vector3 &euler, unsigned long time) {
@@ -343,7 +390,7 @@ void XFormNode::rotate(const Vector3 &euler, unsigned long time) {
 			keyframe->prs.rotation = xrot * yrot * zrot * keyframe->prs.rotation;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::rotate(const Matrix3x3 &rmat, unsigned long time) {
@@ -356,7 +403,7 @@ void XFormNode::rotate(const Matrix3x3 &rmat, unsigned long time) {
 	q.v.z = sqrt((rmat[2][2] + 1.0 - 2.0 * ssq) / 2.0);
 
 	rotate(q, time);
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::scale(const Vector3 &scale, unsigned long time) {
@@ -372,23 +419,23 @@ void XFormNode::scale(const Vector3 &scale, unsigned long time) {
 			keyframe->prs.scale.z *= scale.z;
 		}
 	}
-	cache.valid = false;
+	invalidate_cache();
 }
 
 
 void XFormNode::reset_position(unsigned long time) {
 	set_position(Vector3(0, 0, 0), time);
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::reset_rotation(unsigned long time) {
 	set_rotation(Quaternion(), time);
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::reset_scaling(unsigned long time) {
 	set_scaling(Vector3(1, 1, 1), time);
-	cache.valid = false;
+	invalidate_cache();
 }
 
 void XFormNode::reset_xform(unsigned long time) {
@@ -401,16 +448,24 @@ void XFormNode::reset_xform(unsigned long time) {
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
 
 PRS XFormNode::get_prs(unsigned long time) const {
-	if(cache.valid && time == cache.time) {
-		return cache.prs;
+	if(cache.valid) {
+		if(time == cache.time) return cache.prs;
+
+		// without keyframes or controllers up the hierarchy, any
+		// animation time yields the same PRS (but not XFORM_LOCAL_PRS).
+		if(cache.time_invariant && time != XFORM_LOCAL_PRS && cache.time != XFORM_LOCAL_PRS) {
+			return cache.prs;
+		}
 	}
 	cache.valid = true;
+	cache.xform_valid = false;
 	cache.time = time;
 
 	PRS parent_prs;
 	if(parent) {
 		parent_prs = parent->get_prs(time);
 	}
+	cache.time_invariant = !key_count && !use_ctrl && (!parent || parent->cache.time_invariant);
 	
 	if(time == XFORM_LOCAL_PRS) {
 		cache.prs = combine_prs(local_prs, parent_prs);
@@ -477,3 +532,15 @@ PRS XFormNode::get_prs(unsigned long time) const {
 	cache.prs = inherit_prs(prs, parent_prs);
 	return cache.prs;
 }
+
+/* returns the world transformation matrix at the specified time,
+ * built from get_prs() and cached along with it.
+ */
+Matrix4x4 XFormNode::get_xform_matrix(unsigned long time) const {
+	PRS prs = get_prs(time);
+	if(!cache.xform_valid) {
+		cache.xform = prs.get_xform_matrix();
+		cache.xform_valid = true;
+	}
+	return cache.xform;
+}
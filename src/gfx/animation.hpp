@@ -79,10 +79,14 @@ protected:
 	// PRS cache
 	mutable struct {
 		PRS prs;
+		Matrix4x4 xform;		// world matrix derived from prs (if xform_valid)
 		unsigned long time;
-		bool valid;
+		bool valid, xform_valid;
+		bool time_invariant;	// no keys/controllers on this node or its ancestors
 	} cache;
 
+	static unsigned long hierarchy_rev;
+
 	int key_count;
 	std::vector<Keyframe> keys;
 	std::vector<MotionController> trans_ctrl, rot_ctrl, scale_ctrl;
@@ -96,6 +100,8 @@ protected:
 	Keyframe *get_nearest_key(int start, int end, unsigned long time);
 	inline const Keyframe *get_nearest_key(int start, int end, unsigned long time) const;
 	void get_key_interval(unsigned long time, const Keyframe **start, const Keyframe **end) const;
+
+	void invalidate_cache();
 	
 public:
 	std::string name;
@@ -105,6 +111,10 @@ public:
 	XFormNode();
 	virtual ~XFormNode();
 
+	virtual void add_child(XFormNode *child);
+	virtual bool remove_child(XFormNode *child);
+	static unsigned long get_hierarchy_revision();
+
 	virtual void add_controller(MotionController ctrl, ControllerType ctrl_type);
 	virtual std::vector<MotionController> *get_controllers(ControllerType ctrl_type);
 		
@@ -125,6 +135,9 @@ public:
 	virtual Quaternion get_rotation(unsigned long time = XFORM_LOCAL_PRS) const;
 	virtual Vector3 get_scaling(unsigned long time = XFORM_LOCAL_PRS) const;
 	virtual Vector3 get_pivot() const;
+
+	// the PRS of the node itself, without keyframes, controllers or parents
+	virtual PRS get_local_prs() const;
 	
 	virtual void translate(const Vector3 &trans, unsigned long time = XFORM_LOCAL_PRS);
 	virtual void rotate(const Quaternion &rot, unsigned long time = XFORM_LOCAL_PRS);
@@ -138,6 +151,7 @@ public:
 	virtual void reset_xform(unsigned long time = XFORM_LOCAL_PRS);
 	
 	virtual PRS get_prs(unsigned long time = XFORM_LOCAL_PRS) const;
+	virtual Matrix4x4 get_xform_matrix(unsigned long time = XFORM_LOCAL_PRS) const;
 };
 
 #include "animation.inl"
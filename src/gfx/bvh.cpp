@@ -0,0 +1,388 @@
+/*
+This file is part of the graphics core library.
+
+Copyright (c) 2004, 2005 John Tsiombikas <nuclear@siggraph.org>
+
+the graphics core library is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+the graphics core library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with the graphics core library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Dynamic bounding volume hierarchy (AABB tree) */
+
+#include <float.h>
+#include <algorithm>
+#include "bvh.hpp"
+
+#define LEAF_SIZE	4
+
+// true for items with their center below a splitting plane
+struct CenterBelow {
+	const Vector3 *centers;
+	int axis;
+	scalar_t split;
+
+	bool operator ()(int id) const {
+		return (&centers[id].x)[axis] < split;
+	}
+};
+
+static inline void merge_bounds(Vector3 *min, Vector3 *max, const Vector3 &bmin, const Vector3 &bmax) {
+	min->x = std::min(min->x, bmin.x);
+	min->y = std::min(min->y, bmin.y);
+	min->z = std::min(min->z, bmin.z);
+	max->x = std::max(max->x, bmax.x);
+	max->y = std::max(max->y, bmax.y);
+	max->z = std::max(max->z, bmax.z);
+}
+
+BVHTree::BVHTree(scalar_t margin) {
+	this->margin = margin;
+	item_count = 0;
+	refit_count = 0;
+	valid = true;
+}
+
+void BVHTree::clear() {
+	nodes.clear();
+	items.clear();
+	item_order.clear();
+	free_items.clear();
+	item_count = 0;
+	refit_count = 0;
+	valid = true;
+}
+
+int BVHTree::add_item(const Vector3 &min, const Vector3 &max) {
+	Item item;
+	Vector3 fat = (max - min) * margin;
+	item.min = min - fat;
+	item.max = max + fat;
+	item.leaf = -1;
+	item.active = true;
+
+	int id;
+	if(!free_items.empty()) {
+		id = free_items.back();
+		free_items.pop_back();
+		items[id] = item;
+	} else {
+		id = (int)items.size();
+		items.push_back(item);
+	}
+
+	item_count++;
+	valid = false;
+	return id;
+}
+
+void BVHTree::remove_item(int id) {
+	if(id < 0 || id >= (int)items.size() || !items[id].active) return;
+
+	items[id].active = false;
+	free_items.push_back(id);
+	item_count--;
+	valid = false;
+}
+
+/* updates the bounds of an item, if they are still within its fattened
+ * bounds, nothing changes. Otherwise its leaf and the path to the root are
+ * refitted, until enough refits have accumulated to degrade the tree,
+ * at which point the next query rebuilds it.
+ */
+void BVHTree::update_item(int id, const Vector3 &min, const Vector3 &max) {
+	Item *item = &items[id];
+	if(min.x >= item->min.x && min.y >= item->min.y && min.z >= item->min.z &&
+			max.x <= item->max.x && max.y <= item->max.y && max.z <= item->max.z) {
+		return;
+	}
+
+	Vector3 fat = (max - min) * margin;
+	item->min = min - fat;
+	item->max = max + fat;
+
+	if(!valid) return;	// will be rebuilt anyway
+
+	refit(item->leaf);
+	if(++refit_count > item_count / 4 + LEAF_SIZE) {
+		valid = false;
+	}
+}
+
+void BVHTree::refit(int node) {
+	Node *n = &nodes[node];
+	n->min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+	n->max = -n->min;
+	for(int i=0; i<n->count; i++) {
+		const Item *item = &items[item_order[n->first + i]];
+		merge_bounds(&n->min, &n->max, item->min, item->max);
+	}
+
+	while(n->parent != -1) {
+		n = &nodes[n->parent];
+		n->min = nodes[n->left].min;
+		n->max = nodes[n->left].max;
+		merge_bounds(&n->min, &n->max, nodes[n->right].min, nodes[n->right].max);
+	}
+}
+
+/* top-down build, splitting each node in the middle of the longest axis
+ * of the bounds of its item centers. Those bounds are passed down clipped
+ * at the splitting plane, and only recalculated exactly when a split fails
+ * to separate the items. If even that fails (e.g. all centers coincide),
+ * the items are simply split in half. Node bounds are merged bottom-up.
+ */
+int BVHTree::build(int first, int count, int parent, const Vector3 &cmin, const Vector3 &cmax) {
+	int idx = (int)nodes.size();
+	nodes.push_back(Node());
+
+	Node n;
+	n.parent = parent;
+	n.left = n.right = -1;
+	n.first = first;
+	n.count = count;
+
+	if(count > LEAF_SIZE) {
+		std::vector<int>::iterator start = item_order.begin() + first;
+		Vector3 smin = cmin, smax = cmax;
+		int half = split(start, count, smin, smax);
+
+		if(half == 0 || half == count) {
+			// the clipped center bounds were too loose, find the exact ones
+			smin = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+			smax = -smin;
+			for(int i=0; i<count; i++) {
+				const Vector3 &c = centers[item_order[first + i]];
+				merge_bounds(&smin, &smax, c, c);
+			}
+			half = split(start, count, smin, smax);
+		}
+
+		Vector3 left_cmax = smax, right_cmin = smin;
+		if(half == 0 || half == count) {
+			half = count / 2;
+		} else {
+			int axis;
+			scalar_t split_pos = get_split_plane(smin, smax, &axis);
+			(&left_cmax.x)[axis] = split_pos;
+			(&right_cmin.x)[axis] = split_pos;
+		}
+
+		n.left = build(first, half, idx, smin, left_cmax);
+		n.right = build(first + half, count - half, idx, right_cmin, smax);
+		n.count = 0;
+
+		n.min = nodes[n.left].min;
+		n.max = nodes[n.left].max;
+		merge_bounds(&n.min, &n.max, nodes[n.right].min, nodes[n.right].max);
+	} else {
+		n.min = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+		n.max = -n.min;
+		for(int i=0; i<count; i++) {
+			Item *item = &items[item_order[first + i]];
+			merge_bounds(&n.min, &n.max, item->min, item->max);
+			item->leaf = idx;
+		}
+	}
+
+	nodes[idx] = n;
+	return idx;
+}
+
+// partitions count item ids at start by the node splitting plane
+int BVHTree::split(std::vector<int>::iterator start, int count, const Vector3 &cmin, const Vector3 &cmax) const {
+	CenterBelow below;
+	below.centers = &centers[0];
+	below.split = get_split_plane(cmin, cmax, &below.axis);
+
+	return (int)(std::partition(start, start + count, below) - start);
+}
+
+// the middle of the longest axis of the center bounds
+scalar_t BVHTree::get_split_plane(const Vector3 &cmin, const Vector3 &cmax, int *axis) {
+	Vector3 csz = cmax - cmin;
+	*axis = csz.x > csz.y ? (csz.x > csz.z ? 0 : 2) : (csz.y > csz.z ? 1 : 2);
+	return ((&cmin.x)[*axis] + (&cmax.x)[*axis]) * 0.5;
+}
+
+void BVHTree::rebuild() {
+	nodes.clear();
+	item_order.clear();
+
+	centers.resize(items.size());
+	for(size_t i=0; i<items.size(); i++) {
+		if(items[i].active) {
+			item_order.push_back((int)i);
+			centers[i] = items[i].min + items[i].max;
+		}
+	}
+
+	if(!item_order.empty()) {
+		Vector3 cmin(FLT_MAX, FLT_MAX, FLT_MAX), cmax = -cmin;
+		for(size_t i=0; i<item_order.size(); i++) {
+			const Vector3 &c = centers[item_order[i]];
+			merge_bounds(&cmin, &cmax, c, c);
+		}
+
+		nodes.reserve(item_order.size() * 2 / LEAF_SIZE + 1);
+		build(0, (int)item_order.size(), -1, cmin, cmax);
+	}
+
+	refit_count = 0;
+	valid = true;
+}
+
+int BVHTree::get_item_count() const {
+	return item_count;
+}
+
+int BVHTree::get_node_count() const {
+	return (int)nodes.size();
+}
+
+void BVHTree::add_subtree(int node, std::vector<int> *res) const {
+	const Node *n = &nodes[node];
+	if(n->left == -1) {
+		for(int i=0; i<n->count; i++) {
+			res->push_back(item_order[n->first + i]);
+		}
+	} else {
+		add_subtree(n->left, res);
+		add_subtree(n->right, res);
+	}
+}
+
+void BVHTree::query(int node, const FrustumPlane *frustum, unsigned int mask, std::vector<int> *res) const {
+	const Node *n = &nodes[node];
+
+	int vis = aabox_frustum_test(n->min, n->max, frustum, &mask);
+	if(vis == BVOL_OUTSIDE) return;
+	if(vis == BVOL_INSIDE) {
+		add_subtree(node, res);
+		return;
+	}
+
+	if(n->left == -1) {
+		for(int i=0; i<n->count; i++) {
+			int id = item_order[n->first + i];
+			unsigned int item_mask = mask;
+			if(aabox_frustum_test(items[id].min, items[id].max, frustum, &item_mask) != BVOL_OUTSIDE) {
+				res->push_back(id);
+			}
+		}
+	} else {
+		query(n->left, frustum, mask, res);
+		query(n->right, frustum, mask, res);
+	}
+}
+
+/* appends the ids of all the items with bounds at least partially inside
+ * the frustum to res, returns the number of items added.
+ */
+int BVHTree::get_visible(const FrustumPlane *frustum, std::vector<int> *res) {
+	if(!valid) rebuild();
+	
+	size_t prev_size = res->size();
+	if(!nodes.empty()) {
+		query(0, frustum, 0x3f, res);
+	}
+	return (int)(res->size() - prev_size);
+}
+
+void BVHTree::query(int node, const Ray &ray, std::vector<int> *res, std::vector<scalar_t> *dist) const {
+	const Node *n = &nodes[node];
+	if(!aabox_ray_test(n->min, n->max, ray)) return;
+
+	if(n->left == -1) {
+		for(int i=0; i<n->count; i++) {
+			int id = item_order[n->first + i];
+			scalar_t t;
+			if(aabox_ray_test(items[id].min, items[id].max, ray, &t)) {
+				res->push_back(id);
+				if(dist) dist->push_back(t);
+			}
+		}
+	} else {
+		query(n->left, ray, res, dist);
+		query(n->right, ray, res, dist);
+	}
+}
+
+/* appends the ids of all the items whose bounds are hit by the ray to res,
+ * and if dist is not null, the ray parameter of each hit to dist.
+ */
+int BVHTree::get_ray_hits(const Ray &ray, std::vector<int> *res, std::vector<scalar_t> *dist) {
+	if(!valid) rebuild();
+
+	size_t prev_size = res->size();
+	if(!nodes.empty()) {
+		query(0, ray, res, dist);
+	}
+	return (int)(res->size() - prev_size);
+}
+
+/* returns the id of the item whose bounds are hit first by the ray, or -1,
+ * visiting the nearest child first and skipping any subtree entered
+ * further away than the best hit so far.
+ */
+int BVHTree::get_nearest_ray_hit(const Ray &ray, scalar_t *dist) {
+	if(!valid) rebuild();
+	if(nodes.empty()) return -1;
+
+	int best = -1;
+	scalar_t best_t = FLT_MAX;
+
+	std::vector<int> stack;
+	stack.push_back(0);
+
+	while(!stack.empty()) {
+		const Node *n = &nodes[stack.back()];
+		stack.pop_back();
+
+		scalar_t t;
+		if(!aabox_ray_test(n->min, n->max, ray, &t) || t >= best_t) continue;
+
+		if(n->left == -1) {
+			for(int i=0; i<n->count; i++) {
+				int id = item_order[n->first + i];
+				if(aabox_ray_test(items[id].min, items[id].max, ray, &t) && t < best_t) {
+					best_t = t;
+					best = id;
+				}
+			}
+		} else {
+			scalar_t tl, tr;
+			bool hit_l = aabox_ray_test(nodes[n->left].min, nodes[n->left].max, ray, &tl);
+			bool hit_r = aabox_ray_test(nodes[n->right].min, nodes[n->right].max, ray, &tr);
+			int left = n->left, right = n->right;
+
+			// push the furthest first, so that the nearest is visited first
+			if(hit_l && hit_r) {
+				if(tl < tr) {
+					stack.push_back(right);
+					stack.push_back(left);
+				} else {
+					stack.push_back(left);
+					stack.push_back(right);
+				}
+			} else if(hit_l) {
+				stack.push_back(left);
+			} else if(hit_r) {
+				stack.push_back(right);
+			}
+		}
+	}
+
+	if(dist && best != -1) *dist = best_t;
+	return best;
+}
@@ -0,0 +1,86 @@
+/*
+This file is part of the graphics core library.
+
+Copyright (c) 2004, 2005 John Tsiombikas <nuclear@siggraph.org>
+
+the graphics core library is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+the graphics core library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with the graphics core library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Dynamic bounding volume hierarchy (AABB tree) */
+
+#ifndef _BVH_HPP_
+#define _BVH_HPP_
+
+#include <vector>
+#include "bvol.hpp"
+
+/* Dynamic AABB tree over an arbitrary set of items, referenced by the
+ * integer ids returned from add_item(). Items that move are refitted in
+ * place as long as the tree quality is acceptable; adding/removing items,
+ * or too many refits since the last build, trigger a full (lazy) rebuild.
+ * Items are stored with slightly fattened bounds, so that small movements
+ * do not touch the tree at all.
+ */
+class BVHTree {
+private:
+	struct Node {
+		Vector3 min, max;
+		int parent;
+		int left, right;	// child nodes, -1 for leaves
+		int first, count;	// range of item_order covered by a leaf
+	};
+
+	struct Item {
+		Vector3 min, max;	// fattened bounds
+		int leaf;
+		bool active;
+	};
+
+	std::vector<Node> nodes;
+	std::vector<Item> items;
+	std::vector<int> item_order;
+	std::vector<int> free_items;
+	std::vector<Vector3> centers;	// item box centers (x2), used while building
+	int item_count;
+	scalar_t margin;
+	int refit_count;
+	bool valid;
+
+	int build(int first, int count, int parent, const Vector3 &cmin, const Vector3 &cmax);
+	int split(std::vector<int>::iterator start, int count, const Vector3 &cmin, const Vector3 &cmax) const;
+	static scalar_t get_split_plane(const Vector3 &cmin, const Vector3 &cmax, int *axis);
+	void refit(int node);
+	void query(int node, const FrustumPlane *frustum, unsigned int mask, std::vector<int> *res) const;
+	void query(int node, const Ray &ray, std::vector<int> *res, std::vector<scalar_t> *dist) const;
+	void add_subtree(int node, std::vector<int> *res) const;
+	
+public:
+	BVHTree(scalar_t margin = 0.1);
+
+	void clear();
+	int add_item(const Vector3 &min, const Vector3 &max);
+	void remove_item(int id);
+	void update_item(int id, const Vector3 &min, const Vector3 &max);
+
+	void rebuild();
+	int get_item_count() const;
+	int get_node_count() const;
+
+	int get_visible(const FrustumPlane *frustum, std::vector<int> *res);
+	int get_ray_hits(const Ray &ray, std::vector<int> *res, std::vector<scalar_t> *dist = 0);
+	int get_nearest_ray_hit(const Ray &ray, scalar_t *dist = 0);
+};
+
+#endif	// _BVH_HPP_
@@ -23,6 +23,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  * Author: John Tsiombikas 2005
  */
 
+#include <float.h>
 #include "bvol.hpp"
 
 BoundingVolume::BoundingVolume() {
@@ -74,3 +75,126 @@ bool BoundingSphere::visible(const FrustumPlane *frustum) const {
 	}
 	return false;
 }
+
+
+BoundingAABox::BoundingAABox(const Vector3 &min, const Vector3 &max) {
+	this->min = min;
+	this->max = max;
+}
+
+// returns the world-space bounding box of this box under xform
+BoundingAABox BoundingAABox::transformed(const Matrix4x4 &xform) const {
+	BoundingAABox box = *this;
+	aabox_transform(&box.min, &box.max, xform);
+	return box;
+}
+
+bool BoundingAABox::ray_hit(const Ray &ray) const {
+	BoundingAABox box = transformed(transform);
+	
+	if(!aabox_ray_test(box.min, box.max, ray)) return false;
+	if(!children.size()) return true;
+
+	for(size_t i=0; i<children.size(); i++) {
+		if(children[i]->ray_hit(ray)) return true;
+	}
+	return false;
+}
+
+bool BoundingAABox::visible(const FrustumPlane *frustum) const {
+	BoundingAABox box = transformed(transform);
+	
+	if(aabox_frustum_test(box.min, box.max, frustum) == BVOL_OUTSIDE) return false;
+	if(!children.size()) return true;
+
+	for(size_t i=0; i<children.size(); i++) {
+		if(children[i]->visible(frustum)) return true;
+	}
+	return false;
+}
+
+
+/* classifies a box against the 6 frustum planes, using the box corners
+ * furthest along and against each plane normal. If plane_mask is not null,
+ * only the planes with their bit set are tested, and the bits of the planes
+ * that contain the box completely are cleared, so that anything contained
+ * in this box (e.g. BVH children) need not test against them again.
+ */
+int aabox_frustum_test(const Vector3 &min, const Vector3 &max, const FrustumPlane *frustum, unsigned int *plane_mask) {
+	unsigned int mask = plane_mask ? *plane_mask : 0x3f;
+	int res = BVOL_INSIDE;
+
+	for(int i=0; i<6; i++) {
+		if(!(mask & (1 << i))) continue;
+		const FrustumPlane *p = frustum + i;
+
+		scalar_t px = p->a >= 0.0 ? max.x : min.x;
+		scalar_t py = p->b >= 0.0 ? max.y : min.y;
+		scalar_t pz = p->c >= 0.0 ? max.z : min.z;
+		if(p->a * px + p->b * py + p->c * pz + p->d < 0.0) {
+			return BVOL_OUTSIDE;
+		}
+
+		scalar_t nx = p->a >= 0.0 ? min.x : max.x;
+		scalar_t ny = p->b >= 0.0 ? min.y : max.y;
+		scalar_t nz = p->c >= 0.0 ? min.z : max.z;
+		if(p->a * nx + p->b * ny + p->c * nz + p->d >= 0.0) {
+			mask &= ~(1 << i);
+		} else {
+			res = BVOL_INTERSECT;
+		}
+	}
+
+	if(plane_mask) *plane_mask = mask;
+	return res;
+}
+
+/* slab test of a ray (origin + t * dir, t >= 0) against a box, optionally
+ * returns the ray parameter where it enters the box (0 if it starts inside).
+ */
+bool aabox_ray_test(const Vector3 &min, const Vector3 &max, const Ray &ray, scalar_t *t) {
+	const scalar_t *bmin = &min.x, *bmax = &max.x;
+	const scalar_t *orig = &ray.origin.x, *dir = &ray.dir.x;
+	scalar_t tnear = 0.0, tfar = FLT_MAX;
+
+	for(int i=0; i<3; i++) {
+		if(fabs(dir[i]) < xsmall_number) {
+			if(orig[i] < bmin[i] || orig[i] > bmax[i]) return false;
+			continue;
+		}
+
+		scalar_t inv_dir = 1.0 / dir[i];
+		scalar_t t0 = (bmin[i] - orig[i]) * inv_dir;
+		scalar_t t1 = (bmax[i] - orig[i]) * inv_dir;
+		if(t0 > t1) {
+			scalar_t tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+
+		if(t0 > tnear) tnear = t0;
+		if(t1 < tfar) tfar = t1;
+		if(tnear > tfar) return false;
+	}
+
+	if(t) *t = tnear;
+	return true;
+}
+
+/* transforms a box and replaces it with the axis-aligned box enclosing
+ * the result, by transforming the center and projecting the extents.
+ */
+void aabox_transform(Vector3 *min, Vector3 *max, const Matrix4x4 &xform) {
+	Vector3 center = (*min + *max) * 0.5;
+	Vector3 ext = (*max - *min) * 0.5;
+
+	Vector3 new_center = center.transformed(xform);
+	Vector3 new_ext;
+	scalar_t *next = &new_ext.x;
+	for(int i=0; i<3; i++) {
+		next[i] = fabs(xform[i][0]) * ext.x + fabs(xform[i][1]) * ext.y + fabs(xform[i][2]) * ext.z;
+	}
+
+	*min = new_center - new_ext;
+	*max = new_center + new_ext;
+}
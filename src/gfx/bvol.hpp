@@ -54,4 +54,23 @@ public:
 	virtual bool visible(const FrustumPlane *frustum) const;
 };
 
+class BoundingAABox : public BoundingVolume {
+public:
+	Vector3 min, max;
+
+	BoundingAABox(const Vector3 &min = Vector3(0,0,0), const Vector3 &max = Vector3(0,0,0));
+
+	BoundingAABox transformed(const Matrix4x4 &xform) const;
+
+	virtual bool ray_hit(const Ray &ray) const;
+	virtual bool visible(const FrustumPlane *frustum) const;
+};
+
+// axis-aligned box tests, shared by BoundingAABox and BVHTree
+enum {BVOL_OUTSIDE, BVOL_INTERSECT, BVOL_INSIDE};
+
+int aabox_frustum_test(const Vector3 &min, const Vector3 &max, const FrustumPlane *frustum, unsigned int *plane_mask = 0);
+bool aabox_ray_test(const Vector3 &min, const Vector3 &max, const Ray &ray, scalar_t *t = 0);
+void aabox_transform(Vector3 *min, Vector3 *max, const Matrix4x4 &xform);
+
 #endif	// _BVOL_HPP_
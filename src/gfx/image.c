@@ -26,69 +26,188 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <stdio.h>
 #include <stdlib.h>
 #include "image.h"
+#include "common/simd.h"
 
 #ifdef IMGLIB_USE_PNG
 int check_png(FILE *fp);
-void *load_png(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int probe_png(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int load_png_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch);
 int save_png(FILE *fp, void *pixels, unsigned long xsz, unsigned long ysz);
 #endif	/* IMGLIB_USE_PNG */
 
 #ifdef IMGLIB_USE_JPEG
 int check_jpeg(FILE *fp);
-void *load_jpeg(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int probe_jpeg(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int load_jpeg_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch);
 int save_jpeg(FILE *fp, void *pixels, unsigned long xsz, unsigned long ysz);
 #endif	/* IMGLIB_USE_JPEG */
 
 #ifdef IMGLIB_USE_TGA
 int check_tga(FILE *fp);
-void *load_tga(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int probe_tga(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int load_tga_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch);
 int save_tga(FILE *fp, void *pixels, unsigned long xsz, unsigned long ysz);
 #endif	/* IMGLIB_USE_TGA */
 
 #ifdef IMGLIB_USE_PPM
 int check_ppm(FILE *fp);
-void *load_ppm(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int probe_ppm(FILE *fp, unsigned long *xsz, unsigned long *ysz);
+int load_ppm_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch);
 int save_ppm(FILE *fp, void *pixels, unsigned long xsz, unsigned long ysz);
 #endif	/* IMGLIB_USE_PPM */
 
 
 static unsigned long save_flags;
 
+static int find_format(FILE *fp) {
+#ifdef IMGLIB_USE_PNG
+	if(check_png(fp)) return IMG_FMT_PNG;
+#endif	/* IMGLIB_USE_PNG */
+
+#ifdef IMGLIB_USE_JPEG
+	if(check_jpeg(fp)) return IMG_FMT_JPEG;
+#endif	/* IMGLIB_USE_JPEG */
+
+#ifdef IMGLIB_USE_TGA
+	if(check_tga(fp)) return IMG_FMT_TGA;
+#endif	/* IMGLIB_USE_TGA */
+
+#ifdef IMGLIB_USE_PPM
+	if(check_ppm(fp)) return IMG_FMT_PPM;
+#endif	/* IMGLIB_USE_PPM */
+
+	return -1;
+}
+
+static int probe_file(FILE *fp, int fmt, unsigned long *xsz, unsigned long *ysz) {
+	switch(fmt) {
+#ifdef IMGLIB_USE_PNG
+	case IMG_FMT_PNG:
+		return probe_png(fp, xsz, ysz);
+#endif	/* IMGLIB_USE_PNG */
+
+#ifdef IMGLIB_USE_JPEG
+	case IMG_FMT_JPEG:
+		return probe_jpeg(fp, xsz, ysz);
+#endif	/* IMGLIB_USE_JPEG */
+
+#ifdef IMGLIB_USE_TGA
+	case IMG_FMT_TGA:
+		return probe_tga(fp, xsz, ysz);
+#endif	/* IMGLIB_USE_TGA */
+
+#ifdef IMGLIB_USE_PPM
+	case IMG_FMT_PPM:
+		return probe_ppm(fp, xsz, ysz);
+#endif	/* IMGLIB_USE_PPM */
+
+	default:
+		break;
+	}
+	return -1;
+}
+
+static int load_file(FILE *fp, int fmt, void *dest, unsigned long xsz, unsigned long ysz, long pitch) {
+	switch(fmt) {
+#ifdef IMGLIB_USE_PNG
+	case IMG_FMT_PNG:
+		return load_png_into(fp, dest, xsz, ysz, pitch);
+#endif	/* IMGLIB_USE_PNG */
+
+#ifdef IMGLIB_USE_JPEG
+	case IMG_FMT_JPEG:
+		return load_jpeg_into(fp, dest, xsz, ysz, pitch);
+#endif	/* IMGLIB_USE_JPEG */
+
+#ifdef IMGLIB_USE_TGA
+	case IMG_FMT_TGA:
+		return load_tga_into(fp, dest, xsz, ysz, pitch);
+#endif	/* IMGLIB_USE_TGA */
+
+#ifdef IMGLIB_USE_PPM
+	case IMG_FMT_PPM:
+		return load_ppm_into(fp, dest, xsz, ysz, pitch);
+#endif	/* IMGLIB_USE_PPM */
+
+	default:
+		break;
+	}
+	return -1;
+}
 
 void *load_image(const char *fname, unsigned long *xsz, unsigned long *ysz) {
 	FILE *file;
+	int fmt;
+	unsigned long x, y;
+	void *pixels;
 
 	if(!(file = fopen(fname, "rb"))) {
 		fprintf(stderr, "Image loading error: could not open file %s\n", fname);
 		return 0;
 	}
-	
-#ifdef IMGLIB_USE_PNG
-	if(check_png(file)) {
-		return load_png(file, xsz, ysz);
+
+	if((fmt = find_format(file)) == -1 || probe_file(file, fmt, &x, &y) == -1) {
+		fclose(file);
+		return 0;
 	}
-#endif	/* IMGLIB_USE_PNG */
-	
-#ifdef IMGLIB_USE_JPEG
-	if(check_jpeg(file)) {
-		return load_jpeg(file, xsz, ysz);
+
+	if(!(pixels = malloc(x * y * 4))) {
+		fclose(file);
+		return 0;
 	}
-#endif	/* IMGLIB_USE_JPEG */
-	
-#ifdef IMGLIB_USE_TGA
-	if(check_tga(file)) {
-		return load_tga(file, xsz, ysz);
+
+	if(load_file(file, fmt, pixels, x, y, x * 4) == -1) {
+		free(pixels);
+		fclose(file);
+		return 0;
 	}
-#endif	/* IMGLIB_USE_TGA */
 
-#ifdef IMGLIB_USE_PPM
-	if(check_ppm(file)) {
-		return load_ppm(file, xsz, ysz);
+	fclose(file);
+	*xsz = x;
+	*ysz = y;
+	return pixels;
+}
+
+int probe_image(const char *fname, unsigned long *xsz, unsigned long *ysz) {
+	FILE *file;
+	int fmt, res;
+
+	if(!(file = fopen(fname, "rb"))) {
+		fprintf(stderr, "Image loading error: could not open file %s\n", fname);
+		return -1;
 	}
-#endif	/* IMGLIB_USE_PPM */
+
+	res = (fmt = find_format(file)) == -1 ? -1 : probe_file(file, fmt, xsz, ysz);
 
 	fclose(file);
-	return 0;
+	return res;
+}
+
+int load_image_into(const char *fname, void *dest, unsigned long xsz, unsigned long ysz, long pitch) {
+	FILE *file;
+	int fmt, res;
+	unsigned long x, y;
+
+	if(!(file = fopen(fname, "rb"))) {
+		fprintf(stderr, "Image loading error: could not open file %s\n", fname);
+		return -1;
+	}
+
+	if((fmt = find_format(file)) == -1 || probe_file(file, fmt, &x, &y) == -1) {
+		fclose(file);
+		return -1;
+	}
+
+	if(x != xsz || y != ysz) {
+		fprintf(stderr, "Image loading error: %s is %lux%lu, expected %lux%lu\n", fname, x, y, xsz, ysz);
+		fclose(file);
+		return -1;
+	}
+
+	res = load_file(file, fmt, dest, xsz, ysz, pitch ? pitch : (long)xsz * 4);
+
+	fclose(file);
+	return res;
 }
 
 void free_image(void *img) {
@@ -146,3 +265,137 @@ void set_image_save_flags(unsigned int flags) {
 unsigned int get_image_save_flags(void) {
 	return save_flags;
 }
+
+
+/* Pixel conversions for the loaders (JT)
+ * the loaders read the pixels of each row at the end of the destination row
+ * and expand them to 32bit in place, so src may be inside dest, as long as
+ * it's not before the pixels converted so far (src >= dest + count for 24bit
+ * pixels, src >= dest + 3 * count for 8bit ones). The conversions go front to
+ * back, and the SSSE3 versions load 16 pixels before storing any of them,
+ * which keeps that safe.
+ * The destination byte order is always B, G, R, A (see color_bits.h).
+ */
+
+#ifdef X86_SIMD
+static int have_ssse3(void) {
+	static int ssse3 = -1;
+	if(ssse3 == -1) {
+		ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+	}
+	return ssse3;
+}
+
+TARGET_SSSE3
+static unsigned long conv24_ssse3(unsigned char *dest, const unsigned char *src, unsigned long count, int swap_rb) {
+	__m128i alpha = _mm_set1_epi32((int)0xff000000);
+	__m128i shuf;
+	unsigned long i;
+
+	if(swap_rb) {
+		shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	} else {
+		shuf = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	}
+
+	for(i=0; i + 16 <= count; i+=16) {
+		const __m128i *sptr = (const __m128i*)(src + i * 3);
+		__m128i *dptr = (__m128i*)(dest + i * 4);
+
+		__m128i a = _mm_loadu_si128(sptr);
+		__m128i b = _mm_loadu_si128(sptr + 1);
+		__m128i c = _mm_loadu_si128(sptr + 2);
+
+		/* line up 4 pixels at the start of each register */
+		__m128i p1 = _mm_alignr_epi8(b, a, 12);
+		__m128i p2 = _mm_alignr_epi8(c, b, 8);
+		__m128i p3 = _mm_srli_si128(c, 4);
+
+		_mm_storeu_si128(dptr, _mm_or_si128(_mm_shuffle_epi8(a, shuf), alpha));
+		_mm_storeu_si128(dptr + 1, _mm_or_si128(_mm_shuffle_epi8(p1, shuf), alpha));
+		_mm_storeu_si128(dptr + 2, _mm_or_si128(_mm_shuffle_epi8(p2, shuf), alpha));
+		_mm_storeu_si128(dptr + 3, _mm_or_si128(_mm_shuffle_epi8(p3, shuf), alpha));
+	}
+	return i;
+}
+
+TARGET_SSSE3
+static unsigned long conv8_ssse3(unsigned char *dest, const unsigned char *src, unsigned long count) {
+	__m128i alpha = _mm_set1_epi32((int)0xff000000);
+	__m128i shuf0 = _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+	__m128i next = _mm_setr_epi8(4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0, 4, 4, 4, 0);
+	unsigned long i;
+
+	for(i=0; i + 16 <= count; i+=16) {
+		__m128i *dptr = (__m128i*)(dest + i * 4);
+		__m128i g = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i shuf = shuf0;
+		int j;
+
+		for(j=0; j<4; j++) {
+			_mm_storeu_si128(dptr + j, _mm_or_si128(_mm_shuffle_epi8(g, shuf), alpha));
+			shuf = _mm_add_epi8(shuf, next);	/* the alpha entries stay -1 */
+		}
+	}
+	return i;
+}
+#endif	/* X86_SIMD */
+
+static void conv24(unsigned char *dest, const unsigned char *src, unsigned long count, int swap_rb) {
+	unsigned long i = 0;
+	int r = swap_rb ? 0 : 2;
+	int b = swap_rb ? 2 : 0;
+
+#ifdef X86_SIMD
+	if(have_ssse3()) {
+		i = conv24_ssse3(dest, src, count, swap_rb);
+	}
+#endif
+
+	for(; i<count; i++) {
+		unsigned char pix[3];
+		pix[0] = src[i * 3];
+		pix[1] = src[i * 3 + 1];
+		pix[2] = src[i * 3 + 2];
+
+		dest[i * 4] = pix[b];
+		dest[i * 4 + 1] = pix[1];
+		dest[i * 4 + 2] = pix[r];
+		dest[i * 4 + 3] = 0xff;
+	}
+}
+
+/* conv_bgr24_bgra - (JT) for the B, G, R byte order of targa files */
+void conv_bgr24_bgra(unsigned char *dest, const unsigned char *src, unsigned long count) {
+	conv24(dest, src, count, 0);
+}
+
+/* conv_rgb24_bgra - (JT) for the R, G, B byte order of ppm and jpeg */
+void conv_rgb24_bgra(unsigned char *dest, const unsigned char *src, unsigned long count) {
+	conv24(dest, src, count, 1);
+}
+
+/* conv_gray8_bgra - (JT) grayscale to opaque gray */
+void conv_gray8_bgra(unsigned char *dest, const unsigned char *src, unsigned long count) {
+	unsigned long i = 0;
+
+#ifdef X86_SIMD
+	if(have_ssse3()) {
+		i = conv8_ssse3(dest, src, count);
+	}
+#endif
+
+	for(; i<count; i++) {
+		unsigned char c = src[i];
+		dest[i * 4] = dest[i * 4 + 1] = dest[i * 4 + 2] = c;
+		dest[i * 4 + 3] = 0xff;
+	}
+}
+
+/* set_opaque_alpha - (JT) for 32bit pixels without meaningful alpha */
+void set_opaque_alpha(unsigned char *pixels, unsigned long count) {
+	unsigned long i;
+	for(i=0; i<count; i++) {
+		pixels[i * 4 + 3] = 0xff;
+	}
+}
@@ -69,6 +69,19 @@ extern "C" {
  */
 void *load_image(const char *fname, unsigned long *xsz, unsigned long *ysz);
 
+/* probe_image() reads just enough of the image file to find its size,
+ * returns 0 on success, -1 if it can't be read or the format is unknown.
+ */
+int probe_image(const char *fname, unsigned long *xsz, unsigned long *ysz);
+
+/* load_image_into() decodes the image directly into dest, without allocating
+ * any pixel buffers. xsz and ysz must be the size reported by probe_image,
+ * pitch is the distance in bytes from the start of a row to the next, 0 for
+ * xsz * 4. A negative pitch, with dest pointing to the last row, stores the
+ * image bottom-up. Returns 0 on success, -1 on failure.
+ */
+int load_image_into(const char *fname, void *dest, unsigned long xsz, unsigned long ysz, long pitch);
+
 /* deallocate the image data with this function
  * note: provided for consistency, simply calls free()
  */
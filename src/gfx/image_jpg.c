@@ -40,10 +40,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <jpeglib.h>
 #include "color_bits.h"
 
-typedef struct
-{
-	unsigned char r,g,b;
-} RGBTriplet;
+void conv_rgb24_bgra(unsigned char *dest, const unsigned char *src, unsigned long count);
 
 /*jpeg signature*/
 int check_jpeg(FILE *fp){
@@ -63,13 +60,26 @@ int check_jpeg(FILE *fp){
     return 1;
 }
 
-void *load_jpeg(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
-	int i;
-	RGBTriplet *buffer;
-	uint32_t *image;
-	
-	JSAMPLE *tmp;
-    
+int probe_jpeg(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+
+	fseek(fp, 0, SEEK_SET);
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fp);
+
+	jpeg_read_header(&cinfo, TRUE);
+
+	*xsz = cinfo.image_width;
+	*ysz = cinfo.image_height;
+
+	jpeg_destroy_decompress(&cinfo);
+	return 0;
+}
+
+int load_jpeg_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch) {
 	struct jpeg_decompress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
@@ -80,45 +90,42 @@ void *load_jpeg(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
 	jpeg_stdio_src(&cinfo, fp);
 	
 	jpeg_read_header(&cinfo, TRUE);
+
+	if(cinfo.image_width != xsz || cinfo.image_height != ysz) {
+		jpeg_destroy_decompress(&cinfo);
+		return -1;
+	}
 	
+#ifdef JCS_EXTENSIONS
+	/* libjpeg-turbo can output our byte order directly, with opaque alpha */
+	cinfo.out_color_space = JCS_EXT_BGRA;
+#else
 	/* force output to rgb */
 	cinfo.out_color_space = JCS_RGB;
-	
-    /* allocate space */
-    buffer = malloc(cinfo.image_width * sizeof(RGBTriplet));
-    if (!buffer) return 0;
-    image = malloc(cinfo.image_width * (cinfo.image_height) * sizeof(uint32_t));
-    if (!image) return 0;
-    
-    tmp = (JSAMPLE*) buffer;
-
-	/* return w and h */
-	*xsz = cinfo.image_width;
-	*ysz = cinfo.image_height;
-    
-	/* Decompress, pack and store */
-    jpeg_start_decompress(&cinfo);
-    {
-        while (cinfo.output_scanline < cinfo.output_height) 
-        {
-            jpeg_read_scanlines(&cinfo, &tmp, 1);
-			if (cinfo.output_scanline == 0) continue;
-            
-            for (i=0;i<cinfo.image_width;i++)
-            {
-				int offs = i + (cinfo.output_scanline-1) * cinfo.output_width;
-                image[offs] = PACK_COLOR24(buffer[i].r, buffer[i].g, buffer[i].b);
-            }
-        }
-    }
-    jpeg_finish_decompress(&cinfo);
+#endif
+
+	/* Decompress each scanline into its place in dest. Without the libjpeg-turbo
+	 * extensions, it goes at the end of the row and is expanded in place.
+	 */
+	jpeg_start_decompress(&cinfo);
+	while(cinfo.output_scanline < cinfo.output_height) {
+		unsigned char *row = (unsigned char*)dest + (long)cinfo.output_scanline * pitch;
+		JSAMPROW line;
+
+#ifdef JCS_EXTENSIONS
+		line = row;
+		jpeg_read_scanlines(&cinfo, &line, 1);
+#else
+		line = row + xsz;
+		jpeg_read_scanlines(&cinfo, &line, 1);
+		conv_rgb24_bgra(row, line, xsz);
+#endif
+	}
+	jpeg_finish_decompress(&cinfo);
 	
 	/*Done - cleanup*/
 	jpeg_destroy_decompress(&cinfo);
-	free(buffer);
-	fclose(fp);
-
-	return (void*) image;
+	return 0;
 }
 
 /* TODO: implement this */
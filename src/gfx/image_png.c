@@ -41,80 +41,107 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 int check_png(FILE *fp) {
 	unsigned char sig[FILE_SIG_BYTES];
 
+	fseek(fp, 0, SEEK_SET);
 	fread(sig, 1, FILE_SIG_BYTES, fp);
 
 	return png_sig_cmp(sig, 0, FILE_SIG_BYTES) == 0 ? 1 : 0;
 }
 
-void *load_png(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
+int probe_png(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
 	png_struct *png_ptr;
 	png_info *info_ptr;
-	int i;
-	uint32_t **lineptr, *pixels, width, height;
+
+	if(!(png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
+		return -1;
+	}
+	
+	if(!(info_ptr = png_create_info_struct(png_ptr))) {
+		png_destroy_read_struct(&png_ptr, 0, 0);
+		return -1;
+	}
+	
+	if(setjmp(png_jmpbuf(png_ptr))) {		
+		png_destroy_read_struct(&png_ptr, &info_ptr, 0);
+		return -1;
+	}
+
+	fseek(fp, FILE_SIG_BYTES, SEEK_SET);
+	png_init_io(png_ptr, fp);	
+	png_set_sig_bytes(png_ptr, FILE_SIG_BYTES);
+	png_read_info(png_ptr, info_ptr);
+
+	*xsz = png_get_image_width(png_ptr, info_ptr);
+	*ysz = png_get_image_height(png_ptr, info_ptr);
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, 0);
+	return 0;
+}
+
+int load_png_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch) {
+	png_struct *png_ptr;
+	png_info *info_ptr;
+	int i, pass, passes;
+	png_uint_32 width, height;
 	int channel_bits, color_type, ilace_type, compression, filtering;
 	
 	if(!(png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
-		fclose(fp);
-		return 0;
+		return -1;
 	}
 	
 	if(!(info_ptr = png_create_info_struct(png_ptr))) {
 		png_destroy_read_struct(&png_ptr, 0, 0);
-		fclose(fp);
-		return 0;
+		return -1;
 	}
 	
 	if(setjmp(png_jmpbuf(png_ptr))) {		
 		png_destroy_read_struct(&png_ptr, &info_ptr, 0);
-		fclose(fp);
-		return 0;
+		return -1;
 	}
 	
+	fseek(fp, FILE_SIG_BYTES, SEEK_SET);
 	png_init_io(png_ptr, fp);	
 	png_set_sig_bytes(png_ptr, FILE_SIG_BYTES);
-	
-	png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_BGR, 0);
+	png_read_info(png_ptr, info_ptr);
 		
 	png_get_IHDR(png_ptr, info_ptr, &width, &height, &channel_bits, &color_type, &ilace_type, &compression, &filtering);
-	pixels = malloc(width * height * sizeof(uint32_t));
-	
-	lineptr = (uint32_t**)png_get_rows(png_ptr, info_ptr);
-	
-	for(i=0; i<height; i++) {
-		
-		switch(color_type) {
-		case PNG_COLOR_TYPE_RGB:
-			{
-				int j;
-				unsigned char *ptr = (unsigned char*)lineptr[i];
-				for(j=0; j<width; j++) {
-			
-					uint32_t pixel;
-					pixel = PACK_COLOR24(*(ptr+2), *(ptr+1), *ptr);
-					ptr+=3;
-					pixels[i * width + j] = pixel;
-				}
-			}
-			break;
-			
-		case PNG_COLOR_TYPE_RGB_ALPHA:
-			memcpy(&pixels[i * width], lineptr[i], width * sizeof(uint32_t));
-			break;
-			
-		default:
-			png_destroy_read_struct(&png_ptr, &info_ptr, 0);
-			fclose(fp);
-			return 0;
+	if(width != xsz || height != ysz) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, 0);
+		return -1;
+	}
+
+	/* have libpng convert everything to 8bit B, G, R, A */
+	if(color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_set_palette_to_rgb(png_ptr);
+	}
+	if(color_type == PNG_COLOR_TYPE_GRAY && channel_bits < 8) {
+		png_set_expand_gray_1_2_4_to_8(png_ptr);
+	}
+	if(png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+		png_set_tRNS_to_alpha(png_ptr);
+	}
+	if(channel_bits == 16) {
+		png_set_strip_16(png_ptr);
+	}
+	if(!(color_type & PNG_COLOR_MASK_COLOR)) {
+		png_set_gray_to_rgb(png_ptr);
+	}
+	png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);	/* unless there's alpha */
+	png_set_bgr(png_ptr);
+
+	passes = png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+
+	/* the rows are decoded right into dest, interlaced images take more
+	 * than one pass over them.
+	 */
+	for(pass=0; pass<passes; pass++) {
+		for(i=0; i<height; i++) {
+			png_read_row(png_ptr, (png_byte*)dest + (long)i * pitch, 0);
 		}
-				
 	}
 	
 	png_destroy_read_struct(&png_ptr, &info_ptr, 0);
-	fclose(fp);
-
-	*xsz = width;
-	*ysz = height;
-	return pixels;
+	return 0;
 }
 
 /* TODO: implement this */
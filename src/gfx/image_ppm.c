@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include "color_bits.h"
 
+void conv_rgb24_bgra(unsigned char *dest, const unsigned char *src, unsigned long count);
 
 int check_ppm(FILE *fp) {
 	fseek(fp, 0, SEEK_SET);
@@ -16,7 +17,11 @@ int check_ppm(FILE *fp) {
 	return 0;
 }
 
-static int read_to_wspace(FILE *fp, char *buf, int bsize) {
+/* reads the next header field, skipping comments. skip_wspace makes it
+ * skip all the whitespace after it, not just the first character, which
+ * can't be done after the last field, as the pixel data follow.
+ */
+static int read_to_wspace(FILE *fp, char *buf, int bsize, int skip_wspace) {
 	int c, count = 0;
 	
 	while((c = fgetc(fp)) != -1 && !isspace(c) && count < bsize - 1) {
@@ -30,80 +35,73 @@ static int read_to_wspace(FILE *fp, char *buf, int bsize) {
 	}
 	*buf = 0;
 	
-	while((c = fgetc(fp)) != -1 && isspace(c));
-	ungetc(c, fp);
+	if(skip_wspace) {
+		while((c = fgetc(fp)) != -1 && isspace(c));
+		ungetc(c, fp);
+	}
 	return count;
 }
 
-void *load_ppm(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
+/* reads the header, leaving the file at the start of the pixel data */
+static int read_header(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
 	char buf[64];
-	int bytes, raw;
-	unsigned int w, h, i, sz;
-	uint32_t *pixels;
-	
+
 	fseek(fp, 0, SEEK_SET);
 	
-	bytes = read_to_wspace(fp, buf, 64);
-	raw = buf[1] == '6';
+	read_to_wspace(fp, buf, 64, 1);
 
-	if((bytes = read_to_wspace(fp, buf, 64)) == 0) {
-		fclose(fp);
-		return 0;
+	if(read_to_wspace(fp, buf, 64, 1) == 0) {
+		return -1;
 	}
 	if(!isdigit(*buf)) {
-		fprintf(fp, "load_ppm: invalid width: %s", buf);
-		fclose(fp);
-		return 0;
+		fprintf(stderr, "load_ppm: invalid width: %s\n", buf);
+		return -1;
 	}
-	w = atoi(buf);
+	*xsz = atoi(buf);
 
-	if((bytes = read_to_wspace(fp, buf, 64)) == 0) {
-		fclose(fp);
-		return 0;
+	if(read_to_wspace(fp, buf, 64, 1) == 0) {
+		return -1;
 	}
 	if(!isdigit(*buf)) {
-		fprintf(fp, "load_ppm: invalid height: %s", buf);
-		fclose(fp);
-		return 0;
+		fprintf(stderr, "load_ppm: invalid height: %s\n", buf);
+		return -1;
 	}
-	h = atoi(buf);
+	*ysz = atoi(buf);
 
-	if((bytes = read_to_wspace(fp, buf, 64)) == 0) {
-		fclose(fp);
-		return 0;
+	if(read_to_wspace(fp, buf, 64, 0) == 0) {
+		return -1;
 	}
 	if(!isdigit(*buf) || atoi(buf) != 255) {
-		fprintf(fp, "load_ppm: invalid or unsupported max value: %s", buf);
-		fclose(fp);
-		return 0;
+		fprintf(stderr, "load_ppm: invalid or unsupported max value: %s\n", buf);
+		return -1;
 	}
+	return 0;
+}
 
-	if(!(pixels = malloc(w * h * sizeof *pixels))) {
-		fputs("malloc failed", fp);
-		fclose(fp);
-		return 0;
-	}
+int probe_ppm(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
+	return read_header(fp, xsz, ysz);
+}
 
-	sz = h * w;
-	for(i=0; i<sz; i++) {
-		int r = fgetc(fp);
-		int g = fgetc(fp);
-		int b = fgetc(fp);
+int load_ppm_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch) {
+	unsigned long w, h, i;
 
-		if(r == -1 || g == -1 || b == -1) {
-			free(pixels);
-			fclose(fp);
-			fputs("load_ppm: EOF while reading pixel data", fp);
-			return 0;
-		}
-		pixels[i] = PACK_COLOR24(r, g, b);
+	if(read_header(fp, &w, &h) == -1 || w != xsz || h != ysz) {
+		return -1;
 	}
 
-	fclose(fp);
+	/* each row is read at the end of its place in dest, and expanded
+	 * to 32 bits in place.
+	 */
+	for(i=0; i<ysz; i++) {
+		unsigned char *row = (unsigned char*)dest + (long)i * pitch;
 
-	if(xsz) *xsz = w;
-	if(ysz) *ysz = h;
-	return pixels;
+		if(fread(row + xsz, 3, xsz, fp) < xsz) {
+			fputs("load_ppm: EOF while reading pixel data\n", stderr);
+			return -1;
+		}
+		conv_rgb24_bgra(row, row + xsz, xsz);
+	}
+	return 0;
 }
 
 int save_ppm(FILE *fp, void *pixels, unsigned long xsz, unsigned long ysz) {
@@ -63,8 +63,24 @@ struct tga_footer {
 	char sig[18];				/* signature with . and \0 */
 };
 
+/* rle packets may cross rows, so the decoder state is kept between rows */
+#define RLE_BUF_SIZE	4096
+
+struct rle_state {
+	FILE *fp;
+	unsigned char buf[RLE_BUF_SIZE];
+	unsigned long pos, count;	/* read position and amount of data in buf */
+	unsigned long run;			/* pixels left in the current packet */
+	int repeat;					/* nonzero for run-length packets */
+	unsigned char pix[4];		/* the repeated pixel */
+};
+
 /*static void print_tga_info(struct tga_header *hdr);*/
 
+void conv_bgr24_bgra(unsigned char *dest, const unsigned char *src, unsigned long count);
+void conv_gray8_bgra(unsigned char *dest, const unsigned char *src, unsigned long count);
+void set_opaque_alpha(unsigned char *pixels, unsigned long count);
+
 int check_tga(FILE *fp) {
 	struct tga_footer foot;
 	
@@ -75,77 +91,185 @@ int check_tga(FILE *fp) {
 	return strcmp(foot.sig, "TRUEVISION-XFILE.") == 0 ? 1 : 0;
 }
 
-void *load_tga(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
-	struct tga_header hdr;
-	unsigned long x, y, sz;
-	int i;
-	uint32_t *pix;
+static int read_header(FILE *fp, struct tga_header *hdr) {
+	unsigned char buf[18];
 
-	/* read header */
 	fseek(fp, 0, SEEK_SET);
-	hdr.idlen = fgetc(fp);
-	hdr.cmap_type = fgetc(fp);
-	hdr.img_type = fgetc(fp);
-	hdr.cmap_first = read_int16_le(fp);
-	hdr.cmap_len = read_int16_le(fp);
-	hdr.cmap_entry_sz = fgetc(fp);
-	hdr.img_x = read_int16_le(fp);
-	hdr.img_y = read_int16_le(fp);
-	hdr.img_width = read_int16_le(fp);
-	hdr.img_height = read_int16_le(fp);
-	hdr.img_bpp = fgetc(fp);
-	hdr.img_desc = fgetc(fp);
-
-	if(feof(fp)) {
-		fclose(fp);
-		return 0;
+	if(fread(buf, 1, 18, fp) < 18) {
+		return -1;
 	}
-	
-	/* only read true color images */
-	if(hdr.img_type != 2) {
-		fclose(fp);
-		fprintf(stderr, "only true color tga images supported\n");
-		return 0;
+
+	hdr->idlen = buf[0];
+	hdr->cmap_type = buf[1];
+	hdr->img_type = buf[2];
+	hdr->cmap_first = buf[3] | (buf[4] << 8);
+	hdr->cmap_len = buf[5] | (buf[6] << 8);
+	hdr->cmap_entry_sz = buf[7];
+	hdr->img_x = buf[8] | (buf[9] << 8);
+	hdr->img_y = buf[10] | (buf[11] << 8);
+	hdr->img_width = buf[12] | (buf[13] << 8);
+	hdr->img_height = buf[14] | (buf[15] << 8);
+	hdr->img_bpp = buf[16];
+	hdr->img_desc = buf[17];
+
+	/* only true color (24 or 32 bits) and grayscale (8 bits) images,
+	 * uncompressed or rle compressed.
+	 */
+	switch(hdr->img_type) {
+	case 2:
+	case 10:
+		if(hdr->img_bpp == 24 || hdr->img_bpp == 32) {
+			return 0;
+		}
+		break;
+
+	case 3:
+	case 11:
+		if(hdr->img_bpp == 8) {
+			return 0;
+		}
+		break;
+
+	default:
+		break;
 	}
 
-	fseek(fp, hdr.idlen, SEEK_CUR); /* skip the image ID */
+	fprintf(stderr, "only true color and grayscale tga images supported\n");
+	return -1;
+}
 
-	/* skip the color map if it exists */
-	if(hdr.cmap_type == 1) {
-		fseek(fp, hdr.cmap_len * hdr.cmap_entry_sz / 8, SEEK_CUR);
+int probe_tga(FILE *fp, unsigned long *xsz, unsigned long *ysz) {
+	struct tga_header hdr;
+
+	if(read_header(fp, &hdr) == -1) {
+		return -1;
 	}
+	*xsz = hdr.img_width;
+	*ysz = hdr.img_height;
+	return 0;
+}
+
+static int rle_read(struct rle_state *rs, unsigned char *dest, unsigned long bytes) {
+	while(bytes) {
+		unsigned long sz;
+
+		if(rs->pos >= rs->count) {
+			rs->pos = 0;
+			if(!(rs->count = fread(rs->buf, 1, RLE_BUF_SIZE, rs->fp))) {
+				return -1;
+			}
+		}
+
+		sz = rs->count - rs->pos;
+		if(sz > bytes) sz = bytes;
 
-	x = hdr.img_width;
-	y = hdr.img_height;
-	sz = x * y;
-	if(!(pix = malloc(sz * 4))) {
-		fclose(fp);
-		return 0;
+		memcpy(dest, rs->buf + rs->pos, sz);
+		rs->pos += sz;
+		dest += sz;
+		bytes -= sz;
 	}
+	return 0;
+}
 
-	for(i=0; i<y; i++) {
-		uint32_t *ptr;
-		int j;
+static int rle_decode(struct rle_state *rs, unsigned char *dest, unsigned long count, int bpp) {
+	while(count) {
+		unsigned long i, n;
+
+		if(!rs->run) {
+			unsigned char c;
+			if(rle_read(rs, &c, 1) == -1) {
+				return -1;
+			}
+			rs->run = (c & 0x7f) + 1;
+			rs->repeat = c & 0x80;
+
+			if(rs->repeat && rle_read(rs, rs->pix, bpp) == -1) {
+				return -1;
+			}
+		}
 
-		ptr = pix + ((hdr.img_desc & 0x20) ? i : y-(i+1)) * x;
+		n = rs->run < count ? rs->run : count;
+
+		if(rs->repeat) {
+			for(i=0; i<n; i++) {
+				memcpy(dest, rs->pix, bpp);
+				dest += bpp;
+			}
+		} else {
+			/* raw packets go straight to the destination */
+			if(rle_read(rs, dest, n * bpp) == -1) {
+				return -1;
+			}
+			dest += n * bpp;
+		}
 
-		for(j=0; j<x; j++) {
-			unsigned char r, g, b, a;
-			r = fgetc(fp);
-			g = fgetc(fp);
-			b = fgetc(fp);
-			a = (hdr.img_desc & 0xf) ? fgetc(fp) : 255;
-		
-			*ptr++ = PACK_COLOR32(a, r, g, b);
-			
-			if(feof(fp)) break;
+		rs->run -= n;
+		count -= n;
+	}
+	return 0;
+}
+
+int load_tga_into(FILE *fp, void *dest, unsigned long xsz, unsigned long ysz, long pitch) {
+	struct tga_header hdr;
+	struct rle_state rs;
+	unsigned long i, raw_offs;
+	int bpp;
+
+	if(read_header(fp, &hdr) == -1 || hdr.img_width != xsz || hdr.img_height != ysz) {
+		return -1;
+	}
+	bpp = hdr.img_bpp / 8;
+
+	/* skip the image ID and the color map if it exists */
+	i = 18 + hdr.idlen;
+	if(hdr.cmap_type == 1) {
+		i += hdr.cmap_len * hdr.cmap_entry_sz / 8;
+	}
+	fseek(fp, i, SEEK_SET);
+
+	rs.fp = fp;
+	rs.pos = rs.count = 0;
+	rs.run = 0;
+
+	/* each row is read at the end of its place in dest, and expanded
+	 * to 32 bits in place.
+	 */
+	raw_offs = xsz * (4 - bpp);
+
+	for(i=0; i<ysz; i++) {
+		unsigned long y = (hdr.img_desc & 0x20) ? i : ysz - i - 1;
+		unsigned char *row = (unsigned char*)dest + (long)y * pitch;
+		unsigned char *raw = row + raw_offs;
+
+		if(hdr.img_type & 8) {
+			if(rle_decode(&rs, raw, xsz, bpp) == -1) break;
+		} else {
+			if(fread(raw, bpp, xsz, fp) < xsz) break;
+		}
+
+		switch(bpp) {
+		case 1:
+			conv_gray8_bgra(row, raw, xsz);
+			break;
+
+		case 3:
+			conv_bgr24_bgra(row, raw, xsz);
+			break;
+
+		default:
+			/* same byte order, only the alpha may need fixing */
+			if(!(hdr.img_desc & 0xf)) {
+				set_opaque_alpha(row, xsz);
+			}
+			break;
 		}
 	}
 
-	fclose(fp);
-	*xsz = x;
-	*ysz = y;
-	return pix;
+	if(i < ysz) {
+		fprintf(stderr, "load_tga: unexpected end of file\n");
+		return -1;
+	}
+	return 0;
 }
 
 int save_tga(FILE *fp, void *pixels, unsigned long xsz, unsigned long ysz) {
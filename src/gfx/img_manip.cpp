@@ -28,9 +28,19 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <cmath>
 #include <cstring>
 #include <cctype>
+#include <climits>
 #include "img_manip.hpp"
 #include "color.hpp"
 #include "common/err_msg.h"
+#include "common/threadpool.h"
+#include "n3dmath2/n3dmath2.hpp"
+#include "n3dmath2/n3dmath2_batch.hpp"
+
+/* the filters must give the same results on every code path, -ffast-math
+ * would turn the divisions into multiplications by the reciprocal.
+ */
+#define SIMD_EXACT_MATH
+#include "common/simd.h"
 
 // Macros
 #define PACK_ARGB32(a,r,g,b)	PACK_COLOR32(a,r,g,b)
@@ -40,8 +50,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define GETG(c) 		(((c) >> GREEN_SHIFT32) & GREEN_MASK32)
 #define GETB(c) 		(((c) >> BLUE_SHIFT32) & BLUE_MASK32)
 
-static inline scalar_t cerp(scalar_t x0, scalar_t x1, scalar_t x2, scalar_t x3, scalar_t t);
-static inline int clamp_integer(int i, int from, int to);
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#define CLAMP(n, l, h)	MIN(MAX((n), (l)), (h))
 
 // ------------ simple operations ----------------
 void clear_pixel_buffer(PixelBuffer *pb, const Color &col) {
@@ -56,333 +67,887 @@ void clear_pixel_buffer(PixelBuffer *pb, const Color &col) {
 
 // ------------ resampling ------------------
 
-static bool resample_line(scalar_t *dst, int dst_width, int dst_pitch, scalar_t *src, int src_width, int src_pitch)
+/* Resampler (JT)
+ * works on the packed pixels: every destination row is made by combining
+ * the source rows under the filter into a temporary row (the vertical pass,
+ * which runs along the source rows), which is then filtered horizontally into
+ * the destination. The weights of every destination column and row are
+ * computed beforehand in fixed point, and the destination rows are split
+ * among the threads of the thread pool. When shrinking, the filter is
+ * widened by the scale factor so that every source pixel contributes.
+ */
+#define RESAMPLE_PREC		14
+#define RESAMPLE_ROUND		(1 << (RESAMPLE_PREC - 1))
+#define RESAMPLE_BAND_ROWS	16
+
+struct ResampleWeights {
+	int ntaps;			// taps per destination pixel, always even
+	int *first;			// first source pixel of every destination pixel
+	short *weights;		// ntaps for every destination pixel
+	int pad;			// how far the taps go past the edges
+};
+
+static double filter_radius(ImgResampleFilter filter)
+{
+	switch(filter) {
+	case RESAMPLE_BILINEAR:
+		return 1.0;
+	case RESAMPLE_LANCZOS:
+		return 3.0;
+	case RESAMPLE_BICUBIC:
+	default:
+		return 2.0;
+	}
+}
+
+static double sinc(double x)
 {
-	if (!dst || !src) return false;
+	if(x == 0.0) return 1.0;
+	x *= 3.14159265358979323846;
+	return sin(x) / x;
+}
 
-	scalar_t x0,x1,x2,x3,t;
-	int i0,i1,i2,i3;
-	for (int i=0;i<dst_width;i++)
-	{
-		i1 = (i*src_width)/dst_width;
-		i0 = i1 - 1; if(i0 < 0) i0 = 0;
-		i2 = i1 + 1; if(i2 >= src_width) i2 = src_width - 1;
-		i3 = i1 + 2; if(i3 >= src_width) i3 = src_width - 1;
+static double filter_weight(ImgResampleFilter filter, double x)
+{
+	x = fabs(x);
 
-		x0 = src[i0 * src_pitch];
-		x1 = src[i1 * src_pitch];
-		x2 = src[i2 * src_pitch];
-		x3 = src[i3 * src_pitch];
+	switch(filter) {
+	case RESAMPLE_BILINEAR:
+		return x < 1.0 ? 1.0 - x : 0.0;
 
-		t = ((scalar_t)i * (scalar_t)src_width) / (scalar_t)dst_width;
-		t -= i1;
+	case RESAMPLE_LANCZOS:
+		return x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
 
-		// write the destination element
-		dst[i * dst_pitch] = cerp(x0, x1, x2, x3, t);
+	case RESAMPLE_BICUBIC:
+	default:
+		// catmull-rom
+		if(x < 1.0) return (1.5 * x - 2.5) * x * x + 1.0;
+		if(x < 2.0) return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+		return 0.0;
 	}
+}
 
-	return true;
+static void calc_weights(ResampleWeights *rw, int src_size, int dst_size, ImgResampleFilter filter)
+{
+	double scale = (double)src_size / (double)dst_size;
+	double fscale = scale > 1.0 ? scale : 1.0;
+	double support = filter_radius(filter) * fscale;
+
+	rw->ntaps = ((int)ceil(support * 2.0) + 2) & ~1;
+	rw->first = new int[dst_size];
+	rw->weights = new short[dst_size * rw->ntaps];
+	rw->pad = 0;
+
+	double *w = new double[rw->ntaps];
+
+	for(int i=0; i<dst_size; i++) {
+		// pixel centers are at +0.5
+		double center = (i + 0.5) * scale;
+		int first = (int)floor(center - support + 0.5);
+
+		double sum = 0.0;
+		for(int j=0; j<rw->ntaps; j++) {
+			w[j] = filter_weight(filter, (first + j + 0.5 - center) / fscale);
+			sum += w[j];
+		}
+
+		// fixed point weights summing up to exactly 1.0, the rounding error
+		// goes to the largest one.
+		short *iw = rw->weights + i * rw->ntaps;
+		int isum = 0, max_idx = 0;
+		for(int j=0; j<rw->ntaps; j++) {
+			iw[j] = (short)floor(w[j] / sum * (1 << RESAMPLE_PREC) + 0.5);
+			isum += iw[j];
+			if(iw[j] > iw[max_idx]) max_idx = j;
+		}
+		iw[max_idx] += (1 << RESAMPLE_PREC) - isum;
+
+		rw->first[i] = first;
+		rw->pad = MAX(rw->pad, -first);
+		rw->pad = MAX(rw->pad, first + rw->ntaps - src_size);
+	}
+
+	delete [] w;
 }
 
-static bool resample2d(scalar_t *dst, int dst_w, int dst_h, scalar_t *src, int src_w, int src_h)
+static void free_weights(ResampleWeights *rw)
 {
-	if (!src || !dst) return false;
+	delete [] rw->first;
+	delete [] rw->weights;
+}
 
-	if (dst_w == src_w && dst_h == src_h)
-	{
-		memcpy(dst, src, dst_w * dst_h * sizeof(scalar_t));
-		return true;
+struct ResampleJob {
+	const Pixel *src;
+	Pixel *dest;
+	int src_w, src_h, dst_w, dst_h;
+	ResampleWeights horiz, vert;
+	int *hpair;			// horizontal weights paired up for the SIMD code
+	SimdLevel simd;
+};
+
+static inline unsigned char fixed_to_byte(int sum)
+{
+	sum >>= RESAMPLE_PREC;
+	return (unsigned char)CLAMP(sum, 0, 255);
+}
+
+// vertical pass, from ntaps source rows to dst, for the bytes [start, end)
+static void resample_vert_c(unsigned char *dst, const unsigned char **rows, const short *weights,
+		int ntaps, int start, int end)
+{
+	for(int x=start; x<end; x++) {
+		int sum = RESAMPLE_ROUND;
+		for(int t=0; t<ntaps; t++) {
+			sum += weights[t] * rows[t][x];
+		}
+		dst[x] = fixed_to_byte(sum);
 	}
+}
+
+static void resample_horiz_c(Pixel *dst, const unsigned char *src, const ResampleWeights *rw, int count)
+{
+	unsigned char *dptr = (unsigned char*)dst;
 
-	// first resample along x
-	scalar_t *temp = (scalar_t*)malloc(dst_w * src_h * sizeof(scalar_t));
+	for(int i=0; i<count; i++) {
+		const unsigned char *sptr = src + (rw->first[i] + rw->pad) * 4;
+		const short *w = rw->weights + i * rw->ntaps;
 
-	if (dst_w == src_w)
-	{
-		memcpy(temp, src, src_w * src_h * sizeof(scalar_t));
+		for(int c=0; c<4; c++) {
+			int sum = RESAMPLE_ROUND;
+			for(int t=0; t<rw->ntaps; t++) {
+				sum += w[t] * sptr[t * 4 + c];
+			}
+			*dptr++ = fixed_to_byte(sum);
+		}
 	}
-	else
-	{
-		// horizontal resample
-		for (int i=0;i<src_h;i++)
-		{
-			resample_line(temp + i*dst_w, dst_w, 1, src + i * src_w, src_w, 1);
+}
+
+#ifdef X86_SIMD
+/* wpair holds the weights in pairs for pmaddwd, the low 16 bits for the even
+ * tap and the high 16 bits for the odd one. Works from byte start onwards,
+ * 16 at a time, and returns where it stopped.
+ */
+TARGET_SSE2
+static int resample_vert_sse2(unsigned char *dst, const unsigned char **rows, const int *wpair,
+		int ntaps, int start, int bytes)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi32(RESAMPLE_ROUND);
+	int x;
+
+	for(x=start; x + 16 <= bytes; x+=16) {
+		__m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+
+		for(int t=0; t<ntaps; t+=2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(rows[t] + x));
+			__m128i b = _mm_loadu_si128((const __m128i*)(rows[t + 1] + x));
+			__m128i w = _mm_set1_epi32(wpair[t / 2]);
+
+			__m128i alo = _mm_unpacklo_epi8(a, zero), ahi = _mm_unpackhi_epi8(a, zero);
+			__m128i blo = _mm_unpacklo_epi8(b, zero), bhi = _mm_unpackhi_epi8(b, zero);
+
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(alo, blo), w));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(alo, blo), w));
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(ahi, bhi), w));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(ahi, bhi), w));
 		}
+
+		acc0 = _mm_srai_epi32(acc0, RESAMPLE_PREC);
+		acc1 = _mm_srai_epi32(acc1, RESAMPLE_PREC);
+		acc2 = _mm_srai_epi32(acc2, RESAMPLE_PREC);
+		acc3 = _mm_srai_epi32(acc3, RESAMPLE_PREC);
+
+		// the saturating packs do the clamping
+		__m128i lo = _mm_packs_epi32(acc0, acc1);
+		__m128i hi = _mm_packs_epi32(acc2, acc3);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
 	}
+	return x;
+}
 
-	// Now temp is stretched horizontally
-	// stretch vertically
-	if (dst_h == src_h)
-	{
-		memcpy(dst, temp, dst_w * dst_h * sizeof(scalar_t));
+// same as above, 32 bytes at a time
+TARGET_AVX2
+static int resample_vert_avx2(unsigned char *dst, const unsigned char **rows, const int *wpair,
+		int ntaps, int start, int bytes)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i round = _mm256_set1_epi32(RESAMPLE_ROUND);
+	int x;
+
+	for(x=start; x + 32 <= bytes; x+=32) {
+		__m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+
+		for(int t=0; t<ntaps; t+=2) {
+			__m256i a = _mm256_loadu_si256((const __m256i*)(rows[t] + x));
+			__m256i b = _mm256_loadu_si256((const __m256i*)(rows[t + 1] + x));
+			__m256i w = _mm256_set1_epi32(wpair[t / 2]);
+
+			__m256i alo = _mm256_unpacklo_epi8(a, zero), ahi = _mm256_unpackhi_epi8(a, zero);
+			__m256i blo = _mm256_unpacklo_epi8(b, zero), bhi = _mm256_unpackhi_epi8(b, zero);
+
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(alo, blo), w));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(alo, blo), w));
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(ahi, bhi), w));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(ahi, bhi), w));
+		}
+
+		acc0 = _mm256_srai_epi32(acc0, RESAMPLE_PREC);
+		acc1 = _mm256_srai_epi32(acc1, RESAMPLE_PREC);
+		acc2 = _mm256_srai_epi32(acc2, RESAMPLE_PREC);
+		acc3 = _mm256_srai_epi32(acc3, RESAMPLE_PREC);
+
+		// all of this stays within the 128bit lanes, so the bytes end up
+		// back in their original order.
+		__m256i lo = _mm256_packs_epi32(acc0, acc1);
+		__m256i hi = _mm256_packs_epi32(acc2, acc3);
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_packus_epi16(lo, hi));
 	}
-	else
-	{
-		// vertical resample
-		for (int i=0; i<dst_w; i++)
-		{
-			resample_line(dst+i, dst_h, dst_w, temp + i, src_h, dst_w);
+	return x;
+}
+
+TARGET_SSE2
+static void resample_horiz_sse2(Pixel *dst, const unsigned char *src, const ResampleWeights *rw,
+		const int *wpair, int count)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi32(RESAMPLE_ROUND);
+
+	for(int i=0; i<count; i++) {
+		const unsigned char *sptr = src + (rw->first[i] + rw->pad) * 4;
+		const int *wp = wpair + i * rw->ntaps / 2;
+		__m128i acc = round;
+
+		for(int t=0; t<rw->ntaps; t+=2) {
+			// two pixels, channels interleaved as p0.c0 p1.c0 p0.c1 p1.c1 ...
+			__m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(sptr + t * 4)), zero);
+			p = _mm_unpacklo_epi16(p, _mm_srli_si128(p, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_set1_epi32(wp[t / 2])));
 		}
+
+		acc = _mm_srai_epi32(acc, RESAMPLE_PREC);
+		acc = _mm_packs_epi32(acc, acc);
+		dst[i] = (Pixel)_mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
 	}
+}
+#endif	// X86_SIMD
 
-	// cleanup
-	free(temp);
+static void pair_weights(int *wpair, const short *weights, int count)
+{
+	for(int i=0; i<count; i+=2) {
+		wpair[i / 2] = (int)((unsigned short)weights[i] | ((unsigned int)(unsigned short)weights[i + 1] << 16));
+	}
+}
 
-	return true;
+static void resample_task(int idx, void *cls)
+{
+	const ResampleJob *job = (const ResampleJob*)cls;
+	const ResampleWeights *vw = &job->vert, *hw = &job->horiz;
+
+	int y0 = idx * RESAMPLE_BAND_ROWS;
+	int y1 = MIN(y0 + RESAMPLE_BAND_ROWS, job->dst_h);
+	int row_bytes = job->src_w * 4;
+
+	// the temporary row is padded with copies of the edge pixels for the
+	// horizontal pass
+	unsigned char *tmp = new unsigned char[(job->src_w + 2 * hw->pad) * 4];
+	unsigned char *tmp_row = tmp + hw->pad * 4;
+	const unsigned char **rows = new const unsigned char*[vw->ntaps];
+	int *vpair = new int[vw->ntaps / 2];
+
+	for(int y=y0; y<y1; y++) {
+		for(int t=0; t<vw->ntaps; t++) {
+			int sy = CLAMP(vw->first[y] + t, 0, job->src_h - 1);
+			rows[t] = (const unsigned char*)(job->src + sy * job->src_w);
+		}
+		const short *weights = vw->weights + y * vw->ntaps;
+
+		int done = 0;
+#ifdef X86_SIMD
+		if(job->simd >= SIMD_SSE2) {
+			pair_weights(vpair, weights, vw->ntaps);
+			if(job->simd >= SIMD_AVX2) {
+				done = resample_vert_avx2(tmp_row, rows, vpair, vw->ntaps, done, row_bytes);
+			}
+			done = resample_vert_sse2(tmp_row, rows, vpair, vw->ntaps, done, row_bytes);
+		}
+#endif
+		resample_vert_c(tmp_row, rows, weights, vw->ntaps, done, row_bytes);
+
+		for(int i=0; i<hw->pad; i++) {
+			memcpy(tmp + i * 4, tmp_row, 4);
+			memcpy(tmp_row + (job->src_w + i) * 4, tmp_row + row_bytes - 4, 4);
+		}
+
+		Pixel *dst = job->dest + y * job->dst_w;
+#ifdef X86_SIMD
+		if(job->simd >= SIMD_SSE2) {
+			resample_horiz_sse2(dst, tmp, hw, job->hpair, job->dst_w);
+			continue;
+		}
+#endif
+		resample_horiz_c(dst, tmp, hw, job->dst_w);
+	}
+
+	delete [] tmp;
+	delete [] rows;
+	delete [] vpair;
 }
 
-static bool pack_scalar_rgb2dw(Pixel *dst, scalar_t *ac, scalar_t *rc, scalar_t *gc, scalar_t *bc, int samples)
+bool resample_pixel_buffer(PixelBuffer *dest, const PixelBuffer &src, ImgResampleFilter filter)
 {
-	if (!dst || !ac || !rc || !gc || !bc) return false;
+	if(!dest || !dest->buffer || !src.buffer) return false;
+	if(!dest->width || !dest->height || !src.width || !src.height) return false;
 
-	int a, r, g, b;
+	ResampleJob job;
+	job.src = src.buffer;
+	job.dest = dest->buffer;
+	job.src_w = src.width;
+	job.src_h = src.height;
+	job.dst_w = dest->width;
+	job.dst_h = dest->height;
+	job.simd = get_simd_level();
 
-	for (int i=0;i<samples;i++)
-	{
-		a = (int)(ac[i] + 0.5f);
-		r = (int)(rc[i] + 0.5f);
-		g = (int)(gc[i] + 0.5f);
-		b = (int)(bc[i] + 0.5f);
+	calc_weights(&job.horiz, job.src_w, job.dst_w, filter);
+	calc_weights(&job.vert, job.src_h, job.dst_h, filter);
 
-		a = clamp_integer(a, 0, 255);
-		r = clamp_integer(r, 0, 255);
-		g = clamp_integer(g, 0, 255);
-		b = clamp_integer(b, 0, 255);
+	job.hpair = new int[job.dst_w * job.horiz.ntaps / 2];
+	pair_weights(job.hpair, job.horiz.weights, job.dst_w * job.horiz.ntaps);
 
-		dst[i] = PACK_ARGB32(a, r, g, b);
-	}
+	tpool_parallel_for((job.dst_h + RESAMPLE_BAND_ROWS - 1) / RESAMPLE_BAND_ROWS, resample_task, &job);
 
+	free_weights(&job.horiz);
+	free_weights(&job.vert);
+	delete [] job.hpair;
 	return true;
 }
 
-bool resample_pixel_buffer(PixelBuffer *pb, int w, int h)
+bool resample_pixel_buffer(PixelBuffer *pb, int w, int h, ImgResampleFilter filter)
 {
-	if (!pb || !pb->buffer || pb->width < 0 || pb->height < 0) return false;
-
-	if ((int)pb->width == w && (int)pb->height == h) return true;
+	if(!pb || !pb->buffer || w <= 0 || h <= 0) return false;
 
-	// split channels
-	scalar_t *a, *newa, *r, *newr, *g, *newg, *b, *newb;
+	if((int)pb->width == w && (int)pb->height == h) return true;
 
-	a = (scalar_t*)malloc(pb->width * pb->height * sizeof(scalar_t));	
-	r = (scalar_t*)malloc(pb->width * pb->height * sizeof(scalar_t));
-	g = (scalar_t*)malloc(pb->width * pb->height * sizeof(scalar_t));
-	b = (scalar_t*)malloc(pb->width * pb->height * sizeof(scalar_t));
+	PixelBuffer dest;
+	dest.width = w;
+	dest.height = h;
+	dest.pitch = w * sizeof(Pixel);
+	dest.buffer = new Pixel[w * h];
 
-	newa = (scalar_t*)malloc(w * h * sizeof(scalar_t));
-	newr = (scalar_t*)malloc(w * h * sizeof(scalar_t));
-	newg = (scalar_t*)malloc(w * h * sizeof(scalar_t));
-	newb = (scalar_t*)malloc(w * h * sizeof(scalar_t));
+	if(!resample_pixel_buffer(&dest, *pb, filter)) {
+		return false;
+	}
 
-	for(int i=0; i<(int)(pb->width * pb->height); i++)
-	{
-		a[i] = GETA(pb->buffer[i]);
-		r[i] = GETR(pb->buffer[i]);
-		g[i] = GETG(pb->buffer[i]);
-		b[i] = GETB(pb->buffer[i]);
-	}
-
-	// resample
-	resample2d(newa, w, h, a, pb->width, pb->height);
-	resample2d(newr, w, h, r, pb->width, pb->height);
-	resample2d(newg, w, h, g, pb->width, pb->height);
-	resample2d(newb, w, h, b, pb->width, pb->height);
-
-	// pack
-	Pixel *temp = (Pixel*)malloc(w * h * sizeof(Pixel));
-	pack_scalar_rgb2dw(temp, newa, newr, newg, newb, w * h);
-	free(pb->buffer);
-	pb->buffer = temp;
-	temp = 0;
+	delete [] pb->buffer;
+	pb->buffer = dest.buffer;
 	pb->width = w;
 	pb->height = h;
+	pb->pitch = dest.pitch;
 
-	// cleanup
-	free(a); free(r); free(g); free(b);
-	free(newa); free(newr); free(newg); free(newb);
-
+	dest.buffer = 0;
 	return true;
 }
 
 
-// --- static inline functions ---
+// Kernels
+//----------------------------------------------------------------
+
+/* Filtering engine (JT)
+ *
+ * The image is split into bands of rows which are filtered in parallel on the
+ * thread pool. For every band the source rows it needs are expanded to 16bit
+ * channels and padded left and right according to the sampling mode, so the
+ * inner loops never check for the image borders (rows past the top and bottom
+ * are picked the same way, once per row).
+ *
+ * Separable kernels (every row a multiple of the same row) are applied as a
+ * horizontal and a vertical 1D pass, anything else as a single 2D pass. The
+ * result is exactly what applying the whole kernel per pixel gives: the sum
+ * divided by the sum of the kernel (truncated), clamped to [0, 255].
+ *
+ * The SSE2/AVX2 paths accumulate 16bit products in 32bit (pmaddwd) and divide
+ * in single precision, so they are used when the sums fit in 24 bits and the
+ * divisor is small enough for the division to be exact, and the horizontal
+ * pass of separable kernels fits in 16 bits. Otherwise the plain C path does
+ * everything in 32bit ints.
+ */
+
+#define FILTER_BAND_ROWS	32
+#define MAX_KERNEL_DIM		63
 
-static inline scalar_t cerp(scalar_t x0, scalar_t x1, scalar_t x2, scalar_t x3, scalar_t t)
+static inline int map_index(int c, int dim, ImgSamplingMode mode)
 {
-	scalar_t a0, a1, a2, a3, t2;
+	switch(mode) {
+	case SAMPLE_WRAP:
+		c %= dim;
+		return c < 0 ? c + dim : c;
 
-	t2 = t * t;
-	a0 = x3 - x2 - x0 + x1;
-	a1 = x0 - x1 - a0;
-	a2 = x2 - x0;
-	a3 = x1;
+	case SAMPLE_MIRROR:
+		{
+			// reflected around the edge pixels, which aren't repeated
+			if(dim == 1) return 0;
+			int period = 2 * dim - 2;
+			c = (c < 0 ? -c : c) % period;
+			return c < dim ? c : period - c;
+		}
 
-	return(a0 * t * t2 + a1 * t2 + a2 * t + a3);
+	case SAMPLE_CLAMP:
+	default:
+		return CLAMP(c, 0, dim - 1);
+	}
 }
 
+struct FilterJob {
+	const Pixel *src;
+	Pixel *dest;
+	int width, height;
+	ImgSamplingMode mode;
 
-#define MIN(a, b)	((a) < (b) ? (a) : (b))
-#define MAX(a, b)	((a) > (b) ? (a) : (b))
-#define CLAMP(n, l, h)	MIN(MAX((n), (l)), (h))
+	int dim, rad;
+	const int *kernel;			// dim x dim
+	bool separable;
+	int hkernel[MAX_KERNEL_DIM], vkernel[MAX_KERNEL_DIM];	// kernel = vkernel * hkernel / pivot
+	int divisor;
 
-static inline int clamp_integer(int i, int from, int to)
+	SimdLevel simd;
+};
+
+static long abs_sum(const int *k, int count)
 {
-	return CLAMP(i, from, to);
+	long sum = 0;
+	for(int i=0; i<count; i++) {
+		sum += k[i] < 0 ? -k[i] : k[i];
+	}
+	return sum;
 }
 
-// Kernels
-//----------------------------------------------------------------
+/* separate_kernel - (JT)
+ * kernel[i][j] = v[i] * h[j] / pivot, with pivot = kernel[r][c] the first
+ * non-zero element, h its row and v its column. Returns false if the kernel
+ * isn't separable, or if the sums of the two passes, which are pivot times
+ * the sums of the whole kernel, could overflow an int.
+ */
+static bool separate_kernel(FilterJob *job, int *pivot)
+{
+	const int *k = job->kernel;
+	int dim = job->dim;
+
+	int p = 0;
+	while(p < dim * dim && !k[p]) p++;
+	if(p == dim * dim) return false;
+
+	int r = p / dim, c = p % dim;
+	*pivot = k[p];
+	for(int i=0; i<dim; i++) {
+		job->hkernel[i] = k[r * dim + i];
+		job->vkernel[i] = k[i * dim + c];
+	}
+
+	for(int i=0; i<dim; i++) {
+		for(int j=0; j<dim; j++) {
+			if((long)k[i * dim + j] * *pivot != (long)job->vkernel[i] * job->hkernel[j]) {
+				return false;
+			}
+		}
+	}
+
+	double max_sum = (double)abs_sum(k, dim * dim) * 255.0;
+	if(max_sum * (*pivot < 0 ? -*pivot : *pivot) > INT_MAX) {
+		return false;
+	}
+
+	// keep the divisor positive
+	if(*pivot < 0) {
+		*pivot = -*pivot;
+		for(int i=0; i<dim; i++) {
+			job->vkernel[i] = -job->vkernel[i];
+		}
+	}
+	return true;
+}
+
+// checks if the SIMD code can produce the exact results of the C code
+static bool simd_exact(const FilterJob *job)
+{
+	const long sum_limit = 1 << 24;
+	const long max_divisor = 1 << 17;
 
-static ImgSamplingMode samp_mode = SAMPLE_CLAMP;
+	if(job->divisor <= -max_divisor || job->divisor >= max_divisor) return false;
+
+	if(job->separable) {
+		long hsum = abs_sum(job->hkernel, job->dim);
+		long vsum = abs_sum(job->vkernel, job->dim);
+		return hsum * 255 < 32768 && vsum < 32768 && hsum * vsum * 255 < sum_limit;
+	}
+
+	long ksum = abs_sum(job->kernel, job->dim * job->dim);
+	for(int i=0; i<job->dim * job->dim; i++) {
+		if(job->kernel[i] < -32768 || job->kernel[i] > 32767) return false;
+	}
+	return ksum * 255 < sum_limit;
+}
 
-static inline int map_index(int c, int dim)
+/* expands a source row to 16bit channels, with rad pixels of padding on
+ * both sides, and zeros after that up to pad_width.
+ */
+static void load_row(short *dst, const FilterJob *job, int y, int pad_width)
 {
+	const unsigned char *row = (const unsigned char*)(job->src + map_index(y, job->height, job->mode) * job->width);
+	int w = job->width;
+	int x;
 
-	switch (samp_mode)
-	{
-		case SAMPLE_WRAP:
-		{
-			if (c < 0) 
-			{
-				while(c < 0) c += dim;
-				return c;
+	for(x=-job->rad; x<0; x++) {
+		const unsigned char *p = row + map_index(x, w, job->mode) * 4;
+		*dst++ = p[0]; *dst++ = p[1]; *dst++ = p[2]; *dst++ = p[3];
+	}
+	for(int i=0; i<w * 4; i++) {
+		*dst++ = row[i];
+	}
+	for(x=w; x<w + job->rad; x++) {
+		const unsigned char *p = row + map_index(x, w, job->mode) * 4;
+		*dst++ = p[0]; *dst++ = p[1]; *dst++ = p[2]; *dst++ = p[3];
+	}
+	memset(dst, 0, (pad_width - w - 2 * job->rad) * 4 * sizeof *dst);
+}
+
+static inline unsigned char div_clamp(int sum, int divisor)
+{
+	sum /= divisor;
+	return (unsigned char)CLAMP(sum, 0, 255);
+}
+
+// ---- plain C implementation ----
+
+static void filter_band_c(const FilterJob *job, int y0, int y1)
+{
+	int w = job->width, dim = job->dim, rad = job->rad;
+	int pad_width = w + 2 * rad;
+	int rows = y1 - y0 + 2 * rad;
+
+	short *src_row = new short[pad_width * 4];
+
+	if(job->separable) {
+		// horizontal pass for all the source rows of the band
+		int *hrows = new int[rows * w * 4];
+		for(int i=0; i<rows; i++) {
+			load_row(src_row, job, y0 - rad + i, pad_width);
+
+			int *hptr = hrows + i * w * 4;
+			for(int x=0; x<w * 4; x++) {
+				int sum = 0;
+				for(int j=0; j<dim; j++) {
+					sum += job->hkernel[j] * src_row[x + j * 4];
+				}
+				hptr[x] = sum;
 			}
-			if (c >= dim) return c % dim;
-			break;
 		}
-		case SAMPLE_MIRROR:
-		{
-			if (c < 0) return -c;
-			if (c >= dim) return dim - c - 1;
-			break;
+
+		for(int y=y0; y<y1; y++) {
+			const int *col = hrows + (y - y0) * w * 4;
+			unsigned char *dptr = (unsigned char*)(job->dest + y * w);
+
+			for(int x=0; x<w * 4; x++) {
+				int sum = 0;
+				for(int i=0; i<dim; i++) {
+					sum += job->vkernel[i] * col[x + i * w * 4];
+				}
+				dptr[x] = div_clamp(sum, job->divisor);
+			}
 		}
+		delete [] hrows;
 
-		case SAMPLE_CLAMP:
-		default:
-		{
-			if (c < 0) return 0;
-			if (c >= dim) return dim - 1;
-			break;
+	} else {
+		short *srows = new short[rows * pad_width * 4];
+		for(int i=0; i<rows; i++) {
+			load_row(srows + i * pad_width * 4, job, y0 - rad + i, pad_width);
+		}
+
+		for(int y=y0; y<y1; y++) {
+			const short *sptr = srows + (y - y0) * pad_width * 4;
+			unsigned char *dptr = (unsigned char*)(job->dest + y * w);
+
+			for(int x=0; x<w * 4; x++) {
+				int sum = 0;
+				const int *kptr = job->kernel;
+				for(int i=0; i<dim; i++) {
+					for(int j=0; j<dim; j++) {
+						sum += *kptr++ * sptr[x + i * pad_width * 4 + j * 4];
+					}
+				}
+				dptr[x] = div_clamp(sum, job->divisor);
+			}
 		}
+		delete [] srows;
 	}
 
-	return c;
+	delete [] src_row;
 }
 
-static void split_channels(Pixel *img, Pixel *a, Pixel *r, Pixel *g, Pixel *b, unsigned int pixel_count)
+#ifdef X86_SIMD
+// ---- SSE2/AVX2 implementation ----
+
+/* A list of taps, each one a pointer to a row of 16bit pixels and a weight.
+ * The taps are taken in pairs, the weights of a pair are interleaved in a
+ * 32bit word for pmaddwd: (tap0 * w0 + tap1 * w1) per channel in 32bit.
+ * There is always an even number of taps, the last one can have 0 weight.
+ */
+struct TapList {
+	const short **ptr;
+	int *wpair;		// ntaps / 2
+	int ntaps;
+};
+
+TARGET_SSE2
+static inline void accum2_sse2(const TapList *taps, int offs, __m128i *lo, __m128i *hi)
 {
-	for(unsigned int i=0; i<pixel_count; i++)
-	{
-		*a++ = GETA(*img);
-		*r++ = GETR(*img);
-		*g++ = GETG(*img);
-		*b++ = GETB(*img);
-		img++;
+	__m128i sum_lo = _mm_setzero_si128();
+	__m128i sum_hi = _mm_setzero_si128();
+
+	for(int t=0; t<taps->ntaps; t+=2) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(taps->ptr[t] + offs));
+		__m128i b = _mm_loadu_si128((const __m128i*)(taps->ptr[t + 1] + offs));
+		__m128i w = _mm_set1_epi32(taps->wpair[t / 2]);
+
+		sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+		sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
 	}
+	*lo = sum_lo;
+	*hi = sum_hi;
 }
 
-static void join_channels(Pixel *img, Pixel *a, Pixel *r, Pixel *g, Pixel *b, unsigned int pixel_count)
+// count pixels of 16bit sums (2 per iteration)
+TARGET_SSE2
+static void filter_row16_sse2(short *dst, const TapList *taps, int count)
 {
-	for(unsigned int i=0; i<pixel_count; i++)
-	{
-		*img++ = PACK_ARGB32(*a++, *r++, *g++, *b++);
+	for(int x=0; x<count * 4; x+=8) {
+		__m128i lo, hi;
+		accum2_sse2(taps, x, &lo, &hi);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packs_epi32(lo, hi));
 	}
 }
 
-static inline Pixel fetch_pixel(int x, int y, Pixel *img, int w, int h)
+// count pixels of final results (2 per iteration)
+TARGET_SSE2
+static void filter_row8_sse2(Pixel *dst, const TapList *taps, int count, int divisor)
 {
-	x = map_index(x,w);
-	y = map_index(y,h);
+	__m128 div = _mm_set1_ps((float)divisor);
 
-	return img[x+w*y];
+	for(int x=0; x<count * 4; x+=8) {
+		__m128i lo, hi;
+		accum2_sse2(taps, x, &lo, &hi);
+
+		lo = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(lo), div));
+		hi = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(hi), div));
+
+		// the saturating packs do the clamping
+		__m128i res = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i*)(dst + x / 4), _mm_packus_epi16(res, res));
+	}
 }
 
-static Pixel* apply_kernel_to_channel(int *kernel, int kernel_dim, Pixel *img, int w, int h)
+/* the AVX2 versions do 4 pixels per iteration. The unpacks and packs work
+ * within the 128bit lanes, so the sums come out as pixels (0, 2) and (1, 3)
+ * and the packs put them back in order.
+ */
+TARGET_AVX2
+static inline void accum4_avx2(const TapList *taps, int offs, __m256i *lo, __m256i *hi)
 {
-	// only odd kernels
-	if (!(kernel_dim % 2))  return 0;
-	if (!kernel || !img)  return 0;
-	if ((w <= 0) || (h <= 0)) return 0; 
+	__m256i sum_lo = _mm256_setzero_si256();
+	__m256i sum_hi = _mm256_setzero_si256();
 
-	int kernel_l = kernel_dim * kernel_dim;
-	int kernel_center = kernel_dim / 2;
-	int kernel_sum = 0;
-	for (int i=0; i<kernel_l; i++)
-	{
-		kernel_sum += kernel[i];
+	for(int t=0; t<taps->ntaps; t+=2) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(taps->ptr[t] + offs));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(taps->ptr[t + 1] + offs));
+		__m256i w = _mm256_set1_epi32(taps->wpair[t / 2]);
+
+		sum_lo = _mm256_add_epi32(sum_lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+		sum_hi = _mm256_add_epi32(sum_hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
 	}
+	*lo = sum_lo;
+	*hi = sum_hi;
+}
 
-	// allocate memory
-	Pixel *temp = (Pixel*)malloc(w * h * sizeof(Pixel));
+TARGET_AVX2
+static void filter_row16_avx2(short *dst, const TapList *taps, int count)
+{
+	for(int x=0; x<count * 4; x+=16) {
+		__m256i lo, hi;
+		accum4_avx2(taps, x, &lo, &hi);
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_packs_epi32(lo, hi));
+	}
+}
 
-	// pain loop
-	for(int j=0; j<h; j++)
-	{
-		for(int i=0; i<w; i++)
-		{
-			int sum=0;
+TARGET_AVX2
+static void filter_row8_avx2(Pixel *dst, const TapList *taps, int count, int divisor)
+{
+	__m256 div = _mm256_set1_ps((float)divisor);
 
-			// kernel loop
-			for(int kj=0; kj<kernel_dim; kj++)
-			{
-				for(int ki=0; ki<kernel_dim; ki++)
-				{
-					int pixel = (int)fetch_pixel(i + ki - kernel_center, j + kj - kernel_center, img, w, h);
-					sum += pixel * kernel[ki + kernel_dim * kj];
-				}
-			}// end kernel loop
+	for(int x=0; x<count * 4; x+=16) {
+		__m256i lo, hi;
+		accum4_avx2(taps, x, &lo, &hi);
+
+		lo = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(lo), div));
+		hi = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(hi), div));
+
+		__m256i res = _mm256_packs_epi32(lo, hi);
+		res = _mm256_packus_epi16(res, res);
+		res = _mm256_permute4x64_epi64(res, 0x08);
+		_mm_storeu_si128((__m128i*)(dst + x / 4), _mm256_castsi256_si128(res));
+	}
+}
+
+static void set_taps(TapList *taps, const short **ptr, const int *weights, int count)
+{
+	for(int i=0; i<count; i++) {
+		taps->ptr[i] = ptr[i];
+	}
+	if(count & 1) {
+		taps->ptr[count] = ptr[0];
+	}
+	taps->ntaps = (count + 1) & ~1;
+
+	for(int i=0; i<taps->ntaps; i+=2) {
+		int w0 = weights[i];
+		int w1 = i + 1 < count ? weights[i + 1] : 0;
+		taps->wpair[i / 2] = (int)((unsigned short)w0 | ((unsigned int)(unsigned short)w1 << 16));
+	}
+}
+
+static void filter_band_simd(const FilterJob *job, int y0, int y1)
+{
+	void (*filter_row16)(short*, const TapList*, int) = filter_row16_sse2;
+	void (*filter_row8)(Pixel*, const TapList*, int, int) = filter_row8_sse2;
+	if(job->simd >= SIMD_AVX2) {
+		filter_row16 = filter_row16_avx2;
+		filter_row8 = filter_row8_avx2;
+	}
+
+	int w = job->width, dim = job->dim, rad = job->rad;
+	int rows = y1 - y0 + 2 * rad;
+	int wr = (w + 3) & ~3;			// the row functions do multiples of 4 pixels
+	int pad_width = wr + 2 * rad;
+
+	const short *ptr[MAX_KERNEL_DIM * MAX_KERNEL_DIM];
+	TapList taps;
+	taps.ptr = new const short*[dim * dim + 1];
+	taps.wpair = new int[(dim * dim + 1) / 2];
+
+	Pixel *drow = new Pixel[wr];
 
-			if(kernel_sum) {
-				sum /= kernel_sum;
+	if(job->separable) {
+		short *src_row = new short[pad_width * 4];
+		short *hrows = new short[rows * wr * 4];
+
+		for(int j=0; j<dim; j++) {
+			ptr[j] = src_row + j * 4;
+		}
+		set_taps(&taps, ptr, job->hkernel, dim);
+
+		for(int i=0; i<rows; i++) {
+			load_row(src_row, job, y0 - rad + i, pad_width);
+			filter_row16(hrows + i * wr * 4, &taps, wr);
+		}
+
+		for(int y=y0; y<y1; y++) {
+			for(int i=0; i<dim; i++) {
+				ptr[i] = hrows + (y - y0 + i) * wr * 4;
+			}
+			set_taps(&taps, ptr, job->vkernel, dim);
+
+			filter_row8(drow, &taps, wr, job->divisor);
+			memcpy(job->dest + y * w, drow, w * sizeof(Pixel));
+		}
+
+		delete [] src_row;
+		delete [] hrows;
+
+	} else {
+		short *srows = new short[rows * pad_width * 4];
+		for(int i=0; i<rows; i++) {
+			load_row(srows + i * pad_width * 4, job, y0 - rad + i, pad_width);
+		}
+
+		for(int y=y0; y<y1; y++) {
+			for(int i=0; i<dim; i++) {
+				for(int j=0; j<dim; j++) {
+					ptr[i * dim + j] = srows + ((y - y0 + i) * pad_width + j) * 4;
+				}
 			}
-			temp[i + j * w] = CLAMP(sum, 0, 255);
+			set_taps(&taps, ptr, job->kernel, dim * dim);
+
+			filter_row8(drow, &taps, wr, job->divisor);
+			memcpy(job->dest + y * w, drow, w * sizeof(Pixel));
 		}
-	} // end pain loop
 
-	return temp;
+		delete [] srows;
+	}
+
+	delete [] drow;
+	delete [] taps.ptr;
+	delete [] taps.wpair;
+}
+#endif	// X86_SIMD
+
+static void filter_task(int idx, void *cls)
+{
+	const FilterJob *job = (const FilterJob*)cls;
+	int y0 = idx * FILTER_BAND_ROWS;
+	int y1 = MIN(y0 + FILTER_BAND_ROWS, job->height);
+
+#ifdef X86_SIMD
+	if(job->simd >= SIMD_SSE2) {
+		filter_band_simd(job, y0, y1);
+		return;
+	}
+#endif
+	filter_band_c(job, y0, y1);
 }
 
 bool apply_kernel(PixelBuffer *pb, int *kernel, int kernel_dim, ImgSamplingMode sampling)
 {
-	if(!pb || !pb->buffer) return false;
+	if(!pb || !pb->buffer || !kernel) return false;
 	if(pb->width <= 0 || pb->height <= 0) return false;
-	if(!(kernel_dim / 2)) return false;
-	
-	unsigned int sz = pb->width * pb->height;
-
-	// set sampling mode
-	samp_mode = sampling;
-
-	// allocate memory
-	Pixel *tempa = (Pixel*)malloc(sz * sizeof(Pixel));
-	Pixel *tempr = (Pixel*)malloc(sz * sizeof(Pixel));
-	Pixel *tempg = (Pixel*)malloc(sz * sizeof(Pixel));
-	Pixel *tempb = (Pixel*)malloc(sz * sizeof(Pixel));
+	// only odd kernels
+	if(!(kernel_dim / 2) || !(kernel_dim % 2)) return false;
 
-	// split channels
-	split_channels(pb->buffer, tempa, tempr, tempg, tempb, sz);
+	if(kernel_dim > MAX_KERNEL_DIM) {
+		error("apply_kernel: %dx%d kernel too large, max %d", kernel_dim, kernel_dim, MAX_KERNEL_DIM);
+		return false;
+	}
 
-	// apply kernel
-	Pixel *a = apply_kernel_to_channel(kernel, kernel_dim, tempa, pb->width, pb->height);
-	free(tempa);
+	FilterJob job;
+	job.src = pb->buffer;
+	job.width = pb->width;
+	job.height = pb->height;
+	job.mode = sampling;
+	job.dim = kernel_dim;
+	job.rad = kernel_dim / 2;
+	job.kernel = kernel;
 
-	Pixel *r = apply_kernel_to_channel(kernel, kernel_dim, tempr, pb->width, pb->height);
-	free(tempr);
+	int kernel_sum = 0;
+	for(int i=0; i<kernel_dim * kernel_dim; i++) {
+		kernel_sum += kernel[i];
+	}
+	if(!kernel_sum) kernel_sum = 1;
 
-	Pixel *g = apply_kernel_to_channel(kernel, kernel_dim, tempg, pb->width, pb->height);
-	free(tempg);
+	int pivot;
+	if((job.separable = separate_kernel(&job, &pivot))) {
+		job.divisor = pivot * kernel_sum;
+	} else {
+		job.divisor = kernel_sum;
+	}
 
-	Pixel *b = apply_kernel_to_channel(kernel, kernel_dim, tempb, pb->width, pb->height);
-	free(tempb);
+	job.simd = get_simd_level();
+	if(!simd_exact(&job)) {
+		job.simd = SIMD_NONE;
+	}
 
-	// join channels
-	join_channels(pb->buffer, a, r, g, b, sz);
+	Pixel *dest = new Pixel[pb->width * pb->height];
+	job.dest = dest;
 
-	free(a);
-	free(r);
-	free(g);
-	free(b);
+	tpool_parallel_for((job.height + FILTER_BAND_ROWS - 1) / FILTER_BAND_ROWS, filter_task, &job);
 
+	delete [] pb->buffer;
+	pb->buffer = dest;
 	return true;
 }
 
@@ -487,6 +1052,29 @@ int* load_kernel(const char* filename, int *dim)
 /* SobelEdge - (JT)
  * Applies the sobel edge detection algorithm to the pixel buffer
  */
+struct SobelJob {
+	const Pixel *horiz, *vert;
+	Pixel *dest;
+	int width, height;
+	const unsigned char *mag;	// gradient magnitude for every (h, v) pair
+};
+
+static void sobel_task(int idx, void *cls) {
+	const SobelJob *job = (const SobelJob*)cls;
+	int start = idx * FILTER_BAND_ROWS * job->width;
+	int end = MIN(idx * FILTER_BAND_ROWS + FILTER_BAND_ROWS, job->height) * job->width;
+
+	for(int i=start; i<end; i++) {
+		Pixel h = job->horiz[i];
+		Pixel v = job->vert[i];
+
+		Pixel r = job->mag[(GETR(h) << 8) | GETR(v)];
+		Pixel g = job->mag[(GETG(h) << 8) | GETG(v)];
+		Pixel b = job->mag[(GETB(h) << 8) | GETB(v)];
+		job->dest[i] = PACK_ARGB32(255, r, g, b);
+	}
+}
+
 bool sobel_edge(PixelBuffer *pb, ImgSamplingMode sampling) {
 	int sobel_horiz[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
 	int sobel_vert[] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
@@ -497,83 +1085,37 @@ bool sobel_edge(PixelBuffer *pb, ImgSamplingMode sampling) {
 	if(!apply_kernel(&horiz, sobel_horiz, 3, sampling)) return false;
 	if(!apply_kernel(&vert, sobel_vert, 3, sampling)) return false;
 
-	Pixel *vptr = vert.buffer;
-	Pixel *hptr = horiz.buffer;
-	Pixel *dest = pb->buffer;
-	int sz = pb->width * pb->height;
-
-	for(int i=0; i<sz; i++) {
-		Color vcol = unpack_color32(*vptr++);
-		Color hcol = unpack_color32(*hptr++);
-
-		scalar_t r = sqrt(hcol.r * hcol.r + vcol.r * vcol.r);
-		scalar_t g = sqrt(hcol.g * hcol.g + vcol.g * vcol.g);
-		scalar_t b = sqrt(hcol.b * hcol.b + vcol.b * vcol.b);
-
-		*dest++ = pack_color32(Color(r, g, b));
+	// the magnitude only depends on the two 8bit values, so it's computed
+	// once for every pair, with the same color conversions as always.
+	unsigned char *mag = new unsigned char[256 * 256];
+	for(int i=0; i<256; i++) {
+		for(int j=0; j<256; j++) {
+			Color hcol = unpack_color32(PACK_ARGB32(0, i, 0, 0));
+			Color vcol = unpack_color32(PACK_ARGB32(0, j, 0, 0));
+			scalar_t r = sqrt(hcol.r * hcol.r + vcol.r * vcol.r);
+			mag[(i << 8) | j] = GETR(pack_color32(Color(r, 0, 0)));
+		}
 	}
 
-	return true;
-}
-
-
-static inline Pixel blur_pixels(Pixel p1, Pixel p2)
-{
-	// static temp colors
-	static Pixel tempc1, tempc2, tempc3, tempc4;
-	
-	// blur all channels in a SIMD-like manner
-	tempc1 = tempc2 = p1;
-	tempc3 = tempc4 = p2;
-
-	// divide by 2
-	// dividing 2 channels with a single operation
-	tempc1 &= 0xff00ff00; tempc1 >>= 1;
-	tempc2 &= 0x00ff00ff; tempc2 >>= 1;
-	tempc3 &= 0xff00ff00; tempc3 >>= 1;
-	tempc4 &= 0x00ff00ff; tempc4 >>= 1;
-
-	tempc1 = (tempc1 + tempc3) & 0xff00ff00;
-	tempc2 = (tempc2 + tempc4) & 0x00ff00ff;
+	SobelJob job;
+	job.horiz = horiz.buffer;
+	job.vert = vert.buffer;
+	job.dest = pb->buffer;
+	job.width = pb->width;
+	job.height = pb->height;
+	job.mag = mag;
+	tpool_parallel_for((job.height + FILTER_BAND_ROWS - 1) / FILTER_BAND_ROWS, sobel_task, &job);
 
-	return tempc1 | tempc2;
+	delete [] mag;
+	return true;
 }
 
-
+/* blur - (JT)
+ * averages the 4 diagonal neighbours of each pixel, the kernel is separable
+ * so this is done in two passes by apply_kernel.
+ */
 bool blur(PixelBuffer *pb, ImgSamplingMode sampling)
 {
-	if(!pb) return false;
-	if(pb->width <= 0 || pb->height <= 0) return false;
-
-	samp_mode = sampling;
-
-	Pixel *temp = (Pixel*)malloc(pb->width * pb->height * sizeof(Pixel));
-
-	Pixel *scanline = pb->buffer;
-	Pixel *dst_scanline = temp;
-
-	// blur horizontally
-	for(unsigned int j=0; j<pb->height; j++)
-	{
-		for(unsigned int i=0; i<pb->width; i++)
-		{
-			dst_scanline[i] = blur_pixels(scanline[map_index(i-1 , pb->width)], scanline[map_index(i+1 , pb->width)]);
-		}	
-		scanline += pb->width;
-		dst_scanline += pb->width;
-	}
-
-	// blur vertically
-	for(unsigned int i=0; i<pb->width; i++)
-	{
-		for(unsigned int j=0;j<pb->height;j++)
-		{
-			pb->buffer[i+j*pb->width] = blur_pixels(temp[i+map_index(j-1,pb->height)*pb->width], temp[i+map_index(j+1,pb->height)*pb->width]);
-		}
-	}
-
-	// cleanup
-	free(temp);	
-
-	return true;
+	int kernel[] = {1, 0, 1, 0, 0, 0, 1, 0, 1};
+	return apply_kernel(pb, kernel, 3, sampling);
 }
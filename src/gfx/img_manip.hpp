@@ -31,10 +31,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "n3dmath2/n3dmath2_types.hpp"
 
 enum ImgSamplingMode {SAMPLE_CLAMP, SAMPLE_WRAP, SAMPLE_MIRROR};
+enum ImgResampleFilter {RESAMPLE_BILINEAR, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS};
 
 void clear_pixel_buffer(PixelBuffer *pb, const Color &col);
 
-bool resample_pixel_buffer(PixelBuffer *pb, int w, int h);
+bool resample_pixel_buffer(PixelBuffer *pb, int w, int h, ImgResampleFilter filter = RESAMPLE_BICUBIC);
+// resamples src to the size of dest, into the existing dest buffer
+bool resample_pixel_buffer(PixelBuffer *dest, const PixelBuffer &src, ImgResampleFilter filter = RESAMPLE_BICUBIC);
 bool apply_kernel(PixelBuffer *pb, int *kernel, int kernel_dim, ImgSamplingMode sampling = SAMPLE_CLAMP);
 int* load_kernel(const char* filename, int *dim);
 
@@ -0,0 +1,576 @@
+/*
+This file is part of the graphics core library.
+
+Copyright (c) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+the graphics core library is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+the graphics core library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with the graphics core library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <cmath>
+#include "mipmap.hpp"
+#include "n3dmath2/n3dmath2.hpp"
+#include "n3dmath2/n3dmath2_batch.hpp"
+#include "common/aligned_mem.h"
+#include "common/threadpool.h"
+#include "common/err_msg.h"
+
+// the SSE2 and plain code must produce exactly the same levels
+#define SIMD_EXACT_MATH
+#include "common/simd.h"
+
+/* Pixels are processed byte by byte, which keeps this independent of the
+ * channel order. Alpha is always the last byte in memory (see color_bits.h).
+ */
+#define ALPHA_BYTE		3
+
+#define ENC_LUT_SIZE	16384
+#define KAISER_TAPS		8
+#define KAISER_BETA		4.0
+#define ROWS_PER_TASK	16
+
+static float srgb_to_lin[256];
+static float byte_to_float[256];
+static unsigned char lin_to_srgb[ENC_LUT_SIZE];
+static float kaiser_weights[KAISER_TAPS];
+
+// modified bessel function of the first kind, order 0
+static double bessel_i0(double x) {
+	double sum = 1.0, term = 1.0;
+	for(int k=1; k<32; k++) {
+		double t = x / (2.0 * k);
+		term *= t * t;
+		sum += term;
+	}
+	return sum;
+}
+
+static double sinc(double x) {
+	if(x == 0.0) return 1.0;
+	x *= 3.14159265358979323846;
+	return sin(x) / x;
+}
+
+/* the filter is a sinc with its cutoff at half the source frequency,
+ * windowed by a kaiser window 4 source pixels wide on each side. The taps
+ * fall on the centers of the source pixels, at +-0.5, +-1.5 ... +-3.5
+ */
+static bool init_tables() {
+	for(int i=0; i<256; i++) {
+		double v = i / 255.0;
+		srgb_to_lin[i] = (float)(v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+		byte_to_float[i] = (float)v;
+	}
+
+	for(int i=0; i<ENC_LUT_SIZE; i++) {
+		double v = (double)i / (ENC_LUT_SIZE - 1);
+		v = v <= 0.0031308 ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+		lin_to_srgb[i] = (unsigned char)(v * 255.0 + 0.5);
+	}
+
+	double wsum = 0.0, w[KAISER_TAPS];
+	for(int i=0; i<KAISER_TAPS; i++) {
+		double d = i - KAISER_TAPS / 2 + 0.5;
+		double r = d / (KAISER_TAPS / 2);
+		w[i] = sinc(d / 2.0) * bessel_i0(KAISER_BETA * sqrt(1.0 - r * r)) / bessel_i0(KAISER_BETA);
+		wsum += w[i];
+	}
+	for(int i=0; i<KAISER_TAPS; i++) {
+		kaiser_weights[i] = (float)(w[i] / wsum);
+	}
+	return true;
+}
+
+static bool tables_ready = init_tables();
+
+
+MipLevels::MipLevels() {
+	count = 0;
+	for(int i=0; i<MAX_MIP_LEVELS; i++) {
+		level[i].width = level[i].height = level[i].pitch = 0;
+	}
+}
+
+void MipLevels::clear() {
+	for(int i=0; i<MAX_MIP_LEVELS; i++) {
+		delete [] level[i].buffer;
+		level[i].buffer = 0;
+		level[i].width = level[i].height = level[i].pitch = 0;
+	}
+	count = 0;
+}
+
+void MipLevels::set_level_count(int count, unsigned long xsz, unsigned long ysz) {
+	clear();
+
+	if(count > MAX_MIP_LEVELS) count = MAX_MIP_LEVELS;
+	for(int i=0; i<count; i++) {
+		xsz = xsz > 1 ? xsz / 2 : 1;
+		ysz = ysz > 1 ? ysz / 2 : 1;
+
+		level[i].width = xsz;
+		level[i].height = ysz;
+		level[i].pitch = xsz * sizeof(Pixel);
+		level[i].buffer = new Pixel[xsz * ysz];
+	}
+	this->count = count;
+}
+
+unsigned long MipLevels::get_size() const {
+	unsigned long sz = 0;
+	for(int i=0; i<count; i++) {
+		sz += level[i].pitch * level[i].height;
+	}
+	return sz;
+}
+
+int get_mip_level_count(unsigned long xsz, unsigned long ysz) {
+	int count = 1;
+	while((xsz > 1 || ysz > 1) && count <= MAX_MIP_LEVELS) {
+		xsz = xsz > 1 ? xsz / 2 : 1;
+		ysz = ysz > 1 ? ysz / 2 : 1;
+		count++;
+	}
+	return count;
+}
+
+
+// ---- plain C++ implementations ----
+
+/* every function below fills rows [y0, y1) of the destination level, the
+ * destination being half the size of the source (at least 1) in each
+ * direction. Source pixels past the edges are clamped.
+ */
+
+static inline void box8_pixel(Pixel *dst, const Pixel *row0, const Pixel *row1, unsigned long xoffs) {
+	const unsigned char *a = (const unsigned char*)row0;
+	const unsigned char *b = (const unsigned char*)row1;
+	const unsigned char *c = (const unsigned char*)(row0 + xoffs);
+	const unsigned char *d = (const unsigned char*)(row1 + xoffs);
+	unsigned char *dptr = (unsigned char*)dst;
+
+	for(int i=0; i<4; i++) {
+		dptr[i] = (unsigned char)((a[i] + b[i] + c[i] + d[i] + 2) >> 2);
+	}
+}
+
+static void box8_c(Pixel *dst, const Pixel *src, unsigned long sw, unsigned long sh,
+		unsigned long dw, unsigned long y0, unsigned long y1) {
+	unsigned long xoffs = sw > 1 ? 1 : 0;
+
+	for(unsigned long y=y0; y<y1; y++) {
+		const Pixel *row0 = src + 2 * y * sw;
+		const Pixel *row1 = sh > 1 ? row0 + sw : row0;
+		Pixel *dptr = dst + y * dw;
+
+		for(unsigned long x=0; x<dw; x++) {
+			box8_pixel(dptr + x, row0 + 2 * x, row1 + 2 * x, xoffs);
+		}
+	}
+}
+
+static void boxf_c(float *dst, const float *src, unsigned long sw, unsigned long sh,
+		unsigned long dw, unsigned long y0, unsigned long y1) {
+	unsigned long xoffs = sw > 1 ? 4 : 0;
+
+	for(unsigned long y=y0; y<y1; y++) {
+		const float *row0 = src + 2 * y * sw * 4;
+		const float *row1 = sh > 1 ? row0 + sw * 4 : row0;
+		float *dptr = dst + y * dw * 4;
+
+		for(unsigned long x=0; x<dw; x++) {
+			const float *a = row0 + x * 8;
+			const float *b = row1 + x * 8;
+			const float *c = a + xoffs;
+			const float *d = b + xoffs;
+
+			for(int i=0; i<4; i++) {
+				*dptr++ = ((a[i] + c[i]) + (b[i] + d[i])) * 0.25f;
+			}
+		}
+	}
+}
+
+static inline long clamp_idx(long i, long max) {
+	return i < 0 ? 0 : (i > max ? max : i);
+}
+
+static inline float clamp01(float x) {
+	return x < 0.0f ? 0.0f : (x > 1.0f ? 1.0f : x);
+}
+
+/* tmp must have room for a source row: vertical pass into tmp, then the
+ * horizontal pass from tmp to the destination row.
+ */
+static void kaiser_c(float *dst, const float *src, unsigned long sw, unsigned long sh,
+		unsigned long dw, unsigned long y0, unsigned long y1, float *tmp) {
+	const float *w = kaiser_weights;
+
+	for(unsigned long y=y0; y<y1; y++) {
+		const float *rows[KAISER_TAPS];
+		for(int k=0; k<KAISER_TAPS; k++) {
+			long sy = clamp_idx(2 * (long)y - KAISER_TAPS / 2 + 1 + k, (long)sh - 1);
+			rows[k] = src + sy * sw * 4;
+		}
+
+		for(unsigned long x=0; x<sw * 4; x++) {
+			float sum = 0.0f;
+			for(int k=0; k<KAISER_TAPS; k++) {
+				sum += w[k] * rows[k][x];
+			}
+			tmp[x] = sum;
+		}
+
+		float *dptr = dst + y * dw * 4;
+		for(unsigned long x=0; x<dw; x++) {
+			const float *cols[KAISER_TAPS];
+			for(int k=0; k<KAISER_TAPS; k++) {
+				cols[k] = tmp + clamp_idx(2 * (long)x - KAISER_TAPS / 2 + 1 + k, (long)sw - 1) * 4;
+			}
+
+			for(int i=0; i<4; i++) {
+				float sum = 0.0f;
+				for(int k=0; k<KAISER_TAPS; k++) {
+					sum += w[k] * cols[k][i];
+				}
+				*dptr++ = clamp01(sum);
+			}
+		}
+	}
+}
+
+#ifdef X86_SIMD
+// ---- SSE2 implementations ----
+
+TARGET_SSE2
+static void box8_sse2(Pixel *dst, const Pixel *src, unsigned long sw, unsigned long sh,
+		unsigned long dw, unsigned long y0, unsigned long y1) {
+	if(sw < 2) {
+		box8_c(dst, src, sw, sh, dw, y0, y1);
+		return;
+	}
+
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(2);
+
+	for(unsigned long y=y0; y<y1; y++) {
+		const Pixel *row0 = src + 2 * y * sw;
+		const Pixel *row1 = sh > 1 ? row0 + sw : row0;
+		Pixel *dptr = dst + y * dw;
+
+		// two destination pixels from 4x2 source pixels per iteration
+		unsigned long x = 0;
+		for(; x + 1 < dw; x += 2) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(row0 + 2 * x));
+			__m128i b = _mm_loadu_si128((const __m128i*)(row1 + 2 * x));
+
+			// add the two rows in 16bit, pixels 0,1 and pixels 2,3
+			__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+			__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+			// then the horizontal pairs, the sums end up in the low halves
+			lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+			hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+
+			__m128i sum = _mm_unpacklo_epi64(lo, hi);
+			sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+			_mm_storel_epi64((__m128i*)(dptr + x), _mm_packus_epi16(sum, sum));
+		}
+
+		if(x < dw) {
+			box8_pixel(dptr + x, row0 + 2 * x, row1 + 2 * x, 1);
+		}
+	}
+}
+
+TARGET_SSE2
+static void boxf_sse2(float *dst, const float *src, unsigned long sw, unsigned long sh,
+		unsigned long dw, unsigned long y0, unsigned long y1) {
+	unsigned long xoffs = sw > 1 ? 4 : 0;
+	__m128 quarter = _mm_set1_ps(0.25f);
+
+	for(unsigned long y=y0; y<y1; y++) {
+		const float *row0 = src + 2 * y * sw * 4;
+		const float *row1 = sh > 1 ? row0 + sw * 4 : row0;
+		float *dptr = dst + y * dw * 4;
+
+		for(unsigned long x=0; x<dw; x++) {
+			__m128 a = _mm_load_ps(row0 + x * 8);
+			__m128 b = _mm_load_ps(row1 + x * 8);
+			__m128 c = _mm_load_ps(row0 + x * 8 + xoffs);
+			__m128 d = _mm_load_ps(row1 + x * 8 + xoffs);
+
+			__m128 sum = _mm_add_ps(_mm_add_ps(a, c), _mm_add_ps(b, d));
+			_mm_store_ps(dptr + x * 4, _mm_mul_ps(sum, quarter));
+		}
+	}
+}
+
+TARGET_SSE2
+static void kaiser_sse2(float *dst, const float *src, unsigned long sw, unsigned long sh,
+		unsigned long dw, unsigned long y0, unsigned long y1, float *tmp) {
+	__m128 w[KAISER_TAPS];
+	for(int k=0; k<KAISER_TAPS; k++) {
+		w[k] = _mm_set1_ps(kaiser_weights[k]);
+	}
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+
+	for(unsigned long y=y0; y<y1; y++) {
+		const float *rows[KAISER_TAPS];
+		for(int k=0; k<KAISER_TAPS; k++) {
+			long sy = clamp_idx(2 * (long)y - KAISER_TAPS / 2 + 1 + k, (long)sh - 1);
+			rows[k] = src + sy * sw * 4;
+		}
+
+		for(unsigned long x=0; x<sw * 4; x+=4) {
+			__m128 sum = zero;
+			for(int k=0; k<KAISER_TAPS; k++) {
+				sum = _mm_add_ps(sum, _mm_mul_ps(w[k], _mm_load_ps(rows[k] + x)));
+			}
+			_mm_store_ps(tmp + x, sum);
+		}
+
+		float *dptr = dst + y * dw * 4;
+		for(unsigned long x=0; x<dw; x++) {
+			__m128 sum = zero;
+			for(int k=0; k<KAISER_TAPS; k++) {
+				long sx = clamp_idx(2 * (long)x - KAISER_TAPS / 2 + 1 + k, (long)sw - 1);
+				sum = _mm_add_ps(sum, _mm_mul_ps(w[k], _mm_load_ps(tmp + sx * 4)));
+			}
+			sum = _mm_min_ps(_mm_max_ps(sum, zero), one);
+			_mm_store_ps(dptr + x * 4, sum);
+		}
+	}
+}
+#endif	// X86_SIMD
+
+
+// ---- conversions between 8bit pixels and linear floats ----
+
+static void decode_rows(float *dst, const Pixel *src, unsigned long width,
+		unsigned long y0, unsigned long y1, bool gamma) {
+	const float *color_lut = gamma ? srgb_to_lin : byte_to_float;
+
+	const unsigned char *sptr = (const unsigned char*)(src + y0 * width);
+	float *dptr = dst + y0 * width * 4;
+
+	for(unsigned long i=y0 * width; i<y1 * width; i++) {
+		for(int j=0; j<4; j++) {
+			*dptr++ = j == ALPHA_BYTE ? byte_to_float[*sptr++] : color_lut[*sptr++];
+		}
+	}
+}
+
+/* the first level of the gamma correct box filter, straight from the 8bit
+ * pixels, which saves a full size float buffer. Same arithmetic as boxf.
+ */
+static void box_decode_rows(float *dst, const Pixel *src, unsigned long sw, unsigned long sh,
+		unsigned long dw, unsigned long y0, unsigned long y1, bool gamma) {
+	const float *lut[4];
+	for(int i=0; i<4; i++) {
+		lut[i] = gamma && i != ALPHA_BYTE ? srgb_to_lin : byte_to_float;
+	}
+	unsigned long xoffs = sw > 1 ? 4 : 0;
+
+	for(unsigned long y=y0; y<y1; y++) {
+		const unsigned char *row0 = (const unsigned char*)(src + 2 * y * sw);
+		const unsigned char *row1 = sh > 1 ? row0 + sw * 4 : row0;
+		float *dptr = dst + y * dw * 4;
+
+		for(unsigned long x=0; x<dw; x++) {
+			const unsigned char *a = row0 + x * 8;
+			const unsigned char *b = row1 + x * 8;
+			const unsigned char *c = a + xoffs;
+			const unsigned char *d = b + xoffs;
+
+			for(int i=0; i<4; i++) {
+				*dptr++ = ((lut[i][a[i]] + lut[i][c[i]]) + (lut[i][b[i]] + lut[i][d[i]])) * 0.25f;
+			}
+		}
+	}
+}
+
+static void encode_rows(Pixel *dst, const float *src, unsigned long width,
+		unsigned long y0, unsigned long y1, bool gamma) {
+	const float *sptr = src + y0 * width * 4;
+	unsigned char *dptr = (unsigned char*)(dst + y0 * width);
+
+	for(unsigned long i=y0 * width; i<y1 * width; i++) {
+		for(int j=0; j<4; j++) {
+			float v = clamp01(*sptr++);
+			if(gamma && j != ALPHA_BYTE) {
+				*dptr++ = lin_to_srgb[(int)(v * (ENC_LUT_SIZE - 1) + 0.5f)];
+			} else {
+				*dptr++ = (unsigned char)(v * 255.0f + 0.5f);
+			}
+		}
+	}
+}
+
+
+// ---- level construction ----
+
+struct LevelJob {
+	MipFilter filter;
+	bool gamma;
+	bool simd;
+
+	const Pixel *src8;	// the 8bit source level (box filter without gamma only)
+	Pixel *dst8;
+	const float *src;	// or the linear source level
+	float *dst;
+	unsigned long sw, sh, dw, dh;
+
+	float *tmp;			// kaiser: a source row per task
+	int tasks;
+};
+
+static void build_level_task(int idx, void *cls) {
+	LevelJob *job = (LevelJob*)cls;
+
+	unsigned long y0 = job->dh * idx / job->tasks;
+	unsigned long y1 = job->dh * (idx + 1) / job->tasks;
+
+	if(job->filter == MIP_FILTER_BOX && !job->gamma) {
+#ifdef X86_SIMD
+		if(job->simd) {
+			box8_sse2(job->dst8, job->src8, job->sw, job->sh, job->dw, y0, y1);
+			return;
+		}
+#endif
+		box8_c(job->dst8, job->src8, job->sw, job->sh, job->dw, y0, y1);
+		return;
+	}
+
+	if(!job->src && job->filter == MIP_FILTER_KAISER) {
+		// decoding the base level to linear floats, source and destination
+		// are the same size in this case.
+		decode_rows(job->dst, job->src8, job->dw, y0, y1, job->gamma);
+		return;
+	}
+
+	if(!job->src) {
+		box_decode_rows(job->dst, job->src8, job->sw, job->sh, job->dw, y0, y1, job->gamma);
+	} else if(job->filter == MIP_FILTER_KAISER) {
+		float *tmp = job->tmp + idx * job->sw * 4;
+#ifdef X86_SIMD
+		if(job->simd) {
+			kaiser_sse2(job->dst, job->src, job->sw, job->sh, job->dw, y0, y1, tmp);
+		} else
+#endif
+		kaiser_c(job->dst, job->src, job->sw, job->sh, job->dw, y0, y1, tmp);
+	} else {
+#ifdef X86_SIMD
+		if(job->simd) {
+			boxf_sse2(job->dst, job->src, job->sw, job->sh, job->dw, y0, y1);
+		} else
+#endif
+		boxf_c(job->dst, job->src, job->sw, job->sh, job->dw, y0, y1);
+	}
+
+	encode_rows(job->dst8, job->dst, job->dw, y0, y1, job->gamma);
+}
+
+static void run_level(LevelJob *job) {
+	job->tasks = (int)((job->dh + ROWS_PER_TASK - 1) / ROWS_PER_TASK);
+	tpool_parallel_for(job->tasks, build_level_task, job);
+}
+
+bool build_mipmaps(MipLevels *mips, const Pixel *img, unsigned long xsz, unsigned long ysz,
+		MipFilter filter, bool gamma_correct) {
+	if(!img || !xsz || !ysz) {
+		error("build_mipmaps: invalid image");
+		return false;
+	}
+
+	mips->set_level_count(get_mip_level_count(xsz, ysz) - 1, xsz, ysz);
+	if(!mips->count) return true;
+
+	LevelJob job;
+	job.filter = filter;
+	job.gamma = gamma_correct;
+	job.simd = get_simd_level() >= SIMD_SSE2;
+	job.src = job.dst = job.tmp = 0;
+
+	// box filtering of 8bit values works directly on the pixels
+	if(filter == MIP_FILTER_BOX && !gamma_correct) {
+		job.src8 = img;
+		job.sw = xsz;
+		job.sh = ysz;
+
+		for(int i=0; i<mips->count; i++) {
+			job.dst8 = mips->level[i].buffer;
+			job.dw = mips->level[i].width;
+			job.dh = mips->level[i].height;
+			run_level(&job);
+
+			job.src8 = job.dst8;
+			job.sw = job.dw;
+			job.sh = job.dh;
+		}
+		return true;
+	}
+
+	// everything else goes through linear float buffers, one for the
+	// source level and one for the destination level, swapped every time.
+	// The kaiser filter needs the base level decoded beforehand.
+	bool kaiser = filter == MIP_FILTER_KAISER;
+	unsigned long lvl1_size = mips->level[0].width * mips->level[0].height;
+	float *fbuf[2];
+	fbuf[0] = (float*)malloc_aligned((kaiser ? xsz * ysz : lvl1_size) * 4 * sizeof(float), SIMD_ALIGN);
+	fbuf[1] = (float*)malloc_aligned(lvl1_size * 4 * sizeof(float), SIMD_ALIGN);
+
+	int max_tasks = (int)((mips->level[0].height + ROWS_PER_TASK - 1) / ROWS_PER_TASK);
+	if(kaiser) {
+		job.tmp = (float*)malloc_aligned(max_tasks * xsz * 4 * sizeof(float), SIMD_ALIGN);
+	}
+
+	if(!fbuf[0] || !fbuf[1] || (kaiser && !job.tmp)) {
+		error("build_mipmaps: failed to allocate memory for %lux%lu image", xsz, ysz);
+		free_aligned(fbuf[0]);
+		free_aligned(fbuf[1]);
+		free_aligned(job.tmp);
+		mips->clear();
+		return false;
+	}
+
+	job.src8 = img;
+	if(kaiser) {
+		job.dst = fbuf[0];
+		job.dw = xsz;
+		job.dh = ysz;
+		run_level(&job);
+	}
+
+	job.sw = xsz;
+	job.sh = ysz;
+	for(int i=0; i<mips->count; i++) {
+		int first = kaiser ? 1 : 0;	// the buffer level 1 goes to
+		job.src = i || kaiser ? fbuf[(i + first + 1) & 1] : 0;
+		job.dst = fbuf[(i + first) & 1];
+		job.dst8 = mips->level[i].buffer;
+		job.dw = mips->level[i].width;
+		job.dh = mips->level[i].height;
+		run_level(&job);
+
+		job.sw = job.dw;
+		job.sh = job.dh;
+	}
+
+	free_aligned(fbuf[0]);
+	free_aligned(fbuf[1]);
+	free_aligned(job.tmp);
+	return true;
+}
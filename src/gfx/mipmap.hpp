@@ -0,0 +1,69 @@
+/*
+This file is part of the graphics core library.
+
+Copyright (c) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+the graphics core library is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+the graphics core library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with the graphics core library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* mipmap pyramid generation
+ *
+ * Every level is half the size of the previous one (rounding down), down to
+ * 1x1. Filtering is done with SSE2 when the cpu supports it (see
+ * set_simd_level in n3dmath2_batch.hpp), with identical results either way,
+ * and the rows of each level are split among the threads of the thread pool.
+ *
+ * In gamma correct mode the color channels are taken to be sRGB encoded and
+ * are averaged in linear space, alpha is always linear. Otherwise the 8bit
+ * values are filtered as they are.
+ */
+
+#ifndef _MIPMAP_HPP_
+#define _MIPMAP_HPP_
+
+#include <cstring>
+#include "pbuffer.hpp"
+
+#define MAX_MIP_LEVELS	16
+
+enum MipFilter {
+	MIP_FILTER_BOX,		// 2x2 average
+	MIP_FILTER_KAISER	// 8x8 separable kaiser windowed sinc, sharper
+};
+
+// the reduced levels of an image: level[i] is mip level i + 1,
+// the image itself being level 0.
+class MipLevels {
+private:
+	MipLevels(const MipLevels&);
+	MipLevels &operator =(const MipLevels&);
+
+public:
+	int count;
+	PixelBuffer level[MAX_MIP_LEVELS];
+
+	MipLevels();
+
+	void clear();
+	void set_level_count(int count, unsigned long xsz, unsigned long ysz);	// allocates
+	unsigned long get_size() const;	// in bytes, all levels
+};
+
+int get_mip_level_count(unsigned long xsz, unsigned long ysz);	// including level 0
+
+bool build_mipmaps(MipLevels *mips, const Pixel *img, unsigned long xsz, unsigned long ysz,
+		MipFilter filter = MIP_FILTER_BOX, bool gamma_correct = true);
+
+#endif	// _MIPMAP_HPP_
@@ -85,6 +85,7 @@ scalar_t dist_line(const Vector2 &p1, const Vector2 &p2, const Vector2 &p);
 #include "n3dmath2_sph.hpp"
 #include "n3dmath2_ray.hpp"
 #include "n3dmath2_qdr.hpp"
+#include "n3dmath2_batch.hpp"
 
 class Basis {
 public:
@@ -0,0 +1,553 @@
+/*
+This file is part of the n3dmath2 library.
+
+Copyright (c) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+The n3dmath2 library is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+The n3dmath2 library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with the n3dmath2 library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include "n3dmath2.hpp"
+#include "n3dmath2_batch.hpp"
+
+// every code path must give the exact same results
+#define SIMD_EXACT_MATH
+#include "common/simd.h"
+
+// the SIMD paths work on scalar_t, they're only meaningful for single precision
+#ifndef SINGLE_PRECISION_MATH
+#undef X86_SIMD
+#endif
+
+#define ELEM(type, base, stride, i)	((type*)((char*)(base) + (i) * (stride)))
+
+typedef void (*xform_points_func)(Vector3*, const Vector3*, unsigned long, const scalar_t*, size_t, size_t);
+typedef void (*xform_vectors_func)(Vector3*, const Vector3*, unsigned long, const scalar_t*, size_t, size_t);
+typedef void (*normalize_func)(Vector3*, const Vector3*, unsigned long, size_t, size_t);
+typedef void (*mat_mult_func)(Matrix4x4*, const Matrix4x4*, size_t, const Matrix4x4*, unsigned long);
+typedef void (*plane_mask_func)(uint32_t*, const scalar_t* const*, unsigned long, unsigned long, const scalar_t*);
+
+struct BatchFuncs {
+	xform_points_func xform_points;
+	xform_vectors_func xform_vectors;
+	normalize_func normalize;
+	mat_mult_func mat_mult;
+	plane_mask_func plane_mask;
+};
+
+// ---- plain C++ implementations ----
+
+/* mat points to 12 consecutive scalars (the first 3 rows of a Matrix4x4) */
+static void xform_points_c(Vector3 *dest, const Vector3 *src, unsigned long count,
+		const scalar_t *mat, size_t dstride, size_t sstride) {
+	for(unsigned long i=0; i<count; i++) {
+		const Vector3 *v = ELEM(const Vector3, src, sstride, i);
+		scalar_t x = v->x, y = v->y, z = v->z;
+
+		Vector3 *res = ELEM(Vector3, dest, dstride, i);
+		res->x = mat[0] * x + mat[1] * y + mat[2] * z + mat[3];
+		res->y = mat[4] * x + mat[5] * y + mat[6] * z + mat[7];
+		res->z = mat[8] * x + mat[9] * y + mat[10] * z + mat[11];
+	}
+}
+
+/* mat points to 9 consecutive scalars (a Matrix3x3) */
+static void xform_vectors_c(Vector3 *dest, const Vector3 *src, unsigned long count,
+		const scalar_t *mat, size_t dstride, size_t sstride) {
+	for(unsigned long i=0; i<count; i++) {
+		const Vector3 *v = ELEM(const Vector3, src, sstride, i);
+		scalar_t x = v->x, y = v->y, z = v->z;
+
+		Vector3 *res = ELEM(Vector3, dest, dstride, i);
+		res->x = mat[0] * x + mat[1] * y + mat[2] * z;
+		res->y = mat[3] * x + mat[4] * y + mat[5] * z;
+		res->z = mat[6] * x + mat[7] * y + mat[8] * z;
+	}
+}
+
+static void normalize_c(Vector3 *dest, const Vector3 *src, unsigned long count, size_t dstride, size_t sstride) {
+	for(unsigned long i=0; i<count; i++) {
+		const Vector3 *v = ELEM(const Vector3, src, sstride, i);
+		scalar_t x = v->x, y = v->y, z = v->z;
+		scalar_t len = sqrt(x * x + y * y + z * z);
+
+		Vector3 *res = ELEM(Vector3, dest, dstride, i);
+		res->x = x / len;
+		res->y = y / len;
+		res->z = z / len;
+	}
+}
+
+/* m1_stride is 0 when the same left hand matrix is used for every product */
+static void mat_mult_c(Matrix4x4 *dest, const Matrix4x4 *m1, size_t m1_stride, const Matrix4x4 *m2, unsigned long count) {
+	for(unsigned long i=0; i<count; i++) {
+		const Matrix4x4 &a = *ELEM(const Matrix4x4, m1, m1_stride, i);
+		const Matrix4x4 &b = m2[i];
+		scalar_t res[4][4];
+
+		for(int j=0; j<4; j++) {
+			for(int k=0; k<4; k++) {
+				res[j][k] = a[j][0] * b[0][k] + a[j][1] * b[1][k] + a[j][2] * b[2][k] + a[j][3] * b[3][k];
+			}
+		}
+		memcpy(dest[i][0], res, sizeof res);
+	}
+}
+
+/* planes points to the 4 coefficient arrays, v to 4 scalars. Starts from
+ * element start, which is a multiple of 32 when it's called for the tail
+ * of the SIMD versions.
+ */
+static void plane_mask_c(uint32_t *mask, const scalar_t * const *planes, unsigned long start,
+		unsigned long count, const scalar_t *v) {
+	const scalar_t *a = planes[0], *b = planes[1], *c = planes[2], *d = planes[3];
+
+	for(unsigned long i=start; i<count; i++) {
+		if(i % 32 == 0) {
+			mask[i / 32] = 0;
+		}
+
+		scalar_t s = a[i] * v[0] + b[i] * v[1] + c[i] * v[2] + d[i] * v[3];
+		if(s > 0) {
+			mask[i / 32] |= (uint32_t)1 << (i % 32);
+		}
+	}
+}
+
+static const BatchFuncs funcs_c = {xform_points_c, xform_vectors_c, normalize_c, mat_mult_c, plane_mask_c};
+
+#ifdef X86_SIMD
+// ---- SSE2 implementations (4 vectors at a time) ----
+
+/* load 4 vectors and transpose them to one register per coordinate. Tightly
+ * packed arrays are loaded with 3 vector loads and shuffled into place.
+ */
+TARGET_SSE2
+static inline void sse_load3(__m128 &x, __m128 &y, __m128 &z, const Vector3 *base, size_t stride, unsigned long i) {
+	if(stride == sizeof(Vector3)) {
+		const float *p = (const float*)(base + i);
+		__m128 a = _mm_loadu_ps(p);		// x0 y0 z0 x1
+		__m128 b = _mm_loadu_ps(p + 4);	// y1 z1 x2 y2
+		__m128 c = _mm_loadu_ps(p + 8);	// z2 x3 y3 z3
+
+		x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 1, 0, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+		y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 0, 1)),
+				_mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 2, 0, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+		z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 1, 0, 2)), c, _MM_SHUFFLE(3, 0, 2, 0));
+	} else {
+		const Vector3 *v0 = ELEM(const Vector3, base, stride, i);
+		const Vector3 *v1 = ELEM(const Vector3, base, stride, i + 1);
+		const Vector3 *v2 = ELEM(const Vector3, base, stride, i + 2);
+		const Vector3 *v3 = ELEM(const Vector3, base, stride, i + 3);
+		x = _mm_set_ps(v3->x, v2->x, v1->x, v0->x);
+		y = _mm_set_ps(v3->y, v2->y, v1->y, v0->y);
+		z = _mm_set_ps(v3->z, v2->z, v1->z, v0->z);
+	}
+}
+
+/* inverse of the above */
+TARGET_SSE2
+static inline void sse_store3(Vector3 *base, size_t stride, unsigned long i, __m128 x, __m128 y, __m128 z) {
+	if(stride == sizeof(Vector3)) {
+		float *p = (float*)(base + i);
+
+		__m128 xy = _mm_unpacklo_ps(x, y);
+		__m128 a = _mm_shuffle_ps(xy, _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 1, 0));
+		__m128 b = _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1)),
+				_mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 c = _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2)),
+				_mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+
+		_mm_storeu_ps(p, a);
+		_mm_storeu_ps(p + 4, b);
+		_mm_storeu_ps(p + 8, c);
+	} else {
+		float xarr[4], yarr[4], zarr[4];
+		_mm_storeu_ps(xarr, x);
+		_mm_storeu_ps(yarr, y);
+		_mm_storeu_ps(zarr, z);
+
+		for(int j=0; j<4; j++) {
+			Vector3 *res = ELEM(Vector3, base, stride, i + j);
+			res->x = xarr[j];
+			res->y = yarr[j];
+			res->z = zarr[j];
+		}
+	}
+}
+
+TARGET_SSE2
+static void xform_points_sse2(Vector3 *dest, const Vector3 *src, unsigned long count,
+		const scalar_t *mat, size_t dstride, size_t sstride) {
+	__m128 m[12];
+	for(int i=0; i<12; i++) {
+		m[i] = _mm_set1_ps(mat[i]);
+	}
+
+	unsigned long i;
+	for(i=0; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		sse_load3(x, y, z, src, sstride, i);
+
+		__m128 rx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], x), _mm_mul_ps(m[1], y)), _mm_mul_ps(m[2], z)), m[3]);
+		__m128 ry = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[4], x), _mm_mul_ps(m[5], y)), _mm_mul_ps(m[6], z)), m[7]);
+		__m128 rz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[8], x), _mm_mul_ps(m[9], y)), _mm_mul_ps(m[10], z)), m[11]);
+		sse_store3(dest, dstride, i, rx, ry, rz);
+	}
+
+	xform_points_c(ELEM(Vector3, dest, dstride, i), ELEM(const Vector3, src, sstride, i), count - i, mat, dstride, sstride);
+}
+
+TARGET_SSE2
+static void xform_vectors_sse2(Vector3 *dest, const Vector3 *src, unsigned long count,
+		const scalar_t *mat, size_t dstride, size_t sstride) {
+	__m128 m[9];
+	for(int i=0; i<9; i++) {
+		m[i] = _mm_set1_ps(mat[i]);
+	}
+
+	unsigned long i;
+	for(i=0; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		sse_load3(x, y, z, src, sstride, i);
+
+		__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], x), _mm_mul_ps(m[1], y)), _mm_mul_ps(m[2], z));
+		__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[3], x), _mm_mul_ps(m[4], y)), _mm_mul_ps(m[5], z));
+		__m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[6], x), _mm_mul_ps(m[7], y)), _mm_mul_ps(m[8], z));
+		sse_store3(dest, dstride, i, rx, ry, rz);
+	}
+
+	xform_vectors_c(ELEM(Vector3, dest, dstride, i), ELEM(const Vector3, src, sstride, i), count - i, mat, dstride, sstride);
+}
+
+TARGET_SSE2
+static void normalize_sse2(Vector3 *dest, const Vector3 *src, unsigned long count, size_t dstride, size_t sstride) {
+	unsigned long i;
+	for(i=0; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		sse_load3(x, y, z, src, sstride, i);
+
+		__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+
+		__m128 rx = _mm_div_ps(x, len);
+		__m128 ry = _mm_div_ps(y, len);
+		__m128 rz = _mm_div_ps(z, len);
+		sse_store3(dest, dstride, i, rx, ry, rz);
+	}
+
+	normalize_c(ELEM(Vector3, dest, dstride, i), ELEM(const Vector3, src, sstride, i), count - i, dstride, sstride);
+}
+
+TARGET_SSE2
+static void mat_mult_sse2(Matrix4x4 *dest, const Matrix4x4 *m1, size_t m1_stride, const Matrix4x4 *m2, unsigned long count) {
+	for(unsigned long i=0; i<count; i++) {
+		const Matrix4x4 &a = *ELEM(const Matrix4x4, m1, m1_stride, i);
+		const Matrix4x4 &b = m2[i];
+
+		__m128 b0 = _mm_loadu_ps(b[0]);
+		__m128 b1 = _mm_loadu_ps(b[1]);
+		__m128 b2 = _mm_loadu_ps(b[2]);
+		__m128 b3 = _mm_loadu_ps(b[3]);
+
+		// compute all the rows before storing anything, dest may alias m1 or m2
+		__m128 res[4];
+		for(int j=0; j<4; j++) {
+			res[j] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(_mm_set1_ps(a[j][0]), b0),
+						_mm_mul_ps(_mm_set1_ps(a[j][1]), b1)),
+						_mm_mul_ps(_mm_set1_ps(a[j][2]), b2)),
+						_mm_mul_ps(_mm_set1_ps(a[j][3]), b3));
+		}
+
+		for(int j=0; j<4; j++) {
+			_mm_storeu_ps(dest[i][j], res[j]);
+		}
+	}
+}
+
+TARGET_SSE2
+static void plane_mask_sse2(uint32_t *mask, const scalar_t * const *planes, unsigned long start,
+		unsigned long count, const scalar_t *v) {
+	const scalar_t *a = planes[0], *b = planes[1], *c = planes[2], *d = planes[3];
+	__m128 vx = _mm_set1_ps(v[0]), vy = _mm_set1_ps(v[1]);
+	__m128 vz = _mm_set1_ps(v[2]), vw = _mm_set1_ps(v[3]);
+	__m128 zero = _mm_setzero_ps();
+
+	unsigned long i;
+	for(i=start; i + 32 <= count; i += 32) {
+		uint32_t bits = 0;
+		for(int j=0; j<32; j+=4) {
+			unsigned long k = i + j;
+			__m128 s = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + k), vx),
+						_mm_mul_ps(_mm_loadu_ps(b + k), vy)), _mm_mul_ps(_mm_loadu_ps(c + k), vz)),
+					_mm_mul_ps(_mm_loadu_ps(d + k), vw));
+			bits |= (uint32_t)_mm_movemask_ps(_mm_cmpgt_ps(s, zero)) << j;
+		}
+		mask[i / 32] = bits;
+	}
+
+	plane_mask_c(mask, planes, i, count, v);
+}
+
+static const BatchFuncs funcs_sse2 = {xform_points_sse2, xform_vectors_sse2, normalize_sse2, mat_mult_sse2, plane_mask_sse2};
+
+// ---- AVX2 implementations (8 vectors at a time) ----
+
+/* packed arrays are handled as two groups of 4 with the SSE shuffles above,
+ * for anything else AVX2 can gather 8 strided floats with a single
+ * instruction. The gather indices are in units of floats, which is fine
+ * since all our structures consist of floats anyway.
+ */
+TARGET_AVX2
+static inline void avx_load3(__m256 &x, __m256 &y, __m256 &z, const Vector3 *base, size_t stride, unsigned long i) {
+	if(stride == sizeof(Vector3)) {
+		__m128 x0, y0, z0, x1, y1, z1;
+		sse_load3(x0, y0, z0, base, stride, i);
+		sse_load3(x1, y1, z1, base, stride, i + 4);
+
+		x = _mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1);
+		y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+		z = _mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1);
+	} else {
+		const float *p = (const float*)ELEM(const Vector3, base, stride, i);
+		__m256i idx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+				_mm256_set1_epi32((int)(stride / sizeof(float))));
+		x = _mm256_i32gather_ps(p, idx, 4);
+		y = _mm256_i32gather_ps(p + 1, idx, 4);
+		z = _mm256_i32gather_ps(p + 2, idx, 4);
+	}
+}
+
+TARGET_AVX2
+static inline void avx_store3(Vector3 *base, size_t stride, unsigned long i, __m256 x, __m256 y, __m256 z) {
+	sse_store3(base, stride, i, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z));
+	sse_store3(base, stride, i + 4, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1));
+}
+
+TARGET_AVX2
+static void xform_points_avx2(Vector3 *dest, const Vector3 *src, unsigned long count,
+		const scalar_t *mat, size_t dstride, size_t sstride) {
+	__m256 m[12];
+	for(int i=0; i<12; i++) {
+		m[i] = _mm256_set1_ps(mat[i]);
+	}
+
+	unsigned long i;
+	for(i=0; i + 8 <= count; i += 8) {
+		__m256 x, y, z;
+		avx_load3(x, y, z, src, sstride, i);
+
+		__m256 rx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[0], x), _mm256_mul_ps(m[1], y)), _mm256_mul_ps(m[2], z)), m[3]);
+		__m256 ry = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[4], x), _mm256_mul_ps(m[5], y)), _mm256_mul_ps(m[6], z)), m[7]);
+		__m256 rz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[8], x), _mm256_mul_ps(m[9], y)), _mm256_mul_ps(m[10], z)), m[11]);
+		avx_store3(dest, dstride, i, rx, ry, rz);
+	}
+
+	xform_points_sse2(ELEM(Vector3, dest, dstride, i), ELEM(const Vector3, src, sstride, i), count - i, mat, dstride, sstride);
+}
+
+TARGET_AVX2
+static void xform_vectors_avx2(Vector3 *dest, const Vector3 *src, unsigned long count,
+		const scalar_t *mat, size_t dstride, size_t sstride) {
+	__m256 m[9];
+	for(int i=0; i<9; i++) {
+		m[i] = _mm256_set1_ps(mat[i]);
+	}
+
+	unsigned long i;
+	for(i=0; i + 8 <= count; i += 8) {
+		__m256 x, y, z;
+		avx_load3(x, y, z, src, sstride, i);
+
+		__m256 rx = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[0], x), _mm256_mul_ps(m[1], y)), _mm256_mul_ps(m[2], z));
+		__m256 ry = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[3], x), _mm256_mul_ps(m[4], y)), _mm256_mul_ps(m[5], z));
+		__m256 rz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[6], x), _mm256_mul_ps(m[7], y)), _mm256_mul_ps(m[8], z));
+		avx_store3(dest, dstride, i, rx, ry, rz);
+	}
+
+	xform_vectors_sse2(ELEM(Vector3, dest, dstride, i), ELEM(const Vector3, src, sstride, i), count - i, mat, dstride, sstride);
+}
+
+TARGET_AVX2
+static void normalize_avx2(Vector3 *dest, const Vector3 *src, unsigned long count, size_t dstride, size_t sstride) {
+	unsigned long i;
+	for(i=0; i + 8 <= count; i += 8) {
+		__m256 x, y, z;
+		avx_load3(x, y, z, src, sstride, i);
+
+		__m256 len = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+
+		__m256 rx = _mm256_div_ps(x, len);
+		__m256 ry = _mm256_div_ps(y, len);
+		__m256 rz = _mm256_div_ps(z, len);
+		avx_store3(dest, dstride, i, rx, ry, rz);
+	}
+
+	normalize_sse2(ELEM(Vector3, dest, dstride, i), ELEM(const Vector3, src, sstride, i), count - i, dstride, sstride);
+}
+
+/* two rows of the result at a time, each 256bit register holds the same row
+ * of the right hand matrix in both halves.
+ */
+TARGET_AVX2
+static void mat_mult_avx2(Matrix4x4 *dest, const Matrix4x4 *m1, size_t m1_stride, const Matrix4x4 *m2, unsigned long count) {
+	for(unsigned long i=0; i<count; i++) {
+		const Matrix4x4 &a = *ELEM(const Matrix4x4, m1, m1_stride, i);
+		const Matrix4x4 &b = m2[i];
+
+		__m256 b0 = _mm256_broadcast_ps((const __m128*)b[0]);
+		__m256 b1 = _mm256_broadcast_ps((const __m128*)b[1]);
+		__m256 b2 = _mm256_broadcast_ps((const __m128*)b[2]);
+		__m256 b3 = _mm256_broadcast_ps((const __m128*)b[3]);
+
+		__m256 res[2];
+		for(int j=0; j<2; j++) {
+			const scalar_t *r0 = a[j * 2];
+			const scalar_t *r1 = a[j * 2 + 1];
+
+			res[j] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(_mm256_setr_ps(r0[0], r0[0], r0[0], r0[0], r1[0], r1[0], r1[0], r1[0]), b0),
+						_mm256_mul_ps(_mm256_setr_ps(r0[1], r0[1], r0[1], r0[1], r1[1], r1[1], r1[1], r1[1]), b1)),
+						_mm256_mul_ps(_mm256_setr_ps(r0[2], r0[2], r0[2], r0[2], r1[2], r1[2], r1[2], r1[2]), b2)),
+						_mm256_mul_ps(_mm256_setr_ps(r0[3], r0[3], r0[3], r0[3], r1[3], r1[3], r1[3], r1[3]), b3));
+		}
+
+		// the rows of a matrix are contiguous
+		_mm256_storeu_ps(dest[i][0], res[0]);
+		_mm256_storeu_ps(dest[i][2], res[1]);
+	}
+}
+
+TARGET_AVX2
+static void plane_mask_avx2(uint32_t *mask, const scalar_t * const *planes, unsigned long start,
+		unsigned long count, const scalar_t *v) {
+	const scalar_t *a = planes[0], *b = planes[1], *c = planes[2], *d = planes[3];
+	__m256 vx = _mm256_set1_ps(v[0]), vy = _mm256_set1_ps(v[1]);
+	__m256 vz = _mm256_set1_ps(v[2]), vw = _mm256_set1_ps(v[3]);
+	__m256 zero = _mm256_setzero_ps();
+
+	unsigned long i;
+	for(i=start; i + 32 <= count; i += 32) {
+		uint32_t bits = 0;
+		for(int j=0; j<32; j+=8) {
+			unsigned long k = i + j;
+			__m256 s = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(a + k), vx),
+						_mm256_mul_ps(_mm256_loadu_ps(b + k), vy)), _mm256_mul_ps(_mm256_loadu_ps(c + k), vz)),
+					_mm256_mul_ps(_mm256_loadu_ps(d + k), vw));
+			bits |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(s, zero, _CMP_GT_OQ)) << j;
+		}
+		mask[i / 32] = bits;
+	}
+
+	plane_mask_c(mask, planes, i, count, v);
+}
+
+static const BatchFuncs funcs_avx2 = {xform_points_avx2, xform_vectors_avx2, normalize_avx2, mat_mult_avx2, plane_mask_avx2};
+#endif	// X86_SIMD
+
+
+// ---- runtime selection ----
+
+static int simd_level = -1;
+static const BatchFuncs *funcs = &funcs_c;
+
+SimdLevel get_simd_support() {
+#ifdef X86_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	if(__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+	return SIMD_NONE;
+}
+
+SimdLevel get_simd_level() {
+	if(simd_level == -1) {
+		set_simd_level(SIMD_AVX2);
+	}
+	return (SimdLevel)simd_level;
+}
+
+void set_simd_level(SimdLevel level) {
+	SimdLevel support = get_simd_support();
+	if(level > support) {
+		level = support;
+	}
+
+	switch(level) {
+#ifdef X86_SIMD
+	case SIMD_AVX2:
+		funcs = &funcs_avx2;
+		break;
+
+	case SIMD_SSE2:
+		funcs = &funcs_sse2;
+		break;
+#endif
+
+	default:
+		funcs = &funcs_c;
+		break;
+	}
+	simd_level = level;
+}
+
+/* the level is resolved while the program starts up, before there are any
+ * threads around, because the kernels are called from the thread pool and
+ * the first of them would otherwise set it while the others are reading it.
+ */
+static struct SimdInit {
+	SimdInit() {
+		if(simd_level == -1) set_simd_level(SIMD_AVX2);
+	}
+} simd_init;
+
+// ---- public interface ----
+
+void transform_points(Vector3 *dest, const Vector3 *src, unsigned long count, const Matrix4x4 &mat,
+		size_t dest_stride, size_t src_stride) {
+	if(simd_level == -1) get_simd_level();
+	funcs->xform_points(dest, src, count, mat[0], dest_stride, src_stride);
+}
+
+void transform_vectors(Vector3 *dest, const Vector3 *src, unsigned long count, const Matrix3x3 &mat,
+		size_t dest_stride, size_t src_stride) {
+	if(simd_level == -1) get_simd_level();
+	funcs->xform_vectors(dest, src, count, mat[0], dest_stride, src_stride);
+}
+
+void normalize_vectors(Vector3 *dest, const Vector3 *src, unsigned long count,
+		size_t dest_stride, size_t src_stride) {
+	if(simd_level == -1) get_simd_level();
+	funcs->normalize(dest, src, count, dest_stride, src_stride);
+}
+
+void multiply_matrices(Matrix4x4 *dest, const Matrix4x4 *m1, const Matrix4x4 *m2, unsigned long count) {
+	if(simd_level == -1) get_simd_level();
+	funcs->mat_mult(dest, m1, sizeof *m1, m2, count);
+}
+
+void multiply_matrices(Matrix4x4 *dest, const Matrix4x4 &m1, const Matrix4x4 *m2, unsigned long count) {
+	if(simd_level == -1) get_simd_level();
+	funcs->mat_mult(dest, &m1, 0, m2, count);
+}
+
+void plane_side_mask(uint32_t *mask, const scalar_t *a, const scalar_t *b, const scalar_t *c,
+		const scalar_t *d, unsigned long count, const Vector4 &v) {
+	const scalar_t *planes[] = {a, b, c, d};
+	scalar_t vec[] = {v.x, v.y, v.z, v.w};
+
+	if(simd_level == -1) get_simd_level();
+	funcs->plane_mask(mask, planes, 0, count, vec);
+}
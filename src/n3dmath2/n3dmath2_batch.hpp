@@ -0,0 +1,76 @@
+/*
+This file is part of the n3dmath2 library.
+
+Copyright (c) 2007 John Tsiombikas <nuclear@siggraph.org>
+
+The n3dmath2 library is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+The n3dmath2 library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with the n3dmath2 library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* batch operations on arrays of vectors and matrices
+ *
+ * Each function has a plain C++ implementation and, on x86 with gcc,
+ * SSE2 and AVX2 implementations which are selected at runtime according to
+ * the capabilities of the cpu. All implementations perform the exact same
+ * floating point operations in the same order as the corresponding
+ * Vector3/Matrix4x4 member functions, and the file is compiled without
+ * -ffast-math reassociation, so the results are bit-identical whichever
+ * path is taken.
+ *
+ * The vector functions take optional strides (in bytes) so that they can
+ * operate on vectors embedded in larger structures (e.g. Vertex::pos).
+ * src and dest may be the same array.
+ */
+
+#ifndef _N3DMATH2_BATCH_HPP_
+#define _N3DMATH2_BATCH_HPP_
+
+#include <stddef.h>
+#include "n3dmath2.hpp"
+
+enum SimdLevel {
+	SIMD_NONE,
+	SIMD_SSE2,
+	SIMD_AVX2
+};
+
+SimdLevel get_simd_support();		// best instruction set supported by the cpu
+SimdLevel get_simd_level();			// instruction set currently used
+void set_simd_level(SimdLevel level);	// clamped to what the cpu supports
+
+// dest[i] = src[i] transformed by mat (as a point, w = 1)
+void transform_points(Vector3 *dest, const Vector3 *src, unsigned long count, const Matrix4x4 &mat,
+		size_t dest_stride = sizeof(Vector3), size_t src_stride = sizeof(Vector3));
+
+// dest[i] = src[i] transformed by mat (as a direction, no translation)
+void transform_vectors(Vector3 *dest, const Vector3 *src, unsigned long count, const Matrix3x3 &mat,
+		size_t dest_stride = sizeof(Vector3), size_t src_stride = sizeof(Vector3));
+
+// dest[i] = src[i] / |src[i]|
+void normalize_vectors(Vector3 *dest, const Vector3 *src, unsigned long count,
+		size_t dest_stride = sizeof(Vector3), size_t src_stride = sizeof(Vector3));
+
+// sets bit i of mask (32 bits per word, (count + 31) / 32 words) if
+// a[i] * v.x + b[i] * v.y + c[i] * v.z + d[i] * v.w > 0, i.e. classifies
+// points or directions v against count planes stored one array per coefficient.
+void plane_side_mask(uint32_t *mask, const scalar_t *a, const scalar_t *b, const scalar_t *c,
+		const scalar_t *d, unsigned long count, const Vector4 &v);
+
+// dest[i] = m1[i] * m2[i]
+void multiply_matrices(Matrix4x4 *dest, const Matrix4x4 *m1, const Matrix4x4 *m2, unsigned long count);
+
+// dest[i] = m1 * m2[i]
+void multiply_matrices(Matrix4x4 *dest, const Matrix4x4 &m1, const Matrix4x4 *m2, unsigned long count);
+
+#endif	// _N3DMATH2_BATCH_HPP_
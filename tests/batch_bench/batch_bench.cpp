@@ -0,0 +1,183 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* batch_bench
+ * Times the batch kernels of n3dmath2_batch.hpp with the plain C, SSE2 and
+ * AVX2 code paths (those the cpu supports), and checks that every path gives
+ * the same results as the C one.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "n3dmath2/n3dmath2.hpp"
+#include "common/timer.h"
+
+#define VEC_COUNT	1000000
+#define MAT_COUNT	100000
+#define PLANE_COUNT	1000000
+#define REPEAT		10
+
+// vectors embedded in a vertex-like structure, for the strided versions
+struct Embedded {
+	Vector3 pos;
+	scalar_t pad[5];
+};
+
+enum {
+	K_POINTS, K_POINTS_STRIDED, K_VECTORS, K_NORMALIZE, K_PLANES, K_MATRICES,
+	KERNEL_COUNT
+};
+
+static const char *kernel_names[] = {
+	"transform_points", "transform_points (strided)", "transform_vectors",
+	"normalize_vectors", "plane_side_mask", "multiply_matrices"
+};
+
+static const char *simd_names[] = {"C", "SSE2", "AVX2"};
+
+static Vector3 *vec_src;
+static Embedded *emb_src;
+static scalar_t *plane[4];
+static Matrix4x4 *mat_src, xform;
+
+// the results of one code path
+struct Results {
+	Vector3 *points, *strided, *vectors, *normals;
+	uint32_t *mask;
+	Matrix4x4 *mats;
+};
+
+static void run_kernel(int k, Results *res) {
+	switch(k) {
+	case K_POINTS:
+		transform_points(res->points, vec_src, VEC_COUNT, xform);
+		break;
+
+	case K_POINTS_STRIDED:
+		transform_points(res->strided, &emb_src->pos, VEC_COUNT, xform, sizeof(Vector3), sizeof *emb_src);
+		break;
+
+	case K_VECTORS:
+		transform_vectors(res->vectors, vec_src, VEC_COUNT, Matrix3x3(xform));
+		break;
+
+	case K_NORMALIZE:
+		normalize_vectors(res->normals, vec_src, VEC_COUNT);
+		break;
+
+	case K_PLANES:
+		plane_side_mask(res->mask, plane[0], plane[1], plane[2], plane[3], PLANE_COUNT,
+				Vector4(0.5, -1.0, 2.0, 1.0));
+		break;
+
+	case K_MATRICES:
+		multiply_matrices(res->mats, xform, mat_src, MAT_COUNT);
+		break;
+	}
+}
+
+static bool same_results(int k, const Results *a, const Results *b) {
+	switch(k) {
+	case K_POINTS:
+		return !memcmp(a->points, b->points, VEC_COUNT * sizeof(Vector3));
+	case K_POINTS_STRIDED:
+		return !memcmp(a->strided, b->strided, VEC_COUNT * sizeof(Vector3));
+	case K_VECTORS:
+		return !memcmp(a->vectors, b->vectors, VEC_COUNT * sizeof(Vector3));
+	case K_NORMALIZE:
+		return !memcmp(a->normals, b->normals, VEC_COUNT * sizeof(Vector3));
+	case K_PLANES:
+		return !memcmp(a->mask, b->mask, (PLANE_COUNT + 31) / 32 * sizeof(uint32_t));
+	case K_MATRICES:
+		return !memcmp(a->mats, b->mats, MAT_COUNT * sizeof(Matrix4x4));
+	}
+	return false;
+}
+
+int main() {
+	vec_src = new Vector3[VEC_COUNT];
+	emb_src = new Embedded[VEC_COUNT];
+	for(int i=0; i<VEC_COUNT; i++) {
+		vec_src[i] = Vector3(frand(10.0) - 5.0, frand(10.0) - 5.0, frand(10.0) - 5.0);
+		emb_src[i].pos = vec_src[i];
+	}
+
+	for(int i=0; i<4; i++) {
+		plane[i] = new scalar_t[PLANE_COUNT];
+		for(int j=0; j<PLANE_COUNT; j++) {
+			plane[i][j] = frand(2.0) - 1.0;
+		}
+	}
+
+	mat_src = new Matrix4x4[MAT_COUNT];
+	for(int i=0; i<MAT_COUNT; i++) {
+		mat_src[i].rotate(Vector3(frand(3.0), frand(3.0), frand(3.0)));
+		mat_src[i].translate(Vector3(frand(3.0), 1.0, 2.0));
+	}
+	xform.translate(Vector3(1, 2, 3));
+	xform.rotate(Vector3(0.3, 0.2, 0.1));
+	xform.scale(Vector4(1.1, 0.9, 1.3, 1));
+
+	int levels = get_simd_support() + 1;
+	Results res[3];
+	double msec[3][KERNEL_COUNT];
+	int failures = 0;
+
+	for(int s=0; s<levels; s++) {
+		set_simd_level((SimdLevel)s);
+
+		res[s].points = new Vector3[VEC_COUNT];
+		res[s].strided = new Vector3[VEC_COUNT];
+		res[s].vectors = new Vector3[VEC_COUNT];
+		res[s].normals = new Vector3[VEC_COUNT];
+		res[s].mask = new uint32_t[(PLANE_COUNT + 31) / 32];
+		res[s].mats = new Matrix4x4[MAT_COUNT];
+
+		for(int k=0; k<KERNEL_COUNT; k++) {
+			run_kernel(k, res + s);		// warm up
+
+			unsigned long start = timer_usec();
+			for(int r=0; r<REPEAT; r++) {
+				run_kernel(k, res + s);
+			}
+			msec[s][k] = (timer_usec() - start) / 1000.0 / REPEAT;
+
+			if(s > 0 && !same_results(k, res, res + s)) {
+				printf("%s: %s results differ from the C code\n", kernel_names[k], simd_names[s]);
+				failures++;
+			}
+		}
+	}
+
+	printf("%d vectors, %d matrices, msec per call (speedup over C)\n", VEC_COUNT, MAT_COUNT);
+	for(int k=0; k<KERNEL_COUNT; k++) {
+		printf("%-28s", kernel_names[k]);
+		for(int s=0; s<levels; s++) {
+			printf("  %s %7.2f (%.1fx)", simd_names[s], msec[s][k], msec[0][k] / msec[s][k]);
+		}
+		putchar('\n');
+	}
+
+	if(failures) {
+		printf("FAILED\n");
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
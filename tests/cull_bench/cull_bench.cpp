@@ -0,0 +1,233 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* cull_bench
+ * Times frustum culling and ray picking of a large number of moving boxes,
+ * the way Scene does it with a BVHTree, against testing every object's
+ * bounding sphere (what Object::render did before) or box in turn. Checks
+ * that the BVH finds every visible object and the same nearest ray hits.
+ * Runs on the cpu only, the object count can be given on the command line.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include "3dengfx/3denginefx.hpp"
+#include "gfx/bvh.hpp"
+#include "gfx/bvol.hpp"
+#include "common/timer.h"
+
+#define FRAMES		100
+#define RAYS		1000
+#define WORLD_SIZE	1000.0
+
+struct BenchObject {
+	Vector3 pos, vel, ext;		// box center, velocity and half size
+	BoundingSphere sphere;		// centered at the origin, moved by set_transform
+};
+
+static std::vector<BenchObject> objects;
+
+static void get_bounds(const BenchObject &obj, Vector3 *min, Vector3 *max) {
+	*min = obj.pos - obj.ext;
+	*max = obj.pos + obj.ext;
+}
+
+/* every tenth object moves slowly, at most 0.1 units per frame along each
+ * axis (objects are 2 to 10 units wide), bouncing off the sides of the world.
+ * Faster objects leave their fattened BVH bounds more often, and the refits
+ * force more frequent rebuilds.
+ */
+static void move_objects() {
+	for(size_t i=0; i<objects.size(); i+=10) {
+		BenchObject *obj = &objects[i];
+		obj->pos += obj->vel;
+
+		scalar_t *p = &obj->pos.x, *v = &obj->vel.x;
+		for(int j=0; j<3; j++) {
+			if(p[j] < -WORLD_SIZE / 2.0 || p[j] > WORLD_SIZE / 2.0) v[j] = -v[j];
+		}
+	}
+}
+
+// camera at the origin, turning around the y axis
+static void setup_frustum(FrustumPlane *frustum, int frame) {
+	Matrix4x4 view;
+	view.set_rotation(Vector3(0, frame * two_pi / FRAMES, 0));
+
+	Matrix4x4 mvp = create_projection_matrix(quarter_pi, 1.333333, 1.0, WORLD_SIZE / 2.0) * view;
+	for(int i=0; i<6; i++) {
+		frustum[i] = FrustumPlane(mvp, i);
+	}
+}
+
+int main(int argc, char **argv) {
+	int count = argc > 1 ? atoi(argv[1]) : 20000;
+	if(count <= 0) {
+		fprintf(stderr, "usage: %s [object count]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	objects.resize(count);
+	for(int i=0; i<count; i++) {
+		BenchObject *obj = &objects[i];
+		obj->pos = Vector3(frand(WORLD_SIZE), frand(WORLD_SIZE), frand(WORLD_SIZE)) - Vector3(1, 1, 1) * (WORLD_SIZE / 2.0);
+		obj->vel = Vector3(frand(0.2) - 0.1, frand(0.2) - 0.1, frand(0.2) - 0.1);
+		obj->ext = Vector3(frand(4.0) + 1.0, frand(4.0) + 1.0, frand(4.0) + 1.0);
+		obj->sphere.set_radius(obj->ext.length());
+	}
+
+	BVHTree bvh;
+	unsigned long start = timer_usec();
+	for(int i=0; i<count; i++) {
+		Vector3 min, max;
+		get_bounds(objects[i], &min, &max);
+		bvh.add_item(min, max);
+	}
+	bvh.rebuild();
+	double build_msec = (timer_usec() - start) / 1000.0;
+
+	unsigned long sphere_usec = 0, box_usec = 0, update_usec = 0, query_usec = 0;
+	unsigned long visible = 0;
+	std::vector<int> vis;
+	int failures = 0;
+
+	for(int f=0; f<FRAMES; f++) {
+		FrustumPlane frustum[6];
+		setup_frustum(frustum, f);
+		move_objects();
+
+		// what Object::render did for every object
+		start = timer_usec();
+		int sphere_vis = 0;
+		for(int i=0; i<count; i++) {
+			Matrix4x4 world;
+			world.set_translation(objects[i].pos);
+			objects[i].sphere.set_transform(world);
+			if(objects[i].sphere.visible(frustum)) sphere_vis++;
+		}
+		sphere_usec += timer_usec() - start;
+
+		start = timer_usec();
+		std::vector<bool> box_vis(count);
+		for(int i=0; i<count; i++) {
+			Vector3 min, max;
+			get_bounds(objects[i], &min, &max);
+			box_vis[i] = aabox_frustum_test(min, max, frustum) != BVOL_OUTSIDE;
+		}
+		box_usec += timer_usec() - start;
+
+		// what Scene::update_bvh and render_objects do
+		start = timer_usec();
+		for(int i=0; i<count; i++) {
+			Vector3 min, max;
+			get_bounds(objects[i], &min, &max);
+			bvh.update_item(i, min, max);
+		}
+		update_usec += timer_usec() - start;
+
+		start = timer_usec();
+		vis.clear();
+		bvh.get_visible(frustum, &vis);
+		std::sort(vis.begin(), vis.end());
+		query_usec += timer_usec() - start;
+
+		visible += vis.size();
+
+		// the fattened BVH boxes may let a few more through, but none less
+		for(int i=0; i<count; i++) {
+			if(box_vis[i] && !std::binary_search(vis.begin(), vis.end(), i)) {
+				printf("frame %d: visible object %d missed by the BVH\n", f, i);
+				failures++;
+				break;
+			}
+		}
+	}
+
+	/* picking compares the nearest hits against a tree without fattened
+	 * bounds, which must agree exactly with the linear search.
+	 */
+	BVHTree exact(0.0);
+	for(int i=0; i<count; i++) {
+		Vector3 min, max;
+		get_bounds(objects[i], &min, &max);
+		exact.add_item(min, max);
+	}
+	exact.rebuild();
+
+	std::vector<Ray> rays(RAYS);
+	for(int i=0; i<RAYS; i++) {
+		Vector3 dir(frand(2.0) - 1.0, frand(2.0) - 1.0, frand(2.0) - 1.0);
+		rays[i] = Ray(Vector3(0, 0, 0), dir.normalized() * WORLD_SIZE);
+	}
+
+	std::vector<int> linear_hit(RAYS), bvh_hit(RAYS);
+
+	start = timer_usec();
+	for(int r=0; r<RAYS; r++) {
+		scalar_t best_t = 0;
+		linear_hit[r] = -1;
+		for(int i=0; i<count; i++) {
+			Vector3 min, max;
+			get_bounds(objects[i], &min, &max);
+			scalar_t t;
+			if(aabox_ray_test(min, max, rays[r], &t) && (linear_hit[r] == -1 || t < best_t)) {
+				best_t = t;
+				linear_hit[r] = i;
+			}
+		}
+	}
+	double linear_pick_msec = (timer_usec() - start) / 1000.0;
+
+	start = timer_usec();
+	for(int r=0; r<RAYS; r++) {
+		bvh_hit[r] = exact.get_nearest_ray_hit(rays[r]);
+	}
+	double bvh_pick_msec = (timer_usec() - start) / 1000.0;
+
+	int hits = 0;
+	for(int r=0; r<RAYS; r++) {
+		if(linear_hit[r] != bvh_hit[r]) {
+			printf("ray %d: nearest hit %d, BVH found %d\n", r, linear_hit[r], bvh_hit[r]);
+			failures++;
+		}
+		if(linear_hit[r] != -1) hits++;
+	}
+
+	double frame_msec = 1000.0 * FRAMES;
+	printf("%d objects, %d frames, %lu visible per frame, BVH build %.2f msec\n", count, FRAMES,
+			visible / FRAMES, build_msec);
+	printf("culling, msec per frame:\n");
+	printf("  sphere per object  %7.3f\n", sphere_usec / frame_msec);
+	printf("  box per object     %7.3f\n", box_usec / frame_msec);
+	printf("  BVH update         %7.3f\n", update_usec / frame_msec);
+	printf("  BVH query          %7.3f  (%.1fx over spheres with the update, %.1fx without)\n",
+			query_usec / frame_msec, (double)sphere_usec / (update_usec + query_usec),
+			(double)sphere_usec / query_usec);
+	printf("picking %d rays (%d hit), msec per ray:\n", RAYS, hits);
+	printf("  box per object     %7.4f\n", linear_pick_msec / RAYS);
+	printf("  BVH nearest hit    %7.4f  (%.1fx)\n", bvh_pick_msec / RAYS, linear_pick_msec / bvh_pick_msec);
+
+	if(failures) {
+		printf("FAILED\n");
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
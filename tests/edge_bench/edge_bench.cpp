@@ -0,0 +1,187 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* edge_bench
+ * Times TriMesh::calculate_edges on meshes of over a million triangles, a
+ * torus and a set of triangle fans around high valence vertices, against
+ * the per-vertex edge lists it replaced (copied below), on one thread and
+ * on all of them, and checks that both find the same edges.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "3dengfx/3dengfx.hpp"
+#include "3dengfx/ggen.hpp"
+#include "common/threadpool.h"
+#include "common/timer.h"
+
+// there's no GL context, report no capabilities at all
+const GLubyte *glGetString(GLenum name) {
+	return (const GLubyte*)(name == GL_VERSION ? "1.1" : "");
+}
+
+void glGetIntegerv(GLenum pname, GLint *params) {
+	*params = 0;
+}
+
+#define REPEAT		3
+#define FANS		1024
+#define FAN_TRIS	1024
+
+// ---- the previous calculate_edges ----
+static void old_calculate_edges(const TriMesh *mesh, std::vector<Edge> *res) {
+	const Index *igraph = mesh->get_index_graph()->get_data();
+	unsigned int vcount = mesh->get_vertex_array()->get_count();
+	std::vector<Edge> *edge_table = new std::vector<Edge>[vcount];
+	const Triangle *tris = mesh->get_triangle_array()->get_data();
+	unsigned int tcount = mesh->get_triangle_array()->get_count();
+
+	for(unsigned int i=0; i<tcount; i++) {
+		for(unsigned int j=0; j<3; j++) {
+			unsigned int a = igraph[tris[i].vertices[j]];
+			unsigned int b = igraph[tris[i].vertices[(j + 1) % 3]];
+
+			Edge new_edge(a, b, i);
+			if(a > b) std::swap(a, b);
+
+			int edge_found = -1;
+			for(unsigned int edge=0; edge<edge_table[a].size(); edge++) {
+				const Edge &e = edge_table[a][edge];
+				if(e.vertices[0] == b || e.vertices[1] == b) {
+					edge_found = edge;
+					break;
+				}
+			}
+
+			if(edge_found != -1) {
+				edge_table[a][edge_found].adjfaces[1] = i;
+			} else {
+				edge_table[a].push_back(new_edge);
+			}
+		}
+	}
+
+	res->clear();
+	for(unsigned int i=0; i<vcount; i++) {
+		res->insert(res->end(), edge_table[i].begin(), edge_table[i].end());
+	}
+	delete [] edge_table;
+}
+// ----
+
+// orders edges by their vertex pair, regardless of winding
+static bool edge_less(const Edge &a, const Edge &b) {
+	Index alow = std::min(a.vertices[0], a.vertices[1]);
+	Index blow = std::min(b.vertices[0], b.vertices[1]);
+	if(alow != blow) return alow < blow;
+	return std::max(a.vertices[0], a.vertices[1]) < std::max(b.vertices[0], b.vertices[1]);
+}
+
+static bool same_edges(std::vector<Edge> a, std::vector<Edge> b) {
+	if(a.size() != b.size()) return false;
+	std::sort(a.begin(), a.end(), edge_less);
+	std::sort(b.begin(), b.end(), edge_less);
+	return a.empty() || memcmp(&a[0], &b[0], a.size() * sizeof(Edge)) == 0;
+}
+
+// best time of a few runs, on a copy of the mesh with its index graph ready
+static double time_edges(const TriMesh &mesh, std::vector<Edge> *edges) {
+	double best = 0.0;
+	for(int i=0; i<REPEAT; i++) {
+		TriMesh copy(mesh);
+		copy.get_index_graph();
+
+		unsigned long start = timer_usec();
+		const GeometryArray<Edge> *earray = copy.get_edge_array();
+		double msec = (timer_usec() - start) / 1000.0;
+		if(i == 0 || msec < best) best = msec;
+
+		edges->assign(earray->get_data(), earray->get_data() + earray->get_count());
+	}
+	return best;
+}
+
+static int bench(const TriMesh &mesh, const char *name) {
+	std::vector<Edge> old_edges, edges;
+	int threads = tpool_get_thread_count();
+
+	unsigned long start = timer_usec();
+	old_calculate_edges(&mesh, &old_edges);
+	double old_msec = (timer_usec() - start) / 1000.0;
+
+	tpool_set_thread_count(1);
+	double msec1 = time_edges(mesh, &edges);
+	bool same = same_edges(old_edges, edges);
+
+	tpool_set_thread_count(threads);
+	double msec = time_edges(mesh, &edges);
+	same = same && same_edges(old_edges, edges);
+
+	printf("%-10s %lu tris, %lu edges: old %8.1f, 1 thread %6.1f (%.1fx), %d thread(s) %6.1f (%.1fx)\n",
+			name, mesh.get_triangle_array()->get_count(), (unsigned long)edges.size(),
+			old_msec, msec1, old_msec / msec1, threads, msec, old_msec / msec);
+
+	if(!same) {
+		printf("%s: the edges differ from the old code\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	int failures = 0;
+
+	printf("msec per mesh (speedup over the old code)\n");
+	{
+		TriMesh torus;
+		create_torus(&torus, 0.5, 2.0, 200);
+		failures += bench(torus, "torus");
+	}
+
+	{
+		// vertices shared by FAN_TRIS triangles each
+		std::vector<Vertex> verts;
+		std::vector<Triangle> tris;
+		for(int f=0; f<FANS; f++) {
+			Index hub = verts.size();
+			verts.push_back(Vertex(Vector3(f * 3.0, 0, 0)));
+
+			for(int i=0; i<FAN_TRIS; i++) {
+				scalar_t a = two_pi * i / FAN_TRIS;
+				verts.push_back(Vertex(Vector3(f * 3.0 + cos(a), sin(a), 0)));
+			}
+			for(int i=0; i<FAN_TRIS; i++) {
+				tris.push_back(Triangle(hub, hub + 1 + i, hub + 1 + (i + 1) % FAN_TRIS));
+			}
+		}
+
+		TriMesh fans(&verts[0], verts.size(), &tris[0], tris.size());
+		failures += bench(fans, "fans");
+	}
+
+	if(failures) {
+		printf("FAILED\n");
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,187 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* filter_bench
+ * Times apply_kernel on 2K and 4K images, with every SIMD level the cpu
+ * supports on one thread and on all of them, against the per channel, per
+ * pixel convolution it replaced (copied below), and checks that they give
+ * the same results.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "gfx/img_manip.hpp"
+#include "gfx/color_bits.h"
+#include "n3dmath2/n3dmath2_batch.hpp"
+#include "common/threadpool.h"
+#include "common/timer.h"
+
+#define REPEAT	4
+
+struct Kernel {
+	const char *name;
+	int dim;
+	int k[25];
+};
+
+static const Kernel kernels[] = {
+	{"box 3x3", 3, {1, 1, 1, 1, 1, 1, 1, 1, 1}},
+	{"gaussian 5x5", 5, {1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4, 1, 4, 6, 4, 1}},
+	{"sharpen 3x3", 3, {0, -1, 0, -1, 5, -1, 0, -1, 0}}
+};
+#define KERNEL_COUNT	((int)(sizeof kernels / sizeof *kernels))
+
+static const int sizes[] = {2048, 4096};
+
+static const char *simd_names[] = {"C", "SSE2", "AVX2"};
+
+// ---- the previous apply_kernel, clamp sampling only ----
+#define GETA(c) 		(((c) >> ALPHA_SHIFT32) & ALPHA_MASK32)
+#define GETR(c) 		(((c) >> RED_SHIFT32) & RED_MASK32)
+#define GETG(c) 		(((c) >> GREEN_SHIFT32) & GREEN_MASK32)
+#define GETB(c) 		(((c) >> BLUE_SHIFT32) & BLUE_MASK32)
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#define CLAMP(n, l, h)	MIN(MAX((n), (l)), (h))
+
+static inline Pixel fetch_pixel(int x, int y, Pixel *img, int w, int h) {
+	x = CLAMP(x, 0, w - 1);
+	y = CLAMP(y, 0, h - 1);
+	return img[x + w * y];
+}
+
+static Pixel *old_kernel_channel(const int *kernel, int kernel_dim, Pixel *img, int w, int h) {
+	int kernel_center = kernel_dim / 2;
+	int kernel_sum = 0;
+	for(int i=0; i<kernel_dim * kernel_dim; i++) {
+		kernel_sum += kernel[i];
+	}
+
+	Pixel *temp = (Pixel*)malloc(w * h * sizeof(Pixel));
+
+	for(int j=0; j<h; j++) {
+		for(int i=0; i<w; i++) {
+			int sum = 0;
+			for(int kj=0; kj<kernel_dim; kj++) {
+				for(int ki=0; ki<kernel_dim; ki++) {
+					int pixel = (int)fetch_pixel(i + ki - kernel_center, j + kj - kernel_center, img, w, h);
+					sum += pixel * kernel[ki + kernel_dim * kj];
+				}
+			}
+			if(kernel_sum) {
+				sum /= kernel_sum;
+			}
+			temp[i + j * w] = CLAMP(sum, 0, 255);
+		}
+	}
+	return temp;
+}
+
+static void old_apply_kernel(PixelBuffer *pb, const int *kernel, int kernel_dim) {
+	unsigned int sz = pb->width * pb->height;
+	Pixel *chan[4], *res[4];
+
+	for(int c=0; c<4; c++) {
+		chan[c] = (Pixel*)malloc(sz * sizeof(Pixel));
+	}
+	for(unsigned int i=0; i<sz; i++) {
+		Pixel p = pb->buffer[i];
+		chan[0][i] = GETA(p);
+		chan[1][i] = GETR(p);
+		chan[2][i] = GETG(p);
+		chan[3][i] = GETB(p);
+	}
+
+	for(int c=0; c<4; c++) {
+		res[c] = old_kernel_channel(kernel, kernel_dim, chan[c], pb->width, pb->height);
+		free(chan[c]);
+	}
+
+	for(unsigned int i=0; i<sz; i++) {
+		pb->buffer[i] = PACK_COLOR32(res[0][i], res[1][i], res[2][i], res[3][i]);
+	}
+	for(int c=0; c<4; c++) {
+		free(res[c]);
+	}
+}
+// ----
+
+int main() {
+	int levels = get_simd_support() + 1;
+	int threads = tpool_get_thread_count();
+	int failures = 0;
+
+	printf("msec per image (speedup over the old code), on 1 and %d thread(s)\n", threads);
+
+	for(int s=0; s<(int)(sizeof sizes / sizeof *sizes); s++) {
+		int sz = sizes[s];
+
+		PixelBuffer src(sz, sz);
+		srand(1);
+		for(int i=0; i<sz * sz; i++) {
+			src.buffer[i] = ((Pixel)rand() << 16) ^ (Pixel)rand();
+		}
+
+		for(int k=0; k<KERNEL_COUNT; k++) {
+			PixelBuffer old(src);
+			unsigned long start = timer_usec();
+			old_apply_kernel(&old, kernels[k].k, kernels[k].dim);
+			double old_msec = (timer_usec() - start) / 1000.0;
+
+			printf("%dx%d %-13s old %8.1f\n", sz, sz, kernels[k].name, old_msec);
+
+			for(int l=0; l<levels; l++) {
+				set_simd_level((SimdLevel)l);
+				printf("%24s%-4s", "", simd_names[l]);
+
+				for(int t=0; t<2; t++) {
+					tpool_set_thread_count(t ? threads : 1);
+
+					double msec = 0.0;
+					for(int r=0; r<REPEAT; r++) {
+						PixelBuffer pb(src);
+						int kcopy[25];
+						memcpy(kcopy, kernels[k].k, sizeof kcopy);
+
+						start = timer_usec();
+						apply_kernel(&pb, kcopy, kernels[k].dim);
+						msec += (timer_usec() - start) / 1000.0;
+
+						if(r == 0 && memcmp(pb.buffer, old.buffer, sz * sz * sizeof(Pixel)) != 0) {
+							printf("\n%dx%d %s, %s: differs from the old code\n", sz, sz,
+									kernels[k].name, simd_names[l]);
+							failures++;
+						}
+					}
+					msec /= REPEAT;
+					printf(" %8.1f (%5.1fx)", msec, old_msec / msec);
+				}
+				putchar('\n');
+			}
+		}
+	}
+
+	if(failures) {
+		printf("FAILED\n");
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
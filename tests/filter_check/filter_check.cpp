@@ -0,0 +1,149 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* filter_check
+ * Checks apply_kernel against the straightforward per pixel convolution,
+ * for separable and non-separable kernels, every sampling mode and every
+ * SIMD level the cpu supports.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "gfx/img_manip.hpp"
+#include "n3dmath2/n3dmath2_batch.hpp"
+
+#define WIDTH	67
+#define HEIGHT	45
+
+struct Kernel {
+	const char *name;
+	int dim;
+	int k[25];
+};
+
+static const Kernel kernels[] = {
+	{"box", 3, {1, 1, 1, 1, 1, 1, 1, 1, 1}},
+	{"gaussian", 5, {1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4, 1, 4, 6, 4, 1}},
+	{"sobel", 3, {-1, 0, 1, -2, 0, 2, -1, 0, 1}},
+	{"sharpen", 3, {0, -1, 0, -1, 5, -1, 0, -1, 0}},
+	{"negative pivot", 3, {-1, -2, -1, 0, 0, 0, 1, 2, 1}},
+	{"zero sum", 3, {1, 1, 1, 1, -8, 1, 1, 1, 1}},
+	// separable, but pivot times the sums of the kernel overflows an int
+	{"large weights", 3, {1000, 2000, 1000, 2000, 4000, 2000, 1000, 2000, 1000}},
+	{"large 2D", 3, {30000, -20000, 5000, 1000, 40000, 1000, 5000, -20000, 30000}}
+};
+
+static const char *mode_names[] = {"clamp", "wrap", "mirror"};
+static const char *simd_names[] = {"C", "SSE2", "AVX2"};
+
+// same as the edge handling of apply_kernel
+static int map_index(int c, int dim, ImgSamplingMode mode) {
+	switch(mode) {
+	case SAMPLE_WRAP:
+		c %= dim;
+		return c < 0 ? c + dim : c;
+
+	case SAMPLE_MIRROR:
+		{
+			if(dim == 1) return 0;
+			int period = 2 * dim - 2;
+			c = (c < 0 ? -c : c) % period;
+			return c < dim ? c : period - c;
+		}
+
+	default:
+		return c < 0 ? 0 : (c >= dim ? dim - 1 : c);
+	}
+}
+
+static void reference(Pixel *dest, const Pixel *src, const Kernel *kern, ImgSamplingMode mode) {
+	int rad = kern->dim / 2;
+	int ksum = 0;
+	for(int i=0; i<kern->dim * kern->dim; i++) {
+		ksum += kern->k[i];
+	}
+	if(!ksum) ksum = 1;
+
+	const unsigned char *sptr = (const unsigned char*)src;
+	unsigned char *dptr = (unsigned char*)dest;
+
+	for(int y=0; y<HEIGHT; y++) {
+		for(int x=0; x<WIDTH; x++) {
+			for(int c=0; c<4; c++) {
+				int sum = 0;
+				for(int i=0; i<kern->dim; i++) {
+					int sy = map_index(y + i - rad, HEIGHT, mode);
+					for(int j=0; j<kern->dim; j++) {
+						int sx = map_index(x + j - rad, WIDTH, mode);
+						sum += kern->k[i * kern->dim + j] * sptr[(sy * WIDTH + sx) * 4 + c];
+					}
+				}
+				sum /= ksum;
+				dptr[(y * WIDTH + x) * 4 + c] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+			}
+		}
+	}
+}
+
+int main() {
+	PixelBuffer src(WIDTH, HEIGHT);
+	srand(1);
+	for(int i=0; i<WIDTH * HEIGHT; i++) {
+		src.buffer[i] = ((Pixel)rand() << 16) ^ (Pixel)rand();
+	}
+	// a white block, the large weights turned it black
+	for(int y=10; y<20; y++) {
+		for(int x=10; x<20; x++) {
+			src.buffer[y * WIDTH + x] = 0xffffffff;
+		}
+	}
+
+	Pixel *ref = new Pixel[WIDTH * HEIGHT];
+	int failures = 0;
+	int levels = get_simd_support() + 1;
+
+	for(int s=0; s<levels; s++) {
+		set_simd_level((SimdLevel)s);
+
+		for(int k=0; k<(int)(sizeof kernels / sizeof *kernels); k++) {
+			for(int m=0; m<3; m++) {
+				ImgSamplingMode mode = (ImgSamplingMode)m;
+				PixelBuffer pb(src);
+				int kcopy[25];
+				memcpy(kcopy, kernels[k].k, sizeof kcopy);
+
+				reference(ref, src.buffer, kernels + k, mode);
+				if(!apply_kernel(&pb, kcopy, kernels[k].dim, mode)) {
+					printf("%s, %s kernel, %s: apply_kernel failed\n", simd_names[s], kernels[k].name, mode_names[m]);
+					failures++;
+				} else if(memcmp(pb.buffer, ref, WIDTH * HEIGHT * sizeof *ref) != 0) {
+					printf("%s, %s kernel, %s: differs from the per pixel convolution\n",
+							simd_names[s], kernels[k].name, mode_names[m]);
+					failures++;
+				}
+			}
+		}
+	}
+
+	printf("%d SIMD level(s): %s\n", levels, failures ? "FAILED" : "all filters match");
+	delete [] ref;
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
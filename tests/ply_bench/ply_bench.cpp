@@ -0,0 +1,200 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* ply_bench
+ * Measures the throughput of load_mesh_ply (MB/s of file data) on a grid
+ * mesh with normals and texture coordinates, written as ascii, binary
+ * little endian and binary big endian PLY files, and checks that all three
+ * load to the same mesh. Usage: ply_bench [grid size], default 512.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include "3dengfx/3dengfx.hpp"
+#include "common/timer.h"
+
+// there's no GL context, report no capabilities at all
+const GLubyte *glGetString(GLenum name) {
+	return (const GLubyte*)(name == GL_VERSION ? "1.1" : "");
+}
+
+void glGetIntegerv(GLenum pname, GLint *params) {
+	*params = 0;
+}
+
+enum {FMT_ASCII, FMT_LITTLE, FMT_BIG};
+
+static const char *fmt_names[] = {"ascii", "binary_little_endian", "binary_big_endian"};
+static const char *fnames[] = {"bench_ascii.ply", "bench_le.ply", "bench_be.ply"};
+
+static void write_float(FILE *fp, float x, int fmt) {
+	unsigned char b[4];
+	memcpy(b, &x, 4);
+
+	// figure out the byte order of the machine from a known value
+	uint32_t one = 1;
+	bool little = *(unsigned char*)&one == 1;
+	if(little != (fmt == FMT_LITTLE)) {
+		unsigned char tmp = b[0]; b[0] = b[3]; b[3] = tmp;
+		tmp = b[1]; b[1] = b[2]; b[2] = tmp;
+	}
+	fwrite(b, 1, 4, fp);
+}
+
+static void write_int(FILE *fp, uint32_t x, int fmt) {
+	unsigned char b[4];
+	for(int i=0; i<4; i++) {
+		int shift = fmt == FMT_LITTLE ? i * 8 : (3 - i) * 8;
+		b[i] = (x >> shift) & 0xff;
+	}
+	fwrite(b, 1, 4, fp);
+}
+
+static long write_grid(const char *fname, int fmt, int size) {
+	FILE *fp = fopen(fname, "wb");
+	if(!fp) {
+		perror(fname);
+		return -1;
+	}
+
+	int vcount = size * size;
+	int fcount = (size - 1) * (size - 1) * 2;
+
+	fprintf(fp, "ply\nformat %s 1.0\n", fmt_names[fmt]);
+	fprintf(fp, "element vertex %d\n", vcount);
+	fputs("property float x\nproperty float y\nproperty float z\n", fp);
+	fputs("property float nx\nproperty float ny\nproperty float nz\n", fp);
+	fputs("property float u\nproperty float v\n", fp);
+	fprintf(fp, "element face %d\n", fcount);
+	fputs("property list uchar int vertex_indices\nend_header\n", fp);
+
+	for(int i=0; i<vcount; i++) {
+		int x = i % size, y = i / size;
+		float v[8];
+		v[0] = (float)x;
+		v[1] = (float)y;
+		v[2] = (float)(sin(x * 0.1) * cos(y * 0.13) * 5.0);
+		v[3] = 0.0f; v[4] = 0.0f; v[5] = 1.0f;
+		v[6] = (float)x / size;
+		v[7] = (float)y / size;
+
+		if(fmt == FMT_ASCII) {
+			fprintf(fp, "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+		} else {
+			for(int j=0; j<8; j++) {
+				write_float(fp, v[j], fmt);
+			}
+		}
+	}
+
+	for(int y=0; y<size - 1; y++) {
+		for(int x=0; x<size - 1; x++) {
+			uint32_t a = y * size + x;
+			uint32_t tri[2][3] = {{a, a + 1, a + size}, {a + 1, a + size + 1, a + size}};
+
+			for(int t=0; t<2; t++) {
+				if(fmt == FMT_ASCII) {
+					fprintf(fp, "3 %u %u %u\n", tri[t][0], tri[t][1], tri[t][2]);
+				} else {
+					fputc(3, fp);
+					for(int j=0; j<3; j++) {
+						write_int(fp, tri[t][j], fmt);
+					}
+				}
+			}
+		}
+	}
+
+	long fsize = ftell(fp);
+	fclose(fp);
+	return fsize;
+}
+
+static bool same_mesh(TriMesh *a, TriMesh *b) {
+	const VertexArray *va = a->get_vertex_array(), *vb = b->get_vertex_array();
+	const TriangleArray *ta = a->get_triangle_array(), *tb = b->get_triangle_array();
+
+	if(va->get_count() != vb->get_count() || ta->get_count() != tb->get_count()) {
+		return false;
+	}
+
+	for(unsigned long i=0; i<va->get_count(); i++) {
+		const Vertex *v0 = va->get_data() + i, *v1 = vb->get_data() + i;
+		if(memcmp(&v0->pos, &v1->pos, sizeof v0->pos) || memcmp(&v0->tex[0], &v1->tex[0], sizeof v0->tex[0])) {
+			return false;
+		}
+	}
+	for(unsigned long i=0; i<ta->get_count(); i++) {
+		if(memcmp(ta->get_data()[i].vertices, tb->get_data()[i].vertices, sizeof(Index) * 3)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	int size = argc > 1 ? atoi(argv[1]) : 512;
+	if(size < 2) {
+		fprintf(stderr, "usage: %s [grid size >= 2]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	TriMesh *mesh[3];
+	int failures = 0;
+
+	printf("%dx%d grid, %d vertices, %d triangles\n", size, size, size * size, (size - 1) * (size - 1) * 2);
+
+	for(int i=0; i<3; i++) {
+		long fsize = write_grid(fnames[i], i, size);
+		if(fsize < 0) return EXIT_FAILURE;
+
+		unsigned long start = timer_usec();
+		mesh[i] = load_mesh_ply(fnames[i]);
+		double sec = (timer_usec() - start) / 1000000.0;
+		remove(fnames[i]);
+
+		if(!mesh[i]) {
+			printf("%-22s failed to load\n", fmt_names[i]);
+			failures++;
+			continue;
+		}
+
+		double mb = fsize / 1048576.0;
+		printf("%-22s %7.1f MB  %8.1f ms  %7.1f MB/s\n", fmt_names[i], mb, sec * 1000.0, mb / sec);
+	}
+
+	for(int i=1; i<3; i++) {
+		if(mesh[0] && mesh[i] && !same_mesh(mesh[0], mesh[i])) {
+			printf("the %s mesh differs from the ascii one\n", fmt_names[i]);
+			failures++;
+		}
+	}
+
+	for(int i=0; i<3; i++) {
+		delete mesh[i];
+	}
+
+	if(failures) {
+		printf("FAILED\n");
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
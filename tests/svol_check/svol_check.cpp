@@ -0,0 +1,177 @@
+/*
+This file is part of the 3dengfx, realtime visualization system.
+
+Copyright (c) 2005 John Tsiombikas <nuclear@siggraph.org>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* svol_check
+ * Checks the shadow volumes built in parallel by ShadowVolumeCache::update
+ * against the ones built one at a time by get_volume, and against the
+ * meshes of TriMesh::get_shadow_volume, over a few frames of moving point
+ * lights and a directional light, shared meshes, an SoA mesh and a mesh
+ * which is modified half way through. Runs without a GL context.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include "3dengfx/3dengfx.hpp"
+#include "3dengfx/ggen.hpp"
+#include "3dengfx/shadows.hpp"
+#include "common/threadpool.h"
+
+/* there's no GL context, report no capabilities at all, which also keeps
+ * the vertex arrays in system memory.
+ */
+const GLubyte *glGetString(GLenum name) {
+	return (const GLubyte*)(name == GL_VERSION ? "1.1" : "");
+}
+
+void glGetIntegerv(GLenum pname, GLint *params) {
+	*params = 0;
+}
+
+#define CASTERS		12
+#define LIGHTS		4		// the last one is directional
+#define FRAMES		20
+#define EDIT_FRAME	8
+
+static TriMesh *meshes[CASTERS];
+static Vector3 offsets[CASTERS];
+
+static bool same_volume(const std::vector<Vector3> *a, const std::vector<Vector3> *b) {
+	if(a->size() != b->size()) return false;
+	return a->empty() || memcmp(&(*a)[0], &(*b)[0], a->size() * sizeof(Vector3)) == 0;
+}
+
+// get_shadow_volume returns an indexed mesh, compare its triangles in order
+static bool same_as_mesh(const std::vector<Vector3> *vol, TriMesh *mesh) {
+	const Index *idx = mesh->get_index_array()->get_data();
+	unsigned long icount = mesh->get_index_array()->get_count();
+	const Vertex *verts = mesh->get_vertex_array()->get_data();
+
+	if(icount != vol->size()) return false;
+
+	for(unsigned long i=0; i<icount; i++) {
+		if(memcmp(&verts[idx[i]].pos, &(*vol)[i], sizeof(Vector3)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// light position (or direction) in the model space of a caster
+static Vector3 light_vec(int light, int caster, int frame) {
+	if(light == LIGHTS - 1) {
+		return Vector3(sin(frame * 0.05), -1.0, 0.3);
+	}
+	Vector3 pos(light * 10.0 - 10.0 + sin(frame * 0.1), 15.0, cos(frame * 0.1));
+	return pos - offsets[caster];
+}
+
+static const void *caster_key(int i) {
+	return meshes + i;
+}
+
+static const void *light_key(int i) {
+	return offsets + i;	// any distinct addresses will do
+}
+
+static int run(int threads) {
+	tpool_set_thread_count(threads);
+
+	ShadowVolumeCache parallel, serial;
+	int failures = 0;
+
+	for(int f=0; f<FRAMES; f++) {
+		if(f == EDIT_FRAME) {
+			Vertex *v = meshes[1]->get_mod_vertex_array()->get_mod_data();
+			v[5].pos *= 1.2;
+		}
+
+		for(int l=0; l<LIGHTS; l++) {
+			for(int i=0; i<CASTERS; i++) {
+				parallel.request(caster_key(i), light_key(l), meshes[i], light_vec(l, i, f), l == LIGHTS - 1);
+			}
+		}
+		parallel.update();
+
+		for(int l=0; l<LIGHTS; l++) {
+			for(int i=0; i<CASTERS; i++) {
+				Vector3 lt = light_vec(l, i, f);
+				bool dir = l == LIGHTS - 1;
+
+				const std::vector<Vector3> *a = parallel.get_volume(caster_key(i), light_key(l), meshes[i], lt, dir);
+				const std::vector<Vector3> *b = serial.get_volume(caster_key(i), light_key(l), meshes[i], lt, dir);
+
+				if(!same_volume(a, b)) {
+					printf("frame %d, light %d, caster %d: parallel and serial volumes differ\n", f, l, i);
+					failures++;
+				}
+
+				TriMesh *vol = meshes[i]->get_shadow_volume(lt, dir);
+				if(!same_as_mesh(a, vol)) {
+					printf("frame %d, light %d, caster %d: differs from get_shadow_volume\n", f, l, i);
+					failures++;
+				}
+				delete vol;
+			}
+		}
+	}
+
+	// every request has been built by update already
+	if(parallel.get_rebuild_count() != serial.get_rebuild_count()) {
+		printf("%lu parallel rebuilds, %lu serial rebuilds\n", parallel.get_rebuild_count(),
+				serial.get_rebuild_count());
+		failures++;
+	}
+
+	printf("%d thread(s): %lu rebuilds, %s\n", threads, parallel.get_rebuild_count(),
+			failures ? "FAILED" : "all volumes match");
+	return failures;
+}
+
+int main() {
+	TriMesh *shared = new TriMesh;
+	create_torus(shared, 0.5, 1.5, 24);
+
+	for(int i=0; i<CASTERS; i++) {
+		if(i % 4 == 0) {
+			meshes[i] = shared;
+		} else {
+			meshes[i] = new TriMesh;
+			if(i % 2) {
+				create_torus(meshes[i], 0.5, 1.5, 24);
+			} else {
+				create_sphere(meshes[i], 1.0, 24);
+			}
+		}
+		offsets[i] = Vector3((i % 4) * 5.0 - 7.5, 0.0, (i / 4) * 5.0 - 5.0);
+	}
+	meshes[3]->set_vertex_layout(VLAYOUT_SOA);
+
+	int failures = run(1) + run(4);
+
+	for(int i=0; i<CASTERS; i++) {
+		if(i % 4) delete meshes[i];
+	}
+	delete shared;
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}